@@ -1,6 +1,7 @@
 // Client-side implementation in C++ for a chat server with private messages and group messaging
 
 #include <iostream>
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <mutex>
@@ -10,12 +11,363 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <chrono>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include "wire_protocol.h"
+#include "wire_deflate.h"
+#include "udp_delivery.h"
 
 #define BUFFER_SIZE 1024
+#define SCRIPT_READ_SIZE (64 * 1024)     // Script bytes read per wakeup
+#define SEND_BATCH_BYTES (16 * 1024)     // Requests packed into one frame
+#define SEND_HIGH_WATERMARK (256 * 1024) // The script is not read while this much is unsent
+#define RECV_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_BUFFER_SIZE (1 << 20)     // Output is written in pieces of this size
+#define SCRIPT_LINGER_MS 1000            // After the script ends, wait this long for quiet
+#define UDP_HELLO_INTERVAL_MS 200        // The UDP hello is repeated until the server confirms it...
+#define UDP_HELLO_TRIES 10               // ...at most this often
+#define UDP_RECEIVE_BUFFER (4 * 1024 * 1024)
 
 std::mutex cout_mutex;
+std::unordered_map<std::string, unsigned long long> last_group_seq; // Group -> last sequence number seen
+
+// Group messages arrive as "[Group <name> #<seq>] ...". Sequence numbers are
+// consecutive per group, so a jump means messages were lost in between.
+void check_group_sequence(const std::string &message) {
+    if (message.rfind("You joined the group ", 0) == 0) {
+        std::string group_name = message.substr(21, message.size() - 22);
+        last_group_seq.erase(group_name);
+        return;
+    }
+    if (message.rfind("[Group ", 0) != 0) return;
+    size_t hash_pos = message.find(" #", 7);
+    size_t end_pos = message.find(']', 7);
+    if (hash_pos == std::string::npos || end_pos == std::string::npos || hash_pos > end_pos) return;
+
+    std::string group_name = message.substr(7, hash_pos - 7);
+    unsigned long long seq = std::strtoull(message.c_str() + hash_pos + 2, nullptr, 10);
+    auto it = last_group_seq.find(group_name);
+    if (it != last_group_seq.end() && seq > it->second + 1) {
+        std::cout << "[!] Missed " << (seq - it->second - 1) << " message(s) in group " << group_name << std::endl;
+    }
+    last_group_seq[group_name] = seq;
+}
+
+// Text messages are not framed: one recv() may hold several of them, or end
+// in the middle of one. Every "[Group <name> #<seq>]" and "You joined the
+// group <name>." in the buffer is checked, and an unfinished one is kept in
+// text_carry for the next buffer. Group names have no spaces, so a joined
+// name ends at the next space or '[', or with its '.' at the end of a buffer.
+std::string text_carry;
+const std::string GROUP_PREFIX = "[Group ", JOINED_PREFIX = "You joined the group ";
+
+void check_text_group_sequences(const char *data, size_t size) {
+    std::string text = text_carry + std::string(data, size);
+    text_carry.clear();
+    size_t pos = 0;
+    while (true) {
+        size_t group = text.find(GROUP_PREFIX, pos), joined = text.find(JOINED_PREFIX, pos);
+        size_t at = std::min(group, joined);
+        if (at == std::string::npos) break;
+        if (at == group) {
+            size_t end = text.find(']', at);
+            if (end == std::string::npos) {
+                if (text.size() - at < RECV_BUFFER_SIZE) text_carry = text.substr(at);
+                return;
+            }
+            check_group_sequence(text.substr(at, end + 1 - at));
+            pos = end + 1;
+        } else {
+            size_t start = at + JOINED_PREFIX.size();
+            size_t end = text.find_first_of(" [\n", start);
+            if (end == std::string::npos) {
+                if (text.back() != '.') {
+                    if (text.size() - at < RECV_BUFFER_SIZE) text_carry = text.substr(at);
+                    return;
+                }
+                end = text.size();
+            }
+            std::string group_name = text.substr(start, end - start);
+            if (!group_name.empty() && group_name.back() == '.') group_name.pop_back();
+            last_group_seq.erase(group_name);
+            pos = end;
+        }
+    }
+    // Keep what could be the start of a prefix cut off by the buffer's end
+    size_t keep = std::min(text.size() - pos, JOINED_PREFIX.size() - 1);
+    text_carry = text.substr(text.size() - keep);
+}
+
+// Binary protocol (--binary). Server messages are rendered back to the text
+// the text protocol would have sent, so the output looks the same.
+std::mutex names_mutex;
+name_table names; // Names the server has interned, by id
+
+// Buffered output: one write(2) per OUTPUT_BUFFER_SIZE bytes, and whenever
+// the owner runs out of work.
+struct output_writer {
+    int fd;
+    std::string buffer;
+
+    explicit output_writer(int fd) : fd(fd) { buffer.reserve(OUTPUT_BUFFER_SIZE); }
+    ~output_writer() { flush(); }
+
+    void write(const char *data, size_t size) {
+        buffer.append(data, size);
+        if (buffer.size() >= OUTPUT_BUFFER_SIZE) flush();
+    }
+    void line(const std::string &text) {
+        buffer += text;
+        buffer += '\n';
+        if (buffer.size() >= OUTPUT_BUFFER_SIZE) flush();
+    }
+    void flush() {
+        for (size_t done = 0; done < buffer.size();) {
+            ssize_t written = ::write(fd, buffer.data() + done, buffer.size() - done);
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) break; // Output closed: drop it, keep the session going
+            done += written;
+        }
+        buffer.clear();
+    }
+};
+
+// Lines of a script file or pipe, read in large chunks.
+struct script_reader {
+    int fd;
+    std::string buffer;
+    size_t start = 0; // First byte not yet returned
+    bool eof = false;
+
+    explicit script_reader(int fd) : fd(fd) {}
+
+    // One read(2); blocks unless poll() said the script is readable.
+    void fill() {
+        buffer.erase(0, start);
+        start = 0;
+        size_t used = buffer.size();
+        buffer.resize(used + SCRIPT_READ_SIZE);
+        ssize_t bytes_read = read(fd, &buffer[used], SCRIPT_READ_SIZE);
+        buffer.resize(used + (bytes_read > 0 ? bytes_read : 0));
+        if (bytes_read == 0 || (bytes_read < 0 && errno != EINTR && errno != EAGAIN)) {
+            eof = true;
+        }
+    }
+    // The next whole line, without its line ending. At the end of the script
+    // an unterminated last line counts too.
+    bool next_line(std::string &line) {
+        size_t end = buffer.find('\n', start);
+        if (end == std::string::npos) {
+            if (!eof || start == buffer.size()) return false;
+            end = buffer.size();
+        }
+        line.assign(buffer, start, end - start);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        start = end < buffer.size() ? end + 1 : end;
+        return true;
+    }
+    bool finished() const { return eof && start == buffer.size(); }
+    // Blocks until a line is available.
+    bool read_line(std::string &line) {
+        while (!next_line(line)) {
+            if (eof) return false;
+            fill();
+        }
+        return true;
+    }
+};
+
+enum stream_status { STREAM_MESSAGE, STREAM_NEED_DATA, STREAM_BAD };
+
+// Messages from the server, one at a time.
+struct message_stream {
+    int sock;
+    wire_decoder decoder;
+    std::string frame;
+    wire_reader in;
+    message_inflater inflater; // --deflate
+    std::string inflated;
+    wire_reader inner;         // The message inside an OP_COMPRESSED
+    output_writer *raw = nullptr; // --raw: gets every byte received
+
+    message_stream(int sock, const std::string &dictionary) : sock(sock), inflater(dictionary) {}
+
+    // The next message other than a name definition in what has been
+    // received so far.
+    stream_status take(wire_message &message) {
+        while (true) {
+            while (inner.empty() && in.empty()) {
+                frame_status status = decoder.next(frame);
+                if (status == FRAME_BAD) return STREAM_BAD;
+                if (status == FRAME_INCOMPLETE) return STREAM_NEED_DATA;
+                in = wire_reader(frame);
+            }
+            bool nested = !inner.empty();
+            {
+                std::lock_guard<std::mutex> lock(names_mutex);
+                if (!decode_message(nested ? inner : in, names, message)) return STREAM_BAD;
+            }
+            if (message.op == OP_COMPRESSED) {
+                if (nested || !inflater.inflate_message(message.text, message.seq, inflated)) return STREAM_BAD;
+                inner = wire_reader(inflated);
+            } else if (message.op != OP_NAME) {
+                return STREAM_MESSAGE;
+            }
+        }
+    }
+
+    // Blocks until the next message other than a name definition. Returns
+    // false once the server is gone or sends something malformed.
+    bool next(wire_message &message) {
+        while (true) {
+            stream_status status = take(message);
+            if (status != STREAM_NEED_DATA) return status == STREAM_MESSAGE;
+            char buffer[BUFFER_SIZE];
+            int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
+            if (bytes_received <= 0) return false;
+            if (raw) raw->write(buffer, bytes_received);
+            decoder.feed(buffer, bytes_received);
+        }
+    }
+};
+
+void encode_request(std::string &body, const chat_command &command) {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    encode_command(body, command, [](const std::string &name) { return names.id_of(name); });
+}
+
+void send_request(int server_socket, const chat_command &command) {
+    std::string body, frame;
+    encode_request(body, command);
+    put_frame(frame, body);
+    send(server_socket, frame.data(), frame.size(), 0);
+}
+
+// UDP delivery (/udp, udp_delivery.h). The token comes over TCP; the hello is
+// repeated every UDP_HELLO_INTERVAL_MS until the server confirms it over TCP.
+int server_port = 12345; // Cluster node i listens on 12345 + i, for TCP and UDP
+
+struct udp_channel {
+    int sock = -1;
+    std::mutex hello_mutex; // The TCP reader may start a new handshake while the UDP one retries
+    uint64_t token = 0;
+    int hellos = 0;
+    std::chrono::steady_clock::time_point last_hello;
+    std::atomic<bool> confirmed = false;
+    udp_sequence sequence;  // Reader only
+
+    // Returns false if there was no channel yet (the caller starts reading it).
+    bool open(uint64_t new_token) {
+        bool existed = sock >= 0;
+        if (!existed) {
+            sock = socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in server_address{};
+            server_address.sin_family = AF_INET;
+            server_address.sin_port = htons(server_port);
+            server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
+            connect(sock, (sockaddr*)&server_address, sizeof(server_address)); // Only the server's datagrams
+            int buffer_size = UDP_RECEIVE_BUFFER;
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        }
+        std::lock_guard<std::mutex> lock(hello_mutex);
+        token = new_token;
+        hellos = 0;
+        confirmed = false;
+        send_hello();
+        return existed;
+    }
+    void say_hello() {
+        std::lock_guard<std::mutex> lock(hello_mutex);
+        send_hello();
+    }
+    void send_hello() {
+        std::string hello = make_udp_hello(token);
+        send(sock, hello.data(), hello.size(), 0);
+        hellos++;
+        last_hello = std::chrono::steady_clock::now();
+    }
+    // Milliseconds until the next hello is due, or -1 if none is.
+    int hello_wait() {
+        std::lock_guard<std::mutex> lock(hello_mutex);
+        if (sock < 0 || confirmed || hellos >= UDP_HELLO_TRIES) return -1;
+        auto due = last_hello + std::chrono::milliseconds(UDP_HELLO_INTERVAL_MS);
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+        return std::max<int>(0, left.count());
+    }
+    // The lines a datagram shows, loss reports included.
+    void read(const std::string &datagram, std::vector<std::string> &lines) {
+        uint64_t seq;
+        wire_reader in;
+        if (!read_datagram(datagram, seq, in)) return;
+        if (uint64_t missed = sequence.receive(seq)) {
+            lines.push_back("[!] Lost " + std::to_string(missed) + " UDP datagram(s)");
+        }
+        while (!in.empty()) {
+            wire_message message;
+            std::lock_guard<std::mutex> lock(names_mutex);
+            if (!decode_message(in, names, message)) return;
+            if (message.op != OP_NAME) lines.push_back(message.to_text());
+        }
+    }
+};
+
+udp_channel udp;
+
+void handle_udp_messages() {
+    std::string datagram;
+    std::vector<std::string> lines;
+    while (true) {
+        pollfd fd = {udp.sock, POLLIN, 0};
+        poll(&fd, 1, udp.hello_wait());
+        if (udp.hello_wait() == 0) {
+            udp.say_hello();
+        }
+        datagram.resize(UDP_MAX_DATAGRAM);
+        ssize_t size = recv(udp.sock, &datagram[0], datagram.size(), MSG_DONTWAIT);
+        if (size <= 0) continue;
+        datagram.resize(size);
+        lines.clear();
+        udp.read(datagram, lines);
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        for (const std::string &line : lines) {
+            check_group_sequence(line);
+            std::cout << line << std::endl;
+        }
+    }
+}
+
+// Interactive mode: watch the TCP messages for the UDP handshake.
+void follow_udp_handshake(const std::string &text) {
+    size_t at = text.find("UDP token ");
+    if (at != std::string::npos) {
+        uint64_t token = std::strtoull(text.c_str() + at + 10, nullptr, 10);
+        if (token != 0 && !udp.open(token)) {
+            std::thread(handle_udp_messages).detach();
+        }
+    }
+    if (text.find("UDP delivery on.") != std::string::npos) {
+        udp.confirmed = true;
+    }
+}
+
+void handle_binary_messages(message_stream *stream) {
+    wire_message message;
+    while (stream->next(message)) {
+        std::string text = message.to_text();
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        follow_udp_handshake(text);
+        check_group_sequence(text);
+        std::cout << text << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(cout_mutex);
+    std::cout << "Disconnected from server." << std::endl;
+    close(stream->sock);
+    exit(0);
+}
 
 void handle_server_messages(int server_socket) {
     char buffer[BUFFER_SIZE];
@@ -29,11 +381,226 @@ void handle_server_messages(int server_socket) {
             exit(0);
         }
         std::lock_guard<std::mutex> lock(cout_mutex);
+        follow_udp_handshake(buffer);
+        check_text_group_sequences(buffer, bytes_received);
         std::cout << buffer << std::endl;
     }
 }
 
-int main() {
+// --script: one thread and one poll() loop for the whole session. Script
+// lines become binary requests, packed SEND_BATCH_BYTES to a frame and sent
+// without waiting for replies; the script is only read while less than
+// SEND_HIGH_WATERMARK is unsent. Incoming messages are decoded straight from
+// a large receive buffer (or, with --raw, copied out undecoded) and written
+// through the output buffer, which is flushed whenever the loop would block.
+// A /udp in the script adds the UDP socket to the loop (not with --raw, which
+// does not decode the token). The session ends at /exit, when the server
+// disconnects, or once the script is done and the server has been quiet for
+// SCRIPT_LINGER_MS.
+void run_script(int server_socket, message_stream &stream, script_reader &script, output_writer &out, bool raw) {
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    std::string body, outgoing, line, datagram;
+    size_t sent = 0; // Bytes of outgoing already sent
+    std::vector<char> buffer(RECV_BUFFER_SIZE);
+    std::vector<std::string> lines;
+    unsigned long long requests = 0, frames = 0, received = 0, bytes_in = 0, datagrams = 0;
+    bool exiting = false, connected = true;
+    auto started = std::chrono::steady_clock::now();
+
+    while (connected) {
+        while (!exiting && outgoing.size() - sent < SEND_HIGH_WATERMARK && script.next_line(line)) {
+            if (line.empty()) continue;
+            if (line == "/exit") {
+                exiting = true;
+                break;
+            }
+            chat_command command;
+            command_parse parsed = parse_command(line, command);
+            if (parsed == COMMAND_OK) {
+                encode_request(body, command);
+                requests++;
+            } else if (parsed == COMMAND_INVALID) {
+                out.line("Invalid command.");
+            }
+            if (body.size() >= SEND_BATCH_BYTES) {
+                put_frame(outgoing, body);
+                body.clear();
+                frames++;
+            }
+        }
+        if (!body.empty()) {
+            put_frame(outgoing, body);
+            body.clear();
+            frames++;
+        }
+        while (sent < outgoing.size()) {
+            ssize_t bytes_sent = send(server_socket, outgoing.data() + sent, outgoing.size() - sent, MSG_NOSIGNAL);
+            if (bytes_sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) connected = false;
+                break;
+            }
+            sent += bytes_sent;
+        }
+        if (sent == outgoing.size()) {
+            outgoing.clear();
+            sent = 0;
+        }
+        if (exiting && outgoing.empty()) {
+            break;
+        }
+
+        bool want_script = !exiting && !script.finished() && outgoing.size() - sent < SEND_HIGH_WATERMARK;
+        pollfd fds[3] = {{server_socket, (short)(POLLIN | (outgoing.empty() ? 0 : POLLOUT)), 0},
+                         {udp.sock, POLLIN, 0}, {want_script ? script.fd : -1, POLLIN, 0}};
+        int ready = poll(fds, 3, 0); // Negative descriptors are skipped
+        if (ready == 0) {
+            out.flush(); // Nothing to do right now: show what we have, then sleep
+            bool lingering = !want_script && !exiting && outgoing.empty();
+            int timeout = lingering ? SCRIPT_LINGER_MS : -1;
+            int hello = udp.hello_wait();
+            bool hello_first = hello >= 0 && (timeout < 0 || hello < timeout);
+            ready = poll(fds, 3, hello_first ? hello : timeout);
+            if (ready == 0 && lingering && !hello_first) {
+                break;
+            }
+        }
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (udp.hello_wait() == 0) {
+            udp.say_hello();
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            while (true) {
+                ssize_t bytes_received = recv(server_socket, buffer.data(), buffer.size(), 0);
+                if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    break;
+                }
+                if (bytes_received <= 0) {
+                    connected = false;
+                    break;
+                }
+                bytes_in += bytes_received;
+                if (raw) {
+                    out.write(buffer.data(), bytes_received);
+                } else {
+                    stream.decoder.feed(buffer.data(), bytes_received);
+                    wire_message message;
+                    stream_status status;
+                    while ((status = stream.take(message)) == STREAM_MESSAGE) {
+                        std::string text = message.to_text();
+                        if (message.op == OP_UDP_TOKEN) {
+                            udp.open(message.seq);
+                        } else if (text == "UDP delivery on.") {
+                            udp.confirmed = true;
+                        }
+                        check_group_sequence(text);
+                        out.line(text);
+                        received++;
+                    }
+                    if (status == STREAM_BAD) {
+                        connected = false;
+                        break;
+                    }
+                }
+                if ((size_t)bytes_received < buffer.size()) {
+                    break; // Drained, most likely; poll() will tell
+                }
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            while (true) {
+                datagram.resize(UDP_MAX_DATAGRAM);
+                ssize_t size = recv(udp.sock, &datagram[0], datagram.size(), MSG_DONTWAIT);
+                if (size < 0) break;
+                datagram.resize(size);
+                datagrams++;
+                lines.clear();
+                udp.read(datagram, lines);
+                for (const std::string &text : lines) {
+                    check_group_sequence(text);
+                    out.line(text);
+                }
+            }
+        }
+        if (want_script && (fds[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            script.fill();
+        }
+    }
+    if (!connected) {
+        out.line("Disconnected from server.");
+    }
+    out.flush();
+    close(server_socket);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "Sent " << requests << " requests in " << frames << " frames; received " << bytes_in << " bytes";
+    if (!raw) {
+        std::cerr << ", " << received << " messages (" << (unsigned long long)(received / seconds) << "/s)";
+    }
+    if (datagrams > 0) {
+        std::cerr << ", " << datagrams << " UDP datagrams (" << udp.sequence.lost << " lost)";
+    }
+    std::cerr << " in " << seconds << " s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    bool binary = false, deflate = false, raw = false;
+    std::string dictionary = default_dictionary();
+    std::string script_path, out_path;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--binary") {
+            binary = true;
+        } else if (std::string(argv[i]) == "--deflate") {
+            binary = deflate = true;
+        } else if (std::string(argv[i]) == "--dictionary" && i + 1 < argc) {
+            // Must be the server's --dictionary
+            if (!load_dictionary(argv[++i], dictionary)) {
+                std::cerr << "Error: Unable to read dictionary " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::string(argv[i]) == "--script" && i + 1 < argc) {
+            script_path = argv[++i]; // "-" for stdin
+        } else if (std::string(argv[i]) == "--out" && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (std::string(argv[i]) == "--raw") {
+            raw = true;
+        } else {
+            server_port = std::atoi(argv[i]);
+        }
+    }
+    // Scripted sessions pipeline their requests, which needs the binary
+    // protocol's frames: text requests sent back to back would run together.
+    script_reader *script = nullptr;
+    if (!script_path.empty()) {
+        binary = true;
+        int fd = script_path == "-" ? 0 : open(script_path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: Unable to read script " << script_path << std::endl;
+            return 1;
+        }
+        script = new script_reader(fd);
+    } else if (raw || !out_path.empty()) {
+        std::cerr << "Error: --out and --raw need --script." << std::endl;
+        return 1;
+    }
+    int out_fd = out_path.empty() ? 1 : open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        std::cerr << "Error: Unable to write " << out_path << std::endl;
+        return 1;
+    }
+    output_writer out(out_fd);
+    // Login answers come from the script when there is one
+    auto read_input_line = [script](std::string &line) {
+        if (script) {
+            script->read_line(line);
+        } else {
+            std::getline(std::cin, line);
+        }
+    };
     int client_socket;
     sockaddr_in server_address{};
 
@@ -44,7 +611,7 @@ int main() {
     }
 
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(server_port);
     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
@@ -63,29 +630,61 @@ int main() {
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
  
     std::cout << buffer;
-    std::getline(std::cin, username);
+    read_input_line(username);
+    if (binary) {
+        // Ask for the binary protocol; from here on the server sends frames
+        username = (deflate ? BINARY_HELLO_DEFLATE : BINARY_HELLO) + username;
+    }
     send(client_socket, username.c_str(), username.size(), 0);
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
-    std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    message_stream stream(client_socket, dictionary);
+    if (raw) {
+        stream.raw = &out;
+    }
+    if (binary) {
+        wire_message message;
+        if (!stream.next(message)) { // "Enter password: "
+            std::cerr << "Disconnected from server." << std::endl;
+            return 1;
+        }
+        std::cout << message.to_text();
+        read_input_line(password);
+        send_request(client_socket, {REQ_PASSWORD, "", password});
 
-    memset(buffer, 0, BUFFER_SIZE);
-    // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
+        // The login result is a typed message, no need to match its text
+        bool welcome = stream.next(message) && message.op == OP_WELCOME;
+        std::cout << (welcome ? message : wire_message(OP_AUTH_FAILED)).to_text() << std::endl;
+        if (!welcome) {
+            close(client_socket);
+            return 1;
+        }
+        if (script) {
+            run_script(client_socket, stream, *script, out, raw);
+            return 0;
+        }
+        std::thread(handle_binary_messages, &stream).detach();
+    } else {
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
+        std::cout << buffer;
+        std::getline(std::cin, password);
+        send(client_socket, password.c_str(), password.size(), 0);
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
-        close(client_socket);
-        return 1;
-    }
+        memset(buffer, 0, BUFFER_SIZE);
+        // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
+        recv(client_socket, buffer, BUFFER_SIZE, 0); 
+        std::cout << buffer << std::endl;
 
-    // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
-    // We use detach because we want this thread to run in the background while the main thread continues running
-    receive_thread.detach();
+        if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+            close(client_socket);
+            return 1;
+        }
+
+        // Start thread for receiving messages from server
+        std::thread receive_thread(handle_server_messages, client_socket);
+        // We use detach because we want this thread to run in the background while the main thread continues running
+        receive_thread.detach();
+    }
 
     // Send messages to the server
     while (true) {
@@ -94,12 +693,24 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
-
         if (message == "/exit") {
+            if (!binary) send(client_socket, message.c_str(), message.size(), 0);
             close(client_socket);
             break;
         }
+
+        if (binary) {
+            chat_command command;
+            command_parse parsed = parse_command(message, command);
+            if (parsed == COMMAND_OK) {
+                send_request(client_socket, command);
+            } else if (parsed == COMMAND_INVALID) {
+                std::lock_guard<std::mutex> lock(cout_mutex);
+                std::cout << "Invalid command." << std::endl;
+            }
+        } else {
+            send(client_socket, message.c_str(), message.size(), 0);
+        }
     }
 
     return 0;
@@ -0,0 +1,169 @@
+// Benchmark: per-message compression of binary messages (wire_deflate.h)
+//
+// Generates chat-like payloads of several sizes and reports, for deflate with
+// no dictionary, the built-in dictionary and a dictionary trained on a
+// separate set of samples:
+//  - compressed size as a share of the encoded message
+//  - compress and inflate time per message
+// The last line shows what encode-once saves on a fan-out: one compression
+// per message instead of one per recipient.
+//
+// With --train <file> it instead trains a dictionary on the lines of file
+// and writes it to stdout, for the server's and client's --dictionary.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include "wire_protocol.h"
+#include "wire_deflate.h"
+
+#define SAMPLES_PER_SIZE 2000
+#define TRAINING_SAMPLES 5000
+#define VOCABULARY 3000
+#define TRAINED_SIZE 4096      // Setting a dictionary costs time in proportion to its size
+#define FANOUT 1000
+
+using namespace std;
+
+mt19937 rng(425);
+
+// Words drawn with a Zipf distribution, like natural language.
+string random_word() {
+    static vector<double> cumulative;
+    if (cumulative.empty()) {
+        double total = 0;
+        for (int i = 1; i <= VOCABULARY; i++) {
+            total += 1.0 / i;
+            cumulative.push_back(total);
+        }
+    }
+    double pick = uniform_real_distribution<double>(0, cumulative.back())(rng);
+    int rank = lower_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin();
+    // Common words are short, rare ones long, and all are pronounceable.
+    static const char *syllables[] = {"ra", "to", "ne", "ly", "pe", "an", "in", "er", "so", "mi", "ka", "de"};
+    string word;
+    int length = 1 + (int)log2(rank + 2) / 3;
+    for (int i = 0, r = rank; i < length; i++, r /= 12) {
+        word += syllables[(r + i * 7) % 12];
+    }
+    return word;
+}
+
+string random_payload(size_t size) {
+    string text;
+    while (text.size() < size) {
+        if (rng() % 8 == 0) {
+            text += "deploy api-" + to_string(rng() % 20) + " to node-" + to_string(rng() % 50) + ": ok. ";
+        } else {
+            text += random_word() + (rng() % 12 == 0 ? ". " : " ");
+        }
+    }
+    text.resize(size);
+    return text;
+}
+
+string encode(const string &payload) {
+    string out;
+    encode_message(out, wire_message(OP_BROADCAST, "alice", "", payload), [](const string &) { return 1; });
+    return out;
+}
+
+double elapsed_ns(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+struct result {
+    double ratio, compress_ns, inflate_ns;
+};
+
+result bench(const vector<string> &messages, const string &dictionary) {
+    message_compressor compressor(dictionary);
+    message_inflater inflater(dictionary);
+    vector<string> packed(messages.size());
+    size_t raw_total = 0, packed_total = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < messages.size(); i++) {
+        if (!compressor.compress(messages[i], packed[i])) {
+            packed[i].clear(); // Sent as is
+        }
+    }
+    double compress_ns = elapsed_ns(start) / messages.size();
+
+    string inflated;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < messages.size(); i++) {
+        raw_total += messages[i].size();
+        if (packed[i].empty()) {
+            packed_total += messages[i].size();
+            continue;
+        }
+        packed_total += packed[i].size();
+        wire_reader in(packed[i]);
+        name_table names;
+        wire_message message;
+        if (!decode_message(in, names, message) || !inflater.inflate_message(message.text, message.seq, inflated) ||
+            inflated != messages[i]) {
+            cerr << "Round trip failed." << endl;
+            exit(1);
+        }
+    }
+    double inflate_ns = elapsed_ns(start) / messages.size();
+    return {(double)packed_total / raw_total, compress_ns, inflate_ns};
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && string(argv[1]) == "--train") {
+        ifstream file(argv[2]);
+        vector<string> samples;
+        string line;
+        while (getline(file, line)) {
+            samples.push_back(line);
+        }
+        cout << train_dictionary(samples);
+        return 0;
+    }
+    if (argc != 1) {
+        cout << "[USE]: " << argv[0] << " [--train <samples file>]\n";
+        return 1;
+    }
+
+    vector<string> training;
+    for (int i = 0; i < TRAINING_SAMPLES; i++) {
+        training.push_back(random_payload(64 + rng() % 512));
+    }
+    string trained = train_dictionary(training, TRAINED_SIZE);
+
+    cout << "Dictionaries: built-in " << default_dictionary().size() << " bytes, trained "
+         << trained.size() << " bytes\n";
+    cout << "Size      | none: size  compress  inflate | built-in: size  compress  inflate | trained: size  compress  inflate\n";
+    const size_t sizes[] = {128, 256, 512, 1024, 4096, 16384};
+    for (size_t size : sizes) {
+        vector<string> messages;
+        for (int i = 0; i < SAMPLES_PER_SIZE; i++) {
+            messages.push_back(encode(random_payload(size)));
+        }
+        result none = bench(messages, "");
+        result builtin = bench(messages, default_dictionary());
+        result with_trained = bench(messages, trained);
+        printf("%6zu B  | %9.1f%% %7.1fus %7.1fus | %13.1f%% %7.1fus %7.1fus | %12.1f%% %7.1fus %7.1fus\n", size,
+               100 * none.ratio, none.compress_ns / 1000, none.inflate_ns / 1000,
+               100 * builtin.ratio, builtin.compress_ns / 1000, builtin.inflate_ns / 1000,
+               100 * with_trained.ratio, with_trained.compress_ns / 1000, with_trained.inflate_ns / 1000);
+    }
+
+    vector<string> messages;
+    for (int i = 0; i < 200; i++) {
+        messages.push_back(encode(random_payload(4096)));
+    }
+    result once = bench(messages, trained);
+    cout << "Fan-out of a 4 KB message to " << FANOUT << " recipients: compressed once "
+         << once.compress_ns / 1000 << " us, once per recipient " << once.compress_ns * FANOUT / 1e6 << " ms\n";
+    return 0;
+}
@@ -0,0 +1,221 @@
+// Stress test for the server's lock-free building blocks: mpsc_ring.h,
+// work_stealing.h and epoch.h. Each part hammers one structure from many
+// threads and checks the result; the process exits non-zero on any mismatch.
+// Build it with `make tsan` to have ThreadSanitizer watch the same runs.
+//
+//   ./concurrency_stress [threads] [scale]
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include "mpsc_ring.h"
+#include "work_stealing.h"
+#include "epoch.h"
+
+#define RING_CAPACITY 256      // Small, so producers keep finding it full
+#define RING_ITEMS 200000      // Per producer, times scale
+#define TREE_DEPTH 16          // Tasks spawning two children each
+#define EXTERNAL_TASKS 50000   // Per submitting thread, times scale
+#define MAP_KEYS 512
+#define MAP_WRITES 100000      // Per writer, times scale
+#define PAYLOAD_MAGIC 0x5eed5eed
+
+using namespace std;
+
+int failures = 0;
+
+void check(bool ok, const string &what) {
+    if (!ok) {
+        cout << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+// Producers push (producer, sequence) pairs; the consumer checks that each
+// producer's items arrive complete and in order.
+void stress_ring(int producers, int scale) {
+    mpsc_ring<uint64_t> ring(RING_CAPACITY);
+    uint64_t per_producer = (uint64_t)RING_ITEMS * scale;
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&ring, p, per_producer] {
+            for (uint64_t i = 0; i < per_producer; i++) {
+                uint64_t item = (uint64_t)p << 32 | i;
+                while (!ring.push(std::move(item))) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    vector<uint64_t> next(producers, 0);
+    uint64_t received = 0, out_of_order = 0;
+    while (received < per_producer * producers) {
+        uint64_t item;
+        if (!ring.pop(item)) {
+            this_thread::yield();
+            continue;
+        }
+        int p = item >> 32;
+        if ((item & 0xffffffff) != next[p]) out_of_order++;
+        next[p] = (item & 0xffffffff) + 1;
+        received++;
+    }
+    for (thread &t : threads) t.join();
+    check(out_of_order == 0, "ring kept each producer's order");
+    check(ring.empty(), "ring empty at the end");
+    cout << "ring:     " << producers << " producers, " << received << " items" << endl;
+}
+
+// Each task spawns two children down to TREE_DEPTH, so work starts on one
+// worker and has to be stolen to spread; meanwhile outside threads submit
+// tasks through the inboxes.
+void spawn(work_stealing_executor &pool, atomic<uint64_t> &done, int depth) {
+    done++;
+    if (depth < TREE_DEPTH) {
+        pool.submit([&pool, &done, depth] { spawn(pool, done, depth + 1); });
+        pool.submit([&pool, &done, depth] { spawn(pool, done, depth + 1); });
+    }
+}
+
+void stress_executor(int workers, int submitters, int scale) {
+    atomic<uint64_t> tree_done = 0, external_done = 0;
+    uint64_t tree_total = (1ull << (TREE_DEPTH + 1)) - 1;
+    uint64_t external_total = (uint64_t)EXTERNAL_TASKS * scale * submitters;
+    uint64_t stolen;
+    {
+        work_stealing_executor pool(workers);
+        pool.submit([&pool, &tree_done] { spawn(pool, tree_done, 0); });
+        vector<thread> threads;
+        for (int s = 0; s < submitters; s++) {
+            threads.emplace_back([&pool, &external_done, scale] {
+                for (int i = 0; i < EXTERNAL_TASKS * scale; i++) {
+                    pool.submit([&external_done] { external_done++; });
+                }
+            });
+        }
+        for (thread &t : threads) t.join();
+        while (tree_done < tree_total || external_done < external_total) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        // Idle for a while, so that workers go to sleep and must be woken
+        this_thread::sleep_for(chrono::milliseconds(20));
+        pool.submit([&external_done] { external_done++; });
+        while (external_done < external_total + 1) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        // A worker counts a task just after running it
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+        while (pool.executed() < tree_total + external_total + 1 && chrono::steady_clock::now() < deadline) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        stolen = pool.stolen();
+        check(pool.executed() == tree_total + external_total + 1, "executor ran every task once");
+    }
+    check(tree_done == tree_total, "every spawned task ran");
+    cout << "executor: " << workers << " workers, " << tree_total + external_total + 1 << " tasks, "
+         << stolen << " stolen" << endl;
+}
+
+// Writers keep replacing the payloads under each key and retire the old ones;
+// readers check that every payload they find is still intact.
+struct payload {
+    atomic<uint32_t> magic = PAYLOAD_MAGIC;
+    int key;
+};
+
+atomic<int64_t> live_payloads = 0;
+
+payload *make_payload(int key) {
+    live_payloads++;
+    payload *p = new payload;
+    p->key = key;
+    return p;
+}
+
+void free_payload(payload *p) {
+    p->magic = 0;
+    delete p;
+    live_payloads--;
+}
+
+void stress_epoch_map(int readers, int writers, int scale) {
+    epoch_domain domain;
+    epoch_map<int, payload *> map(domain, 64); // Few buckets: long chains to copy
+    atomic<bool> stop = false;
+    atomic<uint64_t> reads = 0, broken = 0;
+
+    vector<thread> threads;
+    for (int r = 0; r < readers; r++) {
+        threads.emplace_back([&, r] {
+            uint64_t mine = 0;
+            unsigned seed = r;
+            while (!stop) {
+                epoch_domain::guard guard(domain);
+                int key = rand_r(&seed) % MAP_KEYS;
+                payload *p;
+                if (map.find(key, p) && (p->magic != PAYLOAD_MAGIC || p->key != key)) broken++;
+                if (mine % 64 == 0) {
+                    map.for_each([&](int k, payload *q) {
+                        if (q->magic != PAYLOAD_MAGIC || q->key != k) broken++;
+                        return true;
+                    });
+                }
+                mine++;
+            }
+            reads += mine;
+        });
+    }
+    vector<thread> writer_threads;
+    for (int w = 0; w < writers; w++) {
+        writer_threads.emplace_back([&, w] {
+            unsigned seed = 1000 + w;
+            // Writer w owns the keys k with k % writers == w
+            for (int i = 0; i < MAP_WRITES * scale; i++) {
+                int key = rand_r(&seed) % (MAP_KEYS / writers) * writers + w;
+                payload *old;
+                bool had = map.find(key, old);
+                if (rand_r(&seed) % 4 == 0) {
+                    map.erase(key);
+                } else {
+                    map.insert_or_assign(key, make_payload(key));
+                }
+                if (had) {
+                    domain.retire([old] { free_payload(old); });
+                }
+            }
+        });
+    }
+    for (thread &t : writer_threads) t.join();
+    stop = true;
+    for (thread &t : threads) t.join();
+
+    domain.synchronize();
+    check(domain.pending() == 0, "every retired payload freed");
+    check(broken == 0, "readers only saw intact payloads");
+    check(live_payloads == (int64_t)map.size(), "payloads left match the map");
+    cout << "epoch:    " << readers << " readers, " << writers << " writers, " << reads << " reads, "
+         << map.size() << " keys left" << endl;
+    map.for_each([](int, payload *p) {
+        free_payload(p);
+        return true;
+    });
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int scale = argc > 2 ? atoi(argv[2]) : 1;
+    if (threads < 2 || scale < 1) {
+        cout << "[USE]: " << argv[0] << " [threads >= 2] [scale >= 1]\n";
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    stress_ring(threads, scale);
+    stress_executor(threads, threads / 2, scale);
+    stress_epoch_map(threads, threads / 2, scale);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << (failures ? "FAILED" : "OK") << " in " << seconds << " s" << endl;
+    return failures ? 1 : 0;
+}
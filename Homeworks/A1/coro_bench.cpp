@@ -0,0 +1,185 @@
+// Benchmark: coroutine switch cost vs thread context switch cost
+//
+// Models the server's two connection models with N idle "connections":
+//  - coroutines: N suspended coroutine frames, resumed round-robin by a
+//    scheduler loop, the way the reactor resumes handlers on readiness.
+//  - threads: N threads passing a token around a ring of semaphores, so every
+//    hand-off is a real kernel context switch, the way a thread-per-client
+//    server wakes a blocked handler.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <coroutine>
+#include <semaphore>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+#define DEFAULT_CONNECTIONS 50000
+#define DEFAULT_ROUNDS 20
+#define THREAD_STACK_SIZE (64 * 1024)
+
+using namespace std;
+
+size_t frame_bytes = 0; // Bytes allocated for coroutine frames
+long work_done = 0;      // Keeps the handler loop from being optimised away
+
+struct bench_task {
+    struct promise_type {
+        void *operator new(size_t size) {
+            frame_bytes += size;
+            return ::operator new(size);
+        }
+        void operator delete(void *ptr) { ::operator delete(ptr); }
+
+        bench_task get_return_object() { return {coroutine_handle<promise_type>::from_promise(*this)}; }
+        suspend_always initial_suspend() noexcept { return {}; }
+        suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+    coroutine_handle<promise_type> handle;
+};
+
+// Ready queue standing in for the reactor's epoll loop.
+struct scheduler {
+    deque<coroutine_handle<>> ready;
+
+    struct yield_awaiter {
+        scheduler *sched;
+        bool await_ready() { return false; }
+        void await_suspend(coroutine_handle<> h) { sched->ready.push_back(h); }
+        void await_resume() {}
+    };
+    yield_awaiter yield() { return {this}; }
+};
+
+// Same shape as a connection handler: a few locals, then a loop of waits.
+bench_task connection_loop(scheduler &sched, int rounds) {
+    string username = "user";
+    for (int i = 0; i < rounds; i++) {
+        co_await sched.yield();
+        work_done += username.size();
+    }
+}
+
+double bench_coroutines(int connections, int rounds) {
+    scheduler sched;
+    vector<bench_task> tasks;
+    tasks.reserve(connections);
+    for (int i = 0; i < connections; i++) {
+        tasks.push_back(connection_loop(sched, rounds));
+        sched.ready.push_back(tasks.back().handle);
+    }
+
+    long switches = 0;
+    auto start = chrono::steady_clock::now();
+    while (!sched.ready.empty()) {
+        coroutine_handle<> h = sched.ready.front();
+        sched.ready.pop_front();
+        h.resume();
+        switches++;
+    }
+    auto end = chrono::steady_clock::now();
+
+    for (auto &t : tasks) {
+        t.handle.destroy();
+    }
+    return chrono::duration<double, nano>(end - start).count() / switches;
+}
+
+struct ring_node {
+    binary_semaphore turn{0};
+    ring_node *next = nullptr;
+    int rounds = 0;
+};
+
+void *ring_thread(void *arg) {
+    ring_node *node = static_cast<ring_node *>(arg);
+    for (int i = 0; i < node->rounds; i++) {
+        node->turn.acquire();
+        node->next->turn.release();
+    }
+    return nullptr;
+}
+
+// Returns ns per hand-off, or a negative value if not every thread could be
+// created (the count that did start is stored in started).
+double bench_threads(int connections, int rounds, int &started) {
+    vector<unique_ptr<ring_node>> nodes;
+    for (int i = 0; i < connections; i++) {
+        nodes.push_back(make_unique<ring_node>());
+        nodes.back()->rounds = rounds;
+    }
+    for (int i = 0; i < connections; i++) {
+        nodes[i]->next = nodes[(i + 1) % connections].get();
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    vector<pthread_t> threads(connections);
+    started = 0;
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], &attr, ring_thread, nodes[i].get()) != 0) {
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (started < connections) {
+        // Let the threads that did start finish on their own ring.
+        for (int i = 0; i < started; i++) {
+            nodes[i]->next = nodes[(i + 1) % started].get();
+        }
+    }
+    if (started == 0) return -1;
+
+    auto start = chrono::steady_clock::now();
+    nodes[0]->turn.release();
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], nullptr);
+    }
+    auto end = chrono::steady_clock::now();
+
+    double ns = chrono::duration<double, nano>(end - start).count() / ((double)started * rounds);
+    return started < connections ? -ns : ns;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = DEFAULT_CONNECTIONS;
+    int rounds = DEFAULT_ROUNDS;
+    if (argc > 1) connections = stoi(argv[1]);
+    if (argc > 2) rounds = stoi(argv[2]);
+    if (argc > 3 || connections <= 0 || rounds <= 0) {
+        cout << "[USE]: " << argv[0] << " [connections] [rounds]\n";
+        return 1;
+    }
+
+    double coro_ns = bench_coroutines(connections, rounds);
+    cout << "Connections: " << connections << ", rounds: " << rounds << "\n";
+    cout << "Coroutine switch:      " << coro_ns << " ns\n";
+    cout << "Coroutine frame size:  " << frame_bytes / connections << " bytes\n";
+
+    int started = 0;
+    double thread_ns = bench_threads(connections, rounds, started);
+    if (thread_ns < 0 && started == 0) {
+        cout << "Thread switch:         could not create any threads\n";
+        return 0;
+    }
+    if (thread_ns < 0) {
+        cout << "Thread switch:         " << -thread_ns << " ns (only " << started
+             << " threads could be created)\n";
+    } else {
+        cout << "Thread switch:         " << thread_ns << " ns\n";
+    }
+    cout << "Thread stack reserved: " << THREAD_STACK_SIZE << " bytes\n";
+    return 0;
+}
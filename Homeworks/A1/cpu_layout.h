@@ -0,0 +1,146 @@
+// CPU and NUMA topology helpers for pinning threads and placing memory.
+//
+// CPU lists use the kernel's notation ("0-3,8,10-11"). The NUMA topology is
+// read from /sys/devices/system/node; a machine without it is one node with
+// every CPU this process may use. Memory is placed with mbind(2) and queried
+// with get_mempolicy(2) through syscall(), so no libnuma is needed.
+//
+// A new thread starts with the CPU mask of the thread that created it, so
+// pinning a thread before it starts others pins those too.
+
+#ifndef CPU_LAYOUT_H
+#define CPU_LAYOUT_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+// "0-3,8" -> {0, 1, 2, 3, 8}. Returns false on anything else.
+inline bool parse_cpu_list(const std::string &text, std::vector<int> &cpus) {
+    cpus.clear();
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (item.empty()) continue;
+        char *end;
+        long first = std::strtol(item.c_str(), &end, 10), last = first;
+        if (*end == '-') {
+            last = std::strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' && *end != '\n') return false;
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return !cpus.empty();
+}
+
+// {0, 1, 2, 3, 8} -> "0-3,8".
+inline std::string format_cpu_list(const std::vector<int> &cpus) {
+    std::string text;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!text.empty()) text += ",";
+        text += std::to_string(cpus[i]);
+        if (j > i) text += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return text.empty() ? "-" : text;
+}
+
+// CPUs the calling thread may run on.
+inline std::vector<int> current_thread_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Restrict the calling thread to cpus. Returns false if the kernel refused
+// (a CPU that does not exist or is outside the process's cpuset).
+inline bool pin_current_thread(const std::vector<int> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+struct numa_topology {
+    std::vector<std::vector<int>> node_cpus; // Node -> its CPUs; nodes without CPUs are empty
+
+    numa_topology() {
+        for (int node = 0;; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) break;
+            std::string line;
+            std::getline(file, line);
+            std::vector<int> cpus;
+            parse_cpu_list(line, cpus);
+            node_cpus.push_back(cpus);
+        }
+        if (node_cpus.empty()) {
+            node_cpus.push_back(current_thread_cpus());
+        }
+    }
+
+    size_t nodes() const { return node_cpus.size(); }
+
+    // Node of a CPU, or -1 if unknown.
+    int node_of(int cpu) const {
+        for (size_t node = 0; node < node_cpus.size(); node++) {
+            for (int c : node_cpus[node]) {
+                if (c == cpu) return node;
+            }
+        }
+        return -1;
+    }
+
+    // Node all of cpus belong to, or -1 if they span several.
+    int node_of(const std::vector<int> &cpus) const {
+        int node = cpus.empty() ? -1 : node_of(cpus[0]);
+        for (int cpu : cpus) {
+            if (node_of(cpu) != node) return -1;
+        }
+        return node;
+    }
+};
+
+// Ask for the pages under [address, address + size) to live on node, moving
+// those already touched. The range is widened to whole pages. Returns false
+// if the kernel refused (no NUMA support, or no such node).
+inline bool place_on_node(const void *address, size_t size, int node) {
+    if (node < 0 || node >= 63 || size == 0) return false; // The kernel reads maxnode - 1 bits
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    uintptr_t end = ((uintptr_t)address + size + page - 1) & ~(page - 1);
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, 64, MPOL_MF_MOVE) == 0;
+}
+
+// Node the page at address lives on, or -1 if it cannot be told.
+inline int memory_node(const void *address) {
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return node;
+}
+
+#endif
@@ -0,0 +1,292 @@
+// Epoch-based reclamation, and a hash map whose readers take no locks.
+//
+// Readers wrap their accesses in an epoch_domain::guard. Writers that unlink
+// something readers may still hold retire() it instead of freeing it. The
+// domain has a global epoch; a guard records the epoch it started in, and the
+// epoch only moves on once every open guard has seen the current one. A thing
+// retired in epoch e is freed once the epoch reaches e + 2, when no guard
+// from before it was unlinked can still be open. Retiring takes a lock;
+// entering and leaving a guard is a store each.
+//
+// Retired things are freed by whoever calls retire() or collect() next, so a
+// process that retires rarely should also call collect() from time to time.
+//
+// epoch_map keeps a fixed number of buckets, each an immutable chain of nodes.
+// A writer copies the chain it changes, publishes the copy and retires the
+// old one, so readers never see a node change under them. Writers take a lock
+// and cost the length of one chain.
+//
+// A thread may use EPOCH_MAX_THREADS domains' worth of guards at most, and a
+// domain must outlive every thread that used it.
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <thread>
+
+#define EPOCH_MAX_THREADS 256  // Threads that may hold a guard on one domain
+#define EPOCH_COLLECT_EVERY 64 // Retirements between attempts to free
+
+class epoch_domain {
+    struct thread_record;
+
+public:
+    epoch_domain() = default;
+    epoch_domain(const epoch_domain &) = delete;
+    epoch_domain &operator=(const epoch_domain &) = delete;
+
+    // Keeps whatever the thread reads from the domain's structures alive.
+    // Guards nest.
+    class guard {
+    public:
+        explicit guard(epoch_domain &domain) : record(domain.record_of_this_thread()) {
+            if (record->depth++ == 0) {
+                record->state.store(domain.epoch.load(std::memory_order_seq_cst) << 1 | 1, std::memory_order_seq_cst);
+            }
+        }
+        ~guard() {
+            if (--record->depth == 0) {
+                record->state.store(0, std::memory_order_release);
+            }
+        }
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+
+    private:
+        thread_record *record;
+    };
+
+    // Run free_fn once no guard that was open before this call remains.
+    void retire(std::function<void()> free_fn) {
+        bool due;
+        {
+            std::lock_guard<std::mutex> lock(limbo_mutex);
+            limbo.emplace_back(epoch.load(std::memory_order_seq_cst), std::move(free_fn));
+            pending_count.store(limbo.size(), std::memory_order_relaxed);
+            due = limbo.size() % EPOCH_COLLECT_EVERY == 0;
+        }
+        if (due) collect();
+    }
+    template <class T>
+    void retire(T *object) {
+        retire([object] { delete object; });
+    }
+
+    // Advance the epoch if every open guard has caught up, and free what is
+    // old enough. Inside a guard it cannot move past that guard's epoch.
+    void collect() {
+        uint64_t current = epoch.load(std::memory_order_seq_cst);
+        bool caught_up = true;
+        for (thread_record &r : records) {
+            uint64_t state = r.state.load(std::memory_order_seq_cst);
+            if ((state & 1) && (state >> 1) != current) {
+                caught_up = false;
+                break;
+            }
+        }
+        if (caught_up) {
+            epoch.compare_exchange_strong(current, current + 1, std::memory_order_seq_cst);
+        }
+        current = epoch.load(std::memory_order_seq_cst);
+
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(limbo_mutex);
+            size_t kept = 0;
+            for (auto &item : limbo) {
+                if (item.first + 2 <= current) {
+                    ready.push_back(std::move(item.second));
+                } else {
+                    limbo[kept++] = std::move(item);
+                }
+            }
+            limbo.resize(kept);
+            pending_count.store(kept, std::memory_order_relaxed);
+        }
+        for (auto &free_fn : ready) {
+            free_fn();
+        }
+    }
+
+    // Free everything retired so far, waiting for open guards to close.
+    void synchronize() {
+        while (pending() > 0) {
+            collect();
+            if (pending() > 0) std::this_thread::yield();
+        }
+    }
+
+    // Retired but not yet freed.
+    size_t pending() const { return pending_count.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) thread_record {
+        std::atomic<uint64_t> state = 0; // Epoch << 1 | 1 while a guard is open, else 0
+        std::atomic<bool> claimed = false;
+        int depth = 0;                   // Owner thread only
+    };
+
+    // Gives the thread's slot back when it exits.
+    struct thread_slots {
+        std::vector<std::pair<const epoch_domain *, thread_record *>> slots;
+        ~thread_slots() {
+            for (auto &[domain, record] : slots) {
+                record->claimed.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    thread_record *record_of_this_thread() {
+        static thread_local thread_slots mine;
+        for (auto &[domain, record] : mine.slots) {
+            if (domain == this) return record;
+        }
+        while (true) {
+            for (thread_record &r : records) {
+                bool expected = false;
+                if (r.claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    mine.slots.emplace_back(this, &r);
+                    return &r;
+                }
+            }
+            std::this_thread::yield(); // More threads than EPOCH_MAX_THREADS
+        }
+    }
+
+    std::atomic<uint64_t> epoch = 0;
+    thread_record records[EPOCH_MAX_THREADS];
+    std::mutex limbo_mutex;
+    std::vector<std::pair<uint64_t, std::function<void()>>> limbo; // Retire epoch, free_fn
+    std::atomic<size_t> pending_count = 0;
+};
+
+template <class K, class V, class Hash = std::hash<K>>
+class epoch_map {
+public:
+    explicit epoch_map(epoch_domain &domain, size_t bucket_count = 1024) : domain(domain) {
+        size_t size = 1;
+        while (size < bucket_count) size *= 2;
+        mask = size - 1;
+        buckets = new std::atomic<node *>[size];
+        for (size_t i = 0; i < size; i++) {
+            buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    ~epoch_map() {
+        for (size_t i = 0; i <= mask; i++) {
+            free_chain(buckets[i].load(std::memory_order_relaxed));
+        }
+        delete[] buckets;
+    }
+    epoch_map(const epoch_map &) = delete;
+    epoch_map &operator=(const epoch_map &) = delete;
+
+    // Readers: any thread, no locks. What they return stays valid while the
+    // caller holds a guard.
+    bool find(const K &key, V &value) const {
+        epoch_domain::guard guard(domain);
+        for (const node *n = bucket_of(key).load(std::memory_order_acquire); n != nullptr; n = n->next) {
+            if (n->key == key) {
+                value = n->value;
+                return true;
+            }
+        }
+        return false;
+    }
+    bool contains(const K &key) const {
+        V ignored;
+        return find(key, ignored);
+    }
+    // f(key, value) for every entry; stops early if f returns false.
+    template <class F>
+    void for_each(F f) const {
+        epoch_domain::guard guard(domain);
+        for (size_t i = 0; i <= mask; i++) {
+            for (const node *n = buckets[i].load(std::memory_order_acquire); n != nullptr; n = n->next) {
+                if (!f(n->key, n->value)) return;
+            }
+        }
+    }
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    // Writers: serialized by a lock.
+    void insert_or_assign(const K &key, const V &value) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        std::atomic<node *> &bucket = bucket_of(key);
+        node *old = bucket.load(std::memory_order_relaxed);
+        node *fresh = new node{key, value, copy_without(old, key)};
+        if (!contains_key(old, key)) count++;
+        bucket.store(fresh, std::memory_order_release);
+        retire_chain(old);
+    }
+    bool erase(const K &key) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        std::atomic<node *> &bucket = bucket_of(key);
+        node *old = bucket.load(std::memory_order_relaxed);
+        if (!contains_key(old, key)) {
+            return false;
+        }
+        bucket.store(copy_without(old, key), std::memory_order_release);
+        count--;
+        retire_chain(old);
+        return true;
+    }
+    void clear() {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        for (size_t i = 0; i <= mask; i++) {
+            retire_chain(buckets[i].exchange(nullptr, std::memory_order_acq_rel));
+        }
+        count = 0;
+    }
+
+private:
+    struct node {
+        K key;
+        V value;
+        node *next;
+    };
+
+    epoch_domain &domain;
+    std::atomic<node *> *buckets;
+    size_t mask;
+    std::mutex write_mutex;
+    std::atomic<size_t> count = 0;
+
+    std::atomic<node *> &bucket_of(const K &key) const { return buckets[Hash{}(key) & mask]; }
+
+    static bool contains_key(const node *n, const K &key) {
+        for (; n != nullptr; n = n->next) {
+            if (n->key == key) return true;
+        }
+        return false;
+    }
+    static node *copy_without(const node *n, const K &key) {
+        node *head = nullptr, **tail = &head;
+        for (; n != nullptr; n = n->next) {
+            if (n->key == key) continue;
+            *tail = new node{n->key, n->value, nullptr};
+            tail = &(*tail)->next;
+        }
+        return head;
+    }
+    static void free_chain(node *n) {
+        while (n != nullptr) {
+            node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+    void retire_chain(node *n) {
+        if (n != nullptr) {
+            domain.retire([n] { free_chain(n); });
+        }
+    }
+};
+
+#endif
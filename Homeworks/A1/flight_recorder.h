@@ -0,0 +1,223 @@
+// Flight recorder: a per-thread ring of recent trace events, written out as
+// Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev) on demand.
+//
+// Only sampled messages are traced. sample() hands every sample_every-th
+// message on a thread a trace id, and every other message gets 0; all the
+// recording calls do nothing for id 0. With the recorder disabled sample()
+// always returns 0, so an untraced message costs one predictable branch per
+// trace point and nothing is ever written.
+//
+// Each thread writes only its own ring, without locks, and overwrites its
+// oldest events when it is full. dump() may run at any time on another
+// thread: a ring is read like a seqlock, and events that were being
+// overwritten while it was read are left out.
+//
+// While a thread works on a traced message it can make the id current
+// (trace_scope), so that code further down records against it without the id
+// being passed along, and so that work handed to another thread can carry it.
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <cstdint>
+#include <ctime>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_DEFAULT_EVENTS 65536 // Per thread
+
+enum trace_phase : char {
+    TRACE_INSTANT = 'i',
+    TRACE_BEGIN = 'B',    // Begin and end of a span on one thread
+    TRACE_END = 'E',
+    TRACE_FLOW_OUT = 's', // The message is handed to another thread...
+    TRACE_FLOW_IN = 'f'   // ...which picks it up here
+};
+
+class flight_recorder {
+public:
+    // The traced message the calling thread is working on, or 0.
+    static inline thread_local uint32_t current = 0;
+
+    // Trace one message in sample_every. Call before other threads record.
+    void enable(uint32_t sample_every, size_t events_per_thread = TRACE_DEFAULT_EVENTS) {
+        every = sample_every == 0 ? 1 : sample_every;
+        size_t size = 2;
+        while (size < events_per_thread) size *= 2;
+        ring_size = size;
+        on = true;
+    }
+    bool enabled() const { return on; }
+
+    // A trace id for the next message, or 0 if it is not traced.
+    uint32_t sample() {
+        if (!on) [[likely]] {
+            return 0;
+        }
+        static thread_local uint32_t seen = 0;
+        if (++seen % every != 0) {
+            return 0;
+        }
+        uint32_t id;
+        while ((id = next_id.fetch_add(1, std::memory_order_relaxed)) == 0) {
+        }
+        return id;
+    }
+
+    // Record an event for message id, if it is traced. name must be a string
+    // literal (only the pointer is kept).
+    void record(uint32_t id, const char *name, trace_phase phase, uint64_t value = 0) {
+        if (id == 0) [[likely]] {
+            return;
+        }
+        thread_ring *ring = own_ring();
+        uint64_t index = ring->claimed.load(std::memory_order_relaxed);
+        ring->claimed.store(index + 1, std::memory_order_relaxed);
+        // Release stores rather than a fence, which ThreadSanitizer cannot
+        // check: a dump that reads any of them also sees the claim above
+        event &e = ring->events[index & (ring->events.size() - 1)];
+        e.ns.store(now_ns(), std::memory_order_release);
+        e.value.store(value, std::memory_order_release);
+        e.name.store(name, std::memory_order_release);
+        e.id.store(id, std::memory_order_release);
+        e.phase.store(phase, std::memory_order_release);
+        ring->published.store(index + 1, std::memory_order_release);
+    }
+
+    // Label the calling thread in dumps. Does nothing while disabled.
+    void name_thread(const std::string &name) {
+        if (!on) return;
+        thread_ring *ring = own_ring();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        ring->name = name;
+    }
+
+    // Write every thread's retained events to path. Returns the number of
+    // events written, or -1 if the file could not be written.
+    long dump(const std::string &path) {
+        std::ofstream out(path);
+        if (!out) return -1;
+        long written = 0;
+        int pid = getpid();
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (const auto &ring : rings) {
+            out << (written++ ? ",\n" : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                << ",\"tid\":" << ring->tid << ",\"args\":{\"name\":\"" << ring->name << "\"}}";
+            std::vector<event_copy> copies;
+            uint64_t published = ring->published.load(std::memory_order_acquire);
+            uint64_t size = ring->events.size();
+            for (uint64_t i = published > size ? published - size : 0; i < published; i++) {
+                const event &e = ring->events[i & (size - 1)];
+                // Acquire loads keep the claimed load below from moving above them
+                copies.push_back({i, e.ns.load(std::memory_order_acquire), e.value.load(std::memory_order_acquire),
+                                  e.name.load(std::memory_order_acquire), e.id.load(std::memory_order_acquire),
+                                  e.phase.load(std::memory_order_acquire)});
+            }
+            uint64_t claimed = ring->claimed.load(std::memory_order_relaxed);
+            for (const event_copy &e : copies) {
+                if (e.index + size < claimed) continue; // Overwritten while we read it
+                out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"msg\",\"ph\":\"" << (char)e.phase << "\",\"pid\":"
+                    << pid << ",\"tid\":" << ring->tid << ",\"ts\":" << e.ns / 1000 << "." << pad3(e.ns % 1000);
+                if (e.phase == TRACE_INSTANT) out << ",\"s\":\"t\"";
+                if (e.phase == TRACE_FLOW_OUT || e.phase == TRACE_FLOW_IN) out << ",\"id\":" << e.id;
+                if (e.phase == TRACE_FLOW_IN) out << ",\"bp\":\"e\"";
+                out << ",\"args\":{\"msg\":" << e.id << ",\"value\":" << e.value << "}}";
+                written++;
+            }
+        }
+        out << "\n]}\n";
+        out.close();
+        return out ? written - rings.size() : -1;
+    }
+
+private:
+    struct event {
+        std::atomic<uint64_t> ns{0};
+        std::atomic<uint64_t> value{0};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint32_t> id{0};
+        std::atomic<char> phase{TRACE_INSTANT};
+    };
+    struct event_copy {
+        uint64_t index, ns, value;
+        const char *name;
+        uint32_t id;
+        char phase;
+    };
+    struct thread_ring {
+        std::vector<event> events;
+        std::atomic<uint64_t> claimed{0};   // Events started...
+        std::atomic<uint64_t> published{0}; // ...and finished
+        long tid;
+        std::string name;
+
+        explicit thread_ring(size_t size) : events(size), tid(syscall(SYS_gettid)), name("thread " + std::to_string(tid)) {}
+    };
+
+    bool on = false;
+    uint32_t every = 1;
+    size_t ring_size = TRACE_DEFAULT_EVENTS;
+    std::atomic<uint32_t> next_id{1};
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<thread_ring>> rings; // Kept after their threads exit
+
+    thread_ring *own_ring() {
+        static thread_local thread_ring *mine = nullptr;
+        if (mine == nullptr) {
+            auto ring = std::make_unique<thread_ring>(ring_size);
+            mine = ring.get();
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            rings.push_back(std::move(ring));
+        }
+        return mine;
+    }
+
+    static uint64_t now_ns() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    static std::string pad3(uint64_t n) {
+        std::string digits = std::to_string(n);
+        return std::string(3 - digits.size(), '0') + digits;
+    }
+};
+
+// Makes id the calling thread's current trace for the scope, recorded as a
+// span called name. Does nothing for id 0.
+class trace_scope {
+public:
+    trace_scope(flight_recorder &recorder, uint32_t id, const char *name) : recorder(recorder), id(id), name(name) {
+        if (id == 0) [[likely]] {
+            return;
+        }
+        previous = flight_recorder::current;
+        flight_recorder::current = id;
+        recorder.record(id, name, TRACE_BEGIN);
+    }
+    ~trace_scope() {
+        if (id == 0) [[likely]] {
+            return;
+        }
+        recorder.record(id, name, TRACE_END);
+        flight_recorder::current = previous;
+    }
+    trace_scope(const trace_scope &) = delete;
+    trace_scope &operator=(const trace_scope &) = delete;
+
+private:
+    flight_recorder &recorder;
+    uint32_t id;
+    const char *name;
+    uint32_t previous = 0;
+};
+
+#endif
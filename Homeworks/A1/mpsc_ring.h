@@ -0,0 +1,104 @@
+// Bounded lock-free ring for handing items from many producer threads to one
+// consumer thread.
+//
+// Every slot carries a sequence number that says whose turn it is (Vyukov's
+// bounded queue). A producer claims the next slot with one compare-and-swap on
+// the tail, fills it and publishes it by bumping the slot's sequence; the
+// consumer takes slots in order and hands each back to the producers one lap
+// later. Neither side ever waits for a lock, and a producer that is preempted
+// while filling its slot only holds up the consumer, never other producers.
+//
+// push() fails instead of waiting when the ring is full, so the caller decides
+// how to apply back-pressure. Only one thread may call pop(), empty() and
+// drained().
+
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+#define RING_CACHE_LINE 64
+
+template <class T>
+class mpsc_ring {
+public:
+    // capacity is rounded up to a power of two.
+    explicit mpsc_ring(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        mask = size - 1;
+        slots.reset(new slot[size]);
+        for (size_t i = 0; i < size; i++) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    mpsc_ring(const mpsc_ring &) = delete;
+    mpsc_ring &operator=(const mpsc_ring &) = delete;
+
+    // Any thread. Moves value in and returns true, or leaves it alone and
+    // returns false if the ring is full.
+    bool push(T &&value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            slot &s = slots[pos & mask];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            ptrdiff_t lag = (ptrdiff_t)(seq - pos);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.value = std::move(value);
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false; // The consumer has not freed this slot yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only. Takes the oldest published item, or returns false.
+    bool pop(T &value) {
+        slot &s = slots[head & mask];
+        if (s.seq.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        value = std::move(s.value);
+        s.value = T();
+        s.seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // Consumer only. False once the next item is published; an item whose
+    // producer is still filling it does not count yet.
+    bool empty() const {
+        return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1;
+    }
+
+    // Consumer only. True when no slot is claimed past the last one taken:
+    // unlike empty(), an item whose producer is still filling it counts.
+    bool drained() const { return tail.load(std::memory_order_acquire) == head; }
+
+    size_t capacity() const { return mask + 1; }
+
+    // The slots' memory, for placing it on a NUMA node.
+    const void *storage() const { return slots.get(); }
+    size_t storage_size() const { return (mask + 1) * sizeof(slot); }
+
+private:
+    struct alignas(RING_CACHE_LINE) slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<slot[]> slots;
+    size_t mask;
+    alignas(RING_CACHE_LINE) std::atomic<size_t> tail = 0; // Next slot producers claim
+    alignas(RING_CACHE_LINE) size_t head = 0;              // Next slot the consumer takes
+};
+
+#endif
@@ -0,0 +1,263 @@
+// Output queue for a non-blocking stream socket.
+//
+// Small writes are copied into the queue; large payloads that go to many
+// sockets (one encoded broadcast, say) are queued by reference, so a fan-out
+// does not copy them once per recipient. flush() gathers up to SEND_MAX_IOV
+// queued pieces into a single sendmsg, like writev.
+//
+// With zero-copy enabled, shared payloads of at least zerocopy_min bytes are
+// sent with MSG_ZEROCOPY: the kernel transmits straight from the payload
+// instead of copying it into the socket buffer. The payload must then stay
+// alive and unchanged until the kernel reports completion on the socket's
+// error queue (which also raises EPOLLERR); until reap_completions() sees
+// that report, the queue keeps a reference to it. The kernel numbers the
+// zero-copy sends on a socket 0, 1, 2, ... and reports ranges of them.
+//
+// On loopback, and on devices that cannot send from user pages, the kernel
+// quietly copies instead (SO_EE_CODE_ZEROCOPY_COPIED); send_counters::copied
+// shows how often that happened. Zero-copy only pays off for large payloads.
+//
+// Not thread-safe; the server guards each queue with its connection's mutex.
+
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <cstdint>
+#include <cerrno>
+#include <string>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define SEND_MAX_IOV 64                 // Queued pieces per sendmsg
+#define SEND_COMPACT_SIZE (64 * 1024)   // Reclaim sent bytes of a copied piece above this
+
+// Totals across queues, for reporting. Shared between threads.
+struct send_counters {
+    std::atomic<uint64_t> calls = 0;           // sendmsg calls that sent something
+    std::atomic<uint64_t> pieces = 0;          // Queued pieces they carried
+    std::atomic<uint64_t> bytes = 0;
+    std::atomic<uint64_t> zerocopy_calls = 0;  // Of the calls, those with MSG_ZEROCOPY
+    std::atomic<uint64_t> zerocopy_bytes = 0;
+    std::atomic<uint64_t> completed = 0;       // Zero-copy sends the kernel has released
+    std::atomic<uint64_t> copied = 0;          // ...of which it had copied after all
+};
+
+class send_queue {
+public:
+    send_counters *counters = nullptr;
+
+    // Ask the kernel for zero-copy sends on fd; shared payloads of at least
+    // min_size bytes are then sent that way. Returns false if it refused.
+    bool enable_zerocopy(int fd, size_t min_size) {
+        int one = 1;
+        if (min_size == 0 || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            zerocopy_min = 0;
+            return false;
+        }
+        zerocopy_min = min_size;
+        return true;
+    }
+
+    // Copy bytes to the end of the queue.
+    void append(const char *data, size_t size) { tail().append(data, size); }
+    void append(const std::string &data) { tail() += data; }
+
+    // The copied piece at the end of the queue, to encode into directly.
+    std::string &tail() {
+        if (pieces.empty() || pieces.back().shared) {
+            pieces.emplace_back();
+            tail_counted = 0;
+        }
+        return pieces.back().owned;
+    }
+
+    // Queue a payload by reference. It must not change while queued.
+    void append_shared(std::shared_ptr<const std::string> payload) {
+        if (payload->empty()) return;
+        count_tail();
+        queued += payload->size();
+        pieces.emplace_back();
+        pieces.back().shared = std::move(payload);
+    }
+
+    // Bytes not yet accepted by the kernel.
+    size_t size() const {
+        bool open_tail = !pieces.empty() && !pieces.back().shared;
+        return queued + (open_tail ? pieces.back().owned.size() - tail_counted : 0);
+    }
+    bool empty() const { return pieces.empty(); }
+
+    // Send as much as the socket takes. Returns false if the connection is
+    // broken; stops quietly when the socket is full.
+    bool flush(int fd) {
+        while (!pieces.empty()) {
+            iovec iov[SEND_MAX_IOV];
+            int count = 0;
+            int flags = MSG_NOSIGNAL;
+            if (zerocopy(pieces.front())) {
+                // Sent on its own, so only this payload has to be kept alive
+                const piece &p = pieces.front();
+                iov[count++] = {(void *)(p.data().data() + p.offset), p.data().size() - p.offset};
+                flags |= MSG_ZEROCOPY;
+            } else {
+                for (const piece &p : pieces) {
+                    if (count == SEND_MAX_IOV || zerocopy(p)) break;
+                    iov[count++] = {(void *)(p.data().data() + p.offset), p.data().size() - p.offset};
+                }
+            }
+            msghdr message{};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            ssize_t sent = sendmsg(fd, &message, flags);
+            if (sent < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // Too many sends awaiting completion: copy this one
+                sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+                flags = MSG_NOSIGNAL;
+            }
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (flags & MSG_ZEROCOPY) {
+                pinned.push_back({next_zerocopy_id++, pieces.front().shared, false});
+            }
+            if (counters) {
+                counters->calls++;
+                counters->pieces += count;
+                counters->bytes += sent;
+                if (flags & MSG_ZEROCOPY) {
+                    counters->zerocopy_calls++;
+                    counters->zerocopy_bytes += sent;
+                }
+            }
+            consume(sent);
+        }
+        return true;
+    }
+
+    // Read zero-copy completions from fd's error queue and release the
+    // payloads they cover. Returns true if there were any; EPOLLERR without
+    // them means a real socket error.
+    bool reap_completions(int fd) {
+        bool found = false;
+        while (true) {
+            char control[128];
+            msghdr message{};
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                if (errno == EINTR) continue;
+                return found;
+            }
+            for (cmsghdr *cm = CMSG_FIRSTHDR(&message); cm != nullptr; cm = CMSG_NXTHDR(&message, cm)) {
+                bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                               (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+                const sock_extended_err *error = (const sock_extended_err *)CMSG_DATA(cm);
+                if (!recverr || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                found = true;
+                release(error->ee_info, error->ee_data, error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+
+    // Payloads still held for the kernel.
+    size_t pinned_count() const { return pinned.size(); }
+
+    // The kernel's number for the next zero-copy send on the socket. A process
+    // that takes the socket over must carry on from here.
+    uint32_t next_zerocopy() const { return next_zerocopy_id; }
+    void set_next_zerocopy(uint32_t id) { next_zerocopy_id = id; }
+
+    // Everything still queued, as one string (for handing the socket over).
+    std::string contents() const {
+        std::string all;
+        for (const piece &p : pieces) {
+            all.append(p.data(), p.offset, std::string::npos);
+        }
+        return all;
+    }
+
+private:
+    struct piece {
+        std::string owned;
+        std::shared_ptr<const std::string> shared;
+        size_t offset = 0; // Bytes already sent
+
+        const std::string &data() const { return shared ? *shared : owned; }
+    };
+    struct pinned_payload {
+        uint32_t id;
+        std::shared_ptr<const std::string> payload;
+        bool done = false;
+    };
+
+    std::deque<piece> pieces;
+    size_t queued = 0;       // Bytes in pieces, except what was added through tail()...
+    size_t tail_counted = 0; // ...to the last piece since it was last counted
+    std::deque<pinned_payload> pinned;
+    size_t zerocopy_min = 0;
+    uint32_t next_zerocopy_id = 0;
+
+    bool zerocopy(const piece &p) const {
+        return zerocopy_min != 0 && p.shared && p.shared->size() - p.offset >= zerocopy_min;
+    }
+
+    void count_tail() {
+        if (!pieces.empty() && !pieces.back().shared) {
+            queued += pieces.back().owned.size() - tail_counted;
+            tail_counted = pieces.back().owned.size();
+        }
+    }
+
+    // Drop what the kernel accepted, and any empty pieces in front.
+    void consume(size_t sent) {
+        count_tail();
+        queued -= sent;
+        while (!pieces.empty()) {
+            piece &p = pieces.front();
+            size_t left = p.data().size() - p.offset;
+            if (sent < left) {
+                p.offset += sent;
+                if (!p.shared && p.offset >= SEND_COMPACT_SIZE && p.offset * 2 >= p.owned.size()) {
+                    if (&p == &pieces.back()) tail_counted -= p.offset;
+                    p.owned.erase(0, p.offset);
+                    p.offset = 0;
+                }
+                return;
+            }
+            sent -= left;
+            pieces.pop_front();
+        }
+    }
+
+    // The kernel is done with zero-copy sends first..last (inclusive, and
+    // possibly wrapped around).
+    void release(uint32_t first, uint32_t last, bool copied) {
+        for (pinned_payload &p : pinned) {
+            if (!p.done && (uint32_t)(p.id - first) <= (uint32_t)(last - first)) {
+                p.done = true;
+                if (counters) {
+                    counters->completed++;
+                    if (copied) counters->copied++;
+                }
+            }
+        }
+        while (!pinned.empty() && pinned.front().done) {
+            pinned.pop_front();
+        }
+    }
+};
+
+#endif
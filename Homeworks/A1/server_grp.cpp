@@ -15,6 +15,31 @@
 #include <arpa/inet.h>
 #include <atomic>
 #include <csignal>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <coroutine>
+#include <optional>
+#include <utility>
+#include <cerrno>
+#include <latch>
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <chrono>
+#include <random>
+#include "topic_trie.h"
+#include "wire_protocol.h"
+#include "wire_deflate.h"
+#include "send_queue.h"
+#include "mpsc_ring.h"
+#include "work_stealing.h"
+#include "epoch.h"
+#include "cpu_layout.h"
+#include "flight_recorder.h"
+#include "udp_delivery.h"
 
 using namespace std;
 
@@ -23,266 +48,2271 @@ using namespace std;
 #define MAX_GROUPS 1000
 #define MAX_GROUP_SIZE 100
 #define MAX_CLIENTS 10000   
+#define NUM_LANES 64        // Group execution lanes, run on the worker pool
+#define LANE_INBOX_SIZE 1024         // Tasks a lane takes without a lock
+#define LANE_BATCH 64                // Tasks a lane runs before yielding its worker
+#define REACTOR_INBOX_SIZE 16384     // Tasks the reactor takes without a lock
+#define REACTOR_BATCH 1024           // Tasks the reactor runs between epoll_waits
+#define MAX_WORKERS 128              // Upper bound for --workers
+#define EPOCH_POLL_MS 50             // Reactor wake-up while retired sockets wait
+#define RX_FOLLOW_ACCEPTS 64         // Accepts between reactor moves with --reactor-cpu rx
+#define MAX_FDS 65536       // Highest socket descriptor the reactor will track
+#define MAX_EVENTS 256      // Readiness events handled per epoll_wait
+#define WRITE_HIGH_WATERMARK (64 * 1024)        // A handler's own writes wait above this
+#define MAX_PENDING_OUTPUT (4 * 1024 * 1024)    // Slow readers are dropped above this
+#define UPGRADE_SOCKET_PATH "/tmp/server_grp.upgrade" // Hot-upgrade control socket
+#define UPGRADE_FDS_PER_MESSAGE 250                  // Descriptors per SCM_RIGHTS message
+#define UPGRADE_CHUNK_SIZE 32768                     // State bytes per message
+#define MAX_NODES 16        // Servers in one cluster
+#define BUS_PORT 13345      // Node i listens for its peers on BUS_PORT + i
+#define LINK_RETRY_MS 500   // Delay between attempts to reach a peer
+#define LINK_GRACE_MS 5000  // How long a lost peer's users and members are kept
+#define COMPRESS_MIN_SIZE 512         // Smaller binary messages are never compressed
+#define SHARE_MIN_SIZE (16 * 1024)    // Larger payloads are queued by reference, not copied
+#define ZEROCOPY_MIN_SIZE (64 * 1024) // Larger shared payloads are sent with MSG_ZEROCOPY
+#define STATS_REPORT_SECONDS 10       // How often send and compression counters are logged
+#define TRACE_FILE_PREFIX "trace-"    // SIGUSR1 writes trace-<pid>-<n>.json
+#define UDP_SEND_BUFFER (4 * 1024 * 1024) // Socket buffer for UDP delivery bursts
 
 std::atomic<int> active_connections = 0;
 
-unordered_map<int, string> clients; // Client socket -> username
+// The registries of logged-in clients are read by every thread for each
+// delivery, and written only at login and logout. Readers take no lock and
+// hold an epoch guard instead; writers take client_mutex. A socket found in a
+// registry stays open while the guard is held, as close_connection retires
+// the close through registry_epochs.
+epoch_domain registry_epochs;
+epoch_map<int, string> clients(registry_epochs); // Client socket -> username
 unordered_map<string, string> users; // Username -> password
-unordered_map<string, unordered_set<int>> groups; // Group -> client sockets
-mutex client_mutex, group_mutex;
+mutex client_mutex; // Serializes registry writers, and guards peers[].users
 bool server_running = true; // To handle graceful shutdown
 
-// Utility function to send a message to a specific client
-void send_message(int client_socket, const string &message) {
+int node_id = 0;      // This server's position in the cluster
+int cluster_size = 1; // Number of servers in the cluster
+
+// A logged-in client anywhere in the cluster: its node and the session number
+// that node gave the connection. Sessions are never reused, unlike sockets.
+typedef uint64_t member_id;
+const member_id NO_MEMBER = 0; // Sessions start at 1
+
+member_id make_member(int node, uint32_t session) {
+    return (uint64_t)node << 32 | session;
+}
+
+int member_node(member_id member) {
+    return member >> 32;
+}
+
+epoch_map<uint32_t, int> session_sockets(registry_epochs); // Session -> socket of local logged-in clients
+
+// Topic subscriptions of local clients, by session. Each node matches its own
+// subscribers; see publish_topic.
+topic_trie topics;
+mutex topic_mutex;
+
+// Groups are sharded over execution lanes. Every group name hashes to exactly one
+// lane, and a lane runs its tasks one at a time in the order they were posted,
+// so operations on one group need no lock while different groups run in
+// parallel. Lanes are not threads: a lane with work is a task on the
+// work-stealing pool (work_stealing.h), and any idle worker may pick it up.
+struct group_state {
+    unordered_map<member_id, int> members; // Member -> its socket here, or -1 on another node
+    uint64_t next_seq = 1;                 // Sequence number of the next /group_msg
+};
+
+// Tasks posted to one consumer by any thread, kept in order per poster. They
+// go through a lock-free ring (mpsc_ring.h); only when it is full do they
+// spill into a locked queue, which then takes every task until the consumer
+// has emptied it, so no poster ever waits for the consumer. The spill is
+// only drained once no ring slot is even claimed: a poster's earlier task
+// may sit in a slot it has claimed but not yet published.
+struct task_inbox {
+    mpsc_ring<function<void()>> ring;
+    mutex spill_mutex;
+    deque<function<void()>> spill;
+    atomic<bool> spilling = false;
+
+    explicit task_inbox(size_t capacity) : ring(capacity) {}
+
+    void push(function<void()> task) {
+        if (!spilling.load(memory_order_acquire) && ring.push(std::move(task))) {
+            return;
+        }
+        lock_guard<mutex> lock(spill_mutex);
+        spilling.store(true, memory_order_release);
+        spill.push_back(std::move(task));
+    }
+
+    // Consumer only.
+    bool pop(function<void()> &task) {
+        if (ring.pop(task)) {
+            return true;
+        }
+        if (!spilling.load(memory_order_acquire)) {
+            return false;
+        }
+        lock_guard<mutex> lock(spill_mutex);
+        // Checked under the lock, which a spilling poster released after any
+        // claim it made on the ring, so that claim is visible here
+        if (spill.empty() || !ring.drained()) {
+            return false; // Retried on the next pop
+        }
+        task = std::move(spill.front());
+        spill.pop_front();
+        if (spill.empty()) {
+            spilling.store(false, memory_order_release);
+        }
+        return true;
+    }
+};
+
+struct lane {
+    task_inbox inbox{LANE_INBOX_SIZE};
+    atomic<int64_t> pending = 0; // Tasks posted and not yet run
+    unordered_map<string, group_state> groups; // Touched only by the lane's tasks
+    int numa_node = -1;          // With --numa: where its memory and home worker are
+    size_t home_worker = 0;      // Worker the lane is handed to when it gets work
+};
+
+lane lanes[NUM_LANES];
+std::atomic<int> group_count = 0;
+work_stealing_executor *executor = nullptr; // Runs the lanes
+
+// With --trace N, one message in N per reactor thread gets a trace id in
+// handle_client. The id is current on a thread while it works on that message
+// (flight_recorder::current), travels with the tasks posted for it, and every
+// step records an event; SIGUSR1 dumps the last events of each thread. Without
+// --trace every id is 0 and each trace point is a single untaken branch.
+flight_recorder tracer;
+
+// Thread layout. By default the scheduler places every thread. The reactor
+// (which also accepts), the workers and the service threads (statistics and
+// cluster links) can each be confined to CPUs of their own, and the reactor
+// can follow the CPU that receives most connections (SO_INCOMING_CPU). With
+// --numa each lane gets a home NUMA node: its inbox is placed there, and when
+// it gets work it is handed to a worker on that node. The worker then makes
+// the lane's group allocations on that node as well. Idle workers still steal
+// across nodes.
+numa_topology topology;
+vector<int> process_cpus;         // The CPUs the process started with
+vector<int> reactor_cpus;         // Empty: not pinned
+vector<int> service_cpus;
+vector<vector<int>> worker_cpus;  // Per worker; empty: not pinned
+vector<vector<int>> worker_affinity; // Per worker, as the worker saw it once pinned
+bool reactor_follows_rx = false;
+bool numa_lanes = false;
+atomic<uint64_t> incoming_cpus[CPU_SETSIZE]; // Accepted connections by SO_INCOMING_CPU
+
+// Called first on every service thread. Threads they start inherit the mask.
+void pin_service_thread() {
+    pin_current_thread(service_cpus.empty() ? process_cpus : service_cpus);
+}
+
+// UDP delivery (udp_delivery.h). Every thread that delivers messages queues
+// datagrams in a sender of its own, and flushes it once it is done with the
+// work at hand: a lane after its batch of tasks, the reactor after each round
+// of events, a link thread after each bus frame. A lane batch that sends a
+// member several equal-sized messages sends them as one GSO write.
+int udp_socket = -1;
+udp_send_stats udp_stats;
+unordered_map<uint64_t, uint32_t> udp_tokens; // Token handed out -> session; reactor only
+
+udp_sender &udp_batch() {
+    thread_local udp_sender sender(udp_socket, udp_stats);
+    return sender;
+}
+
+void flush_udp() {
+    if (udp_socket >= 0) {
+        udp_batch().flush();
+    }
+}
+
+lane &lane_for(const string &group_name) {
+    // The low part of the hash already picked the home node (group_home).
+    return lanes[hash<string>{}(group_name) / cluster_size % NUM_LANES];
+}
+
+// Run up to LANE_BATCH of a lane's tasks on the current worker, then hand the
+// rest back to the pool so that one busy group cannot hold a worker. Only the
+// tasks counted in pending are run, so there is one run_lane per lane at most.
+void run_lane(lane *l) {
+    int64_t due = min<int64_t>(l->pending.load(memory_order_acquire), LANE_BATCH);
+    int64_t ran = 0;
+    function<void()> task;
+    while (ran < due && l->inbox.pop(task)) {
+        task();
+        ran++;
+    }
+    flush_udp();
+    if (l->pending.fetch_sub(ran, memory_order_acq_rel) - ran > 0) {
+        executor->submit([l] { run_lane(l); });
+    }
+}
+
+void post(lane &l, function<void()> task) {
+    if (uint32_t id = flight_recorder::current) [[unlikely]] {
+        tracer.record(id, "enqueued", TRACE_FLOW_OUT, &l - lanes);
+        task = [id, task = std::move(task)] {
+            trace_scope scope(tracer, id, "lane task");
+            tracer.record(id, "enqueued", TRACE_FLOW_IN);
+            task();
+        };
+    }
+    l.inbox.push(std::move(task));
+    if (l.pending.fetch_add(1, memory_order_acq_rel) == 0) {
+        executor->submit_near([&l] { run_lane(&l); }, l.home_worker);
+    }
+}
+
+// All client sockets are non-blocking and served by one epoll reactor thread.
+// Connection logic is written as coroutines that suspend in co_await
+// conn.read_frame() / conn.write() until the reactor sees the socket ready, so
+// an idle client costs a coroutine frame instead of a thread and its stack.
+
+// A detached coroutine: it starts running immediately and frees its own frame
+// when it returns.
+struct client_task {
+    struct promise_type {
+        client_task get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// How far a client has got through login. The handler keeps this up to date
+// so that a connection handed to a new server process resumes where it was.
+enum client_stage {
+    STAGE_NEW,      // Nothing sent yet
+    STAGE_USERNAME, // Prompted for the username
+    STAGE_PASSWORD, // Prompted for the password
+    STAGE_SESSION   // Logged in and listed in clients
+};
+
+struct connection {
+    int fd;
+    mutex out_mutex;         // Lanes write to sockets they do not own
+    send_queue out;          // Output the kernel has not accepted yet
+    bool binary = false;     // Negotiated the binary protocol at login
+    bool deflate = false;    // Also accepts OP_COMPRESSED (wire_deflate.h)
+    string batch;            // Binary messages not yet framed (see flush_output)
+    unordered_set<uint64_t> known_names; // Interned names defined on this connection
+    wire_decoder in;         // Binary requests received but not yet handled
+    coroutine_handle<> reader, writer; // Handler suspended on input / output
+    client_stage stage = STAGE_NEW;
+    string username;
+    uint32_t session = 0;
+    // UDP delivery (udp_delivery.h). The address is written once, by the
+    // reactor, before udp_on is set; it is read only after seeing udp_on.
+    atomic<bool> udp_on = false;
+    sockaddr_in udp_address{};
+    atomic<uint64_t> udp_seq = 0;  // Last datagram sequence number used
+    uint64_t udp_token = 0;        // Handed out and not yet used (reactor only)
+
+    // Resolves to the next chunk the client sent (a whole frame in binary
+    // mode), or nullopt once it is gone.
+    struct read_awaiter {
+        connection *conn;
+        optional<string> frame;
+
+        bool try_read() {
+            while (true) {
+                if (conn->binary) {
+                    string body;
+                    frame_status status = conn->in.next(body);
+                    if (status == FRAME_READY) {
+                        frame.emplace(std::move(body));
+                    }
+                    if (status != FRAME_INCOMPLETE) {
+                        return true; // A bad frame ends the connection
+                    }
+                }
+                char buffer[BUFFER_SIZE];
+                ssize_t bytes_received = recv(conn->fd, buffer, BUFFER_SIZE, 0);
+                if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    return false;
+                }
+                if (bytes_received <= 0) {
+                    return true;
+                }
+                if (!conn->binary) {
+                    frame.emplace(buffer, bytes_received);
+                    return true;
+                }
+                conn->in.feed(buffer, bytes_received);
+            }
+        }
+        bool await_ready() { return try_read(); }
+        void await_suspend(coroutine_handle<> h) { conn->reader = h; conn->pending_read = this; }
+        optional<string> await_resume() { return std::move(frame); }
+    };
+
+    // Queues the message and only suspends while the client is too far behind.
+    struct write_awaiter {
+        connection *conn;
+
+        bool await_ready() {
+            lock_guard<mutex> lock(conn->out_mutex);
+            return conn->pending_output() <= WRITE_HIGH_WATERMARK;
+        }
+        void await_suspend(coroutine_handle<> h) { conn->writer = h; }
+        void await_resume() {}
+    };
+
+    read_awaiter *pending_read = nullptr;
+
+    read_awaiter read_frame() { return {this, nullopt}; }
+    write_awaiter write(const wire_message &message);
+
+    size_t pending_output() const { return out.size() + batch.size(); }
+};
+
+// Output is sent with sendmsg, many queued pieces per call. Payloads of at
+// least SHARE_MIN_SIZE are queued by reference, so a fan-out does not copy
+// them per recipient, and from zerocopy_min_size on (--zerocopy-min, 0 turns
+// it off) they are sent with MSG_ZEROCOPY where the socket allows it.
+size_t zerocopy_min_size = ZEROCOPY_MIN_SIZE;
+send_counters sends;
+
+connection *connections[MAX_FDS]; // Socket -> connection, owned by the reactor
+uint32_t next_session = 1;        // Reactor thread only
+int epoll_fd = -1;
+int wake_fd = -1; // eventfd that interrupts epoll_wait when tasks are posted
+
+task_inbox reactor_tasks{REACTOR_INBOX_SIZE};
+
+// Run a task on the reactor thread, after the current batch of events.
+void post_to_reactor(function<void()> task) {
+    reactor_tasks.push(std::move(task));
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+    }
+}
+
+// Push queued output into the socket. Call with out_mutex held. Returns false
+// if the connection is broken. Binary messages are only framed once the
+// socket has taken everything before them, so whatever piles up behind a slow
+// reader goes out as one batched frame.
+bool flush_output(connection &conn) {
+    while (true) {
+        if (conn.out.empty() && !conn.batch.empty()) {
+            put_frame(conn.out.tail(), conn.batch);
+            conn.batch.clear();
+        }
+        if (!conn.out.flush(conn.fd)) {
+            return false;
+        }
+        if (!conn.out.empty() || conn.batch.empty()) {
+            return true;
+        }
+    }
+}
+
+// Names interned for the binary protocol. Ids are never reused, so clients
+// can keep them for the whole session; they are handed over on upgrade.
+name_table wire_names;
+mutex name_mutex;
+
+bool resolve_name(uint64_t id, string &name) {
+    lock_guard<mutex> lock(name_mutex);
+    const string *found = wire_names.name_of(id);
+    if (found != nullptr) {
+        name = *found;
+    }
+    return found != nullptr;
+}
+
+// Compression of binary messages for clients that negotiated it. Every node
+// and every upgraded process must use the same dictionary as the clients.
+string wire_dictionary = default_dictionary();
+size_t compress_min_size = COMPRESS_MIN_SIZE;
+
+struct compression_stats {
+    atomic<uint64_t> compressed = 0;   // Messages compressed
+    atomic<uint64_t> not_worth = 0;    // Large enough, but did not shrink
+    atomic<uint64_t> raw_bytes = 0;    // Size of the compressed messages before...
+    atomic<uint64_t> packed_bytes = 0; // ...and after
+    atomic<uint64_t> nanoseconds = 0;  // Spent compressing
+    atomic<uint64_t> deliveries = 0;   // Compressed copies queued for clients
+} compression;
+
+// Log the counters every STATS_REPORT_SECONDS while they change.
+void report_stats() {
+    pin_service_thread();
+    uint64_t reported_calls = 0, reported_deliveries = 0, reported_tasks = 0, reported_accepts = 0, reported_datagrams = 0;
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(STATS_REPORT_SECONDS));
+        uint64_t accepts = 0;
+        string by_cpu;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (uint64_t count = incoming_cpus[cpu]) {
+                accepts += count;
+                by_cpu += " " + to_string(cpu) + ":" + to_string(count);
+            }
+        }
+        if (accepts != reported_accepts) {
+            reported_accepts = accepts;
+            cout << "Incoming CPUs (cpu:connections):" << by_cpu << endl;
+        }
+        uint64_t tasks = executor->executed();
+        if (tasks != reported_tasks) {
+            reported_tasks = tasks;
+            cout << "Workers: " << executor->size() << " threads, " << tasks << " lane runs, "
+                 << executor->stolen() << " stolen" << endl;
+        }
+        uint64_t datagrams = udp_stats.datagrams;
+        if (datagrams != reported_datagrams) {
+            reported_datagrams = datagrams;
+            cout << "UDP: " << datagrams << " datagrams in " << udp_stats.calls << " sendmmsg calls, "
+                 << udp_stats.gso_sends << " GSO sends, " << udp_stats.dropped << " dropped" << endl;
+        }
+        uint64_t calls = sends.calls;
+        if (calls != reported_calls) {
+            reported_calls = calls;
+            uint64_t bytes = sends.bytes, pieces = sends.pieces;
+            cout << "Sends: " << calls << " calls, " << bytes << " bytes, "
+                 << (double)pieces / calls << " pieces per call; zero-copy " << sends.zerocopy_calls
+                 << " calls, " << sends.zerocopy_bytes << " bytes, " << sends.completed << " completed ("
+                 << sends.copied << " copied by the kernel)" << endl;
+        }
+        uint64_t deliveries = compression.deliveries;
+        if (deliveries == reported_deliveries) continue;
+        reported_deliveries = deliveries;
+        uint64_t count = compression.compressed, raw = compression.raw_bytes, packed = compression.packed_bytes;
+        cout << "Compression: " << count << " messages (" << compression.not_worth << " not worth it), "
+             << raw << " -> " << packed << " bytes (" << (raw ? 100.0 * packed / raw : 0) << "%), "
+             << (count ? compression.nanoseconds / count / 1000.0 : 0) << " us each, "
+             << deliveries << " deliveries" << endl;
+    }
+}
+
+// Write the flight recorder to a new file on every SIGUSR1. main blocks the
+// signal in every thread, so it only ever arrives here.
+void dump_traces() {
+    pin_service_thread();
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int dumps = 0;
+    while (true) {
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+        if (!tracer.enabled()) {
+            cout << "Tracing is off; start the server with --trace <one in N messages>." << endl;
+            continue;
+        }
+        string path = TRACE_FILE_PREFIX + to_string(getpid()) + "-" + to_string(dumps++) + ".json";
+        long events = tracer.dump(path);
+        if (events < 0) {
+            cerr << "Error writing trace " << path << endl;
+        } else {
+            cout << "Trace: " << events << " events written to " << path << endl;
+        }
+    }
+}
+
+// A message on its way to one or more clients. Each protocol's encoding is
+// built at most once, however many recipients there are.
+struct prepared_message {
+    typedef shared_ptr<const string> form;
+
+    const wire_message &message;
+    form text_form;
+    form binary_form;
+    form compressed_form;                 // Empty if not worth compressing
+    form datagram_form;                   // Names and message, without the sequence number
+    vector<pair<uint64_t, string>> names; // Interned names binary_form refers to
+
+    explicit prepared_message(const wire_message &message) : message(message) {}
+
+    const form &text() {
+        if (!text_form) {
+            text_form = make_shared<const string>(message.to_text());
+        }
+        return text_form;
+    }
+    const form &binary() {
+        if (!binary_form) {
+            string encoded;
+            lock_guard<mutex> lock(name_mutex);
+            encode_message(encoded, message, [this](const string &name) {
+                uint64_t id = wire_names.intern(name);
+                names.emplace_back(id, name);
+                return id;
+            });
+            binary_form = make_shared<const string>(std::move(encoded));
+        }
+        return binary_form;
+    }
+    // UDP datagrams carry their names with them (udp_delivery.h).
+    const form &datagram() {
+        if (!datagram_form) {
+            string body;
+            const string &encoded = *binary();
+            for (const auto &[id, name] : names) {
+                encode_name(body, id, name);
+            }
+            body += encoded;
+            datagram_form = make_shared<const string>(std::move(body));
+        }
+        return datagram_form;
+    }
+    const form &compressed() {
+        if (!compressed_form) {
+            string packed;
+            const string &raw = *binary();
+            if (raw.size() >= compress_min_size) {
+                thread_local message_compressor compressor(wire_dictionary);
+                auto start = chrono::steady_clock::now();
+                bool worth = compressor.compress(raw, packed);
+                compression.nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                if (worth) {
+                    compression.compressed++;
+                    compression.raw_bytes += raw.size();
+                    compression.packed_bytes += packed.size();
+                } else {
+                    compression.not_worth++;
+                }
+            }
+            compressed_form = make_shared<const string>(std::move(packed));
+        }
+        return compressed_form;
+    }
+};
+
+void send_prepared(int client_socket, prepared_message &message) {
+    connection *conn = connections[client_socket];
+    if (conn->udp_on.load(memory_order_acquire) && udp_eligible(message.message.op) &&
+        message.datagram()->size() + 10 <= UDP_MAX_DATAGRAM) {
+        string datagram;
+        put_varint(datagram, conn->udp_seq.fetch_add(1, memory_order_relaxed) + 1);
+        datagram += *message.datagram();
+        tracer.record(flight_recorder::current, "udp queued", TRACE_INSTANT, datagram.size());
+        udp_batch().queue(conn->udp_address, std::move(datagram));
+        return;
+    }
+    const prepared_message::form *payload = conn->binary ? &message.binary() : &message.text();
+    if (conn->deflate && !message.compressed()->empty()) {
+        payload = &message.compressed();
+        compression.deliveries++;
+    }
+    bool shared = (*payload)->size() >= SHARE_MIN_SIZE;
+    uint32_t trace_id = flight_recorder::current;
+    tracer.record(trace_id, "lock wait", TRACE_BEGIN, client_socket);
+    lock_guard<mutex> lock(conn->out_mutex);
+    tracer.record(trace_id, "lock wait", TRACE_END, client_socket);
+    if (conn->binary) {
+        string names;
+        for (const auto &[id, name] : message.names) {
+            if (conn->known_names.insert(id).second) {
+                encode_name(names, id, name);
+            }
+        }
+        if (shared) {
+            // A frame of its own: header and names copied, the payload shared
+            if (!conn->batch.empty()) {
+                put_frame(conn->out.tail(), conn->batch);
+                conn->batch.clear();
+            }
+            string &head = conn->out.tail();
+            put_varint(head, names.size() + (*payload)->size());
+            head += names;
+            conn->out.append_shared(*payload);
+        } else {
+            conn->batch += names;
+            conn->batch += **payload;
+        }
+    } else if (shared) {
+        conn->out.append_shared(*payload);
+    } else {
+        conn->out.append(**payload);
+    }
     //handle error
-    if(send(client_socket, message.c_str(), message.size(), 0) <= 0) {
+    if (!flush_output(*conn) || conn->pending_output() > MAX_PENDING_OUTPUT) {
         cout << "Error sending message to client." << endl;
-        close(client_socket);
+        // Only shut the socket down: the descriptor stays reserved until the
+        // client coroutine and every lane have dropped it, so it cannot be reused
+        // by a new connection while a lane still lists it as a group member.
+        shutdown(client_socket, SHUT_RDWR);
+    }
+    tracer.record(trace_id, "written", TRACE_INSTANT, conn->pending_output()); // Bytes still queued
+}
+
+// Utility function to send a message to a specific client
+void send_message(int client_socket, const wire_message &message) {
+    prepared_message prepared(message);
+    send_prepared(client_socket, prepared);
+}
+
+// Send a message to a user logged in to this node. Returns false if there is
+// no such user here.
+bool send_to_user(const string &target_user, const wire_message &message) {
+    epoch_domain::guard guard(registry_epochs);
+    int target = -1;
+    clients.for_each([&](int sock, const string &user) {
+        if (user == target_user) {
+            target = sock;
+            return false;
+        }
+        return true;
+    });
+    if (target < 0) {
+        return false;
+    }
+    send_message(target, message);
+    return true;
+}
+
+connection::write_awaiter connection::write(const wire_message &message) {
+    send_message(fd, message);
+    return {this};
+}
+
+// Release a connection. Always runs on the reactor thread so that no event for
+// the descriptor is still being dispatched, and only once no thread can still
+// be delivering to the socket after finding it in a registry.
+void close_connection(int client_socket) {
+    registry_epochs.retire([client_socket] {
+        post_to_reactor([client_socket] {
+            connection *conn = connections[client_socket];
+            {
+                lock_guard<mutex> lock(conn->out_mutex);
+                flush_output(*conn);
+            }
+            connections[client_socket] = nullptr;
+            close(client_socket);
+            delete conn;
+        });
+    });
+}
+
+// Load users from users.txt
+void load_users(const string &filename) {
+    ifstream file(filename);
+    if (!file) {
+        cerr << "Error: Unable to open users.txt" << endl;
+        exit(1);
+    }
+
+    string line;
+    while (getline(file, line)) {
+        istringstream iss(line);
+        string username, password;
+        if (getline(iss, username, ':') && getline(iss, password)) {
+            users[username] = password;
+        }
+    }
+}
+
+// Length-prefixed binary encoding shared by the cluster bus and the hot-upgrade
+// state transfer.
+struct state_writer {
+    string data;
+
+    void put_u64(uint64_t value) { data.append((const char *)&value, sizeof(value)); }
+    void put_string(const string &value) {
+        put_u64(value.size());
+        data += value;
+    }
+    void put_message(const wire_message &message) {
+        put_u64(message.op);
+        put_string(message.user);
+        put_string(message.group);
+        put_string(message.text);
+        put_u64(message.seq);
+        put_u64(message.users.size());
+        for (const string &user : message.users) {
+            put_string(user);
+        }
+    }
+};
+
+struct state_reader {
+    const string &data;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint64_t get_u64() {
+        uint64_t value = 0;
+        if (pos + sizeof(value) > data.size()) {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, data.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+    string get_string() {
+        uint64_t size = get_u64();
+        if (!ok || pos + size > data.size()) {
+            ok = false;
+            return "";
+        }
+        string value = data.substr(pos, size);
+        pos += size;
+        return value;
+    }
+    wire_message get_message() {
+        wire_message message;
+        message.op = get_u64();
+        message.user = get_string();
+        message.group = get_string();
+        message.text = get_string();
+        message.seq = get_u64();
+        uint64_t count = get_u64();
+        for (uint64_t i = 0; i < count && ok; i++) {
+            message.users.push_back(get_string());
+        }
+        return message;
+    }
+};
+
+
+// Cluster. Several server processes ("nodes") on one host serve as one chat
+// server. Node i takes clients on PORT + i and talks to the other nodes over a
+// TCP bus on BUS_PORT + i, one link per pair of nodes, dialed by the higher id.
+//  - Directory: nodes announce logins and logouts, so /msg is forwarded to a
+//    node that holds the recipient.
+//  - Groups: a group lives on its home node, in one of that node's lanes, so a
+//    group is totally ordered across the cluster. Other nodes forward group
+//    commands to the home, and members are kept as member_id rather than
+//    sockets.
+//  - Fan-out: a message crosses each link once, together with the list of the
+//    peer's members that should get it, and the peer delivers it locally.
+//    Frames for a peer are queued and written by that link's writer thread, so
+//    a burst goes out in a few large writes.
+// With --nodes 1 (the default) there are no peers and every group is local.
+
+enum bus_op : uint64_t {
+    BUS_HELLO,         // node
+    BUS_SNAPSHOT,      // count, (username, session)...: every local client
+    BUS_USER_ONLINE,   // username
+    BUS_USER_OFFLINE,  // username
+    BUS_BROADCAST,     // excluded member, message: deliver to every local client
+    BUS_PRIVATE,       // target username, sender member, message
+    BUS_DELIVER,       // message, count, member...: deliver to these local clients
+    BUS_GROUP_COMMAND, // op, group, username, member, text: run on the home node
+    BUS_MEMBER_GONE,   // member: drop it from every group
+    BUS_PUBLISH        // topic, message, count, member...: deliver to these members and local subscribers
+};
+
+struct peer_link {
+    mutex out_mutex;
+    condition_variable out_cv;
+    int sock = -1;            // -1 while the link is down
+    bool writing = false;     // Writer thread is using sock
+    uint64_t generation = 0;  // Bumped each time the link comes up
+    string out;               // Length-prefixed frames not yet written
+    unordered_map<string, int> users; // Username -> sessions on that node, under client_mutex
+};
+
+peer_link peers[MAX_NODES];
+atomic<bool> handing_over = false; // Set while a hot upgrade has the links down
+atomic<int> active_links = 0;
+int bus_socket = -1; // Listens for links from higher-numbered nodes
+
+int group_home(const string &group_name) {
+    return hash<string>{}(group_name) % cluster_size;
+}
+
+// Queue a frame for a peer. Returns false if the link is down; whatever is
+// lost is resynced by the snapshot sent when the link comes back.
+bool bus_send(int node, const string &payload) {
+    peer_link &peer = peers[node];
+    {
+        lock_guard<mutex> lock(peer.out_mutex);
+        if (peer.sock < 0) {
+            return false;
+        }
+        uint32_t size = payload.size();
+        peer.out.append((const char *)&size, sizeof(size));
+        peer.out += payload;
+    }
+    peer.out_cv.notify_one();
+    return true;
+}
+
+void bus_send_all(const string &payload) {
+    for (int node = 0; node < cluster_size; node++) {
+        if (node != node_id) {
+            bus_send(node, payload);
+        }
+    }
+}
+
+// Writes everything queued for a peer in one go.
+void link_writer(peer_link *peer) {
+    pin_service_thread();
+    unique_lock<mutex> lock(peer->out_mutex);
+    while (true) {
+        peer->out_cv.wait(lock, [peer] { return peer->sock >= 0 && !peer->out.empty(); });
+        string batch;
+        batch.swap(peer->out);
+        int sock = peer->sock;
+        peer->writing = true;
+        lock.unlock();
+
+        size_t sent_total = 0;
+        while (sent_total < batch.size()) {
+            ssize_t sent = send(sock, batch.data() + sent_total, batch.size() - sent_total, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                shutdown(sock, SHUT_RDWR); // The reader notices and takes the link down
+                break;
+            }
+            sent_total += sent;
+        }
+
+        lock.lock();
+        peer->writing = false;
+        peer->out_cv.notify_all();
+    }
+}
+
+// Send a message to every logged-in client of this node except one.
+void notify_local(const wire_message &message, member_id exclude) {
+    trace_scope scope(tracer, flight_recorder::current, "notify");
+    prepared_message prepared(message);
+    session_sockets.for_each([&](uint32_t session, int sock) {
+        if (make_member(node_id, session) != exclude) {
+            send_prepared(sock, prepared);
+        }
+        return true;
+    });
+}
+
+// Send a message to every logged-in client in the cluster except one.
+void notify_all(const wire_message &message, member_id exclude = NO_MEMBER) {
+    notify_local(message, exclude);
+    state_writer frame;
+    frame.put_u64(BUS_BROADCAST);
+    frame.put_u64(exclude);
+    frame.put_message(message);
+    bus_send_all(frame.data);
+}
+
+void deliver_remote(int node, const vector<member_id> &members, const wire_message &message) {
+    state_writer frame;
+    frame.put_u64(BUS_DELIVER);
+    frame.put_message(message);
+    frame.put_u64(members.size());
+    for (member_id member : members) {
+        frame.put_u64(member);
+    }
+    bus_send(node, frame.data);
+}
+
+// Send a message to one member; client_socket is its socket here, or -1.
+void deliver(member_id member, int client_socket, const wire_message &message) {
+    if (client_socket >= 0) {
+        send_message(client_socket, message);
+    } else {
+        deliver_remote(member_node(member), {member}, message);
+    }
+}
+
+// Send a message to a group's members: local ones directly, remote ones with
+// a single frame per node.
+void deliver_to_group(const group_state &group, const wire_message &message, member_id exclude = NO_MEMBER) {
+    trace_scope scope(tracer, flight_recorder::current, "group fan-out");
+    prepared_message prepared(message);
+    unordered_map<int, vector<member_id>> remote; // Node -> members there
+    for (const auto &[member, sock] : group.members) {
+        if (member == exclude) {
+            continue;
+        }
+        if (sock >= 0) {
+            send_prepared(sock, prepared);
+        } else {
+            remote[member_node(member)].push_back(member);
+        }
+    }
+    for (const auto &[node, members] : remote) {
+        deliver_remote(node, members, message);
+    }
+}
+
+// Remove members of a node from every group on this node, except the sessions
+// in keep (all of them if keep is null).
+void purge_members(int node, shared_ptr<unordered_set<uint32_t>> keep) {
+    for (lane &l : lanes) {
+        post(l, [&l, node, keep] {
+            for (auto &[_, group] : l.groups) {
+                for (auto it = group.members.begin(); it != group.members.end();) {
+                    bool stale = member_node(it->first) == node && (!keep || !keep->count((uint32_t)it->first));
+                    it = stale ? group.members.erase(it) : next(it);
+                }
+            }
+        });
+    }
+}
+
+enum group_op : uint64_t { GROUP_CREATE, GROUP_JOIN, GROUP_MESSAGE, GROUP_LEAVE, GROUP_PUBLISH };
+
+void create_group(lane &l, const string &group_name, const string &username, member_id client, int client_socket) {
+    if (l.groups.find(group_name) != l.groups.end()) {
+        deliver(client, client_socket, "Group already exists.");
+        return;
+    }
+    if (group_count.fetch_add(1) >= MAX_GROUPS) {
+        group_count--;
+        deliver(client, client_socket, "Maximum number of groups reached.");
+        return;
+    }
+    l.groups[group_name].members = {{client, client_socket}};
+    deliver(client, client_socket, "Group " + group_name + " has been created.");
+    notify_all(wire_message(OP_GROUP_CREATED, username, group_name), client);
+}
+
+void join_group(lane &l, const string &group_name, const string &username, member_id client, int client_socket) {
+    auto it = l.groups.find(group_name);
+    if (it == l.groups.end()) {
+        deliver(client, client_socket, "Group not found.");
+        return;
+    }
+    if (it->second.members.size() >= MAX_GROUP_SIZE) {
+        deliver(client, client_socket, "Maximum number of members reached in the group.");
+        return;
+    }
+    it->second.members[client] = client_socket;
+    deliver(client, client_socket, "You joined the group " + group_name + ".");
+    deliver_to_group(it->second, wire_message(OP_GROUP_JOINED, username, group_name), client);
+}
+
+// Group messages are delivered as "[Group <name> #<seq>] <user>: <text>". The
+// sequence number is per group and increases by one for every message, so a
+// member can detect a gap in what it received.
+void message_group(lane &l, const string &group_name, const string &username, member_id client, int client_socket, const string &group_msg) {
+    auto it = l.groups.find(group_name);
+    if (it == l.groups.end() || it->second.members.find(client) == it->second.members.end()) {
+        deliver(client, client_socket, "Either Group not found Or you are not in the group.");
+        return;
+    }
+    uint64_t seq = it->second.next_seq++;
+    deliver_to_group(it->second, wire_message(OP_GROUP_MSG, username, group_name, group_msg, seq));
+}
+
+void leave_group(lane &l, const string &group_name, const string &username, member_id client, int client_socket) {
+    auto it = l.groups.find(group_name);
+    if (it == l.groups.end()) {
+        deliver(client, client_socket, "Group not found.");
+        return;
+    }
+    it->second.members.erase(client);
+    deliver(client, client_socket, "You left the group " + group_name + ".");
+    deliver_to_group(it->second, wire_message(OP_GROUP_LEFT, username, group_name), client);
+}
+
+// Topics are group names with hierarchy ("ops.alerts.db"). A publish is
+// ordered like a group message, in the lane of the topic's home node, and
+// reaches the members of the group with exactly that name as well as every
+// client whose subscription pattern matches. Each peer gets one frame with its
+// exact-match members and adds its own pattern subscribers.
+void publish_topic(lane &l, const string &topic, const string &username, member_id client, int client_socket, const string &text) {
+    vector<string> segments;
+    if (!topic_trie::split(topic, segments, false)) {
+        deliver(client, client_socket, "Invalid topic.");
+        return;
+    }
+    wire_message message(OP_TOPIC_MSG, username, topic, text);
+    prepared_message prepared(message);
+
+    unordered_set<int> local;                     // Sockets, so nobody gets it twice
+    unordered_map<int, vector<member_id>> remote; // Node -> exact-match members there
+    auto it = l.groups.find(topic);
+    if (it != l.groups.end()) {
+        for (const auto &[member, sock] : it->second.members) {
+            if (sock >= 0) {
+                local.insert(sock);
+            } else {
+                remote[member_node(member)].push_back(member);
+            }
+        }
+    }
+    {
+        epoch_domain::guard guard(registry_epochs);
+        {
+            lock_guard<mutex> topic_lock(topic_mutex);
+            for (uint32_t session : topics.match(topic)) {
+                int sock;
+                if (session_sockets.find(session, sock)) {
+                    local.insert(sock);
+                }
+            }
+        }
+        trace_scope scope(tracer, flight_recorder::current, "topic fan-out");
+        for (int sock : local) {
+            send_prepared(sock, prepared);
+        }
+    }
+
+    for (int node = 0; node < cluster_size; node++) {
+        if (node == node_id) continue;
+        state_writer publish;
+        publish.put_u64(BUS_PUBLISH);
+        publish.put_string(topic);
+        publish.put_message(message);
+        publish.put_u64(remote[node].size());
+        for (member_id member : remote[node]) {
+            publish.put_u64(member);
+        }
+        bus_send(node, publish.data);
+    }
+}
+
+// Run a group command in the group's lane on its home node. client_socket is
+// the client's socket if it is connected to this node, and -1 otherwise.
+void run_group_command(group_op op, const string &group_name, const string &username, member_id client, int client_socket, const string &text) {
+    int home = group_home(group_name);
+    if (home != node_id) {
+        state_writer frame;
+        frame.put_u64(BUS_GROUP_COMMAND);
+        frame.put_u64(op);
+        frame.put_string(group_name);
+        frame.put_string(username);
+        frame.put_u64(client);
+        frame.put_string(text);
+        if (!bus_send(home, frame.data)) {
+            deliver(client, client_socket, "Group is temporarily unavailable.");
+        }
+        return;
+    }
+
+    lane &l = lane_for(group_name);
+    post(l, [&l, op, group_name, username, client, client_socket, text] {
+        switch (op) {
+        case GROUP_CREATE: create_group(l, group_name, username, client, client_socket); break;
+        case GROUP_JOIN: join_group(l, group_name, username, client, client_socket); break;
+        case GROUP_MESSAGE: message_group(l, group_name, username, client, client_socket, text); break;
+        case GROUP_LEAVE: leave_group(l, group_name, username, client, client_socket); break;
+        case GROUP_PUBLISH: publish_topic(l, group_name, username, client, client_socket, text); break;
+        }
+    });
+}
+
+void handle_bus_frame(int node, const string &payload) {
+    state_reader frame{payload};
+    switch (frame.get_u64()) {
+    case BUS_SNAPSHOT: {
+        unordered_map<string, int> node_users;
+        auto keep = make_shared<unordered_set<uint32_t>>();
+        uint64_t count = frame.get_u64();
+        for (uint64_t i = 0; i < count && frame.ok; i++) {
+            node_users[frame.get_string()]++;
+            keep->insert((uint32_t)frame.get_u64());
+        }
+        {
+            lock_guard<mutex> lock(client_mutex);
+            peers[node].users = std::move(node_users);
+        }
+        purge_members(node, keep);
+        break;
+    }
+    case BUS_USER_ONLINE: {
+        string username = frame.get_string();
+        lock_guard<mutex> lock(client_mutex);
+        peers[node].users[username]++;
+        break;
+    }
+    case BUS_USER_OFFLINE: {
+        string username = frame.get_string();
+        lock_guard<mutex> lock(client_mutex);
+        auto it = peers[node].users.find(username);
+        if (it != peers[node].users.end() && --it->second <= 0) {
+            peers[node].users.erase(it);
+        }
+        break;
+    }
+    case BUS_BROADCAST: {
+        member_id exclude = frame.get_u64();
+        notify_local(frame.get_message(), exclude);
+        break;
+    }
+    case BUS_PRIVATE: {
+        string target_user = frame.get_string();
+        member_id sender = frame.get_u64();
+        wire_message message = frame.get_message();
+        if (!send_to_user(target_user, message)) {
+            deliver_remote(member_node(sender), {sender}, "User not found.");
+        }
+        break;
+    }
+    case BUS_DELIVER: {
+        wire_message message = frame.get_message();
+        prepared_message prepared(message);
+        uint64_t count = frame.get_u64();
+        epoch_domain::guard guard(registry_epochs);
+        for (uint64_t i = 0; i < count && frame.ok; i++) {
+            int sock;
+            if (session_sockets.find((uint32_t)frame.get_u64(), sock)) {
+                send_prepared(sock, prepared);
+            }
+        }
+        break;
+    }
+    case BUS_GROUP_COMMAND: {
+        group_op op = (group_op)frame.get_u64();
+        string group_name = frame.get_string();
+        string username = frame.get_string();
+        member_id client = frame.get_u64();
+        string text = frame.get_string();
+        if (frame.ok && group_home(group_name) == node_id) {
+            run_group_command(op, group_name, username, client, -1, text);
+        }
+        break;
+    }
+    case BUS_PUBLISH: {
+        string topic = frame.get_string();
+        wire_message message = frame.get_message();
+        prepared_message prepared(message);
+        uint64_t count = frame.get_u64();
+        unordered_set<int> local;
+        epoch_domain::guard guard(registry_epochs);
+        int sock;
+        for (uint64_t i = 0; i < count && frame.ok; i++) {
+            if (session_sockets.find((uint32_t)frame.get_u64(), sock)) {
+                local.insert(sock);
+            }
+        }
+        {
+            lock_guard<mutex> topic_lock(topic_mutex);
+            for (uint32_t session : topics.match(topic)) {
+                if (session_sockets.find(session, sock)) {
+                    local.insert(sock);
+                }
+            }
+        }
+        for (int sock : local) {
+            send_prepared(sock, prepared);
+        }
+        break;
+    }
+    case BUS_MEMBER_GONE: {
+        member_id member = frame.get_u64();
+        for (lane &l : lanes) {
+            post(l, [&l, member] {
+                for (auto &[_, group] : l.groups) {
+                    group.members.erase(member);
+                }
+            });
+        }
+        break;
+    }
+    }
+}
+
+// The link to a node is up: tell it who is logged in here.
+void link_up(int node, int sock) {
+    peer_link &peer = peers[node];
+    lock_guard<mutex> clients_lock(client_mutex);
+    {
+        lock_guard<mutex> lock(peer.out_mutex);
+        peer.sock = sock;
+        peer.generation++;
+        peer.out.clear();
+    }
+    state_writer snapshot;
+    snapshot.put_u64(BUS_SNAPSHOT);
+    snapshot.put_u64(session_sockets.size());
+    session_sockets.for_each([&](uint32_t session, int client_socket) {
+        string username;
+        clients.find(client_socket, username);
+        snapshot.put_string(username);
+        snapshot.put_u64(session);
+        return true;
+    });
+    bus_send(node, snapshot.data);
+    cout << "Linked to node " << node << "." << endl;
+}
+
+// Forget a node whose link stayed down for the whole grace period.
+void forget_node(int node, uint64_t generation) {
+    {
+        lock_guard<mutex> lock(peers[node].out_mutex);
+        if (peers[node].sock >= 0 || peers[node].generation != generation) {
+            return;
+        }
+    }
+    {
+        lock_guard<mutex> lock(client_mutex);
+        peers[node].users.clear();
+    }
+    purge_members(node, nullptr);
+}
+
+void link_down(int node, int sock) {
+    peer_link &peer = peers[node];
+    uint64_t generation;
+    {
+        unique_lock<mutex> lock(peer.out_mutex);
+        if (peer.sock == sock) {
+            peer.sock = -1;
+            peer.out.clear();
+        }
+        shutdown(sock, SHUT_RDWR);
+        peer.out_cv.wait(lock, [&peer] { return !peer.writing; });
+        generation = peer.generation;
+    }
+    close(sock);
+    cout << "Lost link to node " << node << "." << endl;
+
+    // Its users and group members are kept for a while, so a node that is
+    // being hot-upgraded comes back with its memberships intact.
+    thread([node, generation] {
+        this_thread::sleep_for(chrono::milliseconds(LINK_GRACE_MS));
+        forget_node(node, generation);
+    }).detach();
+}
+
+void serve_link(int node, int sock) {
+    active_links++;
+    if (handing_over) {
+        close(sock);
+        active_links--;
+        return;
+    }
+    link_up(node, sock);
+
+    string pending;
+    char chunk[65536];
+    while (true) {
+        ssize_t bytes_received = recv(sock, chunk, sizeof(chunk), 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        pending.append(chunk, bytes_received);
+        size_t pos = 0;
+        uint32_t size;
+        while (pending.size() - pos >= sizeof(size)) {
+            memcpy(&size, pending.data() + pos, sizeof(size));
+            if (pending.size() - pos - sizeof(size) < size) {
+                break;
+            }
+            handle_bus_frame(node, pending.substr(pos + sizeof(size), size));
+            flush_udp();
+            pos += sizeof(size) + size;
+        }
+        pending.erase(0, pos);
+    }
+
+    link_down(node, sock);
+    active_links--;
+}
+
+// Keep a link to a lower-numbered node up.
+void dial_peer(int node) {
+    pin_service_thread();
+    while (true) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(BUS_PORT + node);
+        address.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+        state_writer hello;
+        hello.put_u64(BUS_HELLO);
+        hello.put_u64(node_id);
+        uint32_t size = hello.data.size();
+        string frame = string((const char *)&size, sizeof(size)) + hello.data;
+
+        if (!handing_over && sock >= 0 && connect(sock, (sockaddr*)&address, sizeof(address)) == 0 &&
+            send(sock, frame.data(), frame.size(), MSG_NOSIGNAL) == (ssize_t)frame.size()) {
+            serve_link(node, sock);
+        } else if (sock >= 0) {
+            close(sock);
+        }
+        this_thread::sleep_for(chrono::milliseconds(LINK_RETRY_MS));
+    }
+}
+
+// Read the BUS_HELLO a dialing node starts with. Returns its id, or -1.
+int read_hello(int sock) {
+    uint32_t size = 0;
+    string payload;
+    if (recv(sock, &size, sizeof(size), MSG_WAITALL) != sizeof(size) || size > 64) {
+        return -1;
+    }
+    payload.resize(size);
+    if (recv(sock, payload.data(), size, MSG_WAITALL) != (ssize_t)size) {
+        return -1;
+    }
+    state_reader hello{payload};
+    bool is_hello = hello.get_u64() == BUS_HELLO;
+    int node = hello.get_u64();
+    if (!hello.ok || !is_hello || node <= node_id || node >= cluster_size) {
+        return -1;
+    }
+    return node;
+}
+
+// Accept links from higher-numbered nodes.
+void accept_peers(int bus_socket) {
+    pin_service_thread();
+    while (true) {
+        int sock = accept(bus_socket, nullptr, nullptr);
+        if (sock < 0) {
+            if (errno != EINTR) this_thread::sleep_for(chrono::milliseconds(LINK_RETRY_MS));
+            continue;
+        }
+        thread([sock] {
+            int node = read_hello(sock);
+            if (node < 0) {
+                close(sock);
+                return;
+            }
+            serve_link(node, sock);
+        }).detach();
+    }
+}
+
+// Start the threads that keep this node linked to the rest of the cluster.
+void start_cluster() {
+    for (int node = 0; node < cluster_size; node++) {
+        if (node == node_id) continue;
+        thread(link_writer, &peers[node]).detach();
+        if (node < node_id) {
+            thread(dial_peer, node).detach();
+        }
+    }
+    if (bus_socket >= 0) {
+        thread(accept_peers, bus_socket).detach();
+    }
+}
+
+int open_bus_socket() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(BUS_PORT + node_id);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (sock < 0 || bind(sock, (sockaddr*)&address, sizeof(address)) < 0 || listen(sock, MAX_NODES) < 0) {
+        cerr << "Error opening the cluster bus on port " << BUS_PORT + node_id << "." << endl;
+        return -1;
+    }
+    return sock;
+}
+
+member_id local_member(int client_socket) {
+    return make_member(node_id, connections[client_socket]->session);
+}
+
+void handle_broadcast(const string &broadcast_msg, const string &username) {
+    if (!broadcast_msg.empty()) {
+        notify_all(wire_message(OP_BROADCAST, username, "", broadcast_msg));
+    }
+}
+
+void handle_private_message(const string &target_user, const string &private_msg, const string &username, int client_socket) {
+    if (!private_msg.empty()) {
+        wire_message message(OP_PRIVATE, username, "", private_msg);
+        if (send_to_user(target_user, message)) {
+            return;
+        }
+        // Not here: forward to a node the directory lists the user on
+        lock_guard<mutex> lock(client_mutex);
+        for (int node = 0; node < cluster_size; node++) {
+            if (node != node_id && peers[node].users.count(target_user)) {
+                state_writer frame;
+                frame.put_u64(BUS_PRIVATE);
+                frame.put_string(target_user);
+                frame.put_u64(local_member(client_socket));
+                frame.put_message(message);
+                if (bus_send(node, frame.data)) {
+                    return;
+                }
+            }
+        }
+        send_message(client_socket, "User not found.");
+    }
+}
+
+void handle_create_group(const string &group_name, const string &username, int client_socket) {
+    if (!group_name.empty()) {
+        run_group_command(GROUP_CREATE, group_name, username, local_member(client_socket), client_socket, "");
+    }
+}
+
+void handle_join_group(const string &group_name, const string &username, int client_socket) {
+    if (!group_name.empty()) {
+        run_group_command(GROUP_JOIN, group_name, username, local_member(client_socket), client_socket, "");
+    }
+}
+
+void handle_group_message(const string &group_name, const string &group_msg, const string &username, int client_socket) {
+    if (!group_msg.empty()) {
+        run_group_command(GROUP_MESSAGE, group_name, username, local_member(client_socket), client_socket, group_msg);
+    }
+}
+
+void handle_leave_group(const string &group_name, const string &username, int client_socket) {
+    if (!group_name.empty()) {
+        run_group_command(GROUP_LEAVE, group_name, username, local_member(client_socket), client_socket, "");
+    } else {
+        send_message(client_socket, "Invalid command.");
+    }
+}
+
+void handle_subscribe(const string &pattern, int client_socket) {
+    bool subscribed;
+    {
+        lock_guard<mutex> lock(topic_mutex);
+        subscribed = topics.subscribe(pattern, connections[client_socket]->session);
+    }
+    send_message(client_socket, subscribed ? "Subscribed to " + pattern + "." : "Invalid pattern or already subscribed.");
+}
+
+void handle_unsubscribe(const string &pattern, int client_socket) {
+    bool unsubscribed;
+    {
+        lock_guard<mutex> lock(topic_mutex);
+        unsubscribed = topics.unsubscribe(pattern, connections[client_socket]->session);
+    }
+    send_message(client_socket, unsubscribed ? "Unsubscribed from " + pattern + "." : "Subscription not found.");
+}
+
+// Give the client a token to send from its UDP socket (udp_delivery.h).
+void handle_udp_request(int client_socket) {
+    connection *conn = connections[client_socket];
+    if (udp_socket < 0) {
+        send_message(client_socket, "UDP delivery is not available.");
+        return;
+    }
+    if (conn->udp_on) {
+        send_message(client_socket, "UDP delivery is already on.");
+        return;
+    }
+    static mt19937_64 random_tokens{random_device{}()};
+    udp_tokens.erase(conn->udp_token);
+    do {
+        conn->udp_token = random_tokens();
+    } while (conn->udp_token == 0 || udp_tokens.count(conn->udp_token));
+    udp_tokens[conn->udp_token] = conn->session;
+    send_message(client_socket, wire_message(OP_UDP_TOKEN, "", "", "", conn->udp_token));
+}
+
+void handle_publish(const string &topic, const string &text, const string &username, int client_socket) {
+    if (!text.empty()) {
+        run_group_command(GROUP_PUBLISH, topic, username, local_member(client_socket), client_socket, text);
+    }
+}
+
+// Run a command from either protocol (see parse_command and decode_command).
+void run_command(const chat_command &command, const string &username, int client_socket) {
+    switch (command.op) {
+    case REQ_BROADCAST: handle_broadcast(command.text, username); break;
+    case REQ_PRIVATE: handle_private_message(command.target, command.text, username, client_socket); break;
+    case REQ_CREATE_GROUP: handle_create_group(command.target, username, client_socket); break;
+    case REQ_JOIN_GROUP: handle_join_group(command.target, username, client_socket); break;
+    case REQ_GROUP_MSG: handle_group_message(command.target, command.text, username, client_socket); break;
+    case REQ_LEAVE_GROUP: handle_leave_group(command.target, username, client_socket); break;
+    case REQ_SUBSCRIBE: handle_subscribe(command.target, client_socket); break;
+    case REQ_UNSUBSCRIBE: handle_unsubscribe(command.target, client_socket); break;
+    case REQ_PUBLISH: handle_publish(command.target, command.text, username, client_socket); break;
+    case REQ_PING: send_message(client_socket, wire_message(OP_PONG)); break;
+    case REQ_UDP: handle_udp_request(client_socket); break;
+    default: send_message(client_socket, "Invalid command."); break;
+    }
+}
+
+// Drop a disconnected client from every group in the cluster. Locally the
+// socket is closed by whichever lane finishes last, so a descriptor number is
+// never handed to a new connection while some lane may still deliver to it.
+// Other nodes only know the member by session, which is never reused.
+void remove_from_groups(int client_socket, member_id member) {
+    shared_ptr<void> closer(nullptr, [client_socket](void *) { close_connection(client_socket); });
+    for (lane &l : lanes) {
+        post(l, [&l, member, closer] {
+            for (auto &[_, group] : l.groups) {
+                group.members.erase(member);
+            }
+        });
     }
+    state_writer frame;
+    frame.put_u64(BUS_MEMBER_GONE);
+    frame.put_u64(member);
+    bus_send_all(frame.data);
 }
 
-// Load users from users.txt
-void load_users(const string &filename) {
-    ifstream file(filename);
-    if (!file) {
-        cerr << "Error: Unable to open users.txt" << endl;
-        exit(1);
+// Handle client connection
+client_task handle_client(connection *conn) {
+    int client_socket = conn->fd;
+
+    // Authentication. A connection handed over by a previous server process
+    // skips the steps it has already been through.
+    if (conn->stage == STAGE_NEW) {
+        conn->stage = STAGE_USERNAME;
+        co_await conn->write("Enter username: ");
     }
 
-    string line;
-    while (getline(file, line)) {
-        istringstream iss(line);
-        string username, password;
-        if (getline(iss, username, ':') && getline(iss, password)) {
-            users[username] = password;
+    if (conn->stage == STAGE_USERNAME) {
+        optional<string> username_frame = co_await conn->read_frame();
+        conn->username = username_frame.value_or("");
+        // A binary client prefixes its username with BINARY_HELLO (or
+        // BINARY_HELLO_DEFLATE); everything after this point, including the
+        // password prompt, is framed.
+        if (conn->username.rfind(BINARY_HELLO_DEFLATE, 0) == 0) {
+            conn->binary = conn->deflate = true;
+            conn->username.erase(0, strlen(BINARY_HELLO_DEFLATE));
+        } else if (conn->username.rfind(BINARY_HELLO, 0) == 0) {
+            conn->binary = true;
+            conn->username.erase(0, strlen(BINARY_HELLO));
         }
+        conn->stage = STAGE_PASSWORD;
+        co_await conn->write("Enter password: ");
     }
-}
 
-void handle_broadcast(const string &message, const string &username, int client_socket) {
-    string broadcast_msg = message.substr(11);
-    if (!broadcast_msg.empty()) {
-        broadcast_msg = username + ": " + broadcast_msg;
-        lock_guard<mutex> lock(client_mutex);
-        for (const auto &[sock, _] : clients) {
-            send_message(sock, broadcast_msg);
+    if (conn->stage == STAGE_PASSWORD) {
+        optional<string> password_frame = co_await conn->read_frame();
+        string password = password_frame.value_or("");
+        if (conn->binary) {
+            wire_reader request(password);
+            chat_command command;
+            bool valid = decode_command(request, command, resolve_name) && command.op == REQ_PASSWORD;
+            password = valid ? command.text : "";
         }
-    }
-}
 
-void handle_private_message(const string &message, const string &username, int client_socket) {
-    size_t space_pos = message.find(' ', 5);
-    if (space_pos != string::npos) {
-        string target_user = message.substr(5, space_pos - 5);
-        string private_msg = message.substr(space_pos + 1);
-        if (!private_msg.empty()) {
+        // Validate credentials
+        if (users.find(conn->username) == users.end() || users[conn->username] != password || active_connections >= MAX_CLIENTS) {
+            send_message(client_socket, wire_message(OP_AUTH_FAILED));
+            // if(active_connections >= MAX_CLIENTS) {
+            //     cout<<"Max connections reached. Rejecting client."<<endl;
+            // }
+            close_connection(client_socket);
+            co_return;
+        }
+
+        active_connections++;
+
+        // Add client to the clients map and the cluster directory
+        {
             lock_guard<mutex> lock(client_mutex);
-            bool user_found = false;
-            for (const auto &[sock, user] : clients) {
-                if (user == target_user) {
-                    send_message(sock, "[Private] " + username + ": " + private_msg);
-                    user_found = true;
+            clients.insert_or_assign(client_socket, conn->username);
+            session_sockets.insert_or_assign(conn->session, client_socket);
+            state_writer online;
+            online.put_u64(BUS_USER_ONLINE);
+            online.put_string(conn->username);
+            bus_send_all(online.data);
+        }
+        conn->stage = STAGE_SESSION;
+        send_message(client_socket, wire_message(OP_WELCOME));
+
+        // Notify the new user about the already active users
+        wire_message active_users(OP_ACTIVE_USERS);
+        {
+            lock_guard<mutex> lock(client_mutex);
+            clients.for_each([&](int sock, const string &user) {
+                if (sock != client_socket) {
+                    active_users.users.push_back(user);
+                }
+                return true;
+            });
+            for (int node = 0; node < cluster_size; node++) {
+                if (node == node_id) continue;
+                for (const auto &[user, _] : peers[node].users) {
+                    active_users.users.push_back(user);
+                }
+            }
+        }
+        send_message(client_socket, active_users);
+
+        // Notify others
+        notify_all(wire_message(OP_CHAT_JOINED, conn->username), local_member(client_socket));
+    }
+
+    const string &username = conn->username;
+
+    // Handle commands from the client
+    while (true) {
+        optional<string> frame = co_await conn->read_frame();
+        if (!frame) {
+            break;
+        }
+        // The trace id is only made current around run_command, which never
+        // suspends: another client's coroutine may run at any co_await.
+        uint32_t trace_id = tracer.sample();
+        tracer.record(trace_id, "recv", TRACE_INSTANT, frame->size());
+
+        // Parse commands. A binary frame may carry several requests.
+        chat_command command;
+        if (conn->binary) {
+            wire_reader requests(*frame);
+            while (!requests.empty()) {
+                if (!decode_command(requests, command, resolve_name)) {
+                    co_await conn->write("Invalid command.");
                     break;
                 }
+                tracer.record(trace_id, "parsed", TRACE_INSTANT, command.op);
+                trace_scope scope(tracer, trace_id, "command");
+                run_command(command, username, client_socket);
             }
-            if (!user_found) {
-                send_message(client_socket, "User not found.");
+        } else {
+            command_parse parsed = parse_command(*frame, command);
+            if (parsed == COMMAND_OK) {
+                tracer.record(trace_id, "parsed", TRACE_INSTANT, command.op);
+                trace_scope scope(tracer, trace_id, "command");
+                run_command(command, username, client_socket);
+            } else if (parsed == COMMAND_INVALID) {
+                co_await conn->write("Invalid command.");
             }
         }
     }
+    // Disconnect client
+    member_id member = local_member(client_socket);
+    udp_tokens.erase(conn->udp_token);
+    {
+        lock_guard<mutex> lock(topic_mutex);
+        topics.unsubscribe_all(conn->session);
+    }
+    {
+        lock_guard<mutex> lock(client_mutex);
+        clients.erase(client_socket);
+        session_sockets.erase(conn->session);
+        state_writer offline;
+        offline.put_u64(BUS_USER_OFFLINE);
+        offline.put_string(username);
+        bus_send_all(offline.data);
+    }
+    active_connections--;
+
+    // Notify others
+    notify_all(wire_message(OP_CHAT_LEFT, username));
+    remove_from_groups(client_socket, member);
+}
+
+// Register a connection with the reactor and start (or resume) its handler.
+void watch_connection(connection *conn) {
+    connections[conn->fd] = conn;
+    conn->out.counters = &sends;
+    conn->out.enable_zerocopy(conn->fd, zerocopy_min_size);
+
+    // Edge-triggered: a handler only waits after recv/send returned EAGAIN,
+    // and the next edge is exactly what it is waiting for.
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = conn->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+
+    handle_client(conn);
 }
 
-void handle_create_group(const string &message, const string &username, int client_socket) {
-    if (groups.size() >= MAX_GROUPS) {
-        send_message(client_socket, "Maximum number of groups reached.");
+// Accept every pending connection and start a handler coroutine for each.
+// Count the CPU whose RX queue delivered a new connection. With --reactor-cpu
+// rx, the reactor moves to the CPU that has delivered the most.
+void note_incoming_cpu(int client_socket) {
+    static uint64_t accepted = 0;
+    static int following = -1;
+    int cpu = -1;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0 || cpu < 0 || cpu >= CPU_SETSIZE) {
         return;
     }
+    incoming_cpus[cpu]++;
+    if (!reactor_follows_rx || ++accepted % RX_FOLLOW_ACCEPTS != 0) {
+        return;
+    }
+    int busiest = cpu;
+    for (int c : process_cpus) {
+        if (incoming_cpus[c] > incoming_cpus[busiest]) busiest = c;
+    }
+    if (busiest != following && pin_current_thread({busiest})) {
+        following = busiest;
+        reactor_cpus = {busiest};
+        cout << "Reactor moved to CPU " << busiest << ", which receives most connections." << endl;
+    }
+}
 
-    string group_name = message.substr(14);
-    if (!group_name.empty()) {
-        lock_guard<mutex> lock(group_mutex);
-        if (groups.find(group_name) == groups.end()) {
-            groups[group_name] = {client_socket};
-            send_message(client_socket, "Group " + group_name + " has been created.");
-            string group_created_message = username + " created the group " + group_name + ".";
-            for (const auto &[sock, _] : clients) {
-                if (sock != client_socket) {
-                    send_message(sock, group_created_message);
-                }
+void accept_clients(int server_socket) {
+    while (true) {
+        sockaddr_in client_address;
+        socklen_t client_len = sizeof(client_address);
+        int client_socket = accept4(server_socket, (sockaddr*)&client_address, &client_len, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                cerr << "Error accepting connection." << endl;
             }
-        } else {
-            send_message(client_socket, "Group already exists.");
+            return;
+        }
+        if (client_socket >= MAX_FDS) {
+            close(client_socket);
+            continue;
         }
+
+        note_incoming_cpu(client_socket);
+
+        connection *conn = new connection();
+        conn->fd = client_socket;
+        conn->session = next_session++;
+        watch_connection(conn);
     }
 }
 
-void handle_join_group(const string &message, const string &username, int client_socket) {
-    string group_name = message.substr(12);
-    if (!group_name.empty()) {
-        lock_guard<mutex> lock(group_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            if (groups[group_name].size() >= MAX_GROUP_SIZE) {
-                send_message(client_socket, "Maximum number of members reached in the group.");
-                return;
-            }
-            groups[group_name].insert(client_socket);
-            send_message(client_socket, "You joined the group " + group_name + ".");
-            string join_group_message = username + " joined the group " + group_name + ".";
-            for (int sock : groups[group_name]) {
-                if (sock != client_socket) {
-                    send_message(sock, join_group_message);
-                }
-            }
-        } else {
-            send_message(client_socket, "Group not found.");
+// Hellos from clients' UDP sockets: each switches the client whose token it
+// carries to UDP delivery, from the address it came from.
+void receive_udp_hellos() {
+    while (true) {
+        char buffer[BUFFER_SIZE];
+        sockaddr_in from{};
+        socklen_t from_len = sizeof(from);
+        ssize_t size = recvfrom(udp_socket, buffer, sizeof(buffer), MSG_DONTWAIT, (sockaddr*)&from, &from_len);
+        if (size < 0) {
+            return;
+        }
+        uint64_t token;
+        auto it = read_udp_hello(buffer, size, token) ? udp_tokens.find(token) : udp_tokens.end();
+        if (it == udp_tokens.end()) {
+            continue;
+        }
+        int sock;
+        bool online;
+        {
+            epoch_domain::guard guard(registry_epochs);
+            online = session_sockets.find(it->second, sock);
         }
+        udp_tokens.erase(it);
+        if (!online) {
+            continue;
+        }
+        connection *conn = connections[sock];
+        conn->udp_token = 0;
+        conn->udp_address = from;
+        conn->udp_on.store(true, memory_order_release);
+        send_message(sock, "UDP delivery on.");
     }
 }
 
-void handle_group_message(const string &message, const string &username, int client_socket) {
-    size_t space_pos = message.find(' ', 11);
-    if (space_pos != string::npos) {
-        string group_name = message.substr(11, space_pos - 11);
-        string group_msg = message.substr(space_pos + 1);
-        if (!group_msg.empty()) {
-            lock_guard<mutex> lock(group_mutex);
-            if (groups.find(group_name) != groups.end() && groups[group_name].find(client_socket) != groups[group_name].end()) {
-                for (int sock : groups[group_name]) {
-                    send_message(sock, "[Group " + group_name + "] " + username + ": " + group_msg);
-                }
-            } else {
-                send_message(client_socket, "Either Group not found Or you are not in the group.");
-            }
-        }
+// The UDP delivery socket, on the same port number as the chat server.
+// Returns -1 (and the server carries on with TCP only) if it cannot be bound.
+int open_udp_socket() {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(PORT + node_id);
+    address.sin_addr.s_addr = INADDR_ANY;
+    int buffer_size = UDP_SEND_BUFFER;
+    if (sock < 0 || bind(sock, (sockaddr*)&address, sizeof(address)) < 0) {
+        cerr << "Warning: UDP delivery unavailable, cannot bind UDP port " << PORT + node_id << "." << endl;
+        if (sock >= 0) close(sock);
+        return -1;
     }
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    return sock;
 }
 
-void handle_leave_group(const string &message, const string &username, int client_socket) {
-    string group_name = message.substr(13);
-    if (!group_name.empty()) {
-        lock_guard<mutex> lock(group_mutex);
-        if (groups.find(group_name) != groups.end()) {
-            groups[group_name].erase(client_socket);
-            send_message(client_socket, "You left the group " + group_name + ".");
-            string leave_group_message = username + " left the group " + group_name + ".";
-            for (int sock : groups[group_name]) {
-                if (sock != client_socket) {
-                    send_message(sock, leave_group_message);
-                }
-            }
-        } else {
-            send_message(client_socket, "Group not found.");
+// Resume whatever the connection's handler is waiting for.
+void on_socket_ready(connection *conn, uint32_t ready) {
+    bool broken = ready & EPOLLHUP;
+    if (ready & EPOLLERR) {
+        // Zero-copy completions raise EPOLLERR too; without any it is a real error
+        lock_guard<mutex> lock(conn->out_mutex);
+        broken = !conn->out.reap_completions(conn->fd) || broken;
+    }
+    if (ready & EPOLLOUT) {
+        lock_guard<mutex> lock(conn->out_mutex);
+        broken = !flush_output(*conn) || broken;
+    }
+    if (conn->writer) {
+        bool drained;
+        {
+            lock_guard<mutex> lock(conn->out_mutex);
+            drained = conn->pending_output() <= WRITE_HIGH_WATERMARK;
+        }
+        if (drained || broken) {
+            exchange(conn->writer, nullptr).resume();
+        }
+    }
+    if (conn->reader && (ready & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+        if (conn->pending_read->try_read()) {
+            conn->pending_read = nullptr;
+            exchange(conn->reader, nullptr).resume();
         }
-    } else {
-        send_message(client_socket, "Invalid command.");
     }
 }
 
-// Handle client connection
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    string username;
+// Hot upgrade. A running server listens on UPGRADE_SOCKET_PATH. A new binary
+// started with --takeover connects there; the old process stops serving,
+// sends the listening socket and every client socket with SCM_RIGHTS together
+// with the clients, groups and unsent output, and exits once the new process
+// acknowledges. Connections stay open throughout, and clients that connect in
+// the meantime wait in the shared listen backlog.
+//
+// Messages on the SOCK_SEQPACKET channel start with a type byte:
+//   'F' <old fd numbers>  descriptors attached as SCM_RIGHTS, in the same order
+//   'S' <bytes>           next chunk of serialized state
+//   'E'                   end of state
+//   'A'                   (new -> old) state restored, old process may exit
+
+int upgrade_socket = -1;
+
+// Each node of a cluster has its own control socket.
+string upgrade_socket_path() {
+    return cluster_size == 1 ? UPGRADE_SOCKET_PATH : UPGRADE_SOCKET_PATH "." + to_string(node_id);
+}
+
+bool send_upgrade_message(int channel, const string &payload, const vector<int> &fds = {}) {
+    iovec iov{(void *)payload.data(), payload.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MESSAGE * sizeof(int))];
+    if (!fds.empty()) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    return sendmsg(channel, &msg, 0) == (ssize_t)payload.size();
+}
+
+// Run up to limit of the tasks waiting for the reactor thread. Returns how
+// many ran.
+size_t run_reactor_tasks(size_t limit) {
+    size_t ran = 0;
+    function<void()> task;
+    while (ran < limit && reactor_tasks.pop(task)) {
+        task();
+        ran++;
+    }
+    return ran;
+}
+
+// Wait until every lane has run the tasks posted so far. Called on the reactor
+// thread once the peer link threads, which also post to lanes, have exited,
+// so afterwards the groups and output queues stay put.
+void drain_lanes() {
+    latch done(NUM_LANES);
+    for (lane &l : lanes) {
+        post(l, [&done] { done.count_down(); });
+    }
+    done.wait();
+    // Closes posted by the lanes, once nothing can deliver to the sockets
+    registry_epochs.synchronize();
+    while (run_reactor_tasks(REACTOR_BATCH) > 0) {
+    }
+}
 
-    // Authentication
-    send_message(client_socket, "Enter username: ");
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    username = buffer;
-
-    send_message(client_socket, "Enter password: ");
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    string password = buffer;
-
-    // Validate credentials
-    if (users.find(username) == users.end() || users[username] != password || active_connections >= MAX_CLIENTS) {
-        send_message(client_socket, "Authentication failed.");
-        // if(active_connections >= MAX_CLIENTS) {
-        //     cout<<"Max connections reached. Rejecting client."<<endl;
-        // }
-        close(client_socket);
+void hand_over(int server_socket) {
+    int channel = accept(upgrade_socket, nullptr, nullptr);
+    if (channel < 0) {
         return;
     }
+    cout << "Handing over to the new server process..." << endl;
 
-    active_connections++;
+    // Peers stop talking to this process; they keep its users and members for
+    // LINK_GRACE_MS and the new process links up again well within that.
+    handing_over = true;
+    for (peer_link &peer : peers) {
+        lock_guard<mutex> lock(peer.out_mutex);
+        if (peer.sock >= 0) {
+            shutdown(peer.sock, SHUT_RDWR);
+        }
+    }
+    while (active_links > 0) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    drain_lanes();
 
-    // Add client to the clients map
-    {
-        lock_guard<mutex> lock(client_mutex);
-        clients[client_socket] = username;
+    state_writer state;
+    vector<int> fds = {server_socket};
+    state.put_u64(node_id);
+    state.put_u64(server_socket);
+    state.put_u64(bus_socket >= 0);
+    if (bus_socket >= 0) {
+        fds.push_back(bus_socket);
+        state.put_u64(bus_socket);
+    }
+    state.put_u64(udp_socket >= 0);
+    if (udp_socket >= 0) {
+        fds.push_back(udp_socket);
+        state.put_u64(udp_socket);
+    }
+    state.put_u64(active_connections);
+    state.put_u64(next_session);
+    state.put_u64(wire_names.names.size());
+    for (const auto &[id, name] : wire_names.names) {
+        state.put_u64(id);
+        state.put_string(name);
     }
-    send_message(client_socket, "Welcome to the chat server!\n");
 
-    // Notify the new user about the already active users
-    string active_users;
-    {
-        lock_guard<mutex> lock(client_mutex);
-        for (const auto &client : clients) {
-            if (client.first != client_socket) {
-                active_users += client.second + ", ";
+    vector<connection *> live;
+    for (int fd = 0; fd < MAX_FDS; fd++) {
+        if (connections[fd] != nullptr) {
+            live.push_back(connections[fd]);
+        }
+    }
+    state.put_u64(live.size());
+    for (connection *conn : live) {
+        lock_guard<mutex> lock(conn->out_mutex);
+        fds.push_back(conn->fd);
+        state.put_u64(conn->fd);
+        state.put_u64(conn->stage);
+        state.put_string(conn->username);
+        state.put_u64(conn->session);
+        if (!conn->batch.empty()) {
+            // Frame it now: the new process resumes with whole frames only
+            put_frame(conn->out.tail(), conn->batch);
+            conn->batch.clear();
+        }
+        state.put_string(conn->out.contents());
+        state.put_u64(conn->out.next_zerocopy());
+        state.put_u64(conn->binary);
+        state.put_u64(conn->deflate);
+        state.put_string(conn->in.pending());
+        state.put_u64(conn->udp_on);
+        state.put_u64(conn->udp_address.sin_addr.s_addr);
+        state.put_u64(conn->udp_address.sin_port);
+        state.put_u64(conn->udp_seq);
+        state.put_u64(conn->known_names.size());
+        for (uint64_t id : conn->known_names) {
+            state.put_u64(id);
+        }
+        vector<string> patterns = topics.patterns_of(conn->session);
+        state.put_u64(patterns.size());
+        for (const string &pattern : patterns) {
+            state.put_string(pattern);
+        }
+    }
+
+    uint64_t total_groups = 0;
+    for (lane &l : lanes) {
+        total_groups += l.groups.size();
+    }
+    state.put_u64(total_groups);
+    for (lane &l : lanes) {
+        for (const auto &[name, group] : l.groups) {
+            state.put_string(name);
+            state.put_u64(group.next_seq);
+            state.put_u64(group.members.size());
+            for (const auto &[member, sock] : group.members) {
+                state.put_u64(member);
+                state.put_u64((int64_t)sock);
             }
         }
     }
-    if (!active_users.empty()) {
-        active_users.pop_back(); // Remove the last space
-        active_users.pop_back(); // Remove the last comma
-        send_message(client_socket, "Active users: " + active_users + "");
-    } else {
-        send_message(client_socket, "No other users are currently active.");
+
+    bool sent = true;
+    for (size_t i = 0; sent && i < fds.size(); i += UPGRADE_FDS_PER_MESSAGE) {
+        vector<int> batch(fds.begin() + i, fds.begin() + min(fds.size(), i + UPGRADE_FDS_PER_MESSAGE));
+        string payload = "F";
+        payload.append((const char *)batch.data(), batch.size() * sizeof(int));
+        sent = send_upgrade_message(channel, payload, batch);
+    }
+    for (size_t i = 0; sent && i < state.data.size(); i += UPGRADE_CHUNK_SIZE) {
+        sent = send_upgrade_message(channel, "S" + state.data.substr(i, UPGRADE_CHUNK_SIZE));
     }
+    sent = sent && send_upgrade_message(channel, "E");
 
-    // Notify others
-    string join_message = username + " has joined the chat."; 
-    {
-        lock_guard<mutex> lock(client_mutex);
-        for (const auto &[sock, _] : clients) {
-            if (sock != client_socket) {
-                send_message(sock, join_message);
+    char ack = 0;
+    if (sent && recv(channel, &ack, 1, 0) == 1 && ack == 'A') {
+        cout << "Hand-over of " << live.size() << " connections complete, exiting." << endl;
+        // Skip static destructors: the lane threads are still parked on them.
+        _exit(0);
+    }
+    cerr << "Hand-over failed, resuming service." << endl;
+    close(channel);
+    handing_over = false;
+}
+
+// Receive the state of a running server. Returns the listening socket, or -1.
+// The restored connections still have to be handed to watch_connection.
+int take_over(vector<connection *> &restored) {
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgrade_socket_path().c_str(), sizeof(address.sun_path) - 1);
+    if (channel < 0 || connect(channel, (sockaddr*)&address, sizeof(address)) < 0) {
+        cerr << "Error connecting to the running server at " << upgrade_socket_path() << "." << endl;
+        return -1;
+    }
+
+    unordered_map<uint64_t, int> new_fd; // Descriptor in the old process -> ours
+    string data;
+    vector<char> payload(1 + max<size_t>(UPGRADE_CHUNK_SIZE, UPGRADE_FDS_PER_MESSAGE * sizeof(int)));
+    char control[CMSG_SPACE(UPGRADE_FDS_PER_MESSAGE * sizeof(int))];
+    bool complete = false;
+    while (!complete) {
+        iovec iov{payload.data(), payload.size()};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t size = recvmsg(channel, &msg, 0);
+        if (size <= 0) {
+            cerr << "Error receiving server state." << endl;
+            return -1;
+        }
+        if (payload[0] == 'F') {
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            size_t count = (size - 1) / sizeof(int);
+            if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+                cerr << "Error receiving sockets." << endl;
+                return -1;
+            }
+            for (size_t i = 0; i < count; i++) {
+                int old_fd, fd;
+                memcpy(&old_fd, payload.data() + 1 + i * sizeof(int), sizeof(int));
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                new_fd[old_fd] = fd;
             }
+        } else if (payload[0] == 'S') {
+            data.append(payload.data() + 1, size - 1);
+        } else if (payload[0] == 'E') {
+            complete = true;
         }
     }
 
-    // Handle commands from the client
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
+    state_reader state{data};
+    if ((int)state.get_u64() != node_id) {
+        cerr << "The running server is a different cluster node." << endl;
+        return -1;
+    }
+    int server_socket = new_fd[state.get_u64()];
+    if (state.get_u64()) {
+        bus_socket = new_fd[state.get_u64()];
+    }
+    if (state.get_u64()) {
+        udp_socket = new_fd[state.get_u64()];
+    }
+    active_connections = state.get_u64();
+    next_session = state.get_u64();
+    uint64_t name_count = state.get_u64();
+    for (uint64_t i = 0; i < name_count && state.ok; i++) {
+        uint64_t id = state.get_u64();
+        wire_names.define(id, state.get_string());
+    }
+
+    uint64_t connection_count = state.get_u64();
+    for (uint64_t i = 0; i < connection_count && state.ok; i++) {
+        connection *conn = new connection();
+        conn->fd = new_fd[state.get_u64()];
+        conn->stage = (client_stage)state.get_u64();
+        conn->username = state.get_string();
+        conn->session = state.get_u64();
+        conn->out.append(state.get_string());
+        conn->out.set_next_zerocopy(state.get_u64());
+        conn->binary = state.get_u64();
+        conn->deflate = state.get_u64();
+        string pending_input = state.get_string();
+        conn->in.feed(pending_input.data(), pending_input.size());
+        bool udp_on = state.get_u64();
+        conn->udp_address.sin_family = AF_INET;
+        conn->udp_address.sin_addr.s_addr = state.get_u64();
+        conn->udp_address.sin_port = state.get_u64();
+        conn->udp_seq = state.get_u64();
+        conn->udp_on = udp_on;
+        uint64_t known_count = state.get_u64();
+        for (uint64_t j = 0; j < known_count && state.ok; j++) {
+            conn->known_names.insert(state.get_u64());
+        }
+        uint64_t pattern_count = state.get_u64();
+        for (uint64_t j = 0; j < pattern_count && state.ok; j++) {
+            topics.subscribe(state.get_string(), conn->session);
+        }
+        if (conn->fd >= MAX_FDS) {
+            close(conn->fd);
+            delete conn;
+            continue;
+        }
+        if (conn->stage == STAGE_SESSION) {
+            clients.insert_or_assign(conn->fd, conn->username);
+            session_sockets.insert_or_assign(conn->session, conn->fd);
+        }
+        restored.push_back(conn);
+    }
+
+    uint64_t group_total = state.get_u64();
+    for (uint64_t i = 0; i < group_total && state.ok; i++) {
+        string name = state.get_string();
+        group_state &group = lane_for(name).groups[name];
+        group.next_seq = state.get_u64();
+        uint64_t member_count = state.get_u64();
+        for (uint64_t j = 0; j < member_count && state.ok; j++) {
+            member_id member = state.get_u64();
+            int sock = (int64_t)state.get_u64();
+            group.members[member] = sock >= 0 ? new_fd[sock] : -1;
+        }
+        group_count++;
+    }
+
+    if (!state.ok) {
+        cerr << "Error decoding server state." << endl;
+        return -1;
+    }
+    if (send(channel, "A", 1, 0) != 1) {
+        cerr << "Error acknowledging hand-over." << endl;
+        return -1;
+    }
+    close(channel);
+    cout << "Took over " << restored.size() << " connections and " << group_total << " groups." << endl;
+    return server_socket;
+}
+
+// Listen for a future --takeover process.
+int open_upgrade_socket() {
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgrade_socket_path().c_str(), sizeof(address.sun_path) - 1);
+    unlink(upgrade_socket_path().c_str());
+    if (sock < 0 || bind(sock, (sockaddr*)&address, sizeof(address)) < 0 || listen(sock, 1) < 0) {
+        cerr << "Warning: hot upgrade unavailable, cannot listen on " << upgrade_socket_path() << "." << endl;
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void run_reactor(int server_socket) {
+    epoll_event events[MAX_EVENTS];
+    while (server_running) {
+        // Sockets retired by close_connection are closed once the epoch moves
+        // on, so keep collecting while there are any.
+        int timeout = registry_epochs.pending() > 0 ? EPOCH_POLL_MS : -1;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
             break;
         }
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == server_socket) {
+                accept_clients(server_socket);
+            } else if (fd == wake_fd) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0) {
+                    perror("eventfd read");
+                }
+            } else if (fd == upgrade_socket) {
+                hand_over(server_socket);
+            } else if (fd == udp_socket) {
+                receive_udp_hellos();
+            } else if (connections[fd] != nullptr) {
+                on_socket_ready(connections[fd], events[i].events);
+            }
+        }
 
-        string message(buffer);
-
-        // Parse commands
-        if (message.rfind("/broadcast ", 0) == 0) {
-            handle_broadcast(message, username, client_socket);
-        } else if (message.rfind("/msg ", 0) == 0) {
-            handle_private_message(message, username, client_socket);
-        } else if (message.rfind("/create_group ", 0) == 0) {
-            handle_create_group(message, username, client_socket);
-        } else if (message.rfind("/join_group ", 0) == 0) {
-            handle_join_group(message, username, client_socket);
-        } else if (message.rfind("/group_msg ", 0) == 0) {
-            handle_group_message(message, username, client_socket);
-        } else if (message.rfind("/leave_group ", 0) == 0) {
-            handle_leave_group(message, username, client_socket);
-        } else {
-            send_message(client_socket, "Invalid command.");
+        if (run_reactor_tasks(REACTOR_BATCH) == REACTOR_BATCH) {
+            // More waiting: see to the sockets first, then come back
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0) {
+                perror("eventfd write");
+            }
         }
+        flush_udp();
+        registry_epochs.collect();
     }
-    // Disconnect client
-    {
-        lock_guard<mutex> lock(client_mutex);
-        clients.erase(client_socket);
+}
+
+// Start the workers, pin the calling thread (the reactor) and give the lanes
+// their home workers, as configured.
+void set_up_layout(int workers, const vector<int> &worker_cpu_list) {
+    worker_cpus.assign(workers, {});
+    for (int i = 0; i < workers; i++) {
+        if (!worker_cpu_list.empty()) {
+            worker_cpus[i] = {worker_cpu_list[i % worker_cpu_list.size()]};
+        }
+    }
+    if (numa_lanes && worker_cpu_list.empty()) {
+        // Spread the workers over the NUMA nodes, each free within its node
+        vector<int> nodes;
+        for (size_t n = 0; n < topology.nodes(); n++) {
+            if (!topology.node_cpus[n].empty()) nodes.push_back(n);
+        }
+        for (int i = 0; i < workers; i++) {
+            worker_cpus[i] = topology.node_cpus[nodes[i % nodes.size()]];
+        }
     }
-    close(client_socket);
-    active_connections--;
 
-    // Notify others
-    string leave_message = username + " has left the chat.";
-    {
-        lock_guard<mutex> lock(client_mutex);
-        for (const auto &[sock, _] : clients) {
-            send_message(sock, leave_message);
+    worker_affinity.assign(workers, {});
+    auto started = make_shared<latch>(workers);
+    executor = new work_stealing_executor(workers, [started](size_t i) {
+        pin_current_thread(worker_cpus[i].empty() ? process_cpus : worker_cpus[i]);
+        worker_affinity[i] = current_thread_cpus();
+        tracer.name_thread("worker " + to_string(i));
+        started->count_down();
+    });
+    started->wait();
+    for (int i = 0; i < workers; i++) {
+        if (!worker_cpus[i].empty() && worker_affinity[i] != worker_cpus[i]) {
+            cerr << "Warning: cannot pin worker " << i << " to CPUs " << format_cpu_list(worker_cpus[i]) << "." << endl;
+        }
+    }
+
+    if (!reactor_cpus.empty() && !pin_current_thread(reactor_cpus)) {
+        cerr << "Warning: cannot pin the reactor to CPUs " << format_cpu_list(reactor_cpus) << "." << endl;
+        reactor_cpus.clear();
+    }
+
+    for (int i = 0; i < NUM_LANES; i++) {
+        lanes[i].home_worker = i; // Spread over the workers' inboxes
+    }
+    if (!numa_lanes) {
+        return;
+    }
+    vector<vector<size_t>> near(topology.nodes()); // NUMA node -> workers confined to it
+    vector<int> used;
+    for (int w = 0; w < workers; w++) {
+        int n = topology.node_of(worker_affinity[w]);
+        if (n >= 0) near[n].push_back(w);
+    }
+    for (size_t n = 0; n < near.size(); n++) {
+        if (!near[n].empty()) used.push_back(n);
+    }
+    if (used.empty()) {
+        cerr << "Warning: no worker is confined to one NUMA node, so lanes are not placed." << endl;
+        return;
+    }
+    for (int i = 0; i < NUM_LANES; i++) {
+        lane &l = lanes[i];
+        l.numa_node = used[i % used.size()];
+        const vector<size_t> &candidates = near[l.numa_node];
+        l.home_worker = candidates[i / used.size() % candidates.size()];
+        place_on_node(l.inbox.ring.storage(), l.inbox.ring.storage_size(), l.numa_node);
+    }
+}
+
+string numa_suffix(const vector<int> &cpus) {
+    int n = topology.node_of(cpus);
+    return n >= 0 && topology.nodes() > 1 ? " (NUMA node " + to_string(n) + ")" : "";
+}
+
+// Print the effective thread layout. Called on the reactor thread.
+void report_layout() {
+    cout << "Layout: " << topology.nodes() << " NUMA node(s), process CPUs " << format_cpu_list(process_cpus) << endl;
+    for (size_t n = 0; n < topology.nodes(); n++) {
+        cout << "  NUMA node " << n << ": CPUs " << format_cpu_list(topology.node_cpus[n]) << endl;
+    }
+    vector<int> reactor = current_thread_cpus();
+    cout << "  reactor/acceptor: CPUs " << format_cpu_list(reactor) << numa_suffix(reactor)
+         << (reactor_follows_rx ? ", follows SO_INCOMING_CPU" : "") << endl;
+    cout << "  service threads: CPUs " << format_cpu_list(service_cpus.empty() ? process_cpus : service_cpus) << endl;
+    for (size_t w = 0; w < worker_affinity.size(); w++) {
+        cout << "  worker " << w << ": CPUs " << format_cpu_list(worker_affinity[w]) << numa_suffix(worker_affinity[w]) << endl;
+    }
+    if (!numa_lanes || lanes[0].numa_node < 0) {
+        cout << "  lanes: " << NUM_LANES << ", lane i handed to worker i mod " << worker_affinity.size() << endl;
+        return;
+    }
+    for (size_t n = 0; n < topology.nodes(); n++) {
+        int count = 0, resident = 0;
+        for (const lane &l : lanes) {
+            if (l.numa_node != (int)n) continue;
+            count++;
+            resident += memory_node(l.inbox.ring.storage()) == (int)n;
+        }
+        if (count > 0) {
+            cout << "  lanes on NUMA node " << n << ": " << count << ", inbox memory there for " << resident << endl;
         }
     }
 }
@@ -294,57 +2324,175 @@ void signal_handler(int signal) {
     cout << "Shutting down the server..." << endl;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    bool takeover = false;
+    bool print_layout = false, layout_configured = false;
+    vector<int> worker_cpu_list;
+    process_cpus = current_thread_cpus();
+    int workers = clamp<int>(thread::hardware_concurrency(), 1, MAX_WORKERS);
+    uint32_t trace_every = 0;
+    size_t trace_events = TRACE_DEFAULT_EVENTS;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--takeover") {
+            takeover = true;
+        } else if (arg == "--node" && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+        } else if (arg == "--nodes" && i + 1 < argc) {
+            cluster_size = atoi(argv[++i]);
+        } else if (arg == "--dictionary" && i + 1 < argc) {
+            if (!load_dictionary(argv[++i], wire_dictionary)) {
+                cerr << "Error: Unable to read dictionary " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--compress-min" && i + 1 < argc) {
+            compress_min_size = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--zerocopy-min" && i + 1 < argc) {
+            zerocopy_min_size = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--reactor-cpu" && i + 1 < argc && string(argv[i + 1]) == "rx") {
+            reactor_follows_rx = layout_configured = true;
+            i++;
+        } else if ((arg == "--reactor-cpu" || arg == "--worker-cpus" || arg == "--service-cpus") && i + 1 < argc) {
+            vector<int> &cpus = arg == "--reactor-cpu" ? reactor_cpus : arg == "--worker-cpus" ? worker_cpu_list : service_cpus;
+            if (!parse_cpu_list(argv[++i], cpus)) {
+                cerr << "Error: bad CPU list " << argv[i] << " (e.g. 0-3,8)." << endl;
+                return 1;
+            }
+            layout_configured = true;
+        } else if (arg == "--numa") {
+            numa_lanes = layout_configured = true;
+        } else if (arg == "--layout") {
+            print_layout = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_every = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--trace-events" && i + 1 < argc) {
+            trace_events = strtoul(argv[++i], nullptr, 10);
+        } else {
+            cerr << "Usage: " << argv[0] << " [--takeover] [--node <id> --nodes <count>]"
+                 << " [--dictionary <file>] [--compress-min <bytes>] [--zerocopy-min <bytes>]"
+                 << " [--workers <threads>] [--reactor-cpu <cpus>|rx] [--worker-cpus <cpus>]"
+                 << " [--service-cpus <cpus>] [--numa] [--layout]"
+                 << " [--trace <one in N messages>] [--trace-events <per thread>]" << endl;
+            return 1;
+        }
+    }
+    if (cluster_size < 1 || cluster_size > MAX_NODES || node_id < 0 || node_id >= cluster_size) {
+        cerr << "Error: need 0 <= node < nodes <= " << MAX_NODES << "." << endl;
+        return 1;
+    }
+    if (workers < 1 || workers > MAX_WORKERS) {
+        cerr << "Error: need 1 <= workers <= " << MAX_WORKERS << "." << endl;
+        return 1;
+    }
+
     //signal(SIGINT, signal_handler); // Handle Ctrl+C to shut down the server
     load_users("users.txt");
 
     signal(SIGPIPE, SIG_IGN);
+    // Before any thread starts, so that they all inherit the mask
+    sigset_t trace_signals;
+    sigemptyset(&trace_signals);
+    sigaddset(&trace_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &trace_signals, nullptr);
+    if (trace_every > 0) {
+        tracer.enable(trace_every, trace_events);
+        tracer.name_thread("reactor");
+    }
+
+    set_up_layout(workers, worker_cpu_list);
+    if (print_layout || layout_configured) {
+        report_layout();
+    }
+    if (print_layout) {
+        return 0;
+    }
+    thread(report_stats).detach();
+    thread(dump_traces).detach();
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        cerr << "Error creating socket." << endl;
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        cerr << "Error creating reactor." << endl;
         return 1;
     }
 
-    sockaddr_in server_address{};
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+    int server_socket;
+    vector<connection *> restored;
+    if (takeover) {
+        server_socket = take_over(restored);
+        if (server_socket < 0) {
+            return 1;
+        }
+    } else {
+        server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (server_socket < 0) {
+            cerr << "Error creating socket." << endl;
+            return 1;
+        }
+
+        sockaddr_in server_address{};
+        server_address.sin_family = AF_INET;
+        server_address.sin_port = htons(PORT + node_id);
+        server_address.sin_addr.s_addr = INADDR_ANY;
 
 
-    /////
-    int yes = 1;
+        /////
+        int yes = 1;
 
-    if(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-        std::cout << "[ERROR] setsockopt error";
-        exit(1);
+        if(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+            std::cout << "[ERROR] setsockopt error";
+            exit(1);
+        }
+        /////
+
+        if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
+            cerr << "Error binding socket." << endl;
+            return 1;
+        }
+
+        //Maximum Number of Clients
+        if (listen(server_socket, SOMAXCONN) < 0) {
+            cerr << "Error listening on socket." << endl;
+            return 1;
+        }
+
+        if (cluster_size > 1 && (bus_socket = open_bus_socket()) < 0) {
+            return 1;
+        }
+        udp_socket = open_udp_socket();
     }
-    /////
 
-    if (bind(server_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        cerr << "Error binding socket." << endl;
-        return 1;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = server_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event);
+    event.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+    if (udp_socket >= 0) {
+        event.data.fd = udp_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_socket, &event);
     }
 
-    //Maximum Number of Clients
-    if (listen(server_socket, SOMAXCONN) < 0) {
-        cerr << "Error listening on socket." << endl;
-        return 1;
+    upgrade_socket = open_upgrade_socket();
+    if (upgrade_socket >= 0) {
+        event.data.fd = upgrade_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upgrade_socket, &event);
     }
 
-    cout << "Server is running on port " << PORT << "..." << endl;
+    for (connection *conn : restored) {
+        watch_connection(conn);
+    }
 
-    while (server_running) {
-        sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
-        int client_socket = accept(server_socket, (sockaddr*)&client_address, &client_len);
-        if (client_socket < 0) {
-            if (!server_running) break;
-            cerr << "Error accepting connection." << endl;
-            continue;
-        }
-            thread(handle_client, client_socket).detach();
-        }
+    if (cluster_size > 1) {
+        start_cluster();
+    }
+
+    cout << "Server is running on port " << PORT + node_id << "..." << endl;
+
+    run_reactor(server_socket);
 
     close(server_socket);
     return 0;
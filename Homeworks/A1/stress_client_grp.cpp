@@ -5,17 +5,71 @@
 #include <unistd.h>
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <poll.h>
+#include <cerrno>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include "wire_protocol.h"
 
 #define BUFFER_SIZE 1024
 #define USERNAME "alice"
 #define PASSWORD "password123"
 #define EXIT "/exit"
+#define PING "/ping" // Not a command, so the server answers "Invalid command."
+#define PING_TIMEOUT_MS 5000
 
 
+int server_port = 12345;
+bool binary = false; // --binary: log in with the compact wire protocol
+
+// Binary mode: what one connection has received so far.
+struct binary_session {
+    wire_decoder decoder;
+    name_table names;
+};
+std::vector<binary_session> sessions; // By client
+
+void send_request(int client_socket, const chat_command &command) {
+    std::string body, frame;
+    encode_command(body, command, [](const std::string &) { return 0; });
+    put_frame(frame, body);
+    send(client_socket, frame.data(), frame.size(), 0);
+}
+
+// Decode every complete frame received on a connection. Returns op if one of
+// the messages was of that type (or alt), 0 if not, -1 on a corrupt stream.
+int scan_frames(binary_session &session, uint8_t op, uint8_t alt = 0)
+{
+    int found = 0;
+    std::string body;
+    frame_status status;
+    while ((status = session.decoder.next(body)) == FRAME_READY) {
+        wire_reader in(body);
+        while (!in.empty()) {
+            wire_message message;
+            if (!decode_message(in, session.names, message)) return -1;
+            if (!found && (message.op == op || (alt && message.op == alt))) found = message.op;
+        }
+    }
+    return status == FRAME_BAD ? -1 : found;
+}
+
+// Binary mode: block until a message of type op (or alt) arrives.
+int wait_for(int client_socket, binary_session &session, uint8_t op, uint8_t alt = 0)
+{
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        int found = scan_frames(session, op, alt);
+        if (found != 0) return found;
+        int n = recv(client_socket, buffer, BUFFER_SIZE, 0);
+        if (n <= 0) return -1;
+        session.decoder.feed(buffer, n);
+    }
+}
+
 std::pair<int, int> connectClient(int i, float &successful_connections) 
 {
     std::pair<int, int> socket_success = {0, 0};
@@ -32,7 +86,7 @@ std::pair<int, int> connectClient(int i, float &successful_connections)
     }
 
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(server_port);
     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     // Connecting to the server
@@ -48,6 +102,25 @@ std::pair<int, int> connectClient(int i, float &successful_connections)
     memset(buffer, 0, BUFFER_SIZE);
     recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
+    if (binary) {
+        std::string hello = BINARY_HELLO USERNAME;
+        send(client_socket, hello.c_str(), hello.size(), 0);
+        binary_session &session = sessions[i];
+        int result = -1;
+        if (wait_for(client_socket, session, OP_NOTICE) == OP_NOTICE) {
+            send_request(client_socket, {REQ_PASSWORD, "", PASSWORD});
+            result = wait_for(client_socket, session, OP_WELCOME, OP_AUTH_FAILED);
+        }
+        if (result != OP_WELCOME) {
+            std::cout << "Client "<<i<<" Failed to Connect." << std::endl;
+            close(client_socket);
+            return socket_success;
+        }
+        socket_success = {client_socket, 1};
+        successful_connections++;
+        std::cout << "Client " << i << " connected to the server." << std::endl;
+        return socket_success;
+    }
     send(client_socket, USERNAME, strlen(USERNAME), 0);
 
     memset(buffer, 0, BUFFER_SIZE);
@@ -82,13 +155,112 @@ void disconnectClient(int client_id, std::vector< std::pair<int, bool> > &client
     return;
 }
 
+// Keep every connection open for hold_seconds while one client per second
+// broadcasts, then check that each connection still answers. Used to verify
+// that a hot upgrade of the server drops nobody. Returns the number of failed
+// connections.
+int holdClients(std::vector< std::pair<int, bool> > &client_status, int hold_seconds)
+{
+    char buffer[BUFFER_SIZE];
+    std::vector<pollfd> fds;
+    std::vector<int> owner;
+    for (int i = 0; i < (int)client_status.size(); i++) {
+        if (client_status[i].second) {
+            fds.push_back({client_status[i].first, POLLIN, 0});
+            owner.push_back(i);
+        }
+    }
+    std::vector<bool> alive(fds.size(), true), answered(fds.size(), false);
+    int disconnects = 0;
+
+    // Reads whatever is pending; returns false if the connection went away.
+    auto drain = [&](size_t k) {
+        while (true) {
+            int n = recv(fds[k].fd, buffer, BUFFER_SIZE, MSG_DONTWAIT);
+            if (n > 0 && binary) {
+                binary_session &session = sessions[owner[k]];
+                session.decoder.feed(buffer, n);
+                int found = scan_frames(session, OP_PONG);
+                if (found < 0) return false;
+                if (found == OP_PONG) answered[k] = true;
+                continue;
+            }
+            if (n > 0) {
+                if (std::string(buffer, n).find("Invalid command.") != std::string::npos) {
+                    answered[k] = true;
+                }
+                continue;
+            }
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    };
+    auto poll_round = [&](int timeout_ms) {
+        if (poll(fds.data(), fds.size(), timeout_ms) <= 0) return;
+        for (size_t k = 0; k < fds.size(); k++) {
+            if (alive[k] && fds[k].revents && !drain(k)) {
+                alive[k] = false;
+                fds[k].fd = -1;
+                disconnects++;
+                std::cout << "Client " << owner[k] << " was disconnected." << std::endl;
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    size_t speaker = 0;
+    for (int second = 0; second < hold_seconds && !fds.empty(); second++) {
+        speaker = (speaker + 1) % fds.size();
+        if (alive[speaker] && binary) {
+            send_request(fds[speaker].fd, {REQ_BROADCAST, "", "tick " + std::to_string(second)});
+        } else if (alive[speaker]) {
+            std::string tick = "/broadcast tick " + std::to_string(second);
+            send(fds[speaker].fd, tick.c_str(), tick.size(), 0);
+        }
+        while (std::chrono::steady_clock::now() - start < std::chrono::seconds(second + 1)) {
+            poll_round(100);
+        }
+    }
+
+    for (size_t k = 0; k < fds.size(); k++) {
+        if (alive[k] && binary) {
+            send_request(fds[k].fd, {REQ_PING, "", ""});
+        } else if (alive[k]) {
+            send(fds[k].fd, PING, strlen(PING), 0);
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PING_TIMEOUT_MS);
+    int unanswered = 0;
+    while (std::chrono::steady_clock::now() < deadline) {
+        poll_round(100);
+        unanswered = 0;
+        for (size_t k = 0; k < fds.size(); k++) {
+            if (alive[k] && !answered[k]) unanswered++;
+        }
+        if (unanswered == 0) break;
+    }
+
+    std::cout << "Disconnects: " << disconnects << "\nUnanswered: " << unanswered << std::endl;
+    return disconnects + unanswered;
+}
+
 int main(int argc, char *argv[])
 {
-    if(argc <= 1) {
-        std::cout << "[USE]: a.exe num_clients\n";
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--binary") {
+            binary = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    if(args.empty()) {
+        std::cout << "[USE]: a.exe num_clients [hold_seconds] [port] [--binary]\n";
         return 1;
     }
-    int num_clients = std::stoi(argv[1]);
+    int num_clients = std::stoi(args[0]);
+    int hold_seconds = args.size() > 1 ? std::stoi(args[1]) : 0;
+    if (args.size() > 2) server_port = std::stoi(args[2]);
+    if (binary) sessions.resize(num_clients);
 
     // Success rate
     float successful_connections = 0;
@@ -103,6 +275,10 @@ int main(int argc, char *argv[])
     success_rate = successful_connections / num_clients;
     std::cout << "Success: " << successful_connections << "\nSuccess rate: " << success_rate << std::endl;
 
+    if (hold_seconds > 0 && holdClients(client_status, hold_seconds) > 0) {
+        return 1;
+    }
+
     // Disconnect all clients
     // for(int i = 0; i < num_clients; i++) {
     //     disconnectClient(i, client_status);
@@ -0,0 +1,128 @@
+// Benchmark: topic_trie publish cost with a large number of subscriptions
+//
+// Builds N random subscriptions (default 1M) over a small vocabulary, about a
+// tenth of them with "*" and a few with a trailing "#", then publishes random
+// topics and reports the cost per publish:
+//  - trie, cold: cache cleared before every publish, so each one walks the trie
+//  - trie, warm: repeated topics served from the match cache
+//  - linear scan: matching every subscription, as a flat list would
+// The linear scan only runs a few publishes since it is O(subscriptions).
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include "topic_trie.h"
+
+#define DEFAULT_SUBSCRIPTIONS 1000000
+#define PUBLISHES 100000
+#define DISTINCT_TOPICS 1000
+#define SCAN_PUBLISHES 20
+#define VOCABULARY 32
+
+using namespace std;
+
+mt19937 rng(425);
+
+string word(int i) {
+    return "w" + to_string(i);
+}
+
+string random_topic() {
+    int depth = 3 + rng() % 3;
+    string topic;
+    for (int i = 0; i < depth; i++) {
+        topic += (i ? "." : "") + word(rng() % VOCABULARY);
+    }
+    return topic;
+}
+
+string random_pattern() {
+    int depth = 3 + rng() % 3;
+    string pattern;
+    for (int i = 0; i < depth; i++) {
+        string segment = word(rng() % VOCABULARY);
+        if (i > 0 && rng() % 10 == 0) segment = "*";
+        if (i == depth - 1 && rng() % 50 == 0) segment = "#";
+        pattern += (i ? "." : "") + segment;
+    }
+    return pattern;
+}
+
+// Reference matcher over split segments, used by the linear scan.
+bool matches(const vector<string> &pattern, size_t p, const vector<string> &topic, size_t t) {
+    if (p == pattern.size()) return t == topic.size();
+    if (pattern[p] == "#") {
+        for (size_t k = t; k <= topic.size(); k++) {
+            if (matches(pattern, p + 1, topic, k)) return true;
+        }
+        return false;
+    }
+    if (t == topic.size()) return false;
+    if (pattern[p] != "*" && pattern[p] != topic[t]) return false;
+    return matches(pattern, p + 1, topic, t + 1);
+}
+
+double elapsed_ns(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    int subscriptions = argc > 1 ? stoi(argv[1]) : DEFAULT_SUBSCRIPTIONS;
+
+    topic_trie trie;
+    vector<vector<string>> flat; // Same subscriptions for the linear scan
+    vector<string> segments;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < subscriptions; i++) {
+        string pattern = random_pattern();
+        if (trie.subscribe(pattern, i)) {
+            topic_trie::split(pattern, segments, true);
+            flat.push_back(segments);
+        }
+    }
+    cout << "Subscriptions:        " << trie.size() << " (built in " << elapsed_ns(start) / 1e6 << " ms)\n";
+
+    vector<string> topics;
+    for (int i = 0; i < DISTINCT_TOPICS; i++) {
+        topics.push_back(random_topic());
+    }
+
+    size_t delivered = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < PUBLISHES; i++) {
+        trie.max_cached = 0; // Clears the cache on every lookup
+        delivered += trie.match(topics[i % DISTINCT_TOPICS]).size();
+    }
+    double cold = elapsed_ns(start) / PUBLISHES;
+
+    trie.max_cached = 65536;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < PUBLISHES; i++) {
+        delivered += trie.match(topics[i % DISTINCT_TOPICS]).size();
+    }
+    double warm = elapsed_ns(start) / PUBLISHES;
+
+    size_t scanned = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < SCAN_PUBLISHES; i++) {
+        topic_trie::split(topics[i], segments, false);
+        for (const auto &pattern : flat) {
+            scanned += matches(pattern, 0, segments, 0);
+        }
+    }
+    double scan = elapsed_ns(start) / SCAN_PUBLISHES;
+
+    size_t expected = 0;
+    for (int i = 0; i < SCAN_PUBLISHES; i++) {
+        expected += trie.match(topics[i]).size();
+    }
+
+    cout << "Avg. recipients:      " << delivered / (2.0 * PUBLISHES) << "\n";
+    cout << "Trie publish (cold):  " << cold << " ns\n";
+    cout << "Trie publish (warm):  " << warm << " ns\n";
+    cout << "Linear scan publish:  " << scan << " ns\n";
+    cout << "Results agree:        " << (scanned == expected ? "yes" : "NO") << "\n";
+    return scanned == expected ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+// Topic-pattern matcher for hierarchical topics such as "ops.alerts.db".
+//
+// Subscriptions are patterns of dot-separated segments where "*" matches
+// exactly one segment and "#" matches any number of segments (including none),
+// so "ops.*.db" matches "ops.alerts.db" and "ops.#" matches everything under
+// "ops". Patterns are kept in a trie over segments whose chains of literal
+// segments are compressed into a single edge. A publish walks the trie once,
+// which is O(topic depth) rather than O(subscriptions), and the result for a
+// topic is cached until the subscriptions change.
+//
+// Not thread-safe; the server guards it with a mutex.
+
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+class topic_trie {
+public:
+    typedef uint32_t subscriber;
+
+    // Split "a.b.c" into segments. Returns false for empty segments, and for
+    // wildcards when they are not allowed (topics) or not a whole segment.
+    static bool split(const std::string &text, std::vector<std::string> &segments, bool allow_wildcards) {
+        segments.clear();
+        size_t start = 0;
+        while (true) {
+            size_t dot = text.find('.', start);
+            std::string segment = text.substr(start, dot == std::string::npos ? std::string::npos : dot - start);
+            bool wildcard = segment.find_first_of("*#") != std::string::npos;
+            if (segment.empty() || (wildcard && (!allow_wildcards || segment.size() != 1))) {
+                return false;
+            }
+            segments.push_back(segment);
+            if (dot == std::string::npos) return true;
+            start = dot + 1;
+        }
+    }
+
+    // Returns false if the pattern is malformed or already subscribed.
+    bool subscribe(const std::string &pattern, subscriber id) {
+        std::vector<std::string> segments;
+        if (!split(pattern, segments, true) || !by_subscriber[id].insert(pattern).second) {
+            return false;
+        }
+        insert(root, segments, 0)->subscribers.insert(id);
+        count++;
+        cache.clear();
+        return true;
+    }
+
+    bool unsubscribe(const std::string &pattern, subscriber id) {
+        auto it = by_subscriber.find(id);
+        if (it == by_subscriber.end() || it->second.erase(pattern) == 0) {
+            return false;
+        }
+        if (it->second.empty()) by_subscriber.erase(it);
+        std::vector<std::string> segments;
+        split(pattern, segments, true);
+        erase(root, segments, 0, id);
+        count--;
+        cache.clear();
+        return true;
+    }
+
+    void unsubscribe_all(subscriber id) {
+        auto it = by_subscriber.find(id);
+        if (it == by_subscriber.end()) return;
+        std::unordered_set<std::string> patterns = std::move(it->second);
+        by_subscriber.erase(it);
+        std::vector<std::string> segments;
+        for (const std::string &pattern : patterns) {
+            split(pattern, segments, true);
+            erase(root, segments, 0, id);
+            count--;
+        }
+        cache.clear();
+    }
+
+    // Patterns a subscriber holds, for hand-over to another process.
+    std::vector<std::string> patterns_of(subscriber id) const {
+        auto it = by_subscriber.find(id);
+        if (it == by_subscriber.end()) return {};
+        return std::vector<std::string>(it->second.begin(), it->second.end());
+    }
+
+    // Every subscriber with at least one pattern matching topic, each once.
+    // The reference stays valid until the next call or subscription change.
+    const std::vector<subscriber> &match(const std::string &topic) {
+        auto cached = cache.find(topic);
+        if (cached != cache.end()) {
+            return cached->second;
+        }
+        if (cache.size() >= max_cached) {
+            cache.clear();
+        }
+        std::vector<subscriber> &result = cache[topic];
+        std::vector<std::string> segments;
+        if (split(topic, segments, false)) {
+            collect(root, segments, 0, result);
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+        }
+        return result;
+    }
+
+    size_t size() const { return count; }
+
+    size_t max_cached = 65536; // Topics whose match results are kept
+
+private:
+    struct node {
+        // Segments on the edge into this node. Literal runs are merged into one
+        // edge; "*" and "#" always get a node of their own.
+        std::vector<std::string> label;
+        std::unordered_map<std::string, std::unique_ptr<node>> children; // First label segment -> child
+        std::unordered_set<subscriber> subscribers;
+    };
+
+    node root;
+    size_t count = 0;
+    std::unordered_map<subscriber, std::unordered_set<std::string>> by_subscriber;
+    std::unordered_map<std::string, std::vector<subscriber>> cache;
+
+    static bool is_wildcard(const std::string &segment) {
+        return segment == "*" || segment == "#";
+    }
+
+    // Node for segments[i..], creating and splitting edges as needed.
+    static node *insert(node &parent, const std::vector<std::string> &segments, size_t i) {
+        if (i == segments.size()) {
+            return &parent;
+        }
+        auto it = parent.children.find(segments[i]);
+        if (it == parent.children.end()) {
+            auto child = std::make_unique<node>();
+            if (is_wildcard(segments[i])) {
+                child->label.push_back(segments[i]);
+            } else {
+                for (size_t j = i; j < segments.size() && !is_wildcard(segments[j]); j++) {
+                    child->label.push_back(segments[j]);
+                }
+            }
+            size_t used = child->label.size();
+            node *created = child.get();
+            parent.children[segments[i]] = std::move(child);
+            return insert(*created, segments, i + used);
+        }
+
+        node *child = it->second.get();
+        size_t common = 0;
+        while (common < child->label.size() && i + common < segments.size() &&
+               child->label[common] == segments[i + common]) {
+            common++;
+        }
+        if (common < child->label.size()) {
+            // Split the edge: the shared prefix becomes a new node above child.
+            auto prefix = std::make_unique<node>();
+            prefix->label.assign(child->label.begin(), child->label.begin() + common);
+            std::unique_ptr<node> rest = std::move(it->second);
+            rest->label.erase(rest->label.begin(), rest->label.begin() + common);
+            std::string key = rest->label.front();
+            prefix->children[key] = std::move(rest);
+            it->second = std::move(prefix);
+            child = it->second.get();
+        }
+        return insert(*child, segments, i + common);
+    }
+
+    // Remove id from the pattern's node, then prune nodes left empty and merge
+    // literal chains that no longer branch.
+    static void erase(node &parent, const std::vector<std::string> &segments, size_t i, subscriber id) {
+        if (i == segments.size()) {
+            parent.subscribers.erase(id);
+            return;
+        }
+        auto it = parent.children.find(segments[i]);
+        if (it == parent.children.end()) return;
+        node *child = it->second.get();
+        if (child->label.size() > segments.size() - i ||
+            !std::equal(child->label.begin(), child->label.end(), segments.begin() + i)) {
+            return;
+        }
+        erase(*child, segments, i + child->label.size(), id);
+
+        if (child->subscribers.empty() && child->children.empty()) {
+            parent.children.erase(it);
+        } else if (child->subscribers.empty() && child->children.size() == 1 && !is_wildcard(child->label.front())) {
+            node *only = child->children.begin()->second.get();
+            if (!is_wildcard(only->label.front())) {
+                std::unique_ptr<node> merged = std::move(child->children.begin()->second);
+                merged->label.insert(merged->label.begin(), child->label.begin(), child->label.end());
+                it->second = std::move(merged);
+            }
+        }
+    }
+
+    // Add the subscribers of every pattern below n (whose label is already
+    // matched) that matches segments[i..].
+    static void collect(const node &n, const std::vector<std::string> &segments, size_t i,
+                        std::vector<subscriber> &result) {
+        if (i == segments.size()) {
+            result.insert(result.end(), n.subscribers.begin(), n.subscribers.end());
+        } else {
+            auto literal = n.children.find(segments[i]);
+            if (literal != n.children.end() && !is_wildcard(segments[i])) {
+                const node &child = *literal->second;
+                if (child.label.size() <= segments.size() - i &&
+                    std::equal(child.label.begin(), child.label.end(), segments.begin() + i)) {
+                    collect(child, segments, i + child.label.size(), result);
+                }
+            }
+            auto star = n.children.find("*");
+            if (star != n.children.end()) {
+                collect(*star->second, segments, i + 1, result);
+            }
+        }
+        auto hash = n.children.find("#");
+        if (hash != n.children.end()) {
+            for (size_t j = i; j <= segments.size(); j++) {
+                collect(*hash->second, segments, j, result);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+// UDP delivery of group traffic and presence, an opt-in next to a client's
+// TCP connection.
+//
+// A logged-in client sends REQ_UDP ("/udp") and gets OP_UDP_TOKEN, a random
+// token, over TCP. It then sends UDP_HELLO and the token (a varint) from its
+// UDP socket to the server's UDP port, which has the same number as the TCP
+// port. The server answers "UDP delivery on." over TCP and from then on sends
+// that client's group messages and presence notices (udp_eligible) to the
+// address the hello came from. Everything else stays on TCP, and so does a
+// message too large for one datagram.
+//
+// A datagram is a varint sequence number, counting from 1 per client, then a
+// frame body: OP_NAME for every name the message uses, then the message. So
+// every datagram decodes on its own: a lost one delays nothing after it, and
+// a gap in the sequence numbers tells the client how many it missed.
+//
+// udp_sender batches datagrams and sends them with one sendmmsg(2). Runs of
+// equal-sized datagrams to the same address (the last may be shorter) go out
+// as a single UDP_SEGMENT (GSO) send, when the kernel supports it.
+
+#ifndef UDP_DELIVERY_H
+#define UDP_DELIVERY_H
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "wire_protocol.h"
+
+#define UDP_HELLO "\x7f" "UDP1 "    // A client's hello starts with this
+#define UDP_MAX_DATAGRAM 1400        // Larger messages go over TCP (one Ethernet MTU, less headers)
+#define UDP_BATCH 64                 // Datagrams queued before a sender flushes on its own
+#define UDP_GSO_MAX_SEGMENTS 64      // The kernel's limit per GSO send
+#define UDP_GSO_MAX_BYTES 60000      // And the payload of one GSO send must fit an IP packet
+
+// Messages that may be sent over UDP.
+inline bool udp_eligible(uint8_t op) {
+    return op == OP_GROUP_MSG || op == OP_GROUP_JOINED || op == OP_GROUP_LEFT || op == OP_CHAT_JOINED ||
+           op == OP_CHAT_LEFT;
+}
+
+inline std::string make_udp_hello(uint64_t token) {
+    std::string hello = UDP_HELLO;
+    put_varint(hello, token);
+    return hello;
+}
+
+// Returns false if data is not a hello.
+inline bool read_udp_hello(const char *data, size_t size, uint64_t &token) {
+    size_t prefix = sizeof(UDP_HELLO) - 1;
+    if (size <= prefix || std::string(data, prefix) != UDP_HELLO) return false;
+    std::string rest(data + prefix, size - prefix);
+    wire_reader in(rest);
+    token = in.varint();
+    return in.ok && in.empty() && token != 0;
+}
+
+// Splits a received datagram into its sequence number and its messages;
+// messages points into datagram.
+inline bool read_datagram(const std::string &datagram, uint64_t &seq, wire_reader &messages) {
+    messages = wire_reader(datagram);
+    seq = messages.varint();
+    return messages.ok && seq != 0;
+}
+
+// Loss accounting on the receiving side.
+struct udp_sequence {
+    uint64_t next = 1;
+    uint64_t lost = 0;      // Sequence numbers skipped so far
+    uint64_t reordered = 0; // Datagrams that arrived after a later one
+
+    // Returns how many datagrams went missing just before this one.
+    uint64_t receive(uint64_t seq) {
+        if (seq < next) {
+            reordered++;
+            if (lost > 0) lost--;
+            return 0;
+        }
+        uint64_t missed = seq - next;
+        lost += missed;
+        next = seq + 1;
+        return missed;
+    }
+};
+
+struct udp_send_stats {
+    std::atomic<uint64_t> datagrams = 0; // Handed to the kernel
+    std::atomic<uint64_t> calls = 0;     // sendmmsg calls
+    std::atomic<uint64_t> gso_sends = 0; // Messages that carried several datagrams
+    std::atomic<uint64_t> dropped = 0;   // Refused by the kernel (full socket buffer)
+};
+
+// Collects datagrams and sends them in batches. One per thread: not thread
+// safe, but any number of them may share a socket.
+class udp_sender {
+public:
+    udp_sender(int sock, udp_send_stats &stats) : sock(sock), stats(stats) {}
+    ~udp_sender() { flush(); }
+    udp_sender(const udp_sender &) = delete;
+    udp_sender &operator=(const udp_sender &) = delete;
+
+    void queue(const sockaddr_in &to, std::string datagram) {
+        pending.push_back({to, std::move(datagram)});
+        if (pending.size() >= UDP_BATCH) flush();
+    }
+
+    void flush() {
+        if (pending.empty()) return;
+        // Group by address; each address keeps its own order
+        std::stable_sort(pending.begin(), pending.end(), [](const outgoing &a, const outgoing &b) {
+            return key_of(a.to) < key_of(b.to);
+        });
+        std::vector<mmsghdr> messages;
+        std::vector<iovec> iovs(pending.size());
+        std::vector<size_t> first_of;                    // Message -> its first datagram
+        std::vector<char> controls(pending.size() * CMSG_SPACE(sizeof(uint16_t)));
+        messages.reserve(pending.size());
+        for (size_t i = 0; i < pending.size();) {
+            size_t size = pending[i].datagram.size(), total = size, j = i + 1;
+            if (gso_works.load(std::memory_order_relaxed)) {
+                while (j < pending.size() && j - i < UDP_GSO_MAX_SEGMENTS && key_of(pending[j].to) == key_of(pending[i].to) &&
+                       pending[j].datagram.size() <= size && total + pending[j].datagram.size() <= UDP_GSO_MAX_BYTES) {
+                    total += pending[j].datagram.size();
+                    bool shorter = pending[j++].datagram.size() < size;
+                    if (shorter) break; // Only the last segment may be shorter
+                }
+            }
+            mmsghdr m{};
+            m.msg_hdr.msg_name = &pending[i].to;
+            m.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            m.msg_hdr.msg_iov = &iovs[i];
+            m.msg_hdr.msg_iovlen = j - i;
+            for (size_t k = i; k < j; k++) {
+                iovs[k] = {pending[k].datagram.data(), pending[k].datagram.size()};
+            }
+            if (j - i > 1) {
+                char *control = &controls[messages.size() * CMSG_SPACE(sizeof(uint16_t))];
+                m.msg_hdr.msg_control = control;
+                m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&m.msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = size;
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+            messages.push_back(m);
+            first_of.push_back(i);
+            i = j;
+        }
+
+        for (size_t done = 0; done < messages.size();) {
+            int sent = sendmmsg(sock, &messages[done], messages.size() - done, MSG_DONTWAIT);
+            if (sent < 0 && errno == EINTR) continue;
+            stats.calls++;
+            if (sent > 0) {
+                for (int k = 0; k < sent; k++) {
+                    size_t count = messages[done + k].msg_hdr.msg_iovlen;
+                    stats.datagrams += count;
+                    if (count > 1) stats.gso_sends++;
+                }
+                done += sent;
+                continue;
+            }
+            if (messages[done].msg_hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                // No GSO here: send the rest one datagram at a time from now on
+                gso_works.store(false, std::memory_order_relaxed);
+                pending.erase(pending.begin(), pending.begin() + first_of[done]);
+                flush();
+                return;
+            }
+            stats.dropped += messages[done].msg_hdr.msg_iovlen; // Full buffer or unreachable: it is UDP
+            done++;
+        }
+        pending.clear();
+    }
+
+private:
+    struct outgoing {
+        sockaddr_in to;
+        std::string datagram;
+    };
+
+    static uint64_t key_of(const sockaddr_in &address) {
+        return (uint64_t)address.sin_addr.s_addr << 16 | address.sin_port;
+    }
+
+    int sock;
+    udp_send_stats &stats;
+    std::vector<outgoing> pending;
+    static inline std::atomic<bool> gso_works = true;
+};
+
+#endif
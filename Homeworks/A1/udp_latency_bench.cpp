@@ -0,0 +1,270 @@
+// Group message delivery latency over TCP and over UDP (udp_delivery.h),
+// against a running server_grp.
+//
+// One sender (alice) sends timestamped /group_msg requests at a fixed rate to
+// a group that three TCP receivers and three UDP receivers have joined. Every
+// receiver records how long each message took to arrive; the report gives the
+// percentiles and losses per transport. The interesting case is a lossy link,
+// where TCP holds back every later message until a lost segment is
+// retransmitted, e.g. on loopback (needs root and the sch_netem module):
+//
+//   tc qdisc add dev lo root netem loss 1% delay 1ms
+//   ./udp_latency_bench 20000 2000
+//   tc qdisc del dev lo root
+//
+//   ./udp_latency_bench [messages] [per second] [port]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "wire_protocol.h"
+#include "udp_delivery.h"
+
+#define GROUP "latency"
+#define BUFFER_SIZE 65536
+#define QUIET_MS 2000      // Receivers stop this long after the last message
+#define HELLO_TRIES 20
+
+int server_port = 12345;
+std::atomic<bool> sending_done = false;
+
+struct account {
+    const char *username;
+    const char *password;
+    bool udp;
+};
+
+const account receivers[] = {
+    {"bob", "qwerty456", false},  {"charlie", "secure789", false}, {"david", "helloWorld!", false},
+    {"eve", "trustno1", true},    {"frank", "letmein", true},      {"grace", "passw0rd", true},
+};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A binary-protocol connection, logged in.
+struct session {
+    int sock = -1;
+    wire_decoder decoder;
+    name_table names;
+
+    void request(const chat_command &command) {
+        std::string body, frame;
+        encode_command(body, command, [](const std::string &) { return 0; });
+        put_frame(frame, body);
+        send(sock, frame.data(), frame.size(), 0);
+    }
+
+    // Decoded messages received so far, appended to out. Returns false once
+    // the connection is gone or broken.
+    bool receive(std::vector<wire_message> &out, bool wait) {
+        char buffer[BUFFER_SIZE];
+        ssize_t size = recv(sock, buffer, sizeof(buffer), wait ? 0 : MSG_DONTWAIT);
+        if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) return false;
+        if (size > 0) decoder.feed(buffer, size);
+        std::string body;
+        frame_status status;
+        while ((status = decoder.next(body)) == FRAME_READY) {
+            wire_reader in(body);
+            while (!in.empty()) {
+                wire_message message;
+                if (!decode_message(in, names, message)) return false;
+                if (message.op != OP_NAME) out.push_back(message);
+            }
+        }
+        return status != FRAME_BAD;
+    }
+
+    // Block until a message with op arrives; returns it.
+    bool wait_for(uint8_t op, wire_message &found) {
+        std::vector<wire_message> messages;
+        while (receive(messages, true)) {
+            for (const wire_message &message : messages) {
+                if (message.op == op) {
+                    found = message;
+                    return true;
+                }
+            }
+            messages.clear();
+        }
+        return false;
+    }
+
+    bool login(const account &user) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(server_port);
+        address.sin_addr.s_addr = inet_addr("127.0.0.1");
+        if (sock < 0 || connect(sock, (sockaddr*)&address, sizeof(address)) < 0) return false;
+        char prompt[BUFFER_SIZE];
+        if (recv(sock, prompt, sizeof(prompt), 0) <= 0) return false; // "Enter username: "
+        std::string hello = std::string(BINARY_HELLO) + user.username;
+        send(sock, hello.data(), hello.size(), 0);
+        wire_message message;
+        if (!wait_for(OP_NOTICE, message)) return false; // "Enter password: "
+        request({REQ_PASSWORD, "", user.password});
+        return wait_for(OP_WELCOME, message);
+    }
+};
+
+// Switch a logged-in session to UDP delivery; returns the UDP socket or -1.
+int open_udp(session &tcp) {
+    wire_message token;
+    tcp.request({REQ_UDP, "", ""});
+    if (!tcp.wait_for(OP_UDP_TOKEN, token)) return -1;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(server_port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    connect(sock, (sockaddr*)&address, sizeof(address));
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    std::string hello = make_udp_hello(token.seq);
+    for (int i = 0; i < HELLO_TRIES; i++) {
+        send(sock, hello.data(), hello.size(), 0);
+        pollfd fd = {tcp.sock, POLLIN, 0};
+        if (poll(&fd, 1, 200) > 0) {
+            std::vector<wire_message> messages;
+            tcp.receive(messages, false);
+            for (const wire_message &message : messages) {
+                if (message.text == "UDP delivery on.") return sock;
+            }
+        }
+    }
+    close(sock);
+    return -1;
+}
+
+struct result {
+    std::vector<uint64_t> latencies; // Nanoseconds
+    uint64_t lost = 0;               // UDP: sequence gaps
+    bool ok = false;
+};
+
+// Record the latency of every group message until the sender is done and
+// nothing has arrived for QUIET_MS.
+void receive_messages(session &tcp, int udp_sock, result &r) {
+    pollfd fds[2] = {{tcp.sock, POLLIN, 0}, {udp_sock, POLLIN, 0}};
+    udp_sequence sequence;
+    std::vector<wire_message> messages;
+    std::string datagram(UDP_MAX_DATAGRAM, '\0');
+    auto record = [&r](const wire_message &message) {
+        if (message.op == OP_GROUP_MSG) {
+            r.latencies.push_back(now_ns() - std::strtoull(message.text.c_str(), nullptr, 10));
+        }
+    };
+    while (true) {
+        int ready = poll(fds, 2, QUIET_MS);
+        if (ready == 0 && sending_done) break;
+        if (fds[0].revents & POLLIN) {
+            messages.clear();
+            if (!tcp.receive(messages, false)) break;
+            for (const wire_message &message : messages) record(message);
+        }
+        if (fds[1].revents & POLLIN) {
+            datagram.resize(UDP_MAX_DATAGRAM);
+            ssize_t size = recv(udp_sock, &datagram[0], datagram.size(), MSG_DONTWAIT);
+            if (size <= 0) continue;
+            datagram.resize(size);
+            uint64_t seq;
+            wire_reader in;
+            if (!read_datagram(datagram, seq, in)) continue;
+            sequence.receive(seq);
+            while (!in.empty()) {
+                wire_message message;
+                if (!decode_message(in, tcp.names, message)) break;
+                record(message);
+            }
+        }
+    }
+    r.lost = sequence.lost;
+    r.ok = true;
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+    return sorted[index] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 20000;
+    int rate = argc > 2 ? atoi(argv[2]) : 2000;
+    server_port = argc > 3 ? atoi(argv[3]) : 12345;
+    if (messages < 1 || rate < 1) {
+        std::cout << "[USE]: " << argv[0] << " [messages] [per second] [port]" << std::endl;
+        return 1;
+    }
+
+    session sender;
+    if (!sender.login({"alice", "password123", false})) {
+        std::cerr << "Error: cannot log in the sender." << std::endl;
+        return 1;
+    }
+    sender.request({REQ_CREATE_GROUP, GROUP, ""});
+
+    const size_t count = sizeof(receivers) / sizeof(receivers[0]);
+    std::vector<session> sessions(count);
+    std::vector<int> udp_socks(count, -1);
+    std::vector<result> results(count);
+    for (size_t i = 0; i < count; i++) {
+        if (!sessions[i].login(receivers[i])) {
+            std::cerr << "Error: cannot log in " << receivers[i].username << "." << std::endl;
+            return 1;
+        }
+        if (receivers[i].udp && (udp_socks[i] = open_udp(sessions[i])) < 0) {
+            std::cerr << "Error: the server did not take " << receivers[i].username << "'s UDP hello." << std::endl;
+            return 1;
+        }
+        sessions[i].request({REQ_JOIN_GROUP, GROUP, ""});
+        wire_message joined;
+        if (!sessions[i].wait_for(OP_NOTICE, joined)) return 1; // "You joined the group latency."
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; i++) {
+        threads.emplace_back(receive_messages, std::ref(sessions[i]), udp_socks[i], std::ref(results[i]));
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++) {
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)i * 1000000000 / rate));
+        sender.request({REQ_GROUP_MSG, GROUP, std::to_string(now_ns())});
+    }
+    sending_done = true;
+    for (std::thread &t : threads) t.join();
+
+    std::cout << messages << " messages at " << rate << "/s to " << count / 2 << " TCP and " << count / 2
+              << " UDP receivers. Latency in microseconds:" << std::endl;
+    std::cout << std::left << std::setw(6) << "mode" << std::right << std::setw(10) << "received" << std::setw(8)
+              << "lost" << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10)
+              << "max" << std::endl;
+    for (bool udp : {false, true}) {
+        std::vector<uint64_t> all;
+        uint64_t lost = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (receivers[i].udp != udp) continue;
+            all.insert(all.end(), results[i].latencies.begin(), results[i].latencies.end());
+            lost += results[i].lost;
+        }
+        std::sort(all.begin(), all.end());
+        std::cout << std::left << std::setw(6) << (udp ? "UDP" : "TCP") << std::right << std::setw(10) << all.size()
+                  << std::setw(8) << lost << std::fixed << std::setprecision(1) << std::setw(10) << percentile(all, 50)
+                  << std::setw(10) << percentile(all, 99) << std::setw(10) << percentile(all, 99.9) << std::setw(10)
+                  << (all.empty() ? 0 : all.back() / 1000.0) << std::endl;
+    }
+    close(sender.sock);
+    return 0;
+}
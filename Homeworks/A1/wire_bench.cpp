@@ -0,0 +1,212 @@
+// Benchmark: text protocol vs binary wire protocol, bytes and CPU per message
+//
+// Generates the stream one client receives in a busy chat (mostly group
+// messages, some broadcasts, private messages and presence notices from a pool
+// of users and groups) and measures for each protocol:
+//  - bytes on the wire per message
+//  - encode: what the server does per recipient (render the text, or intern
+//    the names, define new ones and encode the message into a frame)
+//  - decode: what a program reading the stream does to get the fields back
+//    (pick the text apart by its prefixes, or decode the frame)
+// The binary protocol is measured with one frame per message, as sent to a
+// reader that keeps up, and with BATCH messages per frame, as sent to one that
+// is behind.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_set>
+#include "wire_protocol.h"
+
+#define DEFAULT_MESSAGES 1000000
+#define USERS 1000
+#define GROUPS 100
+#define BATCH 16
+
+using namespace std;
+
+mt19937 rng(425);
+
+string random_text() {
+    static const char *words[] = {"the", "build", "is", "green", "again", "lunch", "at", "noon",
+                                  "merge", "request", "ready", "for", "review", "ok", "thanks", "deploy"};
+    string text;
+    int count = 2 + rng() % 10;
+    for (int i = 0; i < count; i++) {
+        text += (i ? " " : "") + string(words[rng() % 16]);
+    }
+    return text;
+}
+
+vector<wire_message> make_stream(int count) {
+    vector<wire_message> stream;
+    vector<uint64_t> seq(GROUPS, 0);
+    for (int i = 0; i < count; i++) {
+        string user = "user" + to_string(rng() % USERS);
+        int g = rng() % GROUPS;
+        string group = "group-" + to_string(g);
+        int kind = rng() % 100;
+        if (kind < 60) {
+            stream.emplace_back(OP_GROUP_MSG, user, group, random_text(), ++seq[g]);
+        } else if (kind < 80) {
+            stream.emplace_back(OP_BROADCAST, user, "", random_text());
+        } else if (kind < 90) {
+            stream.emplace_back(OP_PRIVATE, user, "", random_text());
+        } else if (kind < 95) {
+            stream.emplace_back(OP_GROUP_JOINED, user, group);
+        } else {
+            stream.emplace_back(rng() % 2 ? OP_CHAT_JOINED : OP_CHAT_LEFT, user);
+        }
+    }
+    return stream;
+}
+
+// Recover the fields of a text-protocol message, as a text client has to.
+bool parse_text(const string &text, wire_message &message) {
+    message = wire_message();
+    auto ends_with = [&text](const string &suffix) {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if (text.rfind("[Group ", 0) == 0) {
+        size_t hash_pos = text.find(" #", 7), end_pos = text.find("] ", 7);
+        size_t colon = text.find(": ", end_pos);
+        if (hash_pos == string::npos || end_pos == string::npos || colon == string::npos) return false;
+        message.op = OP_GROUP_MSG;
+        message.group = text.substr(7, hash_pos - 7);
+        message.seq = strtoull(text.c_str() + hash_pos + 2, nullptr, 10);
+        message.user = text.substr(end_pos + 2, colon - end_pos - 2);
+        message.text = text.substr(colon + 2);
+    } else if (text.rfind("[Private] ", 0) == 0) {
+        size_t colon = text.find(": ", 10);
+        if (colon == string::npos) return false;
+        message.op = OP_PRIVATE;
+        message.user = text.substr(10, colon - 10);
+        message.text = text.substr(colon + 2);
+    } else if (ends_with(" has joined the chat.")) {
+        message.op = OP_CHAT_JOINED;
+        message.user = text.substr(0, text.size() - 21);
+    } else if (ends_with(" has left the chat.")) {
+        message.op = OP_CHAT_LEFT;
+        message.user = text.substr(0, text.size() - 19);
+    } else if (text.find(" joined the group ") != string::npos && ends_with(".")) {
+        size_t pos = text.find(" joined the group ");
+        message.op = OP_GROUP_JOINED;
+        message.user = text.substr(0, pos);
+        message.group = text.substr(pos + 18, text.size() - pos - 19);
+    } else {
+        size_t colon = text.find(": ");
+        if (colon == string::npos) return false;
+        message.op = OP_BROADCAST;
+        message.user = text.substr(0, colon);
+        message.text = text.substr(colon + 2);
+    }
+    return true;
+}
+
+double elapsed_ns(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+struct result {
+    size_t bytes;
+    double encode_ns, decode_ns;
+    size_t checksum; // Decoded field sizes, so both protocols can be compared
+};
+
+result bench_text(const vector<wire_message> &stream) {
+    result r{0, 0, 0, 0};
+    vector<string> wire;
+    wire.reserve(stream.size());
+    auto start = chrono::steady_clock::now();
+    for (const wire_message &message : stream) {
+        wire.push_back(message.to_text());
+    }
+    r.encode_ns = elapsed_ns(start) / stream.size();
+
+    wire_message message;
+    start = chrono::steady_clock::now();
+    for (const string &text : wire) {
+        if (parse_text(text, message)) {
+            r.checksum += message.user.size() + message.group.size() + message.text.size() + message.seq;
+        }
+    }
+    r.decode_ns = elapsed_ns(start) / stream.size();
+    for (const string &text : wire) {
+        r.bytes += text.size();
+    }
+    return r;
+}
+
+result bench_binary(const vector<wire_message> &stream, int batch) {
+    result r{0, 0, 0, 0};
+    name_table server_names;          // The server's table
+    unordered_set<uint64_t> known;    // Names defined on this connection
+    string wire, body, message;
+    vector<pair<uint64_t, const string *>> used;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < stream.size(); i++) {
+        used.clear();
+        message.clear();
+        encode_message(message, stream[i], [&](const string &name) {
+            uint64_t id = server_names.intern(name);
+            used.emplace_back(id, &name);
+            return id;
+        });
+        for (const auto &[id, name] : used) {
+            if (known.insert(id).second) encode_name(body, id, *name);
+        }
+        body += message;
+        if ((int)((i + 1) % batch) == 0 || i + 1 == stream.size()) {
+            put_frame(wire, body);
+            body.clear();
+        }
+    }
+    r.encode_ns = elapsed_ns(start) / stream.size();
+    r.bytes = wire.size();
+
+    name_table client_names;
+    wire_decoder decoder;
+    wire_message decoded;
+    start = chrono::steady_clock::now();
+    decoder.feed(wire.data(), wire.size());
+    while (decoder.next(body) == FRAME_READY) {
+        wire_reader in(body);
+        while (!in.empty() && decode_message(in, client_names, decoded)) {
+            if (decoded.op != OP_NAME) {
+                r.checksum += decoded.user.size() + decoded.group.size() + decoded.text.size() + decoded.seq;
+            }
+        }
+    }
+    r.decode_ns = elapsed_ns(start) / stream.size();
+    return r;
+}
+
+void report(const string &name, const result &r, size_t messages) {
+    cout << name << (double)r.bytes / messages << " bytes/msg, encode " << r.encode_ns
+         << " ns/msg, decode " << r.decode_ns << " ns/msg\n";
+}
+
+int main(int argc, char *argv[]) {
+    int messages = argc > 1 ? stoi(argv[1]) : DEFAULT_MESSAGES;
+    if (messages <= 0) {
+        cout << "[USE]: " << argv[0] << " [messages]\n";
+        return 1;
+    }
+    vector<wire_message> stream = make_stream(messages);
+
+    result text = bench_text(stream);
+    result single = bench_binary(stream, 1);
+    result batched = bench_binary(stream, BATCH);
+
+    cout << "Messages: " << messages << " (" << USERS << " users, " << GROUPS << " groups)\n";
+    report("Text:                 ", text, messages);
+    report("Binary, 1 per frame:  ", single, messages);
+    report("Binary, " + to_string(BATCH) + " per frame: ", batched, messages);
+    cout << "Bytes saved (batched): " << 100.0 * (1 - (double)batched.bytes / text.bytes) << "%\n";
+    bool agree = text.checksum == single.checksum && text.checksum == batched.checksum;
+    cout << "Decoded fields agree:  " << (agree ? "yes" : "NO") << "\n";
+    return agree ? 0 : 1;
+}
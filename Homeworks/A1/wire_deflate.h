@@ -0,0 +1,195 @@
+// Per-message compression for the binary wire protocol (see wire_protocol.h).
+//
+// A client that also wants compression starts its username with
+// BINARY_HELLO_DEFLATE instead of BINARY_HELLO. The server may then send a
+// large message as
+//   OP_COMPRESSED  raw size, zlib stream of the encoded message
+// Each message is compressed on its own, against a preset dictionary shared
+// by both sides, so the server compresses a message once and sends the same
+// bytes to every recipient that asked for compression. The dictionary also
+// makes short messages, which have no history of their own, compress well.
+// zlib records the dictionary's Adler-32 in the stream, so a client with a
+// different dictionary fails cleanly instead of decoding garbage.
+//
+// Needs -lz.
+
+#ifndef WIRE_DEFLATE_H
+#define WIRE_DEFLATE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_map>
+#include <zlib.h>
+#include "wire_protocol.h"
+
+#define BINARY_HELLO_DEFLATE "\x7f" "BIN1Z " // Binary protocol with compression
+#define COMPRESS_LEVEL 6
+#define MAX_DICTIONARY_SIZE 32768           // deflate cannot look back further
+
+// Built-in dictionary: common words and phrases of a chat. deflate prefers
+// near matches, so the most frequent strings come last. Replace it with one
+// trained on real traffic (train_dictionary) through --dictionary.
+inline const std::string &default_dictionary() {
+    static const std::string dictionary =
+        "according actually address afternoon agenda already although another anyone anything "
+        "around available because before believe between branch change channel check client "
+        "comment commit config could create current database deadline deploy different document "
+        "during either error everyone example failed feature files follow further getting "
+        "group happen having issue latest little machine maybe meeting merge message minute "
+        "morning needed network nothing number people please possible problem process project "
+        "question quite really release request result review right running schedule second "
+        "server should since something still system thanks thing think though through today "
+        "tomorrow update using version waiting week where which while without working would "
+        "yesterday https://github.com/ http://www. .com/ .html .cpp .txt "
+        "I think we should Can you please Does anyone know Let me know if as soon as possible "
+        "in the meeting on the server the test is failing the build is green "
+        "for the next release I will take a look Thank you! ";
+    return dictionary;
+}
+
+// Build a dictionary from sample messages: the substrings (words and word
+// pairs) that save the most bytes, ordered so the most valuable end up last.
+inline std::string train_dictionary(const std::vector<std::string> &samples, size_t max_size = MAX_DICTIONARY_SIZE) {
+    std::unordered_map<std::string, size_t> counts;
+    for (const std::string &sample : samples) {
+        std::vector<std::string> words;
+        std::istringstream in(sample);
+        std::string word;
+        while (in >> word) {
+            words.push_back(word);
+        }
+        for (size_t i = 0; i < words.size(); i++) {
+            counts[words[i] + " "]++;
+            if (i + 1 < words.size()) counts[words[i] + " " + words[i + 1] + " "]++;
+        }
+    }
+    std::vector<std::pair<size_t, std::string>> ranked;
+    for (const auto &[text, count] : counts) {
+        // A match shorter than 3 bytes is not worth a back-reference.
+        if (count > 1 && text.size() > 3) ranked.emplace_back(count * (text.size() - 3), text);
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    std::vector<const std::string *> chosen;
+    size_t size = 0;
+    for (const auto &[score, text] : ranked) {
+        if (size + text.size() > max_size) continue;
+        chosen.push_back(&text);
+        size += text.size();
+    }
+    std::string dictionary;
+    for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) {
+        dictionary += **it;
+    }
+    return dictionary;
+}
+
+// Read a dictionary file, or return false. Only the last MAX_DICTIONARY_SIZE
+// bytes can ever be used.
+inline bool load_dictionary(const std::string &path, std::string &dictionary) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    dictionary = contents.str();
+    if (dictionary.size() > MAX_DICTIONARY_SIZE) {
+        dictionary.erase(0, dictionary.size() - MAX_DICTIONARY_SIZE);
+    }
+    return true;
+}
+
+// Compresses messages one at a time. Keeps its zlib state between messages
+// to avoid reallocating it; not thread-safe, use one per thread.
+class message_compressor {
+public:
+    explicit message_compressor(const std::string &dictionary) : dictionary(dictionary) {
+        stream = z_stream{};
+        ready = deflateInit(&stream, COMPRESS_LEVEL) == Z_OK;
+    }
+    ~message_compressor() {
+        if (ready) deflateEnd(&stream);
+    }
+    message_compressor(const message_compressor &) = delete;
+    message_compressor &operator=(const message_compressor &) = delete;
+
+    // Append OP_COMPRESSED carrying message to out. Returns false, leaving out
+    // as it was, if that would not be smaller than the message itself.
+    bool compress(const std::string &message, std::string &out) {
+        if (!ready || deflateReset(&stream) != Z_OK ||
+            (!dictionary.empty() &&
+             deflateSetDictionary(&stream, (const Bytef *)dictionary.data(), dictionary.size()) != Z_OK)) {
+            return false;
+        }
+        size_t start = out.size();
+        out += (char)OP_COMPRESSED;
+        put_varint(out, message.size());
+        size_t bound = deflateBound(&stream, message.size());
+        std::string packed(bound, '\0');
+        stream.next_in = (Bytef *)message.data();
+        stream.avail_in = message.size();
+        stream.next_out = (Bytef *)packed.data();
+        stream.avail_out = packed.size();
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            out.resize(start);
+            return false;
+        }
+        packed.resize(stream.total_out);
+        put_bytes(out, packed);
+        if (out.size() - start >= message.size()) {
+            out.resize(start);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string dictionary;
+    z_stream stream;
+    bool ready;
+};
+
+// Decompresses the payload of an OP_COMPRESSED message (as decoded into
+// wire_message::text, with the raw size in seq) into out.
+class message_inflater {
+public:
+    explicit message_inflater(const std::string &dictionary) : dictionary(dictionary) {
+        stream = z_stream{};
+        ready = inflateInit(&stream) == Z_OK;
+    }
+    ~message_inflater() {
+        if (ready) inflateEnd(&stream);
+    }
+    message_inflater(const message_inflater &) = delete;
+    message_inflater &operator=(const message_inflater &) = delete;
+
+    bool inflate_message(const std::string &packed, uint64_t raw_size, std::string &out) {
+        if (!ready || raw_size > MAX_WIRE_FRAME || inflateReset(&stream) != Z_OK) {
+            return false;
+        }
+        out.assign(raw_size, '\0');
+        stream.next_in = (Bytef *)packed.data();
+        stream.avail_in = packed.size();
+        stream.next_out = (Bytef *)out.data();
+        stream.avail_out = out.size();
+        int status = inflate(&stream, Z_FINISH);
+        if (status == Z_NEED_DICT && !dictionary.empty()) {
+            // Fails if the server used a different dictionary
+            if (inflateSetDictionary(&stream, (const Bytef *)dictionary.data(), dictionary.size()) != Z_OK) {
+                return false;
+            }
+            status = inflate(&stream, Z_FINISH);
+        }
+        return status == Z_STREAM_END && stream.total_out == raw_size;
+    }
+
+private:
+    std::string dictionary;
+    z_stream stream;
+    bool ready;
+};
+
+#endif
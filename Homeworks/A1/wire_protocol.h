@@ -0,0 +1,459 @@
+// Compact binary wire protocol, an opt-in alternative to the text protocol.
+//
+// A client opts in by answering the username prompt with BINARY_HELLO followed
+// by the username. From then on both directions exchange frames: a varint
+// length followed by one or more messages, each an opcode byte and its fields.
+// Integers are varints, strings are a varint length and the bytes. The server
+// puts every message that queued up behind a slow socket into one frame.
+//
+// Names of users, groups and topics are interned. The server numbers every
+// name it sends and defines the number with OP_NAME the first time a
+// connection sees it, so later messages carry the number instead of the name.
+// Requests name their target inline (id 0 followed by the name) or by such a
+// number.
+//
+// wire_message::to_text() renders a message exactly as the text protocol
+// sends it. Shared by the server, the client, the load generator and
+// wire_bench.
+
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define BINARY_HELLO "\x7f" "BIN1 " // Prefix of the username that selects the binary protocol
+#define MAX_WIRE_FRAME (1 << 20)    // Larger frames are treated as a broken stream
+
+enum wire_op : uint8_t {
+    // Server -> client
+    OP_NOTICE = 1,    // text: any other server reply
+    OP_NAME,          // id, name: defines an interned name
+    OP_WELCOME,       // login succeeded
+    OP_AUTH_FAILED,   // login failed, the server closes the connection
+    OP_ACTIVE_USERS,  // count, user...
+    OP_BROADCAST,     // user, text
+    OP_PRIVATE,       // user, text
+    OP_GROUP_MSG,     // group, seq, user, text
+    OP_TOPIC_MSG,     // topic, user, text
+    OP_CHAT_JOINED,   // user
+    OP_CHAT_LEFT,     // user
+    OP_GROUP_CREATED, // user, group
+    OP_GROUP_JOINED,  // user, group
+    OP_GROUP_LEFT,    // user, group
+    OP_PONG,          // answer to REQ_PING
+    OP_COMPRESSED,    // raw size, zlib stream of one encoded message (wire_deflate.h)
+    OP_UDP_TOKEN,     // token: proves the client's UDP address (udp_delivery.h)
+
+    // Client -> server
+    REQ_PASSWORD = 64, // text
+    REQ_BROADCAST,     // text
+    REQ_PRIVATE,       // user, text
+    REQ_CREATE_GROUP,  // group
+    REQ_JOIN_GROUP,    // group
+    REQ_GROUP_MSG,     // group, text
+    REQ_LEAVE_GROUP,   // group
+    REQ_SUBSCRIBE,     // pattern
+    REQ_UNSUBSCRIBE,   // pattern
+    REQ_PUBLISH,       // topic, text
+    REQ_PING,
+    REQ_UDP            // ask for UDP delivery; answered with OP_UDP_TOKEN
+};
+
+inline void put_varint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+inline void put_bytes(std::string &out, const std::string &value) {
+    put_varint(out, value.size());
+    out += value;
+}
+
+inline void put_frame(std::string &out, const std::string &body) {
+    put_varint(out, body.size());
+    out += body;
+}
+
+// Reads fields from a frame body. ok turns false on a truncated field.
+struct wire_reader {
+    const char *pos;
+    const char *end;
+    bool ok = true;
+
+    wire_reader() : pos(nullptr), end(nullptr) {}
+    explicit wire_reader(const std::string &data) : pos(data.data()), end(data.data() + data.size()) {}
+
+    bool empty() const { return pos == end; }
+
+    uint8_t byte() {
+        if (pos == end) {
+            ok = false;
+            return 0;
+        }
+        return (uint8_t)*pos++;
+    }
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = byte();
+            if (!ok) return 0;
+            value |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+    std::string bytes() {
+        uint64_t size = varint();
+        if (!ok || size > (uint64_t)(end - pos)) {
+            ok = false;
+            return "";
+        }
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+};
+
+enum frame_status { FRAME_READY, FRAME_INCOMPLETE, FRAME_BAD };
+
+// Splits a received byte stream into frames.
+struct wire_decoder {
+    std::string data;
+    size_t pos = 0; // Start of the first frame not yet returned
+
+    void feed(const char *bytes, size_t size) {
+        if (pos == data.size()) {
+            data.clear();
+            pos = 0;
+        } else if (pos > 65536) {
+            data.erase(0, pos);
+            pos = 0;
+        }
+        data.append(bytes, size);
+    }
+
+    // Bytes received but not yet returned as a frame.
+    std::string pending() const { return data.substr(pos); }
+
+    frame_status next(std::string &body) {
+        uint64_t size = 0;
+        size_t p = pos;
+        for (int shift = 0;; shift += 7) {
+            if (p == data.size()) return FRAME_INCOMPLETE;
+            if (shift > 28) return FRAME_BAD;
+            uint8_t b = data[p++];
+            size |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) break;
+        }
+        if (size > MAX_WIRE_FRAME) return FRAME_BAD;
+        if (data.size() - p < size) return FRAME_INCOMPLETE;
+        body.assign(data, p, size);
+        pos = p + size;
+        return FRAME_READY;
+    }
+};
+
+// Interned names. The server assigns ids with intern(); clients learn them
+// from OP_NAME. Ids start at 1, 0 means "no id".
+struct name_table {
+    std::unordered_map<std::string, uint64_t> ids;
+    std::unordered_map<uint64_t, std::string> names;
+
+    uint64_t intern(const std::string &name) {
+        auto [it, added] = ids.try_emplace(name, ids.size() + 1);
+        if (added) names[it->second] = name;
+        return it->second;
+    }
+    void define(uint64_t id, const std::string &name) {
+        ids[name] = id;
+        names[id] = name;
+    }
+    uint64_t id_of(const std::string &name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? 0 : it->second;
+    }
+    const std::string *name_of(uint64_t id) const {
+        auto it = names.find(id);
+        return it == names.end() ? nullptr : &it->second;
+    }
+};
+
+// A message from the server. Plain notices convert implicitly from strings.
+struct wire_message {
+    uint8_t op = OP_NOTICE;
+    std::string user;
+    std::string group; // Group or topic
+    std::string text;
+    uint64_t seq = 0;
+    std::vector<std::string> users; // OP_ACTIVE_USERS
+
+    wire_message() {}
+    wire_message(const std::string &notice) : text(notice) {}
+    wire_message(const char *notice) : text(notice) {}
+    explicit wire_message(wire_op op, std::string user = "", std::string group = "", std::string text = "", uint64_t seq = 0)
+        : op(op), user(std::move(user)), group(std::move(group)), text(std::move(text)), seq(seq) {}
+
+    std::string to_text() const {
+        switch (op) {
+        case OP_WELCOME: return "Welcome to the chat server!\n";
+        case OP_AUTH_FAILED: return "Authentication failed.";
+        case OP_ACTIVE_USERS: {
+            if (users.empty()) return "No other users are currently active.";
+            std::string list;
+            for (const std::string &name : users) {
+                list += (list.empty() ? "" : ", ") + name;
+            }
+            return "Active users: " + list;
+        }
+        case OP_BROADCAST: return user + ": " + text;
+        case OP_PRIVATE: return "[Private] " + user + ": " + text;
+        case OP_GROUP_MSG: return "[Group " + group + " #" + std::to_string(seq) + "] " + user + ": " + text;
+        case OP_TOPIC_MSG: return "[Topic " + group + "] " + user + ": " + text;
+        case OP_CHAT_JOINED: return user + " has joined the chat.";
+        case OP_CHAT_LEFT: return user + " has left the chat.";
+        case OP_GROUP_CREATED: return user + " created the group " + group + ".";
+        case OP_GROUP_JOINED: return user + " joined the group " + group + ".";
+        case OP_GROUP_LEFT: return user + " left the group " + group + ".";
+        case OP_PONG: return "Pong.";
+        case OP_UDP_TOKEN: return "UDP token " + std::to_string(seq) + ".";
+        default: return text;
+        }
+    }
+};
+
+inline void encode_name(std::string &out, uint64_t id, const std::string &name) {
+    out += (char)OP_NAME;
+    put_varint(out, id);
+    put_bytes(out, name);
+}
+
+// Append a message. id_of(name) returns the interned id of a name; the caller
+// makes sure the recipient has seen its OP_NAME first.
+template <class intern>
+void encode_message(std::string &out, const wire_message &message, intern &&id_of) {
+    out += (char)message.op;
+    switch (message.op) {
+    case OP_NOTICE:
+        put_bytes(out, message.text);
+        break;
+    case OP_ACTIVE_USERS:
+        put_varint(out, message.users.size());
+        for (const std::string &name : message.users) {
+            put_varint(out, id_of(name));
+        }
+        break;
+    case OP_BROADCAST:
+    case OP_PRIVATE:
+        put_varint(out, id_of(message.user));
+        put_bytes(out, message.text);
+        break;
+    case OP_GROUP_MSG:
+        put_varint(out, id_of(message.group));
+        put_varint(out, message.seq);
+        put_varint(out, id_of(message.user));
+        put_bytes(out, message.text);
+        break;
+    case OP_TOPIC_MSG:
+        put_varint(out, id_of(message.group));
+        put_varint(out, id_of(message.user));
+        put_bytes(out, message.text);
+        break;
+    case OP_CHAT_JOINED:
+    case OP_CHAT_LEFT:
+        put_varint(out, id_of(message.user));
+        break;
+    case OP_UDP_TOKEN:
+        put_varint(out, message.seq);
+        break;
+    case OP_GROUP_CREATED:
+    case OP_GROUP_JOINED:
+    case OP_GROUP_LEFT:
+        put_varint(out, id_of(message.user));
+        put_varint(out, id_of(message.group));
+        break;
+    default:
+        break;
+    }
+}
+
+// Decode the next message of a frame. OP_NAME definitions are added to names
+// and returned like any other message. Returns false on malformed input.
+inline bool decode_message(wire_reader &in, name_table &names, wire_message &message) {
+    auto name = [&in, &names]() {
+        const std::string *found = names.name_of(in.varint());
+        if (found == nullptr) {
+            in.ok = false;
+            return std::string();
+        }
+        return *found;
+    };
+
+    message = wire_message();
+    message.op = in.byte();
+    switch (message.op) {
+    case OP_NOTICE:
+        message.text = in.bytes();
+        break;
+    case OP_NAME: {
+        uint64_t id = in.varint();
+        message.user = in.bytes();
+        if (in.ok && id != 0) names.define(id, message.user);
+        break;
+    }
+    case OP_WELCOME:
+    case OP_AUTH_FAILED:
+    case OP_PONG:
+        break;
+    case OP_COMPRESSED:
+        message.seq = in.varint(); // Size once inflated
+        message.text = in.bytes();
+        break;
+    case OP_ACTIVE_USERS: {
+        uint64_t count = in.varint();
+        for (uint64_t i = 0; i < count && in.ok; i++) {
+            message.users.push_back(name());
+        }
+        break;
+    }
+    case OP_BROADCAST:
+    case OP_PRIVATE:
+        message.user = name();
+        message.text = in.bytes();
+        break;
+    case OP_GROUP_MSG:
+        message.group = name();
+        message.seq = in.varint();
+        message.user = name();
+        message.text = in.bytes();
+        break;
+    case OP_TOPIC_MSG:
+        message.group = name();
+        message.user = name();
+        message.text = in.bytes();
+        break;
+    case OP_CHAT_JOINED:
+    case OP_CHAT_LEFT:
+        message.user = name();
+        break;
+    case OP_UDP_TOKEN:
+        message.seq = in.varint();
+        break;
+    case OP_GROUP_CREATED:
+    case OP_GROUP_JOINED:
+    case OP_GROUP_LEFT:
+        message.user = name();
+        message.group = name();
+        break;
+    default:
+        return false;
+    }
+    return in.ok && (message.op != OP_NAME || !message.user.empty());
+}
+
+// A request from a client, in either protocol.
+struct chat_command {
+    uint8_t op = 0;
+    std::string target; // User, group, topic or pattern
+    std::string text;
+};
+
+inline bool command_has_target(uint8_t op) {
+    return op == REQ_PRIVATE || op == REQ_CREATE_GROUP || op == REQ_JOIN_GROUP || op == REQ_GROUP_MSG ||
+           op == REQ_LEAVE_GROUP || op == REQ_SUBSCRIBE || op == REQ_UNSUBSCRIBE || op == REQ_PUBLISH;
+}
+
+inline bool command_has_text(uint8_t op) {
+    return op == REQ_PASSWORD || op == REQ_BROADCAST || op == REQ_PRIVATE || op == REQ_GROUP_MSG || op == REQ_PUBLISH;
+}
+
+enum command_parse {
+    COMMAND_OK,
+    COMMAND_IGNORED, // Target without a message: the server drops it silently
+    COMMAND_INVALID  // The server answers "Invalid command."
+};
+
+// Split a text-protocol command line such as "/group_msg <group> <message>".
+inline command_parse parse_command(const std::string &line, chat_command &command) {
+    static const struct {
+        const char *prefix;
+        uint8_t op;
+    } commands[] = {
+        {"/broadcast ", REQ_BROADCAST},       {"/msg ", REQ_PRIVATE},
+        {"/create_group ", REQ_CREATE_GROUP}, {"/join_group ", REQ_JOIN_GROUP},
+        {"/group_msg ", REQ_GROUP_MSG},       {"/leave_group ", REQ_LEAVE_GROUP},
+        {"/subscribe ", REQ_SUBSCRIBE},       {"/unsubscribe ", REQ_UNSUBSCRIBE},
+        {"/publish ", REQ_PUBLISH},
+    };
+    if (line == "/udp") {
+        command = chat_command{REQ_UDP, "", ""};
+        return COMMAND_OK;
+    }
+    for (const auto &c : commands) {
+        if (line.rfind(c.prefix, 0) != 0) continue;
+        size_t start = strlen(c.prefix);
+        command.op = c.op;
+        command.target.clear();
+        command.text.clear();
+        if (command_has_target(c.op) && command_has_text(c.op)) {
+            size_t space_pos = line.find(' ', start);
+            if (space_pos == std::string::npos) return COMMAND_IGNORED;
+            command.target = line.substr(start, space_pos - start);
+            command.text = line.substr(space_pos + 1);
+        } else if (command_has_target(c.op)) {
+            command.target = line.substr(start);
+        } else {
+            command.text = line.substr(start);
+        }
+        return COMMAND_OK;
+    }
+    return COMMAND_INVALID;
+}
+
+// Append a request. id_of(name) returns the id the server gave the name, or 0
+// to send it inline.
+template <class lookup>
+void encode_command(std::string &out, const chat_command &command, lookup &&id_of) {
+    out += (char)command.op;
+    if (command_has_target(command.op)) {
+        uint64_t id = id_of(command.target);
+        put_varint(out, id);
+        if (id == 0) put_bytes(out, command.target);
+    }
+    if (command_has_text(command.op)) {
+        put_bytes(out, command.text);
+    }
+}
+
+// Decode the next request of a frame. resolve(id, name) looks up an interned
+// name. Returns false on malformed input or an unknown request.
+template <class resolve>
+bool decode_command(wire_reader &in, chat_command &command, resolve &&name_of) {
+    command.op = in.byte();
+    command.target.clear();
+    command.text.clear();
+    if (!in.ok || command.op < REQ_PASSWORD || command.op > REQ_UDP) {
+        return false;
+    }
+    if (command_has_target(command.op)) {
+        uint64_t id = in.varint();
+        if (id == 0) {
+            command.target = in.bytes();
+        } else if (in.ok && !name_of(id, command.target)) {
+            return false;
+        }
+    }
+    if (command_has_text(command.op)) {
+        command.text = in.bytes();
+    }
+    return in.ok;
+}
+
+#endif
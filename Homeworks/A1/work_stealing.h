@@ -0,0 +1,276 @@
+// Work-stealing thread pool.
+//
+// Each worker owns a Chase-Lev deque: it pushes and takes tasks at the bottom
+// without contention, while idle workers steal the oldest task from the top
+// of someone else's deque with a single compare-and-swap. Tasks submitted from
+// outside the pool go through a bounded MPSC ring per worker (mpsc_ring.h),
+// spread round-robin, and the worker moves them into its deque.
+//
+// Idle workers sleep on a futex (std::atomic::wait) of their own. A task in a
+// worker's inbox wakes that worker; a task pushed on a deque wakes one sleeper
+// to steal it. Nobody is woken while all are busy, so a busy pool makes no
+// system calls.
+//
+// The deque follows Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (PPoPP 2013), with sequentially
+// consistent accesses in place of its fences, which ThreadSanitizer cannot
+// follow. When it grows, the old array is kept until the deque is destroyed,
+// as a thief may still be reading it.
+
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <functional>
+#include "mpsc_ring.h"
+
+#define DEQUE_INITIAL_SIZE 256
+#define EXECUTOR_INBOX_SIZE 4096 // Tasks from outside the pool, per worker
+#define STEAL_ATTEMPTS 2         // Rounds over all victims before sleeping
+
+// Deque of pointers. push() and take() are for the owner thread only; any
+// thread may steal().
+template <class T>
+class chase_lev_deque {
+public:
+    chase_lev_deque() { array.store(new ring_array(DEQUE_INITIAL_SIZE), std::memory_order_relaxed); }
+    ~chase_lev_deque() {
+        delete array.load(std::memory_order_relaxed);
+        for (ring_array *old : retired) delete old;
+    }
+    chase_lev_deque(const chase_lev_deque &) = delete;
+    chase_lev_deque &operator=(const chase_lev_deque &) = delete;
+
+    void push(T *item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        ring_array *a = array.load(std::memory_order_relaxed);
+        if (b - t > (int64_t)a->size - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, item);
+        bottom.store(b + 1, std::memory_order_seq_cst);
+    }
+
+    // Newest item, or nullptr.
+    T *take() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        ring_array *a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_seq_cst);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T *item = a->get(b);
+        if (t == b) {
+            // Last item: race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Oldest item, or nullptr if there is none or another thread won it.
+    T *steal() {
+        int64_t t = top.load(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_seq_cst);
+        if (t >= b) {
+            return nullptr;
+        }
+        ring_array *a = array.load(std::memory_order_acquire);
+        T *item = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool empty() const {
+        return top.load(std::memory_order_seq_cst) >= bottom.load(std::memory_order_seq_cst);
+    }
+
+private:
+    struct ring_array {
+        size_t size;
+        std::unique_ptr<std::atomic<T *>[]> items;
+
+        explicit ring_array(size_t size) : size(size), items(new std::atomic<T *>[size]) {}
+        T *get(int64_t i) const { return items[i & (size - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T *item) { items[i & (size - 1)].store(item, std::memory_order_relaxed); }
+    };
+
+    ring_array *grow(ring_array *a, int64_t t, int64_t b) {
+        ring_array *bigger = new ring_array(a->size * 2);
+        for (int64_t i = t; i < b; i++) {
+            bigger->put(i, a->get(i));
+        }
+        retired.push_back(a);
+        array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) std::atomic<int64_t> top = 0;
+    alignas(64) std::atomic<int64_t> bottom = 0;
+    std::atomic<ring_array *> array;
+    std::vector<ring_array *> retired; // Owner only
+};
+
+class work_stealing_executor {
+public:
+    typedef std::function<void()> task;
+
+    // on_start(i), if given, runs first on worker i's thread (to pin it, say).
+    explicit work_stealing_executor(unsigned threads, std::function<void(size_t)> on_start = nullptr)
+        : on_start(std::move(on_start)) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; i++) {
+            workers.push_back(std::make_unique<worker>());
+        }
+        for (unsigned i = 0; i < threads; i++) {
+            workers[i]->thread = std::thread(&work_stealing_executor::run, this, i);
+        }
+    }
+    ~work_stealing_executor() {
+        stopping = true;
+        for (size_t i = 0; i < workers.size(); i++) {
+            wake(i);
+        }
+        for (auto &w : workers) {
+            w->thread.join();
+        }
+        for (auto &w : workers) {
+            while (task *t = w->deque.take()) delete t;
+            task *t;
+            while (w->inbox.pop(t)) delete t;
+        }
+    }
+    work_stealing_executor(const work_stealing_executor &) = delete;
+    work_stealing_executor &operator=(const work_stealing_executor &) = delete;
+
+    // Run fn on some worker. From a worker thread it goes to that worker's
+    // own deque, where it runs next unless it is stolen first.
+    void submit(task fn) { submit_near(std::move(fn), next_inbox.fetch_add(1, std::memory_order_relaxed)); }
+
+    // The same, but from outside the pool it goes to worker preferred
+    // (modulo the pool size) unless that worker's inbox is full.
+    void submit_near(task fn, size_t preferred) {
+        task *t = new task(std::move(fn));
+        if (current == this) {
+            workers[current_index]->deque.push(t);
+            if (sleepers.load(std::memory_order_seq_cst) > 0) {
+                // Let a sleeping worker steal it
+                for (size_t i = 0; i < workers.size(); i++) {
+                    if (workers[i]->sleeping.load(std::memory_order_seq_cst)) {
+                        wake(i);
+                        break;
+                    }
+                }
+            }
+            return;
+        }
+        size_t n = workers.size();
+        size_t i = preferred;
+        for (size_t tries = 1; !workers[i % n]->inbox.push(std::move(t)); tries++, i++) {
+            if (tries % n == 0) std::this_thread::yield(); // Every inbox is full
+        }
+        wake(i % n);
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Tasks run so far, and how many of them were stolen.
+    uint64_t executed() const { return executed_count.load(std::memory_order_relaxed); }
+    uint64_t stolen() const { return stolen_count.load(std::memory_order_relaxed); }
+
+private:
+    struct worker {
+        chase_lev_deque<task> deque;
+        mpsc_ring<task *> inbox{EXECUTOR_INBOX_SIZE};
+        std::atomic<uint32_t> wake_seq = 0; // Bumped to wake the worker
+        std::atomic<bool> sleeping = false;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::function<void(size_t)> on_start;
+    std::atomic<bool> stopping = false;
+    std::atomic<size_t> next_inbox = 0;
+    std::atomic<int> sleepers = 0;
+    std::atomic<uint64_t> executed_count = 0, stolen_count = 0;
+
+    static inline thread_local work_stealing_executor *current = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    void wake(size_t i) {
+        worker &w = *workers[i];
+        w.wake_seq.fetch_add(1, std::memory_order_seq_cst);
+        if (w.sleeping.load(std::memory_order_seq_cst)) {
+            w.wake_seq.notify_one();
+        }
+    }
+
+    task *find_task(size_t self) {
+        worker &me = *workers[self];
+        task *t;
+        while (me.inbox.pop(t)) {
+            me.deque.push(t);
+        }
+        if ((t = me.deque.take()) != nullptr) {
+            return t;
+        }
+        size_t n = workers.size();
+        for (int round = 0; round < STEAL_ATTEMPTS; round++) {
+            for (size_t i = 1; i < n; i++) {
+                if ((t = workers[(self + i) % n]->deque.steal()) != nullptr) {
+                    stolen_count.fetch_add(1, std::memory_order_relaxed);
+                    return t;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Nothing visible anywhere, as seen after announcing that we sleep.
+    bool idle(size_t self) const {
+        if (!workers[self]->inbox.empty()) return false;
+        for (const auto &w : workers) {
+            if (!w->deque.empty()) return false;
+        }
+        return true;
+    }
+
+    void run(size_t self) {
+        current = this;
+        current_index = self;
+        if (on_start) on_start(self);
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (task *t = find_task(self)) {
+                (*t)();
+                delete t;
+                executed_count.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            // Announce first, then look again: a submit() that our last look
+            // missed either sees us sleeping and wakes us, or comes before
+            // the look below, which then finds its task.
+            worker &me = *workers[self];
+            me.sleeping.store(true, std::memory_order_seq_cst);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            uint32_t seen = me.wake_seq.load(std::memory_order_seq_cst);
+            if (idle(self) && !stopping.load(std::memory_order_seq_cst)) {
+                me.wake_seq.wait(seen, std::memory_order_seq_cst);
+            }
+            sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            me.sleeping.store(false, std::memory_order_seq_cst);
+        }
+    }
+};
+
+#endif
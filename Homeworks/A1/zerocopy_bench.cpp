@@ -0,0 +1,222 @@
+// Benchmark: sender CPU per delivered GB for a large fan-out (send_queue.h)
+//
+// One thread sends every payload to RECIPIENTS TCP connections, as the server
+// does for a broadcast, through a send_queue per connection:
+//  - copy:     each queue gets its own copy of the payload (the old path)
+//  - shared:   queues hold a reference to one payload, sent with sendmsg
+//  - zerocopy: the same, sent with MSG_ZEROCOPY and released on completion
+// and reports its own CPU time per GB delivered, the throughput and how many
+// queued pieces went out per sendmsg.
+//
+// By default the receivers are a thread in this process, over loopback. The
+// kernel copies zero-copy data bound for a local socket anyway, so zero-copy
+// only shows its benefit against a sink on another machine:
+//   other host:  ./zerocopy_bench --sink 9000
+//   this host:   ./zerocopy_bench --host <other host> 9000
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include "send_queue.h"
+
+#define RECIPIENTS 32
+#define DEFAULT_MEGABYTES 512      // Delivered per size and mode
+#define MAX_QUEUED (1024 * 1024)   // Per connection, before the sender waits
+#define ZEROCOPY_MIN 1             // The bench decides by mode, not by size
+
+using namespace std;
+
+atomic<uint64_t> received = 0;
+
+// Drain every connection accepted on listener until the process ends.
+void run_sink(int listener) {
+    int epoll_fd = epoll_create1(0);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listener;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+    vector<char> buffer(1 << 20);
+    epoll_event events[64];
+    while (true) {
+        int ready = epoll_wait(epoll_fd, events, 64, -1);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listener) {
+                int sock = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+                if (sock < 0) continue;
+                event.data.fd = sock;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event);
+                continue;
+            }
+            ssize_t bytes = recv(fd, buffer.data(), buffer.size(), 0);
+            if (bytes > 0) {
+                received += bytes;
+            } else if (bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(fd);
+            }
+        }
+    }
+}
+
+int listen_on(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return listener;
+}
+
+double thread_cpu_seconds() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+enum send_mode { MODE_COPY, MODE_SHARED, MODE_ZEROCOPY };
+const char *mode_names[] = {"copy", "shared", "zerocopy"};
+
+struct recipient {
+    int fd;
+    send_queue queue;
+};
+
+void run(const string &host, int port, send_mode mode, size_t size, uint64_t total_bytes) {
+    send_counters counters;
+    vector<unique_ptr<recipient>> recipients;
+    int epoll_fd = epoll_create1(0);
+    for (int i = 0; i < RECIPIENTS; i++) {
+        auto r = make_unique<recipient>();
+        r->fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+        if (connect(r->fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+        fcntl(r->fd, F_SETFL, O_NONBLOCK);
+        r->queue.counters = &counters;
+        if (mode == MODE_ZEROCOPY && !r->queue.enable_zerocopy(r->fd, ZEROCOPY_MIN)) {
+            cout << "Zero-copy not supported here." << endl;
+            exit(1);
+        }
+        epoll_event event{};
+        event.events = EPOLLOUT | EPOLLET; // EPOLLERR is always reported
+        event.data.ptr = r.get();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, r->fd, &event);
+        recipients.push_back(std::move(r));
+    }
+
+    // Wait until every queue is below limit (and, with limit 0, every
+    // zero-copy payload has been released).
+    auto wait_below = [&](size_t limit) {
+        epoll_event events[RECIPIENTS];
+        while (true) {
+            bool waiting = false;
+            for (auto &r : recipients) {
+                if (r->queue.size() > limit || (limit == 0 && r->queue.pinned_count() > 0)) waiting = true;
+            }
+            if (!waiting) return;
+            int ready = epoll_wait(epoll_fd, events, RECIPIENTS, 100);
+            for (int i = 0; i < ready; i++) {
+                recipient *r = (recipient *)events[i].data.ptr;
+                if (events[i].events & EPOLLERR) r->queue.reap_completions(r->fd);
+                r->queue.flush(r->fd);
+            }
+        }
+    };
+
+    uint64_t rounds = max<uint64_t>(1, total_bytes / (size * RECIPIENTS));
+    uint64_t start_received = received;
+    double cpu_start = thread_cpu_seconds();
+    auto wall_start = chrono::steady_clock::now();
+    for (uint64_t round = 0; round < rounds; round++) {
+        // A fresh payload each round, as each broadcast is a new message
+        auto payload = make_shared<string>(size, (char)('a' + round % 26));
+        shared_ptr<const string> shared = payload;
+        for (auto &r : recipients) {
+            if (mode == MODE_COPY) {
+                r->queue.append(*payload);
+            } else {
+                r->queue.append_shared(shared);
+            }
+            r->queue.flush(r->fd);
+        }
+        wait_below(MAX_QUEUED);
+    }
+    wait_below(0);
+    double cpu = thread_cpu_seconds() - cpu_start;
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+    double gigabytes = (double)rounds * size * RECIPIENTS / 1e9;
+
+    printf("%7zu B  %-9s %7.3f s/GB  %6.2f GB/s  %5.2f pieces/call  %s\n", size, mode_names[mode], cpu / gigabytes,
+           gigabytes / wall, (double)counters.pieces / max<uint64_t>(1, counters.calls),
+           mode == MODE_ZEROCOPY ? (to_string(counters.copied) + "/" + to_string(counters.completed) + " copied by the kernel").c_str() : "");
+    for (auto &r : recipients) {
+        close(r->fd);
+    }
+    close(epoll_fd);
+    if (host == "127.0.0.1") {
+        // All of it arrived before the next run
+        while (received - start_received < rounds * size * RECIPIENTS) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    string host = "127.0.0.1";
+    int port = 0;
+    uint64_t megabytes = DEFAULT_MEGABYTES;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--sink" && i + 1 < argc) {
+            run_sink(listen_on(atoi(argv[++i])));
+        } else if (arg == "--host" && i + 2 < argc) {
+            host = argv[++i];
+            port = atoi(argv[++i]);
+        } else if (arg == "--megabytes" && i + 1 < argc) {
+            megabytes = strtoull(argv[++i], nullptr, 10);
+        } else {
+            cout << "[USE]: " << argv[0] << " [--megabytes <per run>] [--host <ip> <port> | --sink <port>]\n";
+            return 1;
+        }
+    }
+    if (port == 0) {
+        int listener = listen_on(0);
+        sockaddr_in address{};
+        socklen_t length = sizeof(address);
+        getsockname(listener, (sockaddr *)&address, &length);
+        port = ntohs(address.sin_port);
+        thread(run_sink, listener).detach();
+    }
+
+    cout << "Fan-out to " << RECIPIENTS << " connections on " << host << ", " << megabytes
+         << " MB per run; CPU is the sending thread's\n";
+    const size_t sizes[] = {4096, 16384, 65536, 262144};
+    for (size_t size : sizes) {
+        for (send_mode mode : {MODE_COPY, MODE_SHARED, MODE_ZEROCOPY}) {
+            run(host, port, mode, size, megabytes * 1000000);
+        }
+    }
+    return 0;
+}
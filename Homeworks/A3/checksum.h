@@ -0,0 +1,143 @@
+// The Internet checksum (RFC 1071): IPv4 headers, TCP and UDP with their
+// pseudo-header, and incremental updates (RFC 1624).
+//
+// Sums are taken over 16-bit words in host byte order. The one's complement
+// sum does not depend on byte order, so a checksum computed this way is
+// stored into a header as is, without htons, and the fields being summed are
+// read straight from the packet, in network byte order.
+//
+// checksum_add() is the workhorse. It runs checksum_add_avx2 on CPUs with
+// AVX2 (checked once, at startup) and checksum_add_scalar otherwise;
+// checksum_add_reference is the plain 16-bit loop of RFC 1071, kept to test
+// and measure the others against.
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <immintrin.h>
+
+// Folds a wide sum to 16 bits, with the end-around carries.
+inline uint16_t checksum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+// RFC 1071, one 16-bit word at a time.
+inline uint64_t checksum_add_reference(const void *data, size_t size, uint64_t sum = 0) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (; size >= 2; size -= 2, bytes += 2) {
+        uint16_t word;
+        memcpy(&word, bytes, 2);
+        sum += word;
+    }
+    if (size) sum += bytes[0]; // The last byte of an odd length is the first byte of a zero-padded word
+    return checksum_fold(sum);
+}
+
+// 64 bits at a time: a word's carry out is added back in, which is what the
+// one's complement sum does anyway.
+inline uint64_t checksum_add_scalar(const void *data, size_t size, uint64_t sum = 0) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    sum = checksum_fold(sum);
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        sum += word;
+        sum += sum < word; // Carry
+    }
+    sum = checksum_fold(sum);
+    if (size & 4) {
+        uint32_t word;
+        memcpy(&word, bytes, 4);
+        sum += word;
+        bytes += 4;
+    }
+    if (size & 2) {
+        uint16_t word;
+        memcpy(&word, bytes, 2);
+        sum += word;
+        bytes += 2;
+    }
+    if (size & 1) sum += bytes[0];
+    return checksum_fold(sum);
+}
+
+// 32 bytes at a time: the 16-bit words are summed in 32-bit lanes, two per
+// lane per iteration, which cannot overflow in 2^15 iterations; the lanes
+// are added into the 64-bit sum after at most that many.
+__attribute__((target("avx2"))) inline uint64_t checksum_add_avx2(const void *data, size_t size, uint64_t sum = 0) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    const __m256i low_words = _mm256_set1_epi32(0xffff);
+    while (size >= 32) {
+        __m256i lanes = _mm256_setzero_si256();
+        size_t vectors = size / 32;
+        if (vectors > 32767) vectors = 32767;
+        for (size_t i = 0; i < vectors; i++, bytes += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)bytes);
+            lanes = _mm256_add_epi32(lanes, _mm256_and_si256(v, low_words));
+            lanes = _mm256_add_epi32(lanes, _mm256_srli_epi32(v, 16));
+        }
+        size -= vectors * 32;
+        alignas(32) uint32_t parts[8];
+        _mm256_store_si256((__m256i *)parts, lanes);
+        for (uint32_t part : parts) sum += part;
+    }
+    return checksum_add_scalar(bytes, size, sum);
+}
+
+inline uint64_t (*pick_checksum_add())(const void *, size_t, uint64_t) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return checksum_add_avx2;
+    return checksum_add_scalar;
+}
+
+inline uint64_t (*const checksum_add_best)(const void *, size_t, uint64_t) = pick_checksum_add();
+
+// Adds size bytes of data to a running sum; the result is already folded to
+// 16 bits, so sums can be chained.
+inline uint64_t checksum_add(const void *data, size_t size, uint64_t sum = 0) {
+    if (size < 64) return checksum_add_scalar(data, size, sum); // Not worth the call through the pointer
+    return checksum_add_best(data, size, sum);
+}
+
+// The checksum of data, ready to store (e.g. an IPv4 header with its
+// checksum field zeroed).
+inline uint16_t internet_checksum(const void *data, size_t size) {
+    return ~checksum_fold(checksum_add(data, size));
+}
+
+// The TCP or UDP checksum of an IPv4 segment (header, with its checksum
+// field zeroed, and payload), including the pseudo-header. Addresses are in
+// network byte order, as in the IP header.
+inline uint16_t transport_checksum(uint32_t source, uint32_t destination, uint8_t protocol, const void *segment,
+                                   size_t size) {
+    uint64_t sum = (uint64_t)source + destination;
+    sum += __builtin_bswap16(protocol);         // Zero byte, then the protocol
+    sum += __builtin_bswap16((uint16_t)size);   // The segment length, in network byte order
+    return ~checksum_fold(checksum_add(segment, size, checksum_fold(sum)));
+}
+
+// RFC 1624, equation 3: the checksum after a 16-bit field changes from old
+// to updated, HC' = ~(~HC + ~m + m'). All three as they are stored.
+inline uint16_t checksum_update16(uint16_t check, uint16_t old, uint16_t updated) {
+    uint64_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old;
+    sum += updated;
+    return ~checksum_fold(sum);
+}
+
+// The same for a 32-bit field, such as an address or a sequence number.
+inline uint16_t checksum_update32(uint16_t check, uint32_t old, uint32_t updated) {
+    uint64_t sum = (uint16_t)~check;
+    sum += (uint16_t)~old + (uint16_t)~(old >> 16);
+    sum += (updated & 0xffff) + (updated >> 16);
+    return ~checksum_fold(sum);
+}
+
+#endif
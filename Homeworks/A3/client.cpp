@@ -0,0 +1,337 @@
+// Load generator for the handshake server: raw SYNs from many source
+// addresses and ports at a set rate, answering each SYN-ACK with the final
+// ACK, or (--flood) SYNs only.
+//
+// Packets are stamped from two templates built once at startup; only the
+// source address, port and sequence numbers change, and the checksums are
+// patched for them (RFC 1624) instead of recomputed. SYNs and ACKs go out in
+// sendmmsg batches and SYN-ACKs come in through recvmmsg, so the client's
+// own work per packet is a copy, a few additions and 1/BATCH of a syscall.
+//
+// Source addresses are --sources consecutive addresses from --source on;
+// replies to them must come back to this host, which for the default,
+// 127.1.0.1 on, loopback does. Each address uses --ports ports from
+// FIRST_PORT. The kernel answers the server's SYN-ACKs with RSTs, as no
+// socket owns these ports; the server ignores those.
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "checksum.h"
+#include "packet_filter.h"
+
+#define SERVER_PORT 12345
+#define CLIENT_MSS 1460
+#define FIRST_PORT 1024
+#define BATCH 64              // Packets per sendmmsg and recvmmsg
+#define PACKET_SIZE 64        // Room for any packet we send
+#define RECEIVE_SLOT_SIZE 256 // SYN-ACKs are 44 bytes; the rest is cut off
+#define SOCKET_BUFFER (8 << 20)
+#define DRAIN_SECONDS 1       // How long to wait for SYN-ACKs after the last SYN
+#define STATS_INTERVAL_SECONDS 1
+
+bool quiet = false;        // -q: no per-second lines
+bool flood = false;        // --flood: send SYNs, never complete a handshake
+long rate = 100000;        // --rate <n>: SYNs per second, 0 for as fast as possible
+long count = 100000;       // --count <n>: SYNs to send
+uint32_t sources = 64;     // --sources <n>: source addresses
+uint32_t ports = 1024;     // --ports <n>: source ports per address
+uint32_t first_source;     // --source <addr>, host byte order
+
+// A packet built once with the first flow's fields and zero sequence
+// numbers and valid checksums, to be copied and patched per flow.
+struct packet_template {
+    char bytes[PACKET_SIZE];
+    size_t size;
+};
+
+// What we know of one (address, port) pair's handshake in flight.
+struct flow_state {
+    uint64_t syn_ns;
+    uint32_t isn;
+    bool waiting;
+};
+
+struct client_stats {
+    uint64_t syns = 0;
+    uint64_t syn_acks = 0;     // Matching a SYN of ours
+    uint64_t stray = 0;        // SYN-ACKs for no SYN in flight, or with a wrong ack number
+    uint64_t send_errors = 0;  // e.g. ENOBUFS
+    uint64_t syscalls = 0;
+} stats;
+
+uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+packet_template build_template(uint32_t server_addr, uint8_t flags) {
+    packet_template t = {};
+    size_t options = flags & TH_SYN ? TCPOLEN_MAXSEG : 0;
+    t.size = sizeof(struct iphdr) + sizeof(struct tcphdr) + options;
+    struct iphdr *ip = (struct iphdr *)t.bytes;
+    struct tcphdr *tcp = (struct tcphdr *)(t.bytes + sizeof(struct iphdr));
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tot_len = htons(t.size);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = htonl(first_source);
+    ip->daddr = server_addr;
+    tcp->source = htons(FIRST_PORT);
+    tcp->dest = htons(SERVER_PORT);
+    tcp->doff = (sizeof(struct tcphdr) + options) / 4;
+    ((uint8_t *)tcp)[13] = flags;
+    tcp->window = htons(65535);
+    if (options) {
+        unsigned char *option = (unsigned char *)(tcp + 1);
+        option[0] = TCPOPT_MAXSEG;
+        option[1] = TCPOLEN_MAXSEG;
+        option[2] = CLIENT_MSS >> 8;
+        option[3] = CLIENT_MSS & 0xff;
+    }
+    tcp->check = transport_checksum(ip->saddr, ip->daddr, IPPROTO_TCP, tcp, t.size - sizeof(struct iphdr));
+    ip->check = internet_checksum(ip, sizeof(struct iphdr));
+    return t;
+}
+
+// Copies t to out for another flow and sequence numbers (host byte order),
+// patching both checksums.
+size_t stamp(const packet_template &t, char *out, uint32_t source, uint16_t port, uint32_t seq, uint32_t ack) {
+    memcpy(out, t.bytes, t.size);
+    struct iphdr *ip = (struct iphdr *)out;
+    struct tcphdr *tcp = (struct tcphdr *)(out + sizeof(struct iphdr));
+    uint32_t saddr = htonl(source);
+    ip->check = checksum_update32(ip->check, ip->saddr, saddr);
+    // The source address is also in the TCP pseudo-header
+    uint16_t check = checksum_update32(tcp->check, ip->saddr, saddr);
+    ip->saddr = saddr;
+    check = checksum_update16(check, tcp->source, htons(port));
+    tcp->source = htons(port);
+    check = checksum_update32(check, tcp->seq, htonl(seq));
+    tcp->seq = htonl(seq);
+    check = checksum_update32(check, tcp->ack_seq, htonl(ack));
+    tcp->ack_seq = htonl(ack);
+    tcp->check = check;
+    return t.size;
+}
+
+// Sends the first n packets of out; the ones the kernel refuses are counted.
+void send_batch(int sock, std::vector<mmsghdr> &out, int n) {
+    for (int sent = 0; sent < n;) {
+        int done = sendmmsg(sock, &out[sent], n - sent, 0);
+        stats.syscalls++;
+        if (done < 0) {
+            if (errno != ENOBUFS && errno != EAGAIN) perror("sendmmsg() failed");
+            stats.send_errors++;
+            sent++; // Skip the packet it failed on
+            continue;
+        }
+        sent += done;
+    }
+}
+
+uint32_t next_random(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+double percentile(const std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()))] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_name = "127.0.0.1";
+    const char *source_name = "127.1.0.1";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "--flood") == 0) {
+            flood = true;
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = std::max(atol(argv[++i]), 0L);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = std::max(atol(argv[++i]), 1L);
+        } else if (strcmp(argv[i], "--sources") == 0 && i + 1 < argc) {
+            sources = std::max(atol(argv[++i]), 1L);
+        } else if (strcmp(argv[i], "--ports") == 0 && i + 1 < argc) {
+            ports = std::min(std::max(atol(argv[++i]), 1L), 65536L - FIRST_PORT);
+        } else if (strcmp(argv[i], "--source") == 0 && i + 1 < argc) {
+            source_name = argv[++i];
+        } else if (argv[i][0] != '-') {
+            server_name = argv[i];
+        } else {
+            std::cout << "[USE]: " << argv[0] << " [server address] [-q] [--flood] [--rate <SYNs/s>] [--count <n>]"
+                      << " [--sources <n>] [--source <first address>] [--ports <n>]" << std::endl;
+            return 1;
+        }
+    }
+    in_addr server_addr, source_addr;
+    if (!inet_aton(server_name, &server_addr) || !inet_aton(source_name, &source_addr)) {
+        std::cerr << "Error: bad address" << std::endl;
+        return 1;
+    }
+    first_source = ntohl(source_addr.s_addr);
+
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    if (setsockopt(sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
+        perror("setsockopt() failed");
+        exit(EXIT_FAILURE);
+    }
+    int buffer = SOCKET_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer, sizeof(buffer));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &buffer, sizeof(buffer));
+    // The raw socket gets a copy of every TCP packet on the host, our own
+    // SYNs included; only the server's SYN-ACKs are worth waking up for, and
+    // in a flood not even those
+    std::vector<sock_filter> filter = syn_ack_filter(SERVER_PORT, 0);
+    if (flood) filter = {bpf_statement(BPF_RET | BPF_K, 0)};
+    if (!attach_filter(sock, filter)) perror("SO_ATTACH_FILTER failed");
+
+    packet_template syn = build_template(server_addr.s_addr, TH_SYN);
+    packet_template ack = build_template(server_addr.s_addr, TH_ACK);
+    size_t flow_count = (size_t)sources * ports;
+    std::vector<flow_state> flows(std::min(flow_count, (size_t)count));
+    std::vector<uint32_t> latencies; // ns, SYN sent to SYN-ACK received
+    latencies.reserve(flood ? 0 : count);
+
+    sockaddr_in destination = {};
+    destination.sin_family = AF_INET;
+    destination.sin_addr = server_addr;
+    std::vector<char> out_buffers(BATCH * PACKET_SIZE), in_buffers(BATCH * RECEIVE_SLOT_SIZE);
+    std::vector<iovec> out_iovs(BATCH), in_iovs(BATCH);
+    std::vector<mmsghdr> out(BATCH), in(BATCH);
+    for (int i = 0; i < BATCH; i++) {
+        out_iovs[i] = {&out_buffers[i * PACKET_SIZE], 0};
+        out[i].msg_hdr.msg_name = &destination;
+        out[i].msg_hdr.msg_namelen = sizeof(destination);
+        out[i].msg_hdr.msg_iov = &out_iovs[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+        in_iovs[i] = {&in_buffers[i * RECEIVE_SLOT_SIZE], RECEIVE_SLOT_SIZE};
+        in[i].msg_hdr.msg_iov = &in_iovs[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::cout << "[+] Sending " << count << " SYNs to " << server_name << ":" << SERVER_PORT << " from " << sources
+              << " addresses x " << ports << " ports at " << (rate ? std::to_string(rate) + " SYNs/s" : "full speed")
+              << (flood ? ", flood" : "") << std::endl;
+
+    uint32_t random_state = monotonic_ns() | 1;
+    uint64_t start = monotonic_ns(), last_syn = start, last_report = start;
+    client_stats reported;
+    long sent = 0;
+    while (true) {
+        uint64_t now = monotonic_ns();
+
+        // SYNs that are due
+        long due = rate ? std::min(count, (long)((now - start) * (double)rate / 1e9) + 1) : count;
+        int batch = std::min(due - sent, (long)BATCH);
+        for (int i = 0; i < batch; i++, sent++) {
+            size_t slot = sent % flows.size();
+            flow_state &flow = flows[slot];
+            flow.isn = next_random(random_state);
+            flow.syn_ns = now;
+            flow.waiting = true;
+            out_iovs[i].iov_len = stamp(syn, (char *)out_iovs[i].iov_base, first_source + slot % sources,
+                                        FIRST_PORT + slot / sources, flow.isn, 0);
+        }
+        if (batch > 0) {
+            send_batch(sock, out, batch);
+            stats.syns += batch;
+            last_syn = now;
+        }
+
+        // SYN-ACKs, each answered with the final ACK
+        int received = flood ? 0 : recvmmsg(sock, in.data(), BATCH, MSG_DONTWAIT, nullptr);
+        if (!flood) stats.syscalls++;
+        int acks = 0;
+        for (int i = 0; i < received; i++) {
+            const struct iphdr *ip = (const struct iphdr *)in_iovs[i].iov_base;
+            size_t ip_size = ip->ihl * 4;
+            if (in[i].msg_len < ip_size + sizeof(struct tcphdr)) continue;
+            const struct tcphdr *tcp = (const struct tcphdr *)((const char *)ip + ip_size);
+            uint32_t source = ntohl(ip->daddr) - first_source;
+            uint32_t port = ntohs(tcp->dest) - FIRST_PORT;
+            size_t slot = (size_t)port * sources + source;
+            if (ip->saddr != server_addr.s_addr || source >= sources || port >= ports || slot >= flows.size() ||
+                !flows[slot].waiting || ntohl(tcp->ack_seq) != flows[slot].isn + 1) {
+                stats.stray++;
+                continue;
+            }
+            flow_state &flow = flows[slot];
+            flow.waiting = false;
+            latencies.push_back(monotonic_ns() - flow.syn_ns);
+            stats.syn_acks++;
+            out_iovs[acks].iov_len = stamp(ack, (char *)out_iovs[acks].iov_base, first_source + source,
+                                           FIRST_PORT + port, flow.isn + 1, ntohl(tcp->seq) + 1);
+            acks++;
+        }
+        if (acks > 0) send_batch(sock, out, acks);
+
+        now = monotonic_ns();
+        if (!quiet && now - last_report >= STATS_INTERVAL_SECONDS * 1000000000ULL) {
+            double seconds = (now - last_report) / 1e9;
+            std::cout << "[+] " << (uint64_t)((stats.syns - reported.syns) / seconds) << " SYNs/s, "
+                      << (uint64_t)((stats.syn_acks - reported.syn_acks) / seconds) << " handshakes/s" << std::endl;
+            reported = stats;
+            last_report = now;
+        }
+        if (sent == count && (flood || stats.syn_acks == (uint64_t)count ||
+                              now - last_syn >= DRAIN_SECONDS * 1000000000ULL)) {
+            break;
+        }
+
+        // Nothing more to do until the next SYN is due or a SYN-ACK arrives
+        if (received < BATCH && batch < BATCH) {
+            long wait_ns = DRAIN_SECONDS * 1000000000L;
+            if (sent < count && rate) wait_ns = (long)((sent * 1e9) / rate) - (long)(now - start);
+            if (wait_ns > 0 && !(flood && sent < count && !rate)) {
+                pollfd fd = {sock, POLLIN, 0};
+                timespec wait = {wait_ns / 1000000000, wait_ns % 1000000000};
+                stats.syscalls++;
+                ppoll(&fd, flood ? 0 : 1, &wait, nullptr);
+            }
+        }
+    }
+    double seconds = (last_syn - start) / 1e9;
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "[+] Sent " << stats.syns << " SYNs in " << seconds << " s: "
+              << (seconds > 0 ? stats.syns / seconds : 0) << " SYNs/s; " << stats.send_errors << " send errors"
+              << std::endl;
+    std::cout << "[+] Client: " << (double)stats.syscalls / (stats.syns + stats.syn_acks) << " syscalls and "
+              << cpu * 1e6 / (stats.syns + stats.syn_acks) << " us CPU per packet sent" << std::endl;
+    if (!flood) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "[+] Completed " << stats.syn_acks << " handshakes ("
+                  << 100.0 * stats.syn_acks / stats.syns << "%), " << stats.stray << " stray SYN-ACKs" << std::endl;
+        std::cout << "[+] SYN to SYN-ACK latency (us): p50 " << percentile(latencies, 50)
+                  << ", p90 " << percentile(latencies, 90) << ", p99 " << percentile(latencies, 99) << ", p99.9 "
+                  << percentile(latencies, 99.9) << ", max " << percentile(latencies, 100) << std::endl;
+    }
+    close(sock);
+    return 0;
+}
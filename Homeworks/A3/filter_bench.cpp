@@ -0,0 +1,119 @@
+// CPU time a running server spends on traffic that is not for it.
+//
+// Pushes small writes through a kernel TCP connection on loopback, on a port
+// the server does not serve, and reports how much CPU the server process
+// used meanwhile. Every segment of that connection reaches the server's raw
+// socket unless its BPF filter (packet_filter.h) drops it in the kernel.
+//
+//   ./filter_bench <server pid> [seconds] [port]
+//
+// `make filter-bench` runs it against the server with and without --no-filter.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define NOISE_PORT 12399
+#define WRITE_SIZE 64 // Small writes, so that nearly every write is a segment
+
+// utime + stime of a process, in clock ticks.
+long process_cpu_ticks(int pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) return -1;
+    std::istringstream fields(line.substr(line.rfind(')') + 2)); // The name may contain spaces
+    std::string field;
+    long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) utime = atol(field.c_str());
+        if (i == 15) stime = atol(field.c_str());
+    }
+    return utime + stime;
+}
+
+// The host's TCP segments sent so far (OutSegs in /proc/net/snmp).
+long tcp_segments_sent() {
+    std::ifstream snmp("/proc/net/snmp");
+    std::string names, values;
+    while (std::getline(snmp, names) && std::getline(snmp, values)) {
+        if (names.rfind("Tcp:", 0) != 0) continue;
+        std::istringstream n(names), v(values);
+        std::string name, value;
+        while (n >> name && v >> value) {
+            if (name == "OutSegs") return atol(value.c_str());
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cout << "[USE]: " << argv[0] << " <server pid> [seconds] [port]" << std::endl;
+        return 1;
+    }
+    int pid = atoi(argv[1]);
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int port = argc > 3 ? atoi(argv[3]) : NOISE_PORT;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0) {
+        perror("Listening socket failed");
+        return 1;
+    }
+    int sender = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(sender, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sender, (sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Connect failed");
+        return 1;
+    }
+    int receiver = accept(listener, nullptr, nullptr);
+
+    std::thread sink([&]() {
+        char buffer[65536];
+        while (recv(receiver, buffer, sizeof(buffer), 0) > 0) {
+        }
+    });
+
+    long ticks_before = process_cpu_ticks(pid);
+    long segments_before = tcp_segments_sent();
+    if (ticks_before < 0) {
+        std::cerr << "Error: no process " << pid << "." << std::endl;
+        return 1;
+    }
+    char data[WRITE_SIZE] = {};
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::seconds(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 64; i++) send(sender, data, sizeof(data), 0);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    long ticks = process_cpu_ticks(pid) - ticks_before;
+    long segments = tcp_segments_sent() - segments_before;
+    shutdown(sender, SHUT_WR);
+    sink.join();
+
+    std::cout << "Background traffic: " << (long)(segments / elapsed) << " TCP segments/s to port " << port
+              << std::endl;
+    std::cout << "Server CPU: " << 100.0 * ticks / sysconf(_SC_CLK_TCK) / elapsed << "% of one core, "
+              << (segments ? 1e9 * ticks / sysconf(_SC_CLK_TCK) / segments : 0) << " ns per segment" << std::endl;
+    close(sender);
+    close(receiver);
+    close(listener);
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Classic BPF socket filters, so that the kernel drops packets the server
+// would ignore before they are queued to it, instead of waking it up for
+// every TCP packet on the host.
+//
+// handshake_filter() accepts IPv4 TCP packets to one port whose SYN, ACK and
+// RST flags are those of a handshake step: SYN alone, or ACK without SYN and
+// RST. Fragments after the first, which carry no TCP header, are dropped.
+// The program is generated for a given link-layer header length: 0 for an
+// AF_INET raw socket, which sees packets from the IP header on, and 14
+// (ETH_HLEN) for an AF_PACKET socket on Ethernet or loopback.
+//
+// syn_ack_filter() is the client's side: SYN-ACKs from one port.
+// tcp_port_filter() takes every TCP packet to one port, for utcp.
+
+#ifndef PACKET_FILTER_H
+#define PACKET_FILTER_H
+
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#define FILTER_ACCEPT_BYTES 0x40000 // "The whole packet"
+
+inline sock_filter bpf_statement(uint16_t code, uint32_t k) { return {code, 0, 0, k}; }
+
+inline sock_filter bpf_jump(uint16_t code, uint32_t k, uint8_t if_true, uint8_t if_false) {
+    return {code, if_true, if_false, k};
+}
+
+inline std::vector<sock_filter> handshake_filter(uint16_t port, uint32_t link_header) {
+    uint32_t l = link_header;
+    // Jump offsets count the instructions skipped; DROP and ACCEPT are the
+    // last two, at 11 and 12
+    return {
+        bpf_statement(BPF_LD | BPF_B | BPF_ABS, l + 9),           //  0: A = IP protocol
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 9),             //  1: TCP, else DROP
+        bpf_statement(BPF_LD | BPF_H | BPF_ABS, l + 6),           //  2: A = flags and fragment offset
+        bpf_jump(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 7, 0),       //  3: not the first fragment: DROP
+        bpf_statement(BPF_LDX | BPF_B | BPF_MSH, l),              //  4: X = IP header length
+        bpf_statement(BPF_LD | BPF_H | BPF_IND, l + 2),           //  5: A = TCP destination port
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 4),          //  6: our port, else DROP
+        bpf_statement(BPF_LD | BPF_B | BPF_IND, l + 13),          //  7: A = TCP flags
+        bpf_statement(BPF_ALU | BPF_AND | BPF_K, 0x16),           //  8: A &= SYN | RST | ACK
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 0x02, 2, 0),          //  9: SYN: ACCEPT
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 0x10, 1, 0),          // 10: ACK: ACCEPT
+        bpf_statement(BPF_RET | BPF_K, 0),                        // 11: DROP
+        bpf_statement(BPF_RET | BPF_K, FILTER_ACCEPT_BYTES),      // 12: ACCEPT
+    };
+}
+
+inline std::vector<sock_filter> syn_ack_filter(uint16_t port, uint32_t link_header) {
+    uint32_t l = link_header;
+    // DROP and ACCEPT at 10 and 11
+    return {
+        bpf_statement(BPF_LD | BPF_B | BPF_ABS, l + 9),           //  0: A = IP protocol
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 8),             //  1: TCP, else DROP
+        bpf_statement(BPF_LD | BPF_H | BPF_ABS, l + 6),           //  2: A = flags and fragment offset
+        bpf_jump(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 6, 0),       //  3: not the first fragment: DROP
+        bpf_statement(BPF_LDX | BPF_B | BPF_MSH, l),              //  4: X = IP header length
+        bpf_statement(BPF_LD | BPF_H | BPF_IND, l + 0),           //  5: A = TCP source port
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 3),          //  6: the server's port, else DROP
+        bpf_statement(BPF_LD | BPF_B | BPF_IND, l + 13),          //  7: A = TCP flags
+        bpf_statement(BPF_ALU | BPF_AND | BPF_K, 0x16),           //  8: A &= SYN | RST | ACK
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 0x12, 1, 0),          //  9: SYN-ACK: ACCEPT
+        bpf_statement(BPF_RET | BPF_K, 0),                        // 10: DROP
+        bpf_statement(BPF_RET | BPF_K, FILTER_ACCEPT_BYTES),      // 11: ACCEPT
+    };
+}
+
+inline std::vector<sock_filter> tcp_port_filter(uint16_t port, uint32_t link_header) {
+    uint32_t l = link_header;
+    // DROP and ACCEPT at 7 and 8
+    return {
+        bpf_statement(BPF_LD | BPF_B | BPF_ABS, l + 9),           //  0: A = IP protocol
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 5),             //  1: TCP, else DROP
+        bpf_statement(BPF_LD | BPF_H | BPF_ABS, l + 6),           //  2: A = flags and fragment offset
+        bpf_jump(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 3, 0),       //  3: not the first fragment: DROP
+        bpf_statement(BPF_LDX | BPF_B | BPF_MSH, l),              //  4: X = IP header length
+        bpf_statement(BPF_LD | BPF_H | BPF_IND, l + 2),           //  5: A = TCP destination port
+        bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, port, 1, 0),          //  6: our port: ACCEPT
+        bpf_statement(BPF_RET | BPF_K, 0),                        //  7: DROP
+        bpf_statement(BPF_RET | BPF_K, FILTER_ACCEPT_BYTES),      //  8: ACCEPT
+    };
+}
+
+// Returns false if the kernel rejects the program.
+inline bool attach_filter(int sock, const std::vector<sock_filter> &program) {
+    sock_fprog filter = {(unsigned short)program.size(), const_cast<sock_filter *>(program.data())};
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == 0;
+}
+
+#endif
@@ -0,0 +1,191 @@
+// AF_PACKET capture with a TPACKET_V3 memory-mapped receive ring and a
+// PACKET_TX_RING for replies, on one socket bound to one interface.
+//
+// The kernel fills the receive ring a block at a time; a block is handed to
+// us when it is full or RING_BLOCK_TIMEOUT_MS after its first packet, so a
+// burst of packets costs one wakeup and no copies: receive() passes each
+// packet to the handler as a pointer into the block, then returns the block.
+//
+// Replies are written straight into transmit frames (tx_frame, tx_commit)
+// and sent together by tx_flush(), one send() for all of them. Packets this
+// host sends are not captured (PACKET_IGNORE_OUTGOING), or every reply would
+// come back to us on loopback.
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#define RING_BLOCK_SIZE (1 << 20)   // Receive ring: 16 blocks of 1 MB
+#define RING_BLOCKS 16
+#define RING_FRAME_SIZE 2048        // Only a hint for TPACKET_V3 receive rings
+#define RING_BLOCK_TIMEOUT_MS 1     // Hand over a block that is not full after this long
+#define TX_FRAME_SIZE 256           // Transmit ring: 1024 frames, room for a small reply each
+#define TX_BLOCK_SIZE (1 << 16)
+#define TX_BLOCKS 4
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+class packet_ring {
+public:
+    packet_ring() = default;
+    packet_ring(const packet_ring &) = delete;
+    packet_ring &operator=(const packet_ring &) = delete;
+    ~packet_ring() {
+        if (map != MAP_FAILED) munmap(map, map_size);
+        if (sock >= 0) close(sock);
+    }
+
+    // Sets up both rings on interface. Returns false (after perror) if any
+    // step fails, e.g. without CAP_NET_RAW or on kernels without TPACKET_V3.
+    bool open(const char *interface) {
+        sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+        if (sock < 0) return fail("AF_PACKET socket");
+        int version = TPACKET_V3, one = 1;
+        if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) return fail("PACKET_VERSION");
+        setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)); // Linux 4.20+; else outgoing replies are skipped below
+
+        tpacket_req3 rx = {};
+        rx.tp_block_size = RING_BLOCK_SIZE;
+        rx.tp_block_nr = RING_BLOCKS;
+        rx.tp_frame_size = RING_FRAME_SIZE;
+        rx.tp_frame_nr = RING_BLOCK_SIZE / RING_FRAME_SIZE * RING_BLOCKS;
+        rx.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+        if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0) return fail("PACKET_RX_RING");
+        tpacket_req3 tx = {};
+        tx.tp_block_size = TX_BLOCK_SIZE;
+        tx.tp_block_nr = TX_BLOCKS;
+        tx.tp_frame_size = TX_FRAME_SIZE;
+        tx.tp_frame_nr = TX_BLOCK_SIZE / TX_FRAME_SIZE * TX_BLOCKS;
+        if (setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) < 0) return fail("PACKET_TX_RING");
+
+        // The receive ring comes first in the mapping, then the transmit ring
+        map_size = (size_t)RING_BLOCK_SIZE * RING_BLOCKS + (size_t)TX_BLOCK_SIZE * TX_BLOCKS;
+        map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, sock, 0);
+        if (map == MAP_FAILED) map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+        if (map == MAP_FAILED) return fail("mmap of the packet rings");
+        tx_ring = (char *)map + (size_t)RING_BLOCK_SIZE * RING_BLOCKS;
+        tx_frames = tx.tp_frame_nr;
+
+        sockaddr_ll address = {};
+        address.sll_family = AF_PACKET;
+        address.sll_protocol = htons(ETH_P_IP);
+        address.sll_ifindex = if_nametoindex(interface);
+        if (address.sll_ifindex == 0) return fail(interface);
+        if (bind(sock, (sockaddr *)&address, sizeof(address)) < 0) return fail("bind to the interface");
+        return true;
+    }
+
+    // Waits up to timeout_ms for a block, then calls
+    //   handle(const char *link_header, const char *packet, size_t size)
+    // for every packet in every block that is ready, with packet pointing at
+    // its network header. Returns the number of packets.
+    template <class handler>
+    size_t receive(int timeout_ms, handler &&handle) {
+        size_t packets = 0;
+        tpacket_block_desc *block = block_at(next_block);
+        if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            pollfd fd = {sock, POLLIN | POLLERR, 0};
+            poll(&fd, 1, timeout_ms);
+            calls++;
+        }
+        while ((block = block_at(next_block))->hdr.bh1.block_status & TP_STATUS_USER) {
+            __sync_synchronize(); // See the block's packets after its status
+            char *frame = (char *)block + block->hdr.bh1.offset_to_first_pkt;
+            for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+                tpacket3_hdr *header = (tpacket3_hdr *)frame;
+                sockaddr_ll *link = (sockaddr_ll *)(frame + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+                if (link->sll_pkttype != PACKET_OUTGOING && header->tp_net >= header->tp_mac &&
+                    header->tp_snaplen >= (uint32_t)(header->tp_net - header->tp_mac)) {
+                    handle((const char *)(frame + header->tp_mac), (const char *)(frame + header->tp_net),
+                           (size_t)(header->tp_snaplen - (header->tp_net - header->tp_mac)));
+                    packets++;
+                }
+                frame += header->tp_next_offset;
+            }
+            __sync_synchronize();
+            block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+            next_block = (next_block + 1) % RING_BLOCKS;
+        }
+        return packets;
+    }
+
+    // The link-layer frame of the next free transmit slot, TX_FRAME_SIZE -
+    // the slot header bytes long, or nullptr if every slot is still queued.
+    char *tx_frame() {
+        tpacket3_hdr *header = tx_header(next_tx);
+        if (header->tp_status != TP_STATUS_AVAILABLE && header->tp_status != TP_STATUS_WRONG_FORMAT) {
+            tx_flush(); // Make room: sends what is queued, and waits for it
+            if (header->tp_status != TP_STATUS_AVAILABLE && header->tp_status != TP_STATUS_WRONG_FORMAT) return nullptr;
+        }
+        return (char *)header + TX_DATA_OFFSET;
+    }
+
+    int fd() const { return sock; }
+
+    // poll() and send() calls so far.
+    uint64_t syscalls() const { return calls; }
+
+    static constexpr size_t tx_frame_capacity() { return TX_FRAME_SIZE - TX_DATA_OFFSET; }
+
+    // Queues the frame returned by tx_frame(), length bytes long.
+    void tx_commit(size_t length) {
+        tpacket3_hdr *header = tx_header(next_tx);
+        header->tp_len = length;
+        header->tp_snaplen = length;
+        __sync_synchronize();
+        header->tp_status = TP_STATUS_SEND_REQUEST;
+        next_tx = (next_tx + 1) % tx_frames;
+        tx_queued++;
+    }
+
+    // Sends every queued frame. Returns the number of send() calls (0 or 1).
+    int tx_flush() {
+        if (tx_queued == 0) return 0;
+        while (send(sock, nullptr, 0, 0) < 0 && errno == EINTR) {
+            calls++;
+        }
+        calls++;
+        tx_queued = 0;
+        return 1;
+    }
+
+private:
+    static constexpr size_t TX_DATA_OFFSET = TPACKET_ALIGN(sizeof(tpacket3_hdr));
+
+    int sock = -1;
+    void *map = MAP_FAILED;
+    size_t map_size = 0;
+    unsigned next_block = 0;
+    char *tx_ring = nullptr;
+    unsigned tx_frames = 0, next_tx = 0, tx_queued = 0;
+    uint64_t calls = 0;
+
+    tpacket_block_desc *block_at(unsigned index) const {
+        return (tpacket_block_desc *)((char *)map + (size_t)index * RING_BLOCK_SIZE);
+    }
+
+    tpacket3_hdr *tx_header(unsigned index) const {
+        return (tpacket3_hdr *)(tx_ring + (size_t)index * TX_FRAME_SIZE);
+    }
+
+    bool fail(const char *what) {
+        perror(what);
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,259 @@
+// Typed views of IPv4, IPv6, TCP and UDP headers in a received buffer,
+// without copying them.
+//
+// A view is a pointer and a size. Its constructor checks, once, that the
+// whole header (options included) lies inside the buffer, and valid() says
+// whether it did; an invalid view must not be read. After that the
+// accessors are loads at fixed offsets: the big-endian byte loads below
+// compile to one load and a byte swap, and every accessor returns host
+// byte order. Everything is constexpr, so views of a constant buffer fold
+// at compile time.
+//
+// parse_packet() takes an IPv4 or IPv6 packet apart down to TCP or UDP.
+// format_tcp_flags() writes the line print_tcp_flags used to stream into a
+// caller's buffer, for logging at packet rates without iostreams.
+
+#ifndef PACKET_VIEW_H
+#define PACKET_VIEW_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define IPV6_MAX_EXTENSION_HEADERS 8
+#define FORMAT_TCP_FLAGS_MAX 96 // Longest line format_tcp_flags writes
+
+constexpr uint16_t load_be16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+constexpr uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+class ipv4_view {
+public:
+    static constexpr size_t MIN_SIZE = 20;
+
+    constexpr ipv4_view() = default;
+    constexpr ipv4_view(const uint8_t *data, size_t size)
+        : data(data), size(size),
+          ok(size >= MIN_SIZE && (data[0] >> 4) == 4 && header_size() >= MIN_SIZE && header_size() <= size &&
+             total_length() >= header_size()) {}
+
+    constexpr bool valid() const { return ok; }
+    constexpr size_t header_size() const { return (data[0] & 0x0f) * 4; }
+    constexpr uint8_t tos() const { return data[1]; }
+    constexpr uint16_t total_length() const { return load_be16(data + 2); }
+    constexpr uint16_t id() const { return load_be16(data + 4); }
+    constexpr bool more_fragments() const { return data[6] & 0x20; }
+    constexpr uint16_t fragment_offset() const { return load_be16(data + 6) & 0x1fff; } // In 8-byte units
+    constexpr uint8_t ttl() const { return data[8]; }
+    constexpr uint8_t protocol() const { return data[9]; }
+    constexpr uint16_t checksum() const { return load_be16(data + 10); }
+    constexpr uint32_t source() const { return load_be32(data + 12); }
+    constexpr uint32_t destination() const { return load_be32(data + 16); }
+
+    // What follows the header, up to the total length or the end of the
+    // buffer, whichever comes first.
+    constexpr const uint8_t *payload() const { return data + header_size(); }
+    constexpr size_t payload_size() const {
+        return (total_length() < size ? total_length() : size) - header_size();
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+};
+
+class ipv6_view {
+public:
+    static constexpr size_t MIN_SIZE = 40;
+
+    constexpr ipv6_view() = default;
+    constexpr ipv6_view(const uint8_t *data, size_t size)
+        : data(data), size(size), ok(size >= MIN_SIZE && (data[0] >> 4) == 6) {}
+
+    constexpr bool valid() const { return ok; }
+    constexpr uint8_t traffic_class() const { return (uint8_t)(load_be16(data) >> 4); }
+    constexpr uint32_t flow_label() const { return load_be32(data) & 0xfffff; }
+    constexpr uint16_t payload_length() const { return load_be16(data + 4); }
+    constexpr uint8_t next_header() const { return data[6]; }
+    constexpr uint8_t hop_limit() const { return data[7]; }
+    constexpr const uint8_t *source() const { return data + 8; }       // 16 bytes
+    constexpr const uint8_t *destination() const { return data + 24; } // 16 bytes
+
+    constexpr const uint8_t *payload() const { return data + MIN_SIZE; }
+    constexpr size_t payload_size() const {
+        return payload_length() < size - MIN_SIZE ? payload_length() : size - MIN_SIZE;
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+};
+
+class tcp_view {
+public:
+    static constexpr size_t MIN_SIZE = 20;
+    static constexpr uint8_t FIN = 0x01, SYN = 0x02, RST = 0x04, PSH = 0x08, ACK = 0x10, URG = 0x20;
+
+    constexpr tcp_view() = default;
+    constexpr tcp_view(const uint8_t *data, size_t size)
+        : data(data), size(size), ok(size >= MIN_SIZE && header_size() >= MIN_SIZE && header_size() <= size) {}
+
+    constexpr bool valid() const { return ok; }
+    constexpr uint16_t source_port() const { return load_be16(data); }
+    constexpr uint16_t destination_port() const { return load_be16(data + 2); }
+    constexpr uint32_t seq() const { return load_be32(data + 4); }
+    constexpr uint32_t ack_seq() const { return load_be32(data + 8); }
+    constexpr size_t header_size() const { return (data[12] >> 4) * 4; }
+    constexpr uint8_t flags() const { return data[13]; }
+    constexpr bool fin() const { return flags() & FIN; }
+    constexpr bool syn() const { return flags() & SYN; }
+    constexpr bool rst() const { return flags() & RST; }
+    constexpr bool psh() const { return flags() & PSH; }
+    constexpr bool ack() const { return flags() & ACK; }
+    constexpr bool urg() const { return flags() & URG; }
+    constexpr uint16_t window() const { return load_be16(data + 14); }
+    constexpr uint16_t checksum() const { return load_be16(data + 16); }
+
+    constexpr const uint8_t *options() const { return data + MIN_SIZE; }
+    constexpr size_t options_size() const { return header_size() - MIN_SIZE; }
+    constexpr const uint8_t *payload() const { return data + header_size(); }
+    constexpr size_t payload_size() const { return size - header_size(); }
+
+    // The MSS option, or 536 if there is none (RFC 9293). Options are
+    // inside the header, which the constructor checked.
+    constexpr uint16_t mss() const {
+        const uint8_t *option = options();
+        size_t length = options_size();
+        for (size_t i = 0; i < length;) {
+            uint8_t kind = option[i];
+            if (kind == 0) break; // End of options
+            if (kind == 1) {      // No-op
+                i++;
+                continue;
+            }
+            if (i + 1 >= length || option[i + 1] < 2 || i + option[i + 1] > length) break;
+            if (kind == 2 && option[i + 1] == 4) return load_be16(option + i + 2);
+            i += option[i + 1];
+        }
+        return 536;
+    }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+};
+
+class udp_view {
+public:
+    static constexpr size_t MIN_SIZE = 8;
+
+    constexpr udp_view() = default;
+    constexpr udp_view(const uint8_t *data, size_t size)
+        : data(data), size(size), ok(size >= MIN_SIZE && length() >= MIN_SIZE) {}
+
+    constexpr bool valid() const { return ok; }
+    constexpr uint16_t source_port() const { return load_be16(data); }
+    constexpr uint16_t destination_port() const { return load_be16(data + 2); }
+    constexpr uint16_t length() const { return load_be16(data + 4); }
+    constexpr uint16_t checksum() const { return load_be16(data + 6); }
+
+    constexpr const uint8_t *payload() const { return data + MIN_SIZE; }
+    constexpr size_t payload_size() const { return (length() < size ? length() : size) - MIN_SIZE; }
+
+private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    bool ok = false;
+};
+
+// A packet taken apart. ip_version is 0 if the buffer holds no valid IP
+// header; tcp and udp are valid only for the first fragment of a TCP or
+// UDP packet whose header fits.
+struct packet_view {
+    uint8_t ip_version = 0;
+    uint8_t protocol = 0;  // The transport protocol, after any IPv6 extension headers
+    ipv4_view ipv4;
+    ipv6_view ipv6;
+    tcp_view tcp;
+    udp_view udp;
+};
+
+constexpr packet_view parse_packet(const uint8_t *data, size_t size) {
+    packet_view packet;
+    const uint8_t *transport = nullptr;
+    size_t transport_size = 0;
+    if (size > 0 && (data[0] >> 4) == 4) {
+        packet.ipv4 = ipv4_view(data, size);
+        if (!packet.ipv4.valid()) return packet;
+        packet.ip_version = 4;
+        packet.protocol = packet.ipv4.protocol();
+        if (packet.ipv4.fragment_offset() != 0) return packet;
+        transport = packet.ipv4.payload();
+        transport_size = packet.ipv4.payload_size();
+    } else if (size > 0 && (data[0] >> 4) == 6) {
+        packet.ipv6 = ipv6_view(data, size);
+        if (!packet.ipv6.valid()) return packet;
+        packet.ip_version = 6;
+        uint8_t next = packet.ipv6.next_header();
+        transport = packet.ipv6.payload();
+        transport_size = packet.ipv6.payload_size();
+        // Hop-by-hop, routing, fragment and destination options headers
+        for (int i = 0; i < IPV6_MAX_EXTENSION_HEADERS && (next == 0 || next == 43 || next == 44 || next == 60); i++) {
+            if (transport_size < 8) return packet;
+            size_t length = next == 44 ? 8 : (transport[1] + 1) * 8;
+            if (next == 44 && (load_be16(transport + 2) & 0xfff8) != 0) { // Not the first fragment
+                packet.protocol = transport[0];
+                return packet;
+            }
+            if (length > transport_size) return packet;
+            next = transport[0];
+            transport += length;
+            transport_size -= length;
+        }
+        packet.protocol = next;
+    } else {
+        return packet;
+    }
+    if (packet.protocol == 6) {
+        packet.tcp = tcp_view(transport, transport_size);
+    } else if (packet.protocol == 17) {
+        packet.udp = udp_view(transport, transport_size);
+    }
+    return packet;
+}
+
+// Writes value in decimal at out; returns the digits written.
+inline size_t format_decimal(char *out, uint32_t value) {
+    char digits[10];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    for (size_t i = 0; i < count; i++) out[i] = digits[count - 1 - i];
+    return count;
+}
+
+// The line print_tcp_flags printed, newline included, into out, which has
+// room for FORMAT_TCP_FLAGS_MAX bytes. Returns its length.
+inline size_t format_tcp_flags(char *out, const tcp_view &tcp) {
+    static const char prefix[] = "[+] TCP Flags:  SYN: 0 ACK: 0 FIN: 0 RST: 0 PSH: 0 SEQ: ";
+    static_assert(sizeof(prefix) - 1 + 10 + 1 <= FORMAT_TCP_FLAGS_MAX, "the longest line must fit");
+    size_t size = sizeof(prefix) - 1;
+    for (size_t i = 0; i < size; i++) out[i] = prefix[i];
+    // The flag digits sit at fixed positions in the prefix
+    out[21] += tcp.syn();
+    out[28] += tcp.ack();
+    out[35] += tcp.fin();
+    out[42] += tcp.rst();
+    out[49] += tcp.psh();
+    size += format_decimal(out + size, tcp.seq());
+    out[size++] = '\n';
+    return size;
+}
+
+#endif
@@ -0,0 +1,261 @@
+// Header parsing cost per packet: the iphdr/tcphdr casts handle_packet used
+// against the views in packet_view.h, on the same IPv4 TCP packets, then
+// parse_packet() on a mix with UDP and IPv6. Also times the -v flag line,
+// streamed through std::cout the old way against format_tcp_flags().
+// Checks first that both parsers agree on every packet and that both flag
+// lines are the same bytes.
+//
+//   ./parse_bench [million packets per measurement]
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "packet_view.h"
+
+#define CORPUS_PACKETS 4096
+#define PACKET_SLOT 128
+
+// The fields the server reads from a segment, in host byte order.
+struct segment_fields {
+    uint32_t source, destination;
+    uint16_t source_port, destination_port;
+    uint32_t seq, ack_seq;
+    uint8_t flags;
+    uint16_t mss;
+
+    bool operator==(const segment_fields &o) const {
+        return source == o.source && destination == o.destination && source_port == o.source_port &&
+               destination_port == o.destination_port && seq == o.seq && ack_seq == o.ack_seq &&
+               flags == o.flags && mss == o.mss;
+    }
+    uint64_t hash() const {
+        return (uint64_t)source * 31 + destination + source_port + destination_port + seq + ack_seq + flags + mss;
+    }
+};
+
+// handle_packet before packet_view.h, read_mss included
+uint16_t read_mss_cast(const struct tcphdr *tcp, size_t tcp_size) {
+    size_t header = tcp->doff * 4;
+    const unsigned char *options = (const unsigned char *)tcp;
+    for (size_t i = sizeof(struct tcphdr); i < header && i < tcp_size;) {
+        unsigned char kind = options[i];
+        if (kind == TCPOPT_EOL) break;
+        if (kind == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= header || i + 1 >= tcp_size || options[i + 1] < 2) break;
+        if (kind == TCPOPT_MAXSEG && options[i + 1] == TCPOLEN_MAXSEG && i + 4 <= tcp_size) {
+            return options[i + 2] << 8 | options[i + 3];
+        }
+        i += options[i + 1];
+    }
+    return 536;
+}
+
+bool parse_cast(const char *packet, size_t size, segment_fields &out) {
+    const struct iphdr *ip = (const struct iphdr *)packet;
+    if (size < sizeof(struct iphdr) || ip->protocol != IPPROTO_TCP) return false;
+    size_t ip_size = ip->ihl * 4;
+    if (ip_size < sizeof(struct iphdr) || size < ip_size + sizeof(struct tcphdr)) return false;
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet + ip_size);
+    out = {ntohl(ip->saddr), ntohl(ip->daddr), ntohs(tcp->source), ntohs(tcp->dest), ntohl(tcp->seq),
+           ntohl(tcp->ack_seq), ((const uint8_t *)tcp)[13], 0};
+    out.mss = tcp->syn ? read_mss_cast(tcp, size - ip_size) : 0;
+    return true;
+}
+
+bool parse_view(const char *packet, size_t size, segment_fields &out) {
+    ipv4_view ip((const uint8_t *)packet, size);
+    if (!ip.valid() || ip.protocol() != IPPROTO_TCP || ip.fragment_offset() != 0) return false;
+    tcp_view tcp(ip.payload(), ip.payload_size());
+    if (!tcp.valid()) return false;
+    out = {ip.source(), ip.destination(), tcp.source_port(), tcp.destination_port(), tcp.seq(), tcp.ack_seq(),
+           tcp.flags(), 0};
+    out.mss = tcp.syn() ? tcp.mss() : 0;
+    return true;
+}
+
+// A view of a constant buffer is folded by the compiler
+constexpr uint8_t CONSTANT_SYN[] = {0x45, 0, 0, 44, 0, 0, 0x40, 0, 64, 6, 0, 0, 10, 0, 0, 2, 10, 0, 0, 1,
+                                    0x30, 0x39, 0x00, 0x50, 0, 0, 0, 1, 0, 0, 0, 0, 0x60, 0x02, 0xff, 0xff,
+                                    0, 0, 0, 0, 2, 4, 0x05, 0xb4};
+static_assert(parse_packet(CONSTANT_SYN, sizeof(CONSTANT_SYN)).tcp.valid(), "a SYN parses");
+static_assert(parse_packet(CONSTANT_SYN, sizeof(CONSTANT_SYN)).tcp.mss() == 1460, "and its MSS is found");
+static_assert(!parse_packet(CONSTANT_SYN, 30).tcp.valid(), "a truncated TCP header is not read");
+
+struct corpus {
+    std::vector<char> data = std::vector<char>(CORPUS_PACKETS * PACKET_SLOT);
+    std::vector<size_t> sizes = std::vector<size_t>(CORPUS_PACKETS);
+    const char *packet(size_t i) const { return &data[i % CORPUS_PACKETS * PACKET_SLOT]; }
+    size_t size(size_t i) const { return sizes[i % CORPUS_PACKETS]; }
+};
+
+size_t build_tcp(char *p, std::mt19937 &random, bool ipv6) {
+    bool syn = random() % 2;
+    size_t options = syn ? 12 : 0; // NOP, NOP, timestamp-sized filler, then MSS
+    size_t ip_size = ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr);
+    size_t size = ip_size + sizeof(struct tcphdr) + options;
+    memset(p, 0, size);
+    if (ipv6) {
+        struct ip6_hdr *ip = (struct ip6_hdr *)p;
+        ip->ip6_flow = htonl(6 << 28);
+        ip->ip6_plen = htons(size - ip_size);
+        ip->ip6_nxt = IPPROTO_TCP;
+        ip->ip6_hlim = 64;
+    } else {
+        struct iphdr *ip = (struct iphdr *)p;
+        ip->ihl = 5;
+        ip->version = 4;
+        ip->tot_len = htons(size);
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_TCP;
+        ip->saddr = random();
+        ip->daddr = random();
+    }
+    struct tcphdr *tcp = (struct tcphdr *)(p + ip_size);
+    tcp->source = random();
+    tcp->dest = htons(12345);
+    tcp->seq = random();
+    tcp->ack_seq = syn ? 0 : random();
+    tcp->doff = (sizeof(struct tcphdr) + options) / 4;
+    ((uint8_t *)tcp)[13] = syn ? TH_SYN : TH_ACK | (random() % 2 ? TH_PUSH : 0);
+    if (syn) {
+        unsigned char *option = (unsigned char *)(tcp + 1);
+        option[0] = option[1] = TCPOPT_NOP;
+        option[2] = 254; // An experimental option to skip
+        option[3] = 6;
+        option[8] = TCPOPT_MAXSEG;
+        option[9] = TCPOLEN_MAXSEG;
+        uint16_t mss = random() % 4 ? 1460 : 536;
+        option[10] = mss >> 8;
+        option[11] = mss & 0xff;
+    }
+    return size;
+}
+
+size_t build_udp(char *p, std::mt19937 &random) {
+    size_t size = sizeof(struct iphdr) + sizeof(struct udphdr) + 32;
+    memset(p, 0, size);
+    struct iphdr *ip = (struct iphdr *)p;
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tot_len = htons(size);
+    ip->protocol = IPPROTO_UDP;
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    udp->source = random();
+    udp->dest = htons(53);
+    udp->len = htons(size - sizeof(struct iphdr));
+    return size;
+}
+
+// IPv4 TCP only, which is all the server sees; or a mix with UDP and IPv6.
+corpus make_corpus(bool mixed) {
+    corpus c;
+    std::mt19937 random(mixed ? 2 : 1);
+    for (size_t i = 0; i < CORPUS_PACKETS; i++) {
+        char *p = &c.data[i * PACKET_SLOT];
+        uint32_t roll = mixed ? random() % 10 : 0;
+        c.sizes[i] = roll < 6 ? build_tcp(p, random, false) : roll < 8 ? build_udp(p, random) : build_tcp(p, random, true);
+    }
+    return c;
+}
+
+void stream_tcp_flags(std::ostream &out, const struct tcphdr *tcp) {
+    out << "[+] TCP Flags: "
+        << " SYN: " << tcp->syn << " ACK: " << tcp->ack << " FIN: " << tcp->fin << " RST: " << tcp->rst
+        << " PSH: " << tcp->psh << " SEQ: " << ntohl(tcp->seq) << std::endl;
+}
+
+template <typename Parse>
+double ns_per_packet(const corpus &c, size_t packets, Parse parse) {
+    volatile uint64_t sink = 0;
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < packets; i++) sum += parse(c.packet(i), c.size(i));
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    sink = sum;
+    (void)sink;
+    return seconds * 1e9 / packets;
+}
+
+int main(int argc, char *argv[]) {
+    size_t packets = (argc > 1 ? atoi(argv[1]) : 50) * (size_t)1e6;
+    if (packets == 0) {
+        std::cout << "[USE]: " << argv[0] << " [million packets per measurement]" << std::endl;
+        return 1;
+    }
+
+    corpus tcp = make_corpus(false), mixed = make_corpus(true);
+    for (size_t i = 0; i < CORPUS_PACKETS; i++) {
+        segment_fields a, b;
+        if (!parse_cast(tcp.packet(i), tcp.size(i), a) || !parse_view(tcp.packet(i), tcp.size(i), b) || !(a == b)) {
+            std::cerr << "Parsers disagree on packet " << i << std::endl;
+            return 1;
+        }
+        std::ostringstream streamed;
+        stream_tcp_flags(streamed, (const struct tcphdr *)(tcp.packet(i) + sizeof(struct iphdr)));
+        char line[FORMAT_TCP_FLAGS_MAX];
+        tcp_view t((const uint8_t *)tcp.packet(i) + sizeof(struct iphdr), tcp.size(i) - sizeof(struct iphdr));
+        if (streamed.str() != std::string(line, format_tcp_flags(line, t))) {
+            std::cerr << "Flag lines differ on packet " << i << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Casts and views agree on all " << CORPUS_PACKETS
+              << " packets, and the flag lines match. Nanoseconds per packet:" << std::endl;
+
+    auto cast = [](const char *p, size_t size) -> uint64_t {
+        segment_fields fields;
+        return parse_cast(p, size, fields) ? fields.hash() : 0;
+    };
+    auto view = [](const char *p, size_t size) -> uint64_t {
+        segment_fields fields;
+        return parse_view(p, size, fields) ? fields.hash() : 0;
+    };
+    auto any = [](const char *p, size_t size) -> uint64_t {
+        packet_view packet = parse_packet((const uint8_t *)p, size);
+        if (packet.tcp.valid()) return packet.tcp.seq() + packet.tcp.destination_port() + packet.tcp.flags();
+        if (packet.udp.valid()) return packet.udp.destination_port() + packet.udp.length();
+        return packet.ip_version;
+    };
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(40) << std::left << "  IPv4 TCP, casts" << ns_per_packet(tcp, packets, cast) << std::endl;
+    std::cout << std::setw(40) << "  IPv4 TCP, views" << ns_per_packet(tcp, packets, view) << std::endl;
+    std::cout << std::setw(40) << "  IPv4/IPv6 TCP and UDP, parse_packet" << ns_per_packet(mixed, packets, any)
+              << std::endl;
+
+    // The -v line for every packet, to /dev/null so the terminal is not timed
+    size_t lines = packets / 10;
+    std::ofstream null_stream("/dev/null");
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lines; i++) {
+        stream_tcp_flags(null_stream, (const struct tcphdr *)(tcp.packet(i) + sizeof(struct iphdr)));
+    }
+    double streamed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    FILE *null_file = fopen("/dev/null", "w");
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lines; i++) {
+        char line[FORMAT_TCP_FLAGS_MAX];
+        tcp_view t((const uint8_t *)tcp.packet(i) + sizeof(struct iphdr), tcp.size(i) - sizeof(struct iphdr));
+        fwrite(line, 1, format_tcp_flags(line, t), null_file);
+    }
+    fclose(null_file);
+    double formatted = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::setw(40) << "  flag line, std::cout << ... endl" << streamed * 1e9 / lines << std::endl;
+    std::cout << std::setw(40) << "  flag line, format_tcp_flags" << formatted * 1e9 / lines << std::endl;
+    return 0;
+}
@@ -0,0 +1,188 @@
+// Reading and writing classic libpcap files (not pcapng), without libpcap.
+//
+// pcap_reader loads a whole file into memory and hands out its packets as
+// pointers into it, with their link-layer header already skipped for the
+// link types we meet in practice (Ethernet, Linux cooked capture, raw IP).
+// Files in either byte order and with micro- or nanosecond timestamps are
+// read; pcap_writer writes raw IPv4 packets (LINKTYPE_RAW) with nanosecond
+// timestamps, which Wireshark and tcpdump read.
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#define PCAP_MAGIC_MICRO 0xa1b2c3d4
+#define PCAP_MAGIC_NANO 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+#define PCAP_WRITE_BUFFER (1 << 20)
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101      // Packets start with the IP header
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define DLT_RAW_BSD 12        // What some systems write for LINKTYPE_RAW
+
+struct pcap_file_header_v2 {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t seconds;
+    uint32_t fraction; // Micro- or nanoseconds
+    uint32_t captured;
+    uint32_t length;   // On the wire
+};
+
+struct pcap_packet {
+    uint64_t ns;          // Timestamp, nanoseconds since the epoch
+    const char *data;     // The network (IP) header
+    size_t size;          // Captured bytes from data on
+};
+
+class pcap_reader {
+public:
+    // Reads path into memory. Returns false, with the reason in error, if the
+    // file cannot be read or is not a pcap file.
+    bool open(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file) return failed("cannot open " + path);
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        contents.resize(size > 0 ? size : 0);
+        bool read = size > 0 && fread(&contents[0], 1, size, file) == (size_t)size;
+        fclose(file);
+        if (!read || contents.size() < sizeof(pcap_file_header_v2)) return failed(path + " is too short");
+
+        pcap_file_header_v2 header;
+        memcpy(&header, contents.data(), sizeof(header));
+        swapped = header.magic == __builtin_bswap32(PCAP_MAGIC_MICRO) || header.magic == __builtin_bswap32(PCAP_MAGIC_NANO);
+        uint32_t magic = swapped ? __builtin_bswap32(header.magic) : header.magic;
+        if (magic != PCAP_MAGIC_MICRO && magic != PCAP_MAGIC_NANO) return failed(path + " is not a pcap file");
+        nanoseconds = magic == PCAP_MAGIC_NANO;
+        linktype = value(header.linktype);
+        position = sizeof(header);
+        return true;
+    }
+
+    // The next packet that carries IPv4, or false at the end of the file.
+    // Packets of other protocols are skipped.
+    bool next(pcap_packet &packet) {
+        while (position + sizeof(pcap_record_header) <= contents.size()) {
+            pcap_record_header record;
+            memcpy(&record, &contents[position], sizeof(record));
+            size_t captured = value(record.captured);
+            const char *data = &contents[position + sizeof(record)];
+            if (position + sizeof(record) + captured > contents.size()) break; // Truncated file
+            position += sizeof(record) + captured;
+
+            size_t skip = network_offset(data, captured);
+            if (skip == SIZE_MAX) continue;
+            packet.ns = value(record.seconds) * 1000000000ULL + value(record.fraction) * (nanoseconds ? 1 : 1000);
+            packet.data = data + skip;
+            packet.size = captured - skip;
+            return true;
+        }
+        return false;
+    }
+
+    // Start over from the first packet.
+    void rewind() { position = sizeof(pcap_file_header_v2); }
+
+    std::string error;
+
+private:
+    std::vector<char> contents;
+    size_t position = 0;
+    bool swapped = false;
+    bool nanoseconds = false;
+    uint32_t linktype = 0;
+
+    uint32_t value(uint32_t field) const { return swapped ? __builtin_bswap32(field) : field; }
+
+    bool failed(const std::string &reason) {
+        error = reason;
+        return false;
+    }
+
+    // Where the IPv4 header starts, or SIZE_MAX if this is not IPv4.
+    size_t network_offset(const char *data, size_t size) const {
+        uint16_t protocol;
+        switch (linktype) {
+        case LINKTYPE_RAW:
+        case DLT_RAW_BSD:
+        case LINKTYPE_IPV4:
+            return size > 0 && (data[0] & 0xf0) == 0x40 ? 0 : SIZE_MAX;
+        case LINKTYPE_ETHERNET:
+            if (size < 14) return SIZE_MAX;
+            memcpy(&protocol, data + 12, 2);
+            if (ntohs(protocol) == 0x8100 && size >= 18) { // One VLAN tag
+                memcpy(&protocol, data + 16, 2);
+                return ntohs(protocol) == 0x0800 ? 18 : SIZE_MAX;
+            }
+            return ntohs(protocol) == 0x0800 ? 14 : SIZE_MAX;
+        case LINKTYPE_LINUX_SLL:
+            if (size < 16) return SIZE_MAX;
+            memcpy(&protocol, data + 14, 2);
+            return ntohs(protocol) == 0x0800 ? 16 : SIZE_MAX;
+        default:
+            return SIZE_MAX;
+        }
+    }
+};
+
+class pcap_writer {
+public:
+    pcap_writer() = default;
+    pcap_writer(const pcap_writer &) = delete;
+    pcap_writer &operator=(const pcap_writer &) = delete;
+    ~pcap_writer() { close(); }
+
+    bool open(const std::string &path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        setvbuf(file, nullptr, _IOFBF, PCAP_WRITE_BUFFER);
+        pcap_file_header_v2 header = {PCAP_MAGIC_NANO, 2, 4, 0, 0, PCAP_SNAPLEN, LINKTYPE_RAW};
+        return fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    // Appends an IPv4 packet taken at ns nanoseconds since the epoch.
+    void write(uint64_t ns, const char *packet, size_t size) {
+        if (!file) return;
+        size_t captured = size < PCAP_SNAPLEN ? size : PCAP_SNAPLEN;
+        pcap_record_header record = {(uint32_t)(ns / 1000000000), (uint32_t)(ns % 1000000000), (uint32_t)captured,
+                                     (uint32_t)size};
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(packet, 1, captured, file);
+        packets++;
+    }
+
+    // Pushes buffered packets to the file, e.g. before the process is killed.
+    void flush() {
+        if (file) fflush(file);
+    }
+
+    void close() {
+        if (file) fclose(file);
+        file = nullptr;
+    }
+
+    uint64_t packets = 0;
+
+private:
+    FILE *file = nullptr;
+};
+
+#endif
@@ -1,27 +1,119 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include "syn_cookie.h"
+#include "packet_ring.h"
+#include "packet_filter.h"
+#include "checksum.h"
+#include "pcap.h"
+#include "packet_view.h"
 
 #define SERVER_PORT 12345  // Listening port
+#define SERVER_MSS 1460    // Announced in our SYN-ACKs
+#define ACCEPT_BACKLOG 4096 // Completed handshakes not yet accepted; more are dropped
+#define STATS_INTERVAL_SECONDS 1
+#define MAX_BATCH 1024      // Largest --batch
+#define BATCH_SLOT_SIZE 2048 // Per received packet in batch mode; handle_packet only needs the headers
+#define REPLY_SIZE 128      // Room for any reply we build
 
-void print_tcp_flags(struct tcphdr *tcp) {
-    std::cout << "[+] TCP Flags: "
-              << " SYN: " << tcp->syn
-              << " ACK: " << tcp->ack
-              << " FIN: " << tcp->fin
-              << " RST: " << tcp->rst
-              << " PSH: " << tcp->psh
-              << " SEQ: " << ntohl(tcp->seq) << std::endl;
+bool verbose = false;  // -v: print every packet
+bool quiet = false;    // -q: do not print accepted connections
+const char *ring_interface = nullptr; // --ring <interface>: capture with packet_ring instead of recvfrom
+int batch_size = 1;       // --batch <n>: packets per recvmmsg and sendmmsg; 1 uses recvfrom and sendto
+int batch_timeout_us = 0; // --batch-timeout <us>: after the first packet, wait this long for a batch to fill
+const char *replay_path = nullptr; // --replay <file>: run a pcap trace through handle_packet, no sockets
+const char *replay_output = nullptr; // --replay-out <file>: write the replies to a pcap file
+int replay_loops = 1;     // --replay-loops <n>: go through the trace n times
+const char *capture_path = nullptr; // --capture <file>: write every packet handed to handle_packet to a pcap file
+bool use_filter = true; // --no-filter: let the kernel queue every TCP packet to us, as before packet_filter.h
+
+// Handshakes are stateless: the SYN-ACK's sequence number is a SYN cookie
+// (syn_cookie.h), and a final ACK that carries a valid cookie completes the
+// connection. Nothing is stored between the two.
+syn_cookies cookies;
+
+// While replaying, the cookie clock follows the packets' timestamps, so a
+// trace checks the same way at any later time.
+bool replaying = false;
+uint64_t replay_clock_ns = 0;
+
+uint32_t cookie_counter() {
+    return replaying ? syn_cookies::counter_at(replay_clock_ns) : syn_cookies::counter();
+}
+
+pcap_writer capture;
+
+struct connection {
+    flow_key flow;
+    uint32_t client_isn;
+    uint32_t server_isn;
+    uint16_t mss;
+};
+
+// Completed connections, handed from the packet loop to accept_connections.
+// One producer and one consumer.
+class accept_queue {
+public:
+    bool push(const connection &c) {
+        size_t tail = tail_index.load(std::memory_order_relaxed);
+        if (tail - head_index.load(std::memory_order_acquire) == ACCEPT_BACKLOG) return false;
+        slots[tail % ACCEPT_BACKLOG] = c;
+        tail_index.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(connection &c) {
+        size_t head = head_index.load(std::memory_order_relaxed);
+        if (head == tail_index.load(std::memory_order_acquire)) return false;
+        c = slots[head % ACCEPT_BACKLOG];
+        head_index.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    connection slots[ACCEPT_BACKLOG];
+    alignas(64) std::atomic<size_t> head_index{0};
+    alignas(64) std::atomic<size_t> tail_index{0};
+};
+
+accept_queue accepted;
+
+// Counted by the packet loop only.
+struct handshake_stats {
+    uint64_t packets = 0;     // TCP packets to SERVER_PORT
+    uint64_t syns = 0;
+    uint64_t syn_acks = 0;    // Sent
+    uint64_t handshakes = 0;  // ACKs with a valid cookie
+    uint64_t bad_acks = 0;    // ACKs without one
+    uint64_t backlog_drops = 0;
+    uint64_t tx_drops = 0;    // No free transmit ring slot for a reply
+    uint64_t syscalls = 0;    // Receives, sends and waits in the packet loop
+} stats;
+
+// One line per packet with -v, formatted into a buffer rather than streamed
+// field by field and flushed each time.
+void print_tcp_flags(const tcp_view &tcp) {
+    char line[FORMAT_TCP_FLAGS_MAX];
+    fwrite(line, 1, format_tcp_flags(line, tcp), stdout);
 }
 
-void send_syn_ack(int sock, struct sockaddr_in *client_addr, struct tcphdr *tcp) {
-    char packet[sizeof(struct iphdr) + sizeof(struct tcphdr)];
-    memset(packet, 0, sizeof(packet));
+// Writes the SYN-ACK for a SYN into packet and returns its size.
+size_t build_syn_ack(const ipv4_view &syn_ip, const tcp_view &syn, uint32_t isn, char *packet) {
+    size_t size = sizeof(struct iphdr) + sizeof(struct tcphdr) + TCPOLEN_MAXSEG;
+    memset(packet, 0, size);
 
     struct iphdr *ip = (struct iphdr *)packet;
     struct tcphdr *tcp_response = (struct tcphdr *)(packet + sizeof(struct iphdr));
@@ -30,34 +122,122 @@ void send_syn_ack(int sock, struct sockaddr_in *client_addr, struct tcphdr *tcp)
     ip->ihl = 5;
     ip->version = 4;
     ip->tos = 0;
-    ip->tot_len = htons(sizeof(packet));
+    ip->tot_len = htons(size);
     ip->id = htons(54321);
     ip->frag_off = 0;
     ip->ttl = 64;
     ip->protocol = IPPROTO_TCP;
-    ip->saddr = client_addr->sin_addr.s_addr;
-    ip->daddr = inet_addr("127.0.0.1");  // Server address
+    ip->saddr = htonl(syn_ip.destination());
+    ip->daddr = htonl(syn_ip.source());
 
     // Fill TCP header
-    tcp_response->source = tcp->dest;
-    tcp_response->dest = tcp->source;
-    tcp_response->seq = htonl(400);
-    tcp_response->ack_seq = htonl(ntohl(tcp->seq) + 1);
-    tcp_response->doff = 5;
+    tcp_response->source = htons(syn.destination_port());
+    tcp_response->dest = htons(syn.source_port());
+    tcp_response->seq = htonl(isn);
+    tcp_response->ack_seq = htonl(syn.seq() + 1);
+    tcp_response->doff = (sizeof(struct tcphdr) + TCPOLEN_MAXSEG) / 4;
     tcp_response->syn = 1;
     tcp_response->ack = 1;
     tcp_response->window = htons(8192);
-    tcp_response->check = 0;  // Kernel will compute the checksum
+    tcp_response->check = 0;  // The kernel does not fill this in for IP_HDRINCL sockets
 
-    // Send packet
-    if (sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("sendto() failed");
-    } else {
-        std::cout << "[+] Sent SYN-ACK" << std::endl;
+    unsigned char *option = (unsigned char *)(tcp_response + 1);
+    option[0] = TCPOPT_MAXSEG;
+    option[1] = TCPOLEN_MAXSEG;
+    option[2] = SERVER_MSS >> 8;
+    option[3] = SERVER_MSS & 0xff;
+    tcp_response->check = transport_checksum(ip->saddr, ip->daddr, IPPROTO_TCP, tcp_response, size - sizeof(struct iphdr));
+    ip->check = internet_checksum(ip, sizeof(struct iphdr)); // Raw sockets redo this one; packet ring frames need it
+    return size;
+}
+
+// Runs the handshake engine on one received IPv4 packet. Writes the reply,
+// if there is one, into reply and returns its size, or 0.
+size_t handle_packet(const char *packet, size_t size, char *reply) {
+    if (capture_path) {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        capture.write(now.tv_sec * 1000000000ULL + now.tv_nsec, packet, size);
+    }
+    // Later fragments carry no TCP header
+    ipv4_view ip((const uint8_t *)packet, size);
+    if (!ip.valid() || ip.protocol() != IPPROTO_TCP || ip.fragment_offset() != 0) return 0;
+    tcp_view tcp(ip.payload(), ip.payload_size());
+    if (!tcp.valid()) return 0;
+
+    // Only process packets for the correct destination port
+    if (tcp.destination_port() != SERVER_PORT) return 0;
+    stats.packets++;
+    if (verbose) print_tcp_flags(tcp);
+    if (tcp.rst()) return 0;
+
+    flow_key flow = {htonl(ip.source()), htonl(ip.destination()), htons(tcp.source_port()),
+                     htons(tcp.destination_port())};
+    if (tcp.syn() && !tcp.ack()) {
+        stats.syns++;
+        uint32_t isn = cookies.make(flow, tcp.seq(), tcp.mss(), cookie_counter());
+        stats.syn_acks++;
+        return build_syn_ack(ip, tcp, isn, reply);
+    }
+
+    if (tcp.ack() && !tcp.syn()) {
+        connection c = {flow, tcp.seq() - 1, tcp.ack_seq() - 1, 0};
+        if (!cookies.check(flow, c.client_isn, c.server_isn, cookie_counter(), c.mss)) {
+            stats.bad_acks++;
+            return 0;
+        }
+        stats.handshakes++;
+        if (!accepted.push(c)) stats.backlog_drops++;
     }
+    return 0;
 }
 
-void receive_syn() {
+// The application side: takes completed connections off the accept queue.
+void accept_connections() {
+    connection c;
+    while (true) {
+        if (!accepted.pop(c)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (quiet) continue;
+        in_addr address = {c.flow.client_addr};
+        std::cout << "[+] Handshake complete with " << inet_ntoa(address) << ":" << ntohs(c.flow.client_port)
+                  << " (MSS " << c.mss << ")" << std::endl;
+    }
+}
+
+// One line per STATS_INTERVAL_SECONDS with traffic: rates and the peak
+// memory use, which a SYN flood must not move.
+void report_stats() {
+    static handshake_stats last;
+    static auto last_time = std::chrono::steady_clock::now();
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - last_time).count();
+    if (seconds < STATS_INTERVAL_SECONDS) return;
+    capture.flush();
+    static double last_cpu = 0;
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    static uint64_t peak = 0;
+    if (stats.packets != last.packets) {
+        uint64_t handshakes = (stats.handshakes - last.handshakes) / seconds;
+        peak = std::max(peak, handshakes);
+        std::cout << "[+] " << (uint64_t)((stats.syns - last.syns) / seconds) << " SYNs/s, " << handshakes
+                  << " handshakes/s (peak " << peak << "), "
+                  << (cpu - last_cpu) * 1e9 / (stats.packets - last.packets) << " ns CPU/packet, "
+                  << (double)(stats.syscalls - last.syscalls) / (stats.packets - last.packets) << " syscalls/packet; total "
+                  << stats.syns << " SYNs, " << stats.handshakes << " handshakes, " << stats.bad_acks
+                  << " bad ACKs, " << stats.backlog_drops << " backlog drops, " << stats.tx_drops
+                  << " TX drops; max RSS " << usage.ru_maxrss << " KB" << std::endl;
+    }
+    last_cpu = cpu;
+    last = stats;
+    last_time = now;
+}
+
+int open_raw_socket() {
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
     if (sock < 0) {
         perror("Socket creation failed");
@@ -71,42 +251,243 @@ void receive_syn() {
         exit(EXIT_FAILURE);
     }
 
+    // Only handshake packets to SERVER_PORT
+    if (use_filter && !attach_filter(sock, handshake_filter(SERVER_PORT, 0))) {
+        perror("SO_ATTACH_FILTER failed");
+    }
+
+    // Wake up now and then to report stats
+    timeval timeout = {STATS_INTERVAL_SECONDS, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+void receive_syn() {
+    int sock = open_raw_socket();
     char buffer[65536];
+    char reply[REPLY_SIZE];
     struct sockaddr_in source_addr;
     socklen_t addr_len = sizeof(source_addr);
 
     while (true) {
         int data_size = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &addr_len);
+        stats.syscalls++;
         if (data_size < 0) {
-            perror("Packet reception failed");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Packet reception failed");
+            report_stats();
             continue;
         }
 
-        struct iphdr *ip = (struct iphdr *)buffer;
-        struct tcphdr *tcp = (struct tcphdr *)(buffer + (ip->ihl * 4));
+        size_t reply_size = handle_packet(buffer, data_size, reply);
+        if (reply_size > 0) {
+            struct sockaddr_in to = {};
+            to.sin_family = AF_INET;
+            to.sin_addr.s_addr = htonl(ipv4_view((const uint8_t *)reply, reply_size).destination());
+            stats.syscalls++;
+            if (sendto(sock, reply, reply_size, 0, (struct sockaddr *)&to, sizeof(to)) < 0) {
+                perror("sendto() failed");
+            }
+        }
+        report_stats();
+    }
 
-        // Only process packets for the correct destination port
-        if (ntohs(tcp->dest) != SERVER_PORT) continue;
+    close(sock);
+}
 
-        print_tcp_flags(tcp);
+// The raw socket loop in batches: one recvmmsg takes up to batch_size
+// packets, waiting batch_timeout_us at most for a batch to fill once the
+// first packet is in, and one sendmmsg sends all of their replies.
+void receive_batches() {
+    int sock = open_raw_socket();
+    std::vector<char> buffers((size_t)batch_size * BATCH_SLOT_SIZE);
+    std::vector<char> replies((size_t)batch_size * REPLY_SIZE);
+    std::vector<iovec> in_iovs(batch_size), out_iovs(batch_size);
+    std::vector<mmsghdr> in(batch_size), out(batch_size);
+    std::vector<sockaddr_in> destinations(batch_size);
+    for (int i = 0; i < batch_size; i++) {
+        in_iovs[i] = {&buffers[(size_t)i * BATCH_SLOT_SIZE], BATCH_SLOT_SIZE};
+        in[i].msg_hdr.msg_iov = &in_iovs[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        out[i].msg_hdr.msg_name = &destinations[i];
+        out[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        out[i].msg_hdr.msg_iov = &out_iovs[i];
+        out[i].msg_hdr.msg_iovlen = 1;
+    }
 
-        if (tcp->syn == 1 && tcp->ack == 0 && ntohl(tcp->seq) == 200) {
-            std::cout << "[+] Received SYN from " << inet_ntoa(source_addr.sin_addr) << std::endl;
-            send_syn_ack(sock, &source_addr, tcp);
+    while (true) {
+        int received = recvmmsg(sock, in.data(), batch_size, MSG_WAITFORONE, nullptr);
+        stats.syscalls++;
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Packet reception failed");
+            report_stats();
+            continue;
+        }
+        if (batch_timeout_us > 0 && received < batch_size) {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(batch_timeout_us);
+            while (received < batch_size) {
+                auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+                if (left.count() <= 0) break;
+                pollfd fd = {sock, POLLIN, 0};
+                timespec wait = {0, (long)left.count()};
+                stats.syscalls += 2;
+                if (ppoll(&fd, 1, &wait, nullptr) <= 0) break;
+                int more = recvmmsg(sock, &in[received], batch_size - received, MSG_DONTWAIT, nullptr);
+                if (more > 0) received += more;
+            }
         }
 
-        if (tcp->ack == 1 && tcp->syn == 0 && ntohl(tcp->seq) == 600) {
-            std::cout << "[+] Received ACK, handshake complete." << std::endl;
-            break;
+        int replies_queued = 0;
+        for (int i = 0; i < received; i++) {
+            char *reply = &replies[(size_t)replies_queued * REPLY_SIZE];
+            size_t reply_size = handle_packet((const char *)in_iovs[i].iov_base, in[i].msg_len, reply);
+            if (reply_size == 0) continue;
+            destinations[replies_queued] = {};
+            destinations[replies_queued].sin_family = AF_INET;
+            destinations[replies_queued].sin_addr.s_addr = htonl(ipv4_view((const uint8_t *)reply, reply_size).destination());
+            out_iovs[replies_queued] = {reply, reply_size};
+            replies_queued++;
+        }
+        for (int sent = 0; sent < replies_queued;) {
+            int n = sendmmsg(sock, &out[sent], replies_queued - sent, 0);
+            stats.syscalls++;
+            if (n < 0) {
+                perror("sendmmsg() failed");
+                break;
+            }
+            sent += n;
         }
+        report_stats();
     }
+}
 
-    close(sock);
+// The same loop on a TPACKET_V3 ring: packets are handled where the kernel
+// put them, and replies are built in the transmit ring, with the Ethernet
+// addresses of the packet they answer swapped.
+void receive_ring(const char *interface) {
+    packet_ring ring;
+    if (!ring.open(interface)) exit(EXIT_FAILURE);
+    if (use_filter && !attach_filter(ring.fd(), handshake_filter(SERVER_PORT, ETH_HLEN))) {
+        perror("SO_ATTACH_FILTER failed");
+    }
+
+    char scratch[REPLY_SIZE];
+    while (true) {
+        ring.receive(STATS_INTERVAL_SECONDS * 1000, [&](const char *link, const char *packet, size_t size) {
+            char *frame = ring.tx_frame();
+            size_t reply_size = handle_packet(packet, size, frame ? frame + ETH_HLEN : scratch);
+            if (reply_size == 0) return;
+            if (frame == nullptr || packet - link != ETH_HLEN) {
+                stats.tx_drops++;
+                return;
+            }
+            const struct ethhdr *from = (const struct ethhdr *)link;
+            struct ethhdr *to = (struct ethhdr *)frame;
+            memcpy(to->h_dest, from->h_source, ETH_ALEN);
+            memcpy(to->h_source, from->h_dest, ETH_ALEN);
+            to->h_proto = htons(ETH_P_IP);
+            ring.tx_commit(ETH_HLEN + reply_size);
+        });
+        ring.tx_flush();
+        stats.syscalls = ring.syscalls();
+        report_stats();
+    }
 }
 
-int main() {
+// Runs a pcap trace through handle_packet as fast as it goes, replies to a
+// pcap file if asked, and reports the packet rate. Completed connections are
+// taken off the accept queue after each packet, as an application would.
+void replay(const char *path) {
+    pcap_reader trace;
+    if (!trace.open(path)) {
+        std::cerr << "Error: " << trace.error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    pcap_writer replies;
+    if (replay_output && !replies.open(replay_output)) {
+        perror(replay_output);
+        exit(EXIT_FAILURE);
+    }
+    replaying = true;
+
+    char reply[REPLY_SIZE];
+    connection c;
+    uint64_t packets = 0, accepted_count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int loop = 0; loop < replay_loops; loop++) {
+        trace.rewind();
+        pcap_packet packet;
+        while (trace.next(packet)) {
+            replay_clock_ns = packet.ns;
+            size_t reply_size = handle_packet(packet.data, packet.size, reply);
+            if (reply_size > 0 && replay_output) replies.write(packet.ns, reply, reply_size);
+            while (accepted.pop(c)) accepted_count++;
+            packets++;
+        }
+    }
+    replies.close();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[+] Replayed " << packets << " packets in " << seconds << " s, " << packets / seconds / 1e6
+              << " Mpps" << std::endl;
+    std::cout << "[+] Replayed: " << stats.syns << " SYNs, " << stats.handshakes << " handshakes, " << stats.bad_acks
+              << " bad ACKs; " << accepted_count << " accepted, " << replies.packets << " replies written" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    const char *key = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quiet = true;
+        } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            ring_interface = argv[++i];
+        } else if (strcmp(argv[i], "--no-filter") == 0) {
+            use_filter = false;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_size = std::min(std::max(atoi(argv[++i]), 1), MAX_BATCH);
+        } else if (strcmp(argv[i], "--batch-timeout") == 0 && i + 1 < argc) {
+            batch_timeout_us = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay-out") == 0 && i + 1 < argc) {
+            replay_output = argv[++i];
+        } else if (strcmp(argv[i], "--replay-loops") == 0 && i + 1 < argc) {
+            replay_loops = std::max(atoi(argv[++i]), 1);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--cookie-key") == 0 && i + 1 < argc) {
+            key = argv[++i];
+        } else {
+            std::cout << "[USE]: " << argv[0] << " [-v] [-q] [--ring <interface>] [--no-filter] [--batch <n>]"
+                      << " [--batch-timeout <us>] [--capture <file>] [--cookie-key <32 hex digits>]" << std::endl;
+            std::cout << "       " << argv[0] << " [-v] --replay <file> [--replay-out <file>] [--replay-loops <n>]"
+                      << " [--cookie-key <32 hex digits>]" << std::endl;
+            return 1;
+        }
+    }
+    // Replays use the trace key unless told otherwise
+    if (replay_path && !key) key = TRACE_COOKIE_KEY;
+    if (key && !cookies.set_key(key)) {
+        std::cerr << "Error: a cookie key is 32 hex digits." << std::endl;
+        return 1;
+    }
+    if (capture_path && !capture.open(capture_path)) {
+        perror(capture_path);
+        return 1;
+    }
+    if (replay_path) {
+        replay(replay_path);
+        return 0;
+    }
+
+    std::thread(accept_connections).detach();
     std::cout << "[+] Server listening on port " << SERVER_PORT << "..." << std::endl;
-    receive_syn();
+    if (ring_interface) {
+        receive_ring(ring_interface);
+    } else if (batch_size > 1) {
+        receive_batches();
+    } else {
+        receive_syn();
+    }
     return 0;
 }
-
@@ -0,0 +1,157 @@
+// SYN cookies: the server's initial sequence number encodes everything it
+// needs to finish a handshake, so nothing is stored per SYN and a SYN flood
+// costs no memory.
+//
+// A cookie is 32 bits:
+//
+//   | 5 bits: time counter | 3 bits: MSS index | 24 bits: SipHash-2-4 |
+//
+// The counter ticks every COOKIE_TICK_SECONDS. The hash covers the 4-tuple,
+// the client's ISN, the counter and the MSS index under a random per-process
+// key. The final ACK of a handshake carries cookie + 1 as its ack number and
+// client ISN + 1 as its sequence number, which is all check() needs: it finds
+// the counter the cookie was made with (at most COOKIE_MAX_AGE ticks ago),
+// recomputes the hash, and returns the MSS the client asked for.
+
+#ifndef SYN_COOKIE_H
+#define SYN_COOKIE_H
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <sys/random.h>
+
+#define COOKIE_TICK_SECONDS 64 // One counter value per 64 s, as in Linux
+#define COOKIE_MAX_AGE 2       // A cookie is good for 2 to 3 ticks
+#define TRACE_COOKIE_KEY "a3a3a3a3a3a3a3a3c00c1e5c00c1e5a3" // Fixed key for synthetic traces and their replays
+
+// The IPv4 4-tuple of a connection, fields in network byte order.
+struct flow_key {
+    uint32_t client_addr;
+    uint32_t server_addr;
+    uint16_t client_port;
+    uint16_t server_port;
+};
+
+inline uint64_t rotl64(uint64_t x, int b) { return (x << b) | (x >> (64 - b)); }
+
+// SipHash-2-4 of size bytes (Aumasson and Bernstein).
+inline uint64_t siphash24(const uint64_t key[2], const void *data, size_t size) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+    auto round = [&]() {
+        v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);
+        v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);
+    };
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t m;
+        memcpy(&m, bytes + i * 8, 8); // Little-endian hosts only, like the rest of the server
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    uint64_t last = (uint64_t)size << 56;
+    for (size_t i = 0; i < size % 8; i++) {
+        last |= (uint64_t)bytes[words * 8 + i] << (8 * i);
+    }
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// MSS values a cookie can carry; a client gets the largest one not above
+// what it asked for.
+const uint16_t cookie_mss_table[8] = {536, 1220, 1300, 1360, 1440, 1460, 8960, 65483};
+
+class syn_cookies {
+public:
+    syn_cookies() {
+        if (getrandom(key, sizeof(key), 0) != sizeof(key)) {
+            key[0] = (uint64_t)time(nullptr) * 0x9e3779b97f4a7c15ULL; // Should not happen; still unique per run
+            key[1] = (uint64_t)clock();
+        }
+    }
+
+    // Replaces the random key, e.g. with one given as 32 hex digits, so
+    // that cookies in a capture can be checked again when it is replayed.
+    // Returns false if hex is not a key.
+    bool set_key(const char *hex) {
+        uint64_t parsed[2] = {0, 0};
+        if (strlen(hex) != 32) return false;
+        for (int i = 0; i < 32; i++) {
+            char c = hex[i] | 0x20; // Lower case
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else {
+                return false;
+            }
+            parsed[i / 16] = parsed[i / 16] << 4 | digit;
+        }
+        key[0] = parsed[0];
+        key[1] = parsed[1];
+        return true;
+    }
+
+    // The time counter at ns nanoseconds since the epoch.
+    static uint32_t counter_at(uint64_t ns) { return ns / 1000000000 / COOKIE_TICK_SECONDS; }
+
+    // The current value of the time counter. It runs on the wall clock, as
+    // pcap timestamps do.
+    static uint32_t counter() {
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return now.tv_sec / COOKIE_TICK_SECONDS;
+    }
+
+    // The ISN to answer a SYN with.
+    uint32_t make(const flow_key &flow, uint32_t client_isn, uint16_t mss, uint32_t now) const {
+        uint32_t index = 0;
+        while (index < 7 && cookie_mss_table[index + 1] <= mss) index++;
+        return (now & 31) << 27 | index << 24 | hash(flow, client_isn, now, index);
+    }
+
+    // Returns true if cookie was made by make() for this flow and client ISN
+    // recently enough, and sets mss to the client's (rounded down) MSS.
+    bool check(const flow_key &flow, uint32_t client_isn, uint32_t cookie, uint32_t now, uint16_t &mss) const {
+        uint32_t age = (now - (cookie >> 27)) & 31;
+        if (age > COOKIE_MAX_AGE || age > now) return false;
+        uint32_t index = cookie >> 24 & 7;
+        if (hash(flow, client_isn, now - age, index) != (cookie & 0xffffff)) return false;
+        mss = cookie_mss_table[index];
+        return true;
+    }
+
+private:
+    uint64_t key[2];
+
+    uint32_t hash(const flow_key &flow, uint32_t client_isn, uint32_t counter, uint32_t index) const {
+        struct {
+            flow_key flow;
+            uint32_t client_isn;
+            uint32_t counter;
+            uint32_t index;
+        } input;
+        memset(&input, 0, sizeof(input));
+        input.flow = flow;
+        input.client_isn = client_isn;
+        input.counter = counter;
+        input.index = index;
+        return siphash24(key, &input, sizeof(input)) & 0xffffff;
+    }
+};
+
+#endif
@@ -0,0 +1,145 @@
+// Writes a synthetic pcap trace for `server --replay`: handshakes from many
+// clients, interleaved, plus the packets the server has to turn away.
+//
+// Every handshake is a SYN and, HANDSHAKE_SPREAD packets later, the final
+// ACK, whose ack number is the cookie the server will have answered with:
+// the trace is made with the same key as the replay (TRACE_COOKIE_KEY unless
+// --cookie-key is given), and the cookie clock follows the timestamps. Mixed
+// in are ACKs with a wrong cookie, RSTs and packets to other ports.
+//
+//   ./trace_gen <out.pcap> [handshakes] [--cookie-key <32 hex digits>]
+//
+// The last line ("Expect: ...") is what the replay must report.
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "syn_cookie.h"
+#include "checksum.h"
+#include "pcap.h"
+
+#define SERVER_PORT 12345
+#define HANDSHAKE_SPREAD 64   // Packets between a SYN and its ACK
+#define TRACE_START_NS 1700000000000000000ULL
+#define PACKET_SPACING_NS 1000
+
+struct pending_ack {
+    flow_key flow;
+    uint32_t client_isn;
+    uint32_t cookie;
+};
+
+// An IPv4 TCP packet with valid checksums; mss 0 means no options.
+size_t build_packet(char *packet, const flow_key &flow, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t mss) {
+    size_t options = mss ? TCPOLEN_MAXSEG : 0;
+    size_t size = sizeof(struct iphdr) + sizeof(struct tcphdr) + options;
+    memset(packet, 0, size);
+    struct iphdr *ip = (struct iphdr *)packet;
+    struct tcphdr *tcp = (struct tcphdr *)(packet + sizeof(struct iphdr));
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tot_len = htons(size);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = flow.client_addr;
+    ip->daddr = flow.server_addr;
+    tcp->source = flow.client_port;
+    tcp->dest = flow.server_port;
+    tcp->seq = htonl(seq);
+    tcp->ack_seq = htonl(ack);
+    tcp->doff = (sizeof(struct tcphdr) + options) / 4;
+    ((uint8_t *)tcp)[13] = flags;
+    tcp->window = htons(65535);
+    if (mss) {
+        unsigned char *option = (unsigned char *)(tcp + 1);
+        option[0] = TCPOPT_MAXSEG;
+        option[1] = TCPOLEN_MAXSEG;
+        option[2] = mss >> 8;
+        option[3] = mss & 0xff;
+    }
+    tcp->check = transport_checksum(ip->saddr, ip->daddr, IPPROTO_TCP, tcp, size - sizeof(struct iphdr));
+    ip->check = internet_checksum(ip, sizeof(struct iphdr));
+    return size;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = nullptr;
+    const char *key = TRACE_COOKIE_KEY;
+    long handshakes = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cookie-key") == 0 && i + 1 < argc) {
+            key = argv[++i];
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            handshakes = atol(argv[i]);
+        }
+    }
+    syn_cookies cookies;
+    if (!path || handshakes < 1 || !cookies.set_key(key)) {
+        std::cout << "[USE]: " << argv[0] << " <out.pcap> [handshakes] [--cookie-key <32 hex digits>]" << std::endl;
+        return 1;
+    }
+    pcap_writer out;
+    if (!out.open(path)) {
+        perror(path);
+        return 1;
+    }
+
+    std::mt19937 random(2025);
+    const uint32_t server_addr = inet_addr("10.0.0.1");
+    std::vector<pending_ack> pending;
+    uint64_t ns = TRACE_START_NS;
+    long syns = 0, valid_acks = 0, bad_acks = 0, resets = 0, other_ports = 0;
+    char packet[128];
+
+    auto emit = [&](size_t size) {
+        out.write(ns, packet, size);
+        ns += PACKET_SPACING_NS;
+    };
+    auto ack_one = [&]() {
+        pending_ack p = pending.front();
+        pending.erase(pending.begin());
+        emit(build_packet(packet, p.flow, p.client_isn + 1, p.cookie + 1, TH_ACK, 0));
+        valid_acks++;
+    };
+
+    while (syns < handshakes || !pending.empty()) {
+        if (syns < handshakes) {
+            flow_key flow = {htonl(0x0a000000 | (random() & 0xffffff)), server_addr,
+                             htons(1024 + random() % 64000), htons(SERVER_PORT)};
+            uint32_t isn = random();
+            uint16_t mss = random() % 4 ? 1460 : 536;
+            emit(build_packet(packet, flow, isn, 0, TH_SYN, mss));
+            pending.push_back({flow, isn, cookies.make(flow, isn, mss, syn_cookies::counter_at(ns))});
+            syns++;
+
+            uint32_t roll = random() % 100;
+            if (roll < 5) { // An ACK nobody sent a SYN for
+                flow.client_port = htons(1024 + random() % 64000);
+                emit(build_packet(packet, flow, random(), random(), TH_ACK, 0));
+                bad_acks++;
+            } else if (roll < 7) {
+                emit(build_packet(packet, flow, random(), 0, TH_RST, 0));
+                resets++;
+            } else if (roll < 17) {
+                flow.server_port = htons(80);
+                emit(build_packet(packet, flow, random(), 0, TH_SYN, 1460));
+                other_ports++;
+            }
+        }
+        if (pending.size() > HANDSHAKE_SPREAD || syns == handshakes) ack_one();
+    }
+    out.close();
+
+    std::cout << "Wrote " << out.packets << " packets to " << path << ": " << syns << " SYNs, " << valid_acks
+              << " completing ACKs, " << bad_acks << " bogus ACKs, " << resets << " RSTs, " << other_ports
+              << " to other ports" << std::endl;
+    std::cout << "Expect: " << syns << " SYNs, " << valid_acks << " handshakes, " << bad_acks << " bad ACKs" << std::endl;
+    return 0;
+}
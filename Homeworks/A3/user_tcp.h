@@ -0,0 +1,519 @@
+// The data path of a minimal userspace TCP, for bulk transfer experiments
+// (utcp.cpp): one sender, one receiver, no I/O. The caller parses segments,
+// hands them over, and sends what these classes ask for.
+//
+// Both sides count in 64-bit stream offsets: byte 0 of the stream is the one
+// after the SYN, and the FIN takes offset length. unwrap_sequence() turns a
+// 32-bit sequence number from the wire back into an offset.
+//
+// tcp_sender:
+// - keeps a sliding window of min(cwnd, peer's window) bytes in flight,
+//   counted as RFC 6675's "pipe": sent, not acknowledged, not SACKed, and not
+//   presumed lost;
+// - learns which bytes arrived from cumulative ACKs and SACK blocks (RFC
+//   2018), and enters recovery after three duplicate ACKs or once more than
+//   (3 - 1) * MSS is SACKed above a hole, then retransmits the holes below
+//   the highest SACKed byte, each once, and again if data sent after them
+//   is SACKed first;
+// - times one segment at a time (Karn: never a retransmitted one) for the
+//   RFC 6298 RTO, and on a timeout presumes everything unSACKed lost and
+//   starts over from one segment;
+// - grows cwnd with Reno (RFC 5681) or CUBIC (RFC 9438).
+//
+// tcp_receiver copies segments into a ring buffer that the application is
+// assumed to drain at once, keeps out-of-order ranges for SACK, and asks for
+// an ACK every second segment, at once when data is out of order or fills a
+// hole, and otherwise when the caller runs out of packets to process.
+
+#ifndef USER_TCP_H
+#define USER_TCP_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#define UTCP_MAX_SACK_BLOCKS 4        // What fits in the option space without timestamps
+#define UTCP_INITIAL_WINDOW 10        // Segments (RFC 6928)
+#define UTCP_DUPACK_THRESHOLD 3
+#define UTCP_INITIAL_RTO_NS 1000000000ULL
+#define UTCP_MIN_RTO_NS 200000000ULL  // 200 ms, as in Linux; RFC 6298 says 1 s
+#define UTCP_MAX_RTO_NS 60000000000ULL
+#define UTCP_WINDOW_SHIFT 7           // Window scale (RFC 7323) we announce
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+// A half-open range of stream offsets.
+struct sack_block {
+    uint64_t start;
+    uint64_t end;
+};
+
+// The offset nearest to reference whose low 32 bits are relative.
+inline uint64_t unwrap_sequence(uint32_t relative, uint64_t reference) {
+    return reference + (int64_t)(int32_t)(relative - (uint32_t)reference);
+}
+
+// Disjoint ranges, merged as they are added.
+class range_set {
+public:
+    // Adds [start, end) and returns the range it ended up in.
+    sack_block add(uint64_t start, uint64_t end) {
+        auto next = ranges.upper_bound(start);
+        if (next != ranges.begin()) {
+            auto previous = std::prev(next);
+            if (previous->second >= start) {
+                start = previous->first;
+                end = std::max(end, previous->second);
+                total -= previous->second - previous->first;
+                ranges.erase(previous);
+            }
+        }
+        while (next != ranges.end() && next->first <= end) {
+            end = std::max(end, next->second);
+            total -= next->second - next->first;
+            next = ranges.erase(next);
+        }
+        ranges[start] = end;
+        total += end - start;
+        return {start, end};
+    }
+
+    // Forgets everything below offset.
+    void remove_below(uint64_t offset) {
+        while (!ranges.empty() && ranges.begin()->first < offset) {
+            auto first = ranges.begin();
+            uint64_t end = first->second;
+            total -= end - first->first;
+            ranges.erase(first);
+            if (end > offset) {
+                ranges[offset] = end;
+                total += end - offset;
+            }
+        }
+    }
+
+    uint64_t bytes() const { return total; }
+    uint64_t highest() const { return ranges.empty() ? 0 : ranges.rbegin()->second; }
+
+    std::map<uint64_t, uint64_t> ranges; // start -> end
+
+private:
+    uint64_t total = 0;
+};
+
+// RFC 6298.
+class rtt_estimator {
+public:
+    void sample(uint64_t rtt) {
+        if (srtt == 0) {
+            srtt = rtt;
+            rttvar = rtt / 2;
+        } else {
+            uint64_t error = srtt > rtt ? srtt - rtt : rtt - srtt;
+            rttvar = (3 * rttvar + error) / 4;
+            srtt = (7 * srtt + rtt) / 8;
+        }
+        min_rtt = min_rtt ? std::min(min_rtt, rtt) : rtt;
+        uint64_t rto = srtt + std::max<uint64_t>(4 * rttvar, 1000000); // G, the clock granularity, is 1 ms
+        base_rto = std::min<uint64_t>(std::max<uint64_t>(rto, UTCP_MIN_RTO_NS), UTCP_MAX_RTO_NS);
+        current_rto = base_rto;
+    }
+
+    void backoff() { current_rto = std::min<uint64_t>(current_rto * 2, UTCP_MAX_RTO_NS); }
+    uint64_t rto() const { return current_rto; }
+
+    uint64_t srtt = 0;
+    uint64_t rttvar = 0;
+    uint64_t min_rtt = 0;
+
+private:
+    uint64_t base_rto = UTCP_INITIAL_RTO_NS;
+    uint64_t current_rto = UTCP_INITIAL_RTO_NS;
+};
+
+enum class congestion_algorithm { reno, cubic };
+
+// cwnd and ssthresh in bytes, for Reno or CUBIC. CUBIC works in segments
+// internally, as the RFC does.
+class congestion_control {
+public:
+    congestion_control(congestion_algorithm algorithm, uint32_t mss)
+        : algorithm(algorithm), mss(mss), cwnd((uint64_t)UTCP_INITIAL_WINDOW * mss) {}
+
+    // New data was cumulatively acknowledged outside recovery.
+    void on_ack(uint64_t acked, uint64_t now, uint64_t srtt) {
+        if (cwnd < ssthresh) { // Slow start: one byte per byte acknowledged
+            uint64_t grow = std::min(acked, ssthresh - cwnd);
+            cwnd += grow;
+            acked -= grow;
+            if (acked == 0) return;
+        }
+        if (algorithm == congestion_algorithm::reno) {
+            bytes_acked += acked;
+            if (bytes_acked >= cwnd) { // One MSS per window
+                bytes_acked -= cwnd;
+                cwnd += mss;
+            }
+            return;
+        }
+
+        double segments = (double)cwnd / mss;
+        if (epoch_start == 0) {
+            epoch_start = now;
+            if (segments < w_max) {
+                k = std::cbrt((w_max - segments) / CUBIC_C);
+                origin = w_max;
+            } else {
+                k = 0;
+                origin = segments;
+            }
+            w_est = segments;
+        }
+        double t = (now - epoch_start) / 1e9;
+        double rtt = srtt / 1e9;
+        double target = origin + CUBIC_C * std::pow(t + rtt - k, 3);
+        target = std::min(std::max(target, segments), 1.5 * segments);
+        double acked_segments = (double)acked / mss;
+        // The Reno-friendly estimate
+        w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked_segments / segments;
+        double cubic = origin + CUBIC_C * std::pow(t - k, 3);
+        if (cubic < w_est) {
+            segments = std::max(segments, w_est);
+        } else {
+            segments += (target - segments) / segments * acked_segments;
+        }
+        cwnd = (uint64_t)(segments * mss);
+    }
+
+    // Fast retransmit; pipe is what was in flight when the loss was found.
+    void on_loss(uint64_t pipe) {
+        if (algorithm == congestion_algorithm::reno) {
+            ssthresh = std::max(pipe / 2, 2 * (uint64_t)mss);
+        } else {
+            cubic_reduce();
+        }
+        cwnd = ssthresh;
+        bytes_acked = 0;
+    }
+
+    // Retransmission timeout: back to one segment.
+    void on_timeout(uint64_t flight) {
+        if (algorithm == congestion_algorithm::reno) {
+            ssthresh = std::max(flight / 2, 2 * (uint64_t)mss);
+        } else {
+            cubic_reduce();
+        }
+        cwnd = mss;
+        bytes_acked = 0;
+    }
+
+    const congestion_algorithm algorithm;
+    const uint32_t mss;
+    uint64_t cwnd;
+    uint64_t ssthresh = UINT64_MAX;
+
+private:
+    uint64_t bytes_acked = 0; // Reno congestion avoidance
+    uint64_t epoch_start = 0; // CUBIC, in ns; 0 until the first ACK after a reduction
+    double w_max = 0;
+    double k = 0;
+    double origin = 0;
+    double w_est = 0;
+
+    void cubic_reduce() {
+        double segments = (double)cwnd / mss;
+        // Fast convergence: give up more to a newer flow
+        w_max = segments < w_max ? segments * (1 + CUBIC_BETA) / 2 : segments;
+        ssthresh = std::max((uint64_t)(segments * CUBIC_BETA * mss), 2 * (uint64_t)mss);
+        epoch_start = 0;
+    }
+};
+
+// What the sender wants sent: a range of the stream, possibly empty, and
+// whether it carries the FIN.
+struct tcp_segment {
+    uint64_t offset;
+    uint32_t size;
+    bool fin;
+    bool retransmission;
+};
+
+class tcp_sender {
+public:
+    tcp_sender(uint64_t length, uint32_t mss, congestion_algorithm algorithm)
+        : length(length), mss(mss), cc(algorithm, mss) {}
+
+    // An ACK: the cumulative offset, the peer's window in bytes and its SACK
+    // blocks.
+    void on_ack(uint64_t ack, uint64_t window, const sack_block *blocks, int block_count, uint64_t now) {
+        peer_window = window;
+        if (fin_sent && ack > length) fin_acked = true;
+        ack = std::min(ack, length);
+
+        for (int i = 0; i < block_count; i++) {
+            uint64_t start = std::max(blocks[i].start, snd_una), end = std::min(blocks[i].end, snd_nxt);
+            if (start < end) sacked.add(start, end);
+        }
+
+        if (ack > snd_una) {
+            uint64_t acked = ack - snd_una;
+            snd_una = ack;
+            sacked.remove_below(snd_una);
+            retransmit_next = std::max(retransmit_next, snd_una);
+            dupacks = 0;
+            if (timing && ack >= timed_end) {
+                rtt.sample(now - timed_at);
+                timing = false;
+            }
+            if (recovering && ack >= recover) {
+                if (!after_timeout) cc.cwnd = cc.ssthresh; // Deflate after fast recovery
+                recovering = false;
+                after_timeout = false;
+            }
+            // cwnd only grows while it is what holds the sender back (RFC 7661)
+            if ((!recovering || after_timeout) && cwnd_limited) cc.on_ack(acked, now, rtt.srtt);
+            rto_deadline = outstanding() ? now + rtt.rto() : 0;
+        } else if (snd_nxt > snd_una) {
+            dupacks++;
+        }
+
+        if (recovering) {
+            lost_end = std::max(lost_end, sacked.highest());
+            // Data sent after the last retransmission round is SACKed
+            // while holes remain: those retransmissions were lost too
+            if (rescan_mark && sacked.highest() >= rescan_mark + UTCP_DUPACK_THRESHOLD * (uint64_t)mss) {
+                retransmit_next = snd_una;
+                rescan_mark = 0;
+            }
+        } else if (snd_nxt > snd_una &&
+                   (dupacks >= UTCP_DUPACK_THRESHOLD || sacked.bytes() > (UTCP_DUPACK_THRESHOLD - 1) * (uint64_t)mss)) {
+            cc.on_loss(pipe());
+            recovering = true;
+            recover = snd_nxt;
+            retransmit_next = snd_una;
+            rescan_mark = 0;
+            lost_end = std::max(sacked.highest(), std::min(snd_una + mss, snd_nxt));
+            fast_recoveries++;
+        }
+    }
+
+    // The next segment to send now, or false if the window is full or
+    // everything is sent. Call until it returns false.
+    bool next(uint64_t now, tcp_segment &segment) {
+        if (recovering) {
+            // The first hole at or above retransmit_next, below lost_end
+            uint64_t start = std::max(retransmit_next, snd_una);
+            auto range = sacked.ranges.upper_bound(start);
+            if (range != sacked.ranges.begin() && std::prev(range)->second > start) start = std::prev(range)->second;
+            if (start < lost_end && start < snd_nxt) {
+                uint64_t end = std::min({start + mss, lost_end, snd_nxt});
+                if (range != sacked.ranges.end()) end = std::min(end, range->first);
+                if (pipe() + (end - start) > cc.cwnd) return false;
+                retransmit_next = end;
+                timing = false; // Karn
+                retransmissions++;
+                arm(now);
+                segment = {start, (uint32_t)(end - start), false, true};
+                return true;
+            }
+            if (rescan_mark == 0) rescan_mark = std::max(snd_nxt, (uint64_t)1);
+        }
+        if (snd_nxt < length) {
+            uint32_t size = (uint32_t)std::min<uint64_t>(mss, length - snd_nxt);
+            if (snd_nxt + size > snd_una + peer_window) {
+                cwnd_limited = false;
+                return false;
+            }
+            if (pipe() + size > cc.cwnd) {
+                cwnd_limited = true;
+                return false;
+            }
+            segment = {snd_nxt, size, false, false};
+            snd_nxt += size;
+            if (!timing) {
+                timing = true;
+                timed_at = now;
+                timed_end = snd_nxt;
+            }
+            arm(now);
+            return true;
+        }
+        if (!fin_sent) {
+            fin_sent = true;
+            arm(now);
+            segment = {length, 0, true, false};
+            return true;
+        }
+        return false;
+    }
+
+    // When on_timer() is next due, in ns; 0 if no timer is running.
+    uint64_t deadline() const { return rto_deadline; }
+
+    void on_timer(uint64_t now) {
+        if (rto_deadline == 0 || now < rto_deadline) return;
+        if (!outstanding()) {
+            rto_deadline = 0;
+            return;
+        }
+        timeouts++;
+        cc.on_timeout(snd_nxt - snd_una - sacked.bytes());
+        rtt.backoff();
+        recovering = true;
+        after_timeout = true;
+        recover = snd_nxt;
+        retransmit_next = snd_una;
+        rescan_mark = 0;
+        lost_end = snd_nxt;
+        timing = false;
+        dupacks = 0;
+        if (fin_sent && !fin_acked && snd_una == length) fin_sent = false; // Send it again
+        rto_deadline = now + rtt.rto();
+    }
+
+    bool done() const { return fin_acked; }
+
+    // RFC 6675's pipe: bytes presumed in the network.
+    uint64_t pipe() const {
+        uint64_t in_flight = snd_nxt - snd_una - sacked.bytes();
+        if (!recovering) return in_flight;
+        // Holes between retransmit_next and lost_end are presumed lost and
+        // not sent again yet
+        uint64_t position = std::max(retransmit_next, snd_una), end = std::min(lost_end, snd_nxt), lost = 0;
+        auto range = sacked.ranges.upper_bound(position);
+        if (range != sacked.ranges.begin() && std::prev(range)->second > position) position = std::prev(range)->second;
+        while (position < end) {
+            uint64_t hole_end = range == sacked.ranges.end() ? end : std::min(end, range->first);
+            if (hole_end > position) lost += hole_end - position;
+            if (range == sacked.ranges.end()) break;
+            position = range->second;
+            range++;
+        }
+        return in_flight - std::min(lost, in_flight);
+    }
+
+    const uint64_t length;
+    const uint32_t mss;
+    congestion_control cc;
+    rtt_estimator rtt;
+    uint64_t retransmissions = 0;
+    uint64_t fast_recoveries = 0;
+    uint64_t timeouts = 0;
+
+private:
+    uint64_t snd_una = 0;
+    uint64_t snd_nxt = 0;
+    uint64_t peer_window = 65535;
+    bool cwnd_limited = true;
+    bool fin_sent = false;
+    bool fin_acked = false;
+    range_set sacked;
+    int dupacks = 0;
+    bool recovering = false;
+    bool after_timeout = false;
+    uint64_t recover = 0;
+    uint64_t retransmit_next = 0;
+    uint64_t rescan_mark = 0;     // snd_nxt when every hole had been retransmitted; 0 before that
+    uint64_t lost_end = 0;
+    bool timing = false;
+    uint64_t timed_at = 0;
+    uint64_t timed_end = 0;
+    uint64_t rto_deadline = 0;
+
+    bool outstanding() const { return snd_nxt > snd_una || (fin_sent && !fin_acked); }
+
+    void arm(uint64_t now) {
+        if (rto_deadline == 0) rto_deadline = now + rtt.rto();
+    }
+};
+
+class tcp_receiver {
+public:
+    explicit tcp_receiver(size_t buffer_size) : buffer(buffer_size) {}
+
+    // A segment at offset. Returns true if it should be acknowledged at once.
+    bool on_segment(uint64_t offset, const char *data, uint32_t size, bool fin) {
+        if (fin) {
+            fin_offset = offset + size;
+            has_fin = true;
+        }
+        uint64_t end = std::min<uint64_t>(offset + size, rcv_nxt + buffer.size()); // The window's right edge
+        if (end <= rcv_nxt) { // A duplicate, or a FIN alone: the sender needs to hear where we are
+            if (has_fin && rcv_nxt == fin_offset) fin_received = true;
+            unacknowledged = 0;
+            return true;
+        }
+        if (offset < rcv_nxt) {
+            data += rcv_nxt - offset;
+            offset = rcv_nxt;
+        }
+        store(offset, data, end - offset);
+
+        bool now = false;
+        if (offset > rcv_nxt) {
+            last_block = out_of_order.add(offset, end);
+            now = true;
+        } else {
+            rcv_nxt = end;
+            if (!out_of_order.ranges.empty() && out_of_order.ranges.begin()->first <= rcv_nxt) {
+                rcv_nxt = std::max(rcv_nxt, out_of_order.ranges.begin()->second);
+                now = true; // A hole was filled
+            }
+            out_of_order.remove_below(rcv_nxt);
+            now = now || ++unacknowledged >= 2;
+        }
+        if (has_fin && rcv_nxt == fin_offset && !fin_received) {
+            fin_received = true;
+            now = true;
+        }
+        if (now) unacknowledged = 0;
+        return now;
+    }
+
+    // Whether in-order data is waiting for an ACK; the caller sends one
+    // when it has nothing else to process.
+    bool ack_pending() const { return unacknowledged > 0; }
+    void acknowledged() { unacknowledged = 0; }
+
+    // The cumulative ACK, including the FIN.
+    uint64_t ack() const { return rcv_nxt + (fin_received ? 1 : 0); }
+    uint64_t window() const { return buffer.size(); }
+
+    // Out-of-order ranges for the SACK option, the most recent first.
+    int sack_blocks(sack_block *blocks) const {
+        int count = 0;
+        auto recent = out_of_order.ranges.find(last_block.start);
+        if (recent != out_of_order.ranges.end()) blocks[count++] = {recent->first, recent->second};
+        for (auto range = out_of_order.ranges.rbegin(); range != out_of_order.ranges.rend(); range++) {
+            if (count == UTCP_MAX_SACK_BLOCKS) break;
+            if (range->first == last_block.start) continue;
+            blocks[count++] = {range->first, range->second};
+        }
+        return count;
+    }
+
+    uint64_t delivered() const { return rcv_nxt; }
+    bool finished() const { return fin_received; }
+
+private:
+    std::vector<char> buffer; // Stream offset o lives at o % size
+    uint64_t rcv_nxt = 0;
+    range_set out_of_order;
+    sack_block last_block = {0, 0};
+    int unacknowledged = 0;
+    bool has_fin = false;
+    bool fin_received = false;
+    uint64_t fin_offset = 0;
+
+    void store(uint64_t offset, const char *data, size_t size) {
+        size_t position = offset % buffer.size();
+        size_t first = std::min(size, buffer.size() - position);
+        memcpy(&buffer[position], data, first);
+        memcpy(&buffer[0], data + first, size - first);
+    }
+};
+
+#endif
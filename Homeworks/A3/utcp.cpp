@@ -0,0 +1,579 @@
+// Bulk transfer over raw sockets with the userspace TCP in user_tcp.h, to
+// compare against kernel TCP (make tcp-bench).
+//
+//   sudo ./utcp recv [--loss <percent>] [--verify]
+//   sudo ./utcp send <bytes> [receiver address] [--cc reno|cubic] [--mss <n>]
+//
+// The receiver waits for one connection on RECEIVER_PORT, takes the stream
+// and reports when the FIN arrives; --loss drops that share of the data
+// segments it gets, to exercise SACK recovery and the RTO, and --verify
+// checks every byte. The sender connects from SENDER_PORT, sends <bytes> of
+// a fixed pattern and reports once its FIN is acknowledged.
+//
+// Each side also opens a kernel TCP socket on its port, listening, with a
+// BPF filter that drops everything: the kernel's TCP then discards our
+// segments silently instead of answering each with a RST, while raw sockets
+// still get their copy.
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "user_tcp.h"
+#include "checksum.h"
+#include "packet_filter.h"
+
+#define RECEIVER_PORT 5001
+#define SENDER_PORT 5002
+#define UTCP_MSS 1460           // Default --mss: an Ethernet-sized segment
+#define MAX_MSS 65000           // A packet must stay under 64 KB with headers and options
+#define BATCH 64                // Packets per sendmmsg and recvmmsg
+#define SLOT_SIZE (MAX_MSS + 128)
+#define RECEIVE_BUFFER (4 << 20) // The receiver's window
+#define PATTERN_SIZE 65536      // The data is this block, over and over
+#define SOCKET_BUFFER (16 << 20)
+#define HANDSHAKE_TRIES 5
+#define LINGER_NS 500000000ULL  // The receiver stays to acknowledge a repeated FIN
+
+// One side's view of the connection; addresses and ports in network byte
+// order, ISNs and the rest in host byte order.
+struct connection {
+    uint32_t local_addr;
+    uint32_t remote_addr;
+    uint16_t local_port;
+    uint16_t remote_port;
+    uint32_t local_isn;
+    uint32_t remote_isn;
+    uint32_t mss;
+    int send_shift;      // Scale of the windows we receive
+    bool sack;
+};
+
+// A received segment, checked and taken apart.
+struct segment_view {
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t source;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t flags;
+    uint16_t window;
+    uint16_t mss;        // From a SYN's options; 0 if absent
+    int window_shift;    // -1 if absent
+    bool sack_permitted;
+    int sack_count;
+    uint32_t sack[UTCP_MAX_SACK_BLOCKS][2];
+    const char *payload;
+    uint32_t payload_size;
+};
+
+// A raw socket with batches of slots to receive into and to send from.
+struct endpoint {
+    int sock;
+    int claim;           // The kernel socket holding our port
+    sockaddr_in destination;
+    std::vector<char> in_slots, out_slots;
+    std::vector<iovec> in_iovs, out_iovs;
+    std::vector<mmsghdr> in, out;
+    int queued = 0;
+    uint64_t syscalls = 0;
+};
+
+char pattern[PATTERN_SIZE];
+
+uint64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void open_endpoint(endpoint &e, uint16_t port) {
+    // The kernel socket: listening, so TCP finds it, and filtered to drop all
+    e.claim = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(e.claim, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    std::vector<sock_filter> drop_all = {bpf_statement(BPF_RET | BPF_K, 0)};
+    if (bind(e.claim, (sockaddr *)&address, sizeof(address)) < 0 || !attach_filter(e.claim, drop_all) ||
+        listen(e.claim, 1) < 0) {
+        perror("Claiming the port failed");
+        exit(EXIT_FAILURE);
+    }
+
+    e.sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (e.sock < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (setsockopt(e.sock, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
+        perror("setsockopt() failed");
+        exit(EXIT_FAILURE);
+    }
+    if (!attach_filter(e.sock, tcp_port_filter(port, 0))) perror("SO_ATTACH_FILTER failed");
+    int buffer = SOCKET_BUFFER;
+    setsockopt(e.sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer, sizeof(buffer));
+    setsockopt(e.sock, SOL_SOCKET, SO_SNDBUFFORCE, &buffer, sizeof(buffer));
+
+    e.in_slots.resize((size_t)BATCH * SLOT_SIZE);
+    e.out_slots.resize((size_t)BATCH * SLOT_SIZE);
+    e.in_iovs.resize(BATCH);
+    e.out_iovs.resize(BATCH);
+    e.in.resize(BATCH);
+    e.out.resize(BATCH);
+    for (int i = 0; i < BATCH; i++) {
+        e.in_iovs[i] = {&e.in_slots[(size_t)i * SLOT_SIZE], SLOT_SIZE};
+        e.in[i].msg_hdr.msg_iov = &e.in_iovs[i];
+        e.in[i].msg_hdr.msg_iovlen = 1;
+        e.out_iovs[i] = {&e.out_slots[(size_t)i * SLOT_SIZE], 0};
+        e.out[i].msg_hdr.msg_name = &e.destination;
+        e.out[i].msg_hdr.msg_namelen = sizeof(e.destination);
+        e.out[i].msg_hdr.msg_iov = &e.out_iovs[i];
+        e.out[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+// Fills the receive slots; returns how many packets arrived.
+int receive(endpoint &e) {
+    int received = recvmmsg(e.sock, e.in.data(), BATCH, MSG_DONTWAIT, nullptr);
+    e.syscalls++;
+    return received < 0 ? 0 : received;
+}
+
+// Waits for a packet or timeout_ns.
+void wait(endpoint &e, uint64_t timeout_ns) {
+    pollfd fd = {e.sock, POLLIN, 0};
+    timespec timeout = {(time_t)(timeout_ns / 1000000000), (long)(timeout_ns % 1000000000)};
+    e.syscalls++;
+    ppoll(&fd, 1, &timeout, nullptr);
+}
+
+// The slot to build the next packet to send in.
+char *next_slot(endpoint &e) { return &e.out_slots[(size_t)e.queued * SLOT_SIZE]; }
+
+void flush(endpoint &e) {
+    for (int sent = 0; sent < e.queued;) {
+        int n = sendmmsg(e.sock, &e.out[sent], e.queued - sent, 0);
+        e.syscalls++;
+        if (n < 0) {
+            if (errno != ENOBUFS && errno != EAGAIN) perror("sendmmsg() failed");
+            sent++; // Lost, as on a wire; TCP will notice
+            continue;
+        }
+        sent += n;
+    }
+    e.queued = 0;
+}
+
+void queue(endpoint &e, size_t size) {
+    e.out_iovs[e.queued].iov_len = size;
+    if (++e.queued == BATCH) flush(e);
+}
+
+// Writes a segment into packet and returns its size. The payload is copied
+// from pattern at stream position payload_offset.
+size_t build_segment(char *packet, const connection &c, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t window,
+                     const unsigned char *options, size_t options_size, uint64_t payload_offset, uint32_t payload_size) {
+    size_t tcp_size = sizeof(struct tcphdr) + options_size;
+    size_t size = sizeof(struct iphdr) + tcp_size + payload_size;
+    struct iphdr *ip = (struct iphdr *)packet;
+    struct tcphdr *tcp = (struct tcphdr *)(packet + sizeof(struct iphdr));
+    memset(packet, 0, sizeof(struct iphdr) + sizeof(struct tcphdr));
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tot_len = htons(size);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = c.local_addr;
+    ip->daddr = c.remote_addr;
+    tcp->source = c.local_port;
+    tcp->dest = c.remote_port;
+    tcp->seq = htonl(seq);
+    tcp->ack_seq = htonl(ack);
+    tcp->doff = tcp_size / 4;
+    ((uint8_t *)tcp)[13] = flags;
+    tcp->window = htons(window);
+    if (options_size) memcpy(tcp + 1, options, options_size);
+    char *payload = (char *)tcp + tcp_size;
+    size_t position = payload_offset % PATTERN_SIZE;
+    size_t first = std::min<size_t>(payload_size, PATTERN_SIZE - position);
+    memcpy(payload, pattern + position, first);
+    memcpy(payload + first, pattern, payload_size - first);
+    tcp->check = transport_checksum(ip->saddr, ip->daddr, IPPROTO_TCP, tcp, tcp_size + payload_size);
+    return size; // The kernel fills in the IP checksum
+}
+
+// Returns false for anything that is not a well-formed TCP segment with a
+// good checksum.
+bool parse_segment(const char *packet, size_t size, segment_view &s) {
+    const struct iphdr *ip = (const struct iphdr *)packet;
+    if (size < sizeof(struct iphdr)) return false;
+    size_t ip_size = ip->ihl * 4;
+    if (ip_size < sizeof(struct iphdr) || ntohs(ip->tot_len) > size || ntohs(ip->tot_len) < ip_size + sizeof(struct tcphdr)) {
+        return false;
+    }
+    size = ntohs(ip->tot_len);
+    const struct tcphdr *tcp = (const struct tcphdr *)(packet + ip_size);
+    size_t tcp_size = size - ip_size, header = tcp->doff * 4;
+    if (header < sizeof(struct tcphdr) || header > tcp_size) return false;
+    uint64_t sum = (uint64_t)ip->saddr + ip->daddr + __builtin_bswap16(IPPROTO_TCP) + __builtin_bswap16((uint16_t)tcp_size);
+    if (checksum_fold(checksum_add(tcp, tcp_size, checksum_fold(sum))) != 0xffff) return false;
+
+    s.saddr = ip->saddr;
+    s.daddr = ip->daddr;
+    s.source = tcp->source;
+    s.seq = ntohl(tcp->seq);
+    s.ack = ntohl(tcp->ack_seq);
+    s.flags = ((const uint8_t *)tcp)[13];
+    s.window = ntohs(tcp->window);
+    s.mss = 0;
+    s.window_shift = -1;
+    s.sack_permitted = false;
+    s.sack_count = 0;
+    s.payload = (const char *)tcp + header;
+    s.payload_size = tcp_size - header;
+    const unsigned char *options = (const unsigned char *)tcp;
+    for (size_t i = sizeof(struct tcphdr); i < header;) {
+        unsigned char kind = options[i];
+        if (kind == TCPOPT_EOL) break;
+        if (kind == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= header || options[i + 1] < 2 || i + options[i + 1] > header) break;
+        unsigned char length = options[i + 1];
+        if (kind == TCPOPT_MAXSEG && length == TCPOLEN_MAXSEG) {
+            s.mss = options[i + 2] << 8 | options[i + 3];
+        } else if (kind == TCPOPT_WINDOW && length == TCPOLEN_WINDOW) {
+            s.window_shift = std::min<int>(options[i + 2], 14);
+        } else if (kind == TCPOPT_SACK_PERMITTED) {
+            s.sack_permitted = true;
+        } else if (kind == TCPOPT_SACK) {
+            for (size_t b = i + 2; b + 8 <= i + length && s.sack_count < UTCP_MAX_SACK_BLOCKS; b += 8) {
+                uint32_t edges[2];
+                memcpy(edges, &options[b], 8);
+                s.sack[s.sack_count][0] = ntohl(edges[0]);
+                s.sack[s.sack_count][1] = ntohl(edges[1]);
+                s.sack_count++;
+            }
+        }
+        i += length;
+    }
+    return true;
+}
+
+// MSS, SACK permitted and window scale, padded to 12 bytes.
+size_t syn_options(unsigned char *options, uint16_t mss) {
+    unsigned char bytes[12] = {TCPOPT_MAXSEG, TCPOLEN_MAXSEG, (unsigned char)(mss >> 8), (unsigned char)mss,
+                               TCPOPT_NOP, TCPOPT_NOP, TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED,
+                               TCPOPT_NOP, TCPOPT_WINDOW, TCPOLEN_WINDOW, UTCP_WINDOW_SHIFT};
+    memcpy(options, bytes, sizeof(bytes));
+    return sizeof(bytes);
+}
+
+// Takes the peer's SYN options into c.
+void agree_options(connection &c, const segment_view &s) {
+    if (s.mss) c.mss = std::min<uint32_t>(c.mss, s.mss);
+    c.send_shift = s.window_shift >= 0 ? s.window_shift : 0;
+    c.sack = s.sack_permitted && s.window_shift >= 0;
+}
+
+// The local address packets to remote leave from.
+uint32_t local_address_for(uint32_t remote) {
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(RECEIVER_PORT);
+    address.sin_addr.s_addr = remote;
+    socklen_t length = sizeof(address);
+    if (connect(probe, (sockaddr *)&address, sizeof(address)) < 0 || getsockname(probe, (sockaddr *)&address, &length) < 0) {
+        perror("No route to the receiver");
+        exit(EXIT_FAILURE);
+    }
+    close(probe);
+    return address.sin_addr.s_addr;
+}
+
+uint32_t next_random(uint32_t &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+uint32_t random_isn() {
+    uint32_t isn;
+    if (getentropy(&isn, sizeof(isn)) != 0) isn = monotonic_ns();
+    return isn;
+}
+
+void print_rate(const char *what, uint64_t bytes, double seconds, double cpu) {
+    std::cout << std::fixed << std::setprecision(2) << "[+] " << what << " " << bytes << " bytes in " << seconds
+              << " s: " << bytes * 8 / seconds / 1e9 << " Gbit/s, " << cpu * 1e9 / bytes << " ns CPU per byte"
+              << std::endl;
+}
+
+int run_sender(uint64_t length, const char *receiver, congestion_algorithm algorithm, uint32_t mss) {
+    endpoint e;
+    open_endpoint(e, SENDER_PORT);
+    connection c = {};
+    if (!inet_aton(receiver, (in_addr *)&c.remote_addr)) {
+        std::cerr << "Error: bad address " << receiver << std::endl;
+        return 1;
+    }
+    c.local_addr = local_address_for(c.remote_addr);
+    c.local_port = htons(SENDER_PORT);
+    c.remote_port = htons(RECEIVER_PORT);
+    c.local_isn = random_isn();
+    c.mss = mss;
+    e.destination.sin_family = AF_INET;
+    e.destination.sin_addr.s_addr = c.remote_addr;
+
+    unsigned char options[40];
+    size_t options_size = syn_options(options, mss);
+    bool connected = false;
+    for (int attempt = 0; attempt < HANDSHAKE_TRIES && !connected; attempt++) {
+        queue(e, build_segment(next_slot(e), c, c.local_isn, 0, TH_SYN, 65535, options, options_size, 0, 0));
+        flush(e);
+        uint64_t deadline = monotonic_ns() + UTCP_INITIAL_RTO_NS;
+        while (!connected && monotonic_ns() < deadline) {
+            wait(e, deadline - monotonic_ns());
+            int received = receive(e);
+            for (int i = 0; i < received && !connected; i++) {
+                segment_view s;
+                if (!parse_segment((const char *)e.in_iovs[i].iov_base, e.in[i].msg_len, s)) continue;
+                if (s.saddr != c.remote_addr || s.source != c.remote_port) continue;
+                if ((s.flags & (TH_SYN | TH_ACK)) != (TH_SYN | TH_ACK) || s.ack != c.local_isn + 1) continue;
+                c.remote_isn = s.seq;
+                agree_options(c, s);
+                connected = true;
+            }
+        }
+    }
+    if (!connected) {
+        std::cerr << "Error: no answer from " << receiver << ":" << RECEIVER_PORT << std::endl;
+        return 1;
+    }
+    std::cout << "[+] Connected to " << receiver << ":" << RECEIVER_PORT << ", MSS " << c.mss
+              << (c.sack ? ", SACK" : "") << ", " << (algorithm == congestion_algorithm::cubic ? "CUBIC" : "Reno")
+              << std::endl;
+
+    tcp_sender sender(length, c.mss, algorithm);
+    uint32_t data_seq = c.local_isn + 1, ack_seq = c.remote_isn + 1;
+    uint64_t last_ack = 0, segments = 0;
+    uint16_t our_window = RECEIVE_BUFFER >> UTCP_WINDOW_SHIFT;
+    uint64_t start = monotonic_ns();
+    double cpu_start = cpu_seconds();
+    while (!sender.done()) {
+        int received = receive(e);
+        uint64_t now = monotonic_ns();
+        for (int i = 0; i < received; i++) {
+            segment_view s;
+            if (!parse_segment((const char *)e.in_iovs[i].iov_base, e.in[i].msg_len, s)) continue;
+            if (s.saddr != c.remote_addr || s.source != c.remote_port || !(s.flags & TH_ACK) || (s.flags & TH_SYN)) {
+                continue;
+            }
+            uint64_t ack = unwrap_sequence(s.ack - data_seq, last_ack);
+            last_ack = std::max(last_ack, ack);
+            sack_block blocks[UTCP_MAX_SACK_BLOCKS];
+            for (int b = 0; b < s.sack_count; b++) {
+                blocks[b] = {unwrap_sequence(s.sack[b][0] - data_seq, last_ack),
+                             unwrap_sequence(s.sack[b][1] - data_seq, last_ack)};
+            }
+            sender.on_ack(ack, (uint64_t)s.window << c.send_shift, blocks, c.sack ? s.sack_count : 0, now);
+        }
+        sender.on_timer(now);
+
+        tcp_segment segment;
+        int sent = 0;
+        while (sender.next(now, segment)) {
+            uint8_t flags = TH_ACK | (segment.fin ? TH_FIN : 0);
+            queue(e, build_segment(next_slot(e), c, data_seq + (uint32_t)segment.offset, ack_seq, flags, our_window,
+                                   nullptr, 0, segment.offset, segment.size));
+            segments++;
+            sent++;
+        }
+        flush(e);
+        if (received == 0 && sent == 0 && !sender.done()) {
+            uint64_t deadline = sender.deadline();
+            wait(e, deadline > now ? deadline - now : UTCP_MIN_RTO_NS);
+        }
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    print_rate("Sent", length, seconds, cpu_seconds() - cpu_start);
+    std::cout << "[+] " << segments << " segments, " << sender.retransmissions << " retransmitted, "
+              << sender.fast_recoveries << " fast recoveries, " << sender.timeouts << " timeouts; cwnd "
+              << sender.cc.cwnd / c.mss << " segments, srtt " << sender.rtt.srtt / 1000.0 << " us, "
+              << (double)e.syscalls / segments << " syscalls per segment" << std::endl;
+    close(e.sock);
+    close(e.claim);
+    return 0;
+}
+
+int run_receiver(double loss_percent, bool verify) {
+    endpoint e;
+    open_endpoint(e, RECEIVER_PORT);
+    connection c = {};
+    c.local_port = htons(RECEIVER_PORT);
+    c.local_isn = random_isn();
+    c.mss = MAX_MSS;
+    std::cout << "[+] Waiting on port " << RECEIVER_PORT << "..." << std::endl;
+
+    tcp_receiver receiver(RECEIVE_BUFFER);
+    bool connected = false;
+    uint32_t loss_threshold = loss_percent / 100 * UINT32_MAX, random_state = random_isn() | 1;
+    uint64_t dropped = 0, bad = 0, acks = 0, start = 0, finish = 0, last_packet = 0;
+    double cpu_start = 0;
+    unsigned char options[40];
+
+    auto send_ack = [&]() {
+        size_t options_size = 0;
+        sack_block blocks[UTCP_MAX_SACK_BLOCKS];
+        int count = c.sack ? receiver.sack_blocks(blocks) : 0;
+        if (count > 0) {
+            options[0] = TCPOPT_NOP;
+            options[1] = TCPOPT_NOP;
+            options[2] = TCPOPT_SACK;
+            options[3] = 2 + 8 * count;
+            for (int b = 0; b < count; b++) {
+                uint32_t edges[2] = {htonl(c.remote_isn + 1 + (uint32_t)blocks[b].start),
+                                     htonl(c.remote_isn + 1 + (uint32_t)blocks[b].end)};
+                memcpy(&options[4 + 8 * b], edges, 8);
+            }
+            options_size = 4 + 8 * count;
+        }
+        queue(e, build_segment(next_slot(e), c, c.local_isn + 1, c.remote_isn + 1 + (uint32_t)receiver.ack(), TH_ACK,
+                               receiver.window() >> UTCP_WINDOW_SHIFT, options, options_size, 0, 0));
+        receiver.acknowledged();
+        acks++;
+    };
+
+    while (true) {
+        int received = receive(e);
+        uint64_t now = monotonic_ns();
+        if (received == 0) {
+            if (receiver.ack_pending()) {
+                send_ack();
+                flush(e);
+            }
+            if (receiver.finished() && now - last_packet > LINGER_NS) break;
+            wait(e, receiver.finished() ? LINGER_NS : 1000000000ULL);
+            continue;
+        }
+        last_packet = now;
+        for (int i = 0; i < received; i++) {
+            segment_view s;
+            if (!parse_segment((const char *)e.in_iovs[i].iov_base, e.in[i].msg_len, s)) {
+                bad++;
+                continue;
+            }
+            if (s.flags & TH_SYN) {
+                if (!connected) {
+                    c.remote_addr = s.saddr;
+                    c.remote_port = s.source;
+                    c.remote_isn = s.seq;
+                    c.local_addr = s.daddr;
+                    agree_options(c, s);
+                    e.destination.sin_family = AF_INET;
+                    e.destination.sin_addr.s_addr = c.remote_addr;
+                    connected = true;
+                }
+                if (s.saddr != c.remote_addr || s.source != c.remote_port) continue;
+                size_t options_size = syn_options(options, c.mss);
+                queue(e, build_segment(next_slot(e), c, c.local_isn, c.remote_isn + 1, TH_SYN | TH_ACK, 65535, options,
+                                       options_size, 0, 0));
+                continue;
+            }
+            if (!connected || s.saddr != c.remote_addr || s.source != c.remote_port) continue;
+            bool fin = s.flags & TH_FIN;
+            if (s.payload_size == 0 && !fin) continue;
+            if (loss_threshold && s.payload_size > 0 && next_random(random_state) < loss_threshold) {
+                dropped++;
+                continue;
+            }
+            uint64_t offset = unwrap_sequence(s.seq - (c.remote_isn + 1), receiver.delivered());
+            if (verify) {
+                for (uint32_t b = 0; b < s.payload_size; b++) {
+                    if (s.payload[b] != pattern[(offset + b) % PATTERN_SIZE]) {
+                        std::cerr << "Error: wrong byte at offset " << offset + b << std::endl;
+                        return 1;
+                    }
+                }
+            }
+            if (start == 0) {
+                start = now;
+                cpu_start = cpu_seconds();
+            }
+            bool was_finished = receiver.finished();
+            if (receiver.on_segment(offset, s.payload, s.payload_size, fin)) send_ack();
+            if (receiver.finished() && !was_finished) finish = now;
+        }
+        if (receiver.ack_pending()) send_ack();
+        flush(e);
+    }
+
+    double seconds = (finish - start) / 1e9;
+    print_rate("Received", receiver.delivered(), seconds, cpu_seconds() - cpu_start);
+    std::cout << "[+] " << acks << " ACKs sent, " << dropped << " segments dropped on purpose, " << bad
+              << " malformed" << (verify ? "; every byte checked" : "") << std::endl;
+    close(e.sock);
+    close(e.claim);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (size_t i = 0; i < PATTERN_SIZE; i++) pattern[i] = (char)(i * 131 + 7);
+    const char *role = argc > 1 ? argv[1] : "";
+    const char *receiver = "127.0.0.1";
+    uint64_t length = 0;
+    congestion_algorithm algorithm = congestion_algorithm::cubic;
+    uint32_t mss = UTCP_MSS;
+    double loss_percent = 0;
+    bool verify = false, usage = strcmp(role, "send") != 0 && strcmp(role, "recv") != 0;
+    for (int i = 2; i < argc && !usage; i++) {
+        if (strcmp(argv[i], "--cc") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "reno") == 0) {
+                algorithm = congestion_algorithm::reno;
+            } else if (strcmp(argv[i], "cubic") != 0) {
+                usage = true;
+            }
+        } else if (strcmp(argv[i], "--mss") == 0 && i + 1 < argc) {
+            mss = std::min(std::max(atoi(argv[++i]), 88), MAX_MSS);
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            loss_percent = std::min(std::max(atof(argv[++i]), 0.0), 50.0);
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (argv[i][0] != '-' && length == 0 && strcmp(role, "send") == 0) {
+            length = strtoull(argv[i], nullptr, 10);
+        } else if (argv[i][0] != '-') {
+            receiver = argv[i];
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || (strcmp(role, "send") == 0 && length == 0)) {
+        std::cout << "[USE]: " << argv[0] << " recv [--loss <percent>] [--verify]" << std::endl;
+        std::cout << "       " << argv[0] << " send <bytes> [receiver address] [--cc reno|cubic] [--mss <n>]" << std::endl;
+        return 1;
+    }
+    if (strcmp(role, "recv") == 0) return run_receiver(loss_percent, verify);
+    return run_sender(length, receiver, algorithm, mss);
+}
@@ -0,0 +1,175 @@
+// Distance vector routing, run as synchronous exchange rounds.
+//
+// Every node's routing table is one row of an n x n cost matrix. In a round
+// each node takes the tables its neighbours sent at the end of the previous
+// round and keeps, per destination, the cheaper of its own entry and
+// linkCost(node, neighbour) + the neighbour's entry; the neighbour becomes
+// the next hop when it is strictly cheaper. A neighbour whose table did not
+// change last round sends nothing, as in the protocol, so later rounds only
+// read the rows that moved. Rounds stop when no table changes.
+//
+// Costs are 16-bit. Rows are padded to 64 bytes and the matrix is 64-byte
+// aligned, so the AVX2 kernel relaxes 16 destinations per instruction: a
+// saturating add (vpaddusw) of the link cost and an unsigned min against
+// INF, so an unreachable 9999 stays 9999 and nothing wraps. Next hops live
+// in a second matrix of the same shape and are blended in on the same
+// mask. Nodes are split across threads with OpenMP; the tables being read
+// are the previous round's copies, so the result does not depend on the
+// thread count.
+//
+// As in the input format, a path costing 9999 or more is unreachable.
+
+#ifndef DISTANCE_VECTOR_H
+#define DISTANCE_VECTOR_H
+
+#include <vector>
+#include <utility>
+#include <new>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+
+#define DV_INF 9999
+#define DV_NO_HOP 0xffff           // Also why there can be at most 65535 nodes
+#define DV_LANES_PER_LINE 32       // uint16_t entries per 64-byte cache line
+
+// A matrix of uint16_t whose rows each start on a 64-byte boundary.
+class CostMatrix {
+public:
+    CostMatrix(int rows, int columns)
+        : stride((columns + DV_LANES_PER_LINE - 1) / DV_LANES_PER_LINE * DV_LANES_PER_LINE) {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, 64, (size_t)rows * stride * sizeof(uint16_t)) != 0) throw std::bad_alloc();
+        data = (uint16_t *)memory;
+    }
+    ~CostMatrix() { free(data); }
+    CostMatrix(const CostMatrix &) = delete;
+    CostMatrix &operator=(const CostMatrix &) = delete;
+
+    uint16_t *row(int i) { return data + (size_t)i * stride; }
+    const uint16_t *row(int i) const { return data + (size_t)i * stride; }
+
+    const size_t stride; // Entries per row, padding included
+
+private:
+    uint16_t *data;
+};
+
+// Relaxes a table over a neighbour's table reached at the given cost, over
+// lanes entries; returns whether any entry dropped.
+typedef bool (*relaxFunction)(uint16_t *table, uint16_t *hops, const uint16_t *neighbourTable, uint16_t cost,
+                              uint16_t neighbour, size_t lanes);
+
+inline bool relaxScalar(uint16_t *table, uint16_t *hops, const uint16_t *neighbourTable, uint16_t cost,
+                        uint16_t neighbour, size_t lanes) {
+    bool changed = false;
+    for (size_t d = 0; d < lanes; d++) {
+        unsigned candidate = cost + neighbourTable[d];
+        if (candidate > DV_INF) candidate = DV_INF;
+        if (candidate < table[d]) {
+            table[d] = candidate;
+            hops[d] = neighbour;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+__attribute__((target("avx2"))) inline bool relaxAvx2(uint16_t *table, uint16_t *hops,
+                                                      const uint16_t *neighbourTable, uint16_t cost,
+                                                      uint16_t neighbour, size_t lanes) {
+    const __m256i costs = _mm256_set1_epi16((short)cost);
+    const __m256i inf = _mm256_set1_epi16(DV_INF);
+    const __m256i hop = _mm256_set1_epi16((short)neighbour);
+    bool changed = false;
+    for (size_t d = 0; d < lanes; d += 16) {
+        __m256i current = _mm256_load_si256((const __m256i *)(table + d));
+        __m256i through = _mm256_load_si256((const __m256i *)(neighbourTable + d));
+        __m256i candidate = _mm256_min_epu16(_mm256_adds_epu16(through, costs), inf);
+        // Both sides are at most INF, which fits a signed 16-bit compare
+        __m256i better = _mm256_cmpgt_epi16(current, candidate);
+        if (_mm256_testz_si256(better, better)) continue; // Most blocks, once routes settle
+        _mm256_store_si256((__m256i *)(table + d), _mm256_min_epu16(current, candidate));
+        __m256i oldHops = _mm256_load_si256((const __m256i *)(hops + d));
+        _mm256_store_si256((__m256i *)(hops + d), _mm256_blendv_epi8(oldHops, hop, better));
+        changed = true;
+    }
+    return changed;
+}
+
+inline relaxFunction pickRelax() {
+    if (__builtin_cpu_supports("avx2")) return relaxAvx2;
+    return relaxScalar;
+}
+
+class DistanceVector {
+public:
+    explicit DistanceVector(int n, relaxFunction relax = pickRelax())
+        : n(n), relax(relax), tables(n, n), sent(n, n), hops(n, n), neighbours(n) {
+        if (n >= DV_NO_HOP) throw std::length_error("distance vector: too many nodes");
+        for (int i = 0; i < n; i++) {
+            uint16_t *table = tables.row(i);
+            for (size_t d = 0; d < tables.stride; d++) table[d] = DV_INF; // Padding included
+            table[i] = 0;
+            memset(hops.row(i), 0xff, hops.stride * sizeof(uint16_t));
+        }
+    }
+
+    // A link usable from `from` to `to`; costs of INF or more are no link.
+    void addLink(int from, int to, int cost) {
+        if (from == to || cost <= 0 || cost >= DV_INF) return;
+        neighbours[from].push_back(std::make_pair(to, (uint16_t)cost));
+        if (cost < tables.row(from)[to]) {
+            tables.row(from)[to] = cost;
+            hops.row(from)[to] = to;
+        }
+    }
+
+    // Exchanges tables until they settle; returns the number of rounds in
+    // which some table changed.
+    int run() {
+        memcpy(sent.row(0), tables.row(0), (size_t)n * tables.stride * sizeof(uint16_t));
+        std::vector<char> sending(n, 1), changed(n, 0);
+        for (int rounds = 0;; rounds++) {
+            int changedTables = 0;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : changedTables)
+            for (int i = 0; i < n; i++) {
+                bool tableChanged = false;
+                for (const std::pair<int, uint16_t> &link : neighbours[i]) {
+                    if (!sending[link.first]) continue;
+                    tableChanged |= relax(tables.row(i), hops.row(i), sent.row(link.first), link.second,
+                                          link.first, tables.stride);
+                }
+                changed[i] = tableChanged;
+                changedTables += tableChanged;
+            }
+            if (changedTables == 0) return rounds;
+
+            // Nodes whose tables changed send them for the next round
+#pragma omp parallel for schedule(static)
+            for (int i = 0; i < n; i++) {
+                if (changed[i]) memcpy(sent.row(i), tables.row(i), tables.stride * sizeof(uint16_t));
+            }
+            sending.swap(changed);
+        }
+    }
+
+    int size() const { return n; }
+    int cost(int node, int destination) const { return tables.row(node)[destination]; }
+    int nextHop(int node, int destination) const {
+        uint16_t hop = hops.row(node)[destination];
+        return hop == DV_NO_HOP ? -1 : hop;
+    }
+
+private:
+    int n;
+    relaxFunction relax;
+    CostMatrix tables; // This round's tables, updated in place
+    CostMatrix sent;   // The tables as last sent to neighbours
+    CostMatrix hops;
+    std::vector<std::vector<std::pair<int, uint16_t>>> neighbours;
+};
+
+#endif
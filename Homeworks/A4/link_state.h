@@ -0,0 +1,226 @@
+// Link state routing: Dijkstra from every source, on all cores.
+//
+// The topology is kept as adjacency arrays (CSR). Each thread owns a
+// scratch set of dist, prev and a radix heap, sized once and reused for
+// every source it runs, so no source allocates. A radix heap suits
+// Dijkstra on small integer costs: keys only grow, so an entry is filed by
+// the highest bit in which it differs from the last key popped and is
+// moved at most 32 times. A key is pushed again instead of decreased, and
+// stale entries are skipped when popped.
+//
+// Sources are split into one contiguous range per thread. A thread takes
+// sources from the front of its own range; when it runs out it steals the
+// back half of the largest range left. Both ends of a range share one
+// atomic word, so a take and a steal never hand out the same source.
+//
+// prev matches the textbook O(n^2) Dijkstra that settles the lowest-index
+// node among equal distances and relaxes only on a strict improvement:
+// there, prev[v] is the predecessor on a shortest path that was settled
+// first, that is the one with the smallest (dist, index). With positive
+// costs all of them are settled before v, so keeping that one on ties gives
+// the same tables whatever order the heap pops equal keys in.
+
+#ifndef LINK_STATE_H
+#define LINK_STATE_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+#define LS_INF 9999
+#define LS_RADIX_BUCKETS 33 // Key equal to the last popped, or differing first in bit 0-31
+
+class RadixHeap {
+public:
+    bool empty() const { return size == 0; }
+
+    // key must not be below the last key popped
+    void push(uint32_t key, int node) {
+        buckets[bucketOf(key)].push_back(std::make_pair(key, node));
+        size++;
+    }
+
+    std::pair<uint32_t, int> pop() {
+        if (buckets[0].empty()) {
+            int i = 1;
+            while (buckets[i].empty()) i++;
+            uint32_t smallest = buckets[i][0].first;
+            for (const std::pair<uint32_t, int> &entry : buckets[i]) smallest = std::min(smallest, entry.first);
+            last = smallest;
+            for (const std::pair<uint32_t, int> &entry : buckets[i]) buckets[bucketOf(entry.first)].push_back(entry);
+            buckets[i].clear(); // Keeps its capacity for the next source
+        }
+        std::pair<uint32_t, int> top = buckets[0].back();
+        buckets[0].pop_back();
+        size--;
+        return top;
+    }
+
+    void clear() {
+        for (std::vector<std::pair<uint32_t, int>> &bucket : buckets) bucket.clear();
+        last = 0;
+        size = 0;
+    }
+
+private:
+    int bucketOf(uint32_t key) const { return key == last ? 0 : 32 - __builtin_clz(key ^ last); }
+
+    std::vector<std::pair<uint32_t, int>> buckets[LS_RADIX_BUCKETS];
+    uint32_t last = 0;
+    size_t size = 0;
+};
+
+// One thread's working memory, reused from source to source.
+struct DijkstraScratch {
+    std::vector<int> dist, prev;
+    RadixHeap heap;
+};
+
+class LinkState {
+public:
+    explicit LinkState(int n) : n(n) {}
+
+    // A link usable from `from` to `to`; costs of INF or more are no link.
+    void addLink(int from, int to, int cost) {
+        if (from == to || cost <= 0 || cost >= LS_INF) return;
+        links.push_back(Link{from, to, cost});
+        built = false;
+    }
+
+    // dist and prev from src, in the format printLSRTable takes. Paths
+    // costing INF or more are unreachable.
+    void shortestPaths(int src, DijkstraScratch &scratch) {
+        build();
+        std::vector<int> &dist = scratch.dist, &prev = scratch.prev;
+        dist.assign(n, LS_INF);
+        prev.assign(n, -1);
+        RadixHeap &heap = scratch.heap;
+        heap.clear();
+        dist[src] = 0;
+        heap.push(0, src);
+        while (!heap.empty()) {
+            std::pair<uint32_t, int> top = heap.pop();
+            int u = top.second;
+            if ((int)top.first != dist[u]) continue; // Pushed again since with a lower cost
+            for (int e = offsets[u]; e < offsets[u + 1]; e++) {
+                int v = targets[e], through = dist[u] + costs[e];
+                if (through < dist[v]) {
+                    dist[v] = through;
+                    prev[v] = u;
+                    heap.push(through, v);
+                } else if (through == dist[v] && through < LS_INF && dist[u] == dist[prev[v]] && u < prev[v]) {
+                    prev[v] = u; // The predecessor the textbook version settles first
+                }
+            }
+        }
+    }
+
+    // Runs every source on `threads` threads (0: one per core) and calls
+    // visit(src, dist, prev) for each, from the thread that ran it. A
+    // positive `sources` runs only sources 0 to sources - 1.
+    template <typename Visit>
+    void allSources(Visit visit, int threads = 0, int sources = 0) {
+        build();
+        if (sources <= 0 || sources > n) sources = n;
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = std::max(1, std::min(threads, sources));
+        std::vector<SourceRange> ranges(threads);
+        for (int t = 0; t < threads; t++) {
+            ranges[t].range.store(
+                packRange((uint64_t)sources * t / threads, (uint64_t)sources * (t + 1) / threads));
+        }
+
+        auto worker = [&](int self) {
+            DijkstraScratch scratch;
+            for (;;) {
+                int src;
+                while (takeSource(ranges[self], src)) {
+                    shortestPaths(src, scratch);
+                    visit(src, scratch.dist, scratch.prev);
+                }
+                if (!stealSources(ranges, self)) return; // No work is ever added, so this is the end
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; t++) workers.emplace_back(worker, t);
+        worker(0);
+        for (std::thread &w : workers) w.join();
+    }
+
+    int size() const { return n; }
+
+private:
+    struct Link {
+        int from, to, cost;
+    };
+
+    // Sources [begin, end) not yet taken: begin in the low 32 bits
+    struct alignas(64) SourceRange {
+        std::atomic<uint64_t> range{0};
+    };
+
+    static uint64_t packRange(uint32_t begin, uint32_t end) { return (uint64_t)end << 32 | begin; }
+
+    static bool takeSource(SourceRange &r, int &src) {
+        uint64_t current = r.range.load();
+        for (;;) {
+            uint32_t begin = (uint32_t)current, end = (uint32_t)(current >> 32);
+            if (begin >= end) return false;
+            if (r.range.compare_exchange_weak(current, packRange(begin + 1, end))) {
+                src = begin;
+                return true;
+            }
+        }
+    }
+
+    // Moves the back half of the largest other range into ranges[self].
+    static bool stealSources(std::vector<SourceRange> &ranges, int self) {
+        for (;;) {
+            int victim = -1;
+            uint32_t most = 0;
+            for (int t = 0; t < (int)ranges.size(); t++) {
+                uint64_t r = ranges[t].range.load();
+                uint32_t left = (uint32_t)(r >> 32) - std::min((uint32_t)r, (uint32_t)(r >> 32));
+                if (t != self && left > most) {
+                    most = left;
+                    victim = t;
+                }
+            }
+            if (victim < 0) return false;
+            uint64_t current = ranges[victim].range.load();
+            uint32_t begin = (uint32_t)current, end = (uint32_t)(current >> 32);
+            if (begin >= end) continue;
+            uint32_t middle = begin + (end - begin) / 2;
+            if (ranges[victim].range.compare_exchange_strong(current, packRange(begin, middle))) {
+                ranges[self].range.store(packRange(middle, end));
+                return true;
+            }
+        }
+    }
+
+    // Links sorted by origin: node u's are [offsets[u], offsets[u + 1])
+    void build() {
+        if (built) return;
+        offsets.assign(n + 1, 0);
+        for (const Link &l : links) offsets[l.from + 1]++;
+        for (int u = 0; u < n; u++) offsets[u + 1] += offsets[u];
+        targets.resize(links.size());
+        costs.resize(links.size());
+        std::vector<int> next(offsets.begin(), offsets.end() - 1);
+        for (const Link &l : links) {
+            targets[next[l.from]] = l.to;
+            costs[next[l.from]++] = l.cost;
+        }
+        built = true;
+    }
+
+    int n;
+    std::vector<Link> links;
+    bool built = false;
+    std::vector<int> offsets, targets, costs;
+};
+
+#endif
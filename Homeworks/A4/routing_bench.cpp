@@ -0,0 +1,228 @@
+// Routing engine timings on large random topologies, which are too big to
+// go through an input file. Each node is on a ring (so the graph is
+// connected) and links to `links` more random nodes, with costs 1-100 in
+// both directions.
+//
+// First checks the distance vector engine against Floyd-Warshall on a
+// small topology, with the scalar kernel and, on CPUs that have it, the
+// AVX2 one: every cost must be the shortest path, and every next hop a
+// neighbour on it. With --lsr it
+// checks the link state engine instead, against the textbook O(n^2)
+// Dijkstra: dist and prev must be identical, so the printed tables are, on
+// a topology with costs 1-3 so that ties are everywhere.
+//
+//   ./routing_bench <nodes> [links per node] [--scalar]
+//   ./routing_bench --lsr <nodes> [links per node] [--threads t] [--sources k]
+//
+// --sources times only the first k sources of the LSR run.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "distance_vector.h"
+#include "link_state.h"
+
+using namespace std;
+
+struct Link {
+    int from, to, cost;
+};
+
+vector<Link> randomTopology(int n, int links, unsigned seed, int maxCost = 100) {
+    mt19937 random(seed);
+    vector<Link> topology;
+    for (int i = 0; i < n; ++i) {
+        int cost = 1 + random() % maxCost;
+        topology.push_back({i, (i + 1) % n, cost});
+        topology.push_back({(i + 1) % n, i, cost});
+        for (int k = 0; k < links; ++k) {
+            int j = random() % n;
+            cost = 1 + random() % maxCost;
+            topology.push_back({i, j, cost});
+            topology.push_back({j, i, cost});
+        }
+    }
+    return topology;
+}
+
+bool checkDistanceVector(relaxFunction relax) {
+    const int n = 300;
+    vector<Link> topology = randomTopology(n, 3, 7);
+    vector<vector<int>> shortest(n, vector<int>(n, DV_INF)), link(n, vector<int>(n, DV_INF));
+    DistanceVector dv(n, relax);
+    for (int i = 0; i < n; ++i) shortest[i][i] = 0;
+    for (const Link &l : topology) {
+        dv.addLink(l.from, l.to, l.cost);
+        if (l.from != l.to && l.cost < link[l.from][l.to]) shortest[l.from][l.to] = link[l.from][l.to] = l.cost;
+    }
+    dv.run();
+    for (int k = 0; k < n; ++k)
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < n; ++j)
+                shortest[i][j] = min(shortest[i][j], shortest[i][k] + shortest[k][j]);
+
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int hop = dv.nextHop(i, j);
+            bool hopOnPath = i == j ? hop == -1 : hop >= 0 && link[i][hop] + shortest[hop][j] == shortest[i][j];
+            if (dv.cost(i, j) != shortest[i][j] || !hopOnPath) {
+                cerr << "Wrong route from " << i << " to " << j << ": cost " << dv.cost(i, j) << ", next hop "
+                     << hop << ", shortest " << shortest[i][j] << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The Dijkstra simulateLSR's TODO asked for: settle the closest unvisited
+// node, lowest index first, and relax on strict improvement.
+void textbookDijkstra(const vector<vector<int>>& graph, int src, vector<int>& dist, vector<int>& prev) {
+    int n = graph.size();
+    dist.assign(n, LS_INF);
+    prev.assign(n, -1);
+    vector<bool> visited(n, false);
+    dist[src] = 0;
+    for (int k = 0; k < n; ++k) {
+        int u = -1;
+        for (int v = 0; v < n; ++v)
+            if (!visited[v] && (u == -1 || dist[v] < dist[u])) u = v;
+        if (dist[u] == LS_INF) break;
+        visited[u] = true;
+        for (int v = 0; v < n; ++v) {
+            int cost = graph[u][v];
+            if (visited[v] || cost <= 0 || cost >= LS_INF) continue;
+            if (dist[u] + cost < dist[v]) {
+                dist[v] = dist[u] + cost;
+                prev[v] = u;
+            }
+        }
+    }
+}
+
+bool checkLinkState() {
+    const int n = 400;
+    vector<vector<int>> graph(n, vector<int>(n, LS_INF));
+    LinkState lsr(n);
+    for (const Link &l : randomTopology(n, 2, 11, 3)) {
+        if (l.from == l.to || l.cost >= graph[l.from][l.to]) continue;
+        graph[l.from][l.to] = l.cost;
+    }
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            lsr.addLink(i, j, graph[i][j]);
+
+    // More threads than sources per thread, so that ranges get stolen
+    vector<vector<int>> dist(n), prev(n);
+    lsr.allSources([&](int src, const vector<int>& d, const vector<int>& p) {
+        dist[src] = d;
+        prev[src] = p;
+    }, 8);
+    vector<int> expectedDist, expectedPrev;
+    for (int src = 0; src < n; ++src) {
+        textbookDijkstra(graph, src, expectedDist, expectedPrev);
+        if (dist[src] != expectedDist || prev[src] != expectedPrev) {
+            cerr << "Link state tables differ from the textbook Dijkstra for source " << src << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int runDVR(int n, int links, bool scalar) {
+    if (n >= DV_NO_HOP) {
+        cerr << "At most " << DV_NO_HOP - 1 << " nodes for DVR\n";
+        return 1;
+    }
+    if (links == 0) links = n / 16;
+    // The AVX2 kernel is only checked where it can run
+    bool avx2 = __builtin_cpu_supports("avx2");
+    if (!checkDistanceVector(relaxScalar) || (avx2 && !checkDistanceVector(relaxAvx2))) return 1;
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    relaxFunction relax = scalar ? relaxScalar : pickRelax();
+    cout << "Distance vector routes match Floyd-Warshall"
+         << (avx2 ? "" : " (scalar kernel only; no AVX2 on this CPU, so its check is skipped)") << ". " << n
+         << " nodes, " << links
+         << " random links per node, " << threads << " threads, "
+         << (relax == relaxAvx2 ? "AVX2" : "scalar") << " kernel." << endl;
+
+    vector<Link> topology = randomTopology(n, links, 1);
+    auto start = chrono::steady_clock::now();
+    DistanceVector dv(n, relax);
+    for (const Link &l : topology) dv.addLink(l.from, l.to, l.cost);
+    int rounds = dv.run();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    long long reachable = 0, total = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            reachable += dv.cost(i, j) < DV_INF;
+            total += dv.cost(i, j);
+        }
+    }
+    cout << fixed << setprecision(2) << "DVR: " << rounds << " rounds, " << seconds << " s, "
+         << reachable << " reachable pairs, mean cost " << (double)total / (double)n / n << endl;
+    return 0;
+}
+
+int runLSR(int n, int links, int threads, int sources) {
+    if (links == 0) links = 4;
+    if (sources <= 0 || sources > n) sources = n;
+    if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+    if (!checkLinkState()) return 1;
+    cout << "Link state tables match the textbook Dijkstra. " << n << " nodes, " << links
+         << " random links per node, " << threads << " threads, " << sources << " sources." << endl;
+
+    vector<Link> topology = randomTopology(n, links, 1);
+    LinkState lsr(n);
+    for (const Link &l : topology) lsr.addLink(l.from, l.to, l.cost);
+
+    atomic<long long> reachable(0), total(0);
+    auto start = chrono::steady_clock::now();
+    lsr.allSources([&](int, const vector<int>& dist, const vector<int>&) {
+        long long r = 0, t = 0;
+        for (int d : dist) {
+            if (d < LS_INF) {
+                r++;
+                t += d;
+            }
+        }
+        reachable += r;
+        total += t;
+    }, threads, sources);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << fixed << setprecision(2) << "LSR: " << seconds << " s, " << seconds * 1e6 / sources
+         << " us per source, " << reachable << " reachable pairs, mean cost " << (double)total / reachable << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = 0, links = 0, threads = 0, sources = 0;
+    bool scalar = false, lsr = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--scalar") == 0) scalar = true;
+        else if (strcmp(argv[i], "--lsr") == 0) lsr = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sources") == 0 && i + 1 < argc) sources = atoi(argv[++i]);
+        else if (n == 0) n = atoi(argv[i]);
+        else links = atoi(argv[i]);
+    }
+    if (n < 2) {
+        cerr << "Usage: " << argv[0] << " <nodes> [links per node] [--scalar]\n"
+             << "       " << argv[0] << " --lsr <nodes> [links per node] [--threads t] [--sources k]\n";
+        return 1;
+    }
+    return lsr ? runLSR(n, links, threads, sources) : runDVR(n, links, scalar);
+}
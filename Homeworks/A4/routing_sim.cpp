@@ -5,6 +5,8 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include "distance_vector.h"
+#include "link_state.h"
 
 using namespace std;
 
@@ -27,8 +29,21 @@ void simulateDVR(const vector<vector<int>>& graph) {
     vector<vector<int>> dist = graph;
     vector<vector<int>> nextHop(n, vector<int>(n));
 
-    //TODO: Complete this
+    // Each node starts with its direct links; a 0 off the diagonal is no link
+    DistanceVector dv(n);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            dv.addLink(i, j, graph[i][j]);
+    int rounds = dv.run();
+
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            dist[i][j] = dv.cost(i, j);
+            nextHop[i][j] = dv.nextHop(i, j);
+        }
+    }
 
+    cout << "Converged after " << rounds << " rounds of table exchanges\n";
     cout << "--- DVR Final Tables ---\n";
     for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
 }
@@ -49,16 +64,18 @@ void printLSRTable(int src, const vector<int>& dist, const vector<int>& prev) {
 
 void simulateLSR(const vector<vector<int>>& graph) {
     int n = graph.size();
-    for (int src = 0; src < n; ++src) {
-        vector<int> dist(n, INF);
-        vector<int> prev(n, -1);
-        vector<bool> visited(n, false);
-        dist[src] = 0;
-        
-         //TODO: Complete this
-        
-        printLSRTable(src, dist, prev);
-    }
+    LinkState lsr(n);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            lsr.addLink(i, j, graph[i][j]);
+
+    // Every source runs Dijkstra on some core; the tables are printed in order after
+    vector<vector<int>> dist(n), prev(n);
+    lsr.allSources([&](int src, const vector<int>& d, const vector<int>& p) {
+        dist[src] = d;
+        prev[src] = p;
+    });
+    for (int src = 0; src < n; ++src) printLSRTable(src, dist[src], prev[src]);
 }
 
 vector<vector<int>> readGraphFromFile(const string& filename) {
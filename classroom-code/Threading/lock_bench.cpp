@@ -0,0 +1,374 @@
+// Lock contention benchmark.
+//
+// Every thread loops: take the lock, run a critical section of cs_iters
+// dependent steps on the shared state, release it, then do some private work.
+// Each lock kind runs for every thread count and critical-section length, and
+// one CSV row is written per run:
+//   - throughput: critical sections per second over all threads
+//   - fairness:   Jain's index of the per-thread counts (1 = all equal, 1/n =
+//                 one thread got everything) and the smallest count over the
+//                 largest
+//
+// Lock kinds:
+//   mutex          std::mutex
+//   shared_mutex   std::shared_mutex, always exclusive
+//   shared_read    std::shared_mutex, shared for --read-percent of the runs
+//   ttas           test-and-test-and-set spinlock
+//   ticket         ticket lock (FIFO)
+//   mcs            MCS queue lock (FIFO, each waiter spins on its own node)
+//   atomic         no lock: the work is done privately and published with
+//                  one fetch_add, the lock-free counter a chat server uses
+//                  for its statistics
+//
+// The spinning locks yield after SPIN_LIMIT attempts so that runs with more
+// threads than cores still finish.
+//
+// Usage: ./lock_bench [--threads 1,2,4] [--cs 0,100] [--locks mutex,mcs]
+//                     [--ms <per run>] [--read-percent <0-100>] > results.csv
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#define SPIN_LIMIT 128          // Busy-wait attempts before yielding the CPU
+#define PRIVATE_ITERS 100       // Work outside the critical section, per acquisition
+#define DEFAULT_RUN_MS 200
+#define DEFAULT_READ_PERCENT 90
+#define CACHE_LINE 64
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Busy-waits a little, then gives the CPU away.
+struct spinner {
+    int count = 0;
+    void pause() {
+        if (++count < SPIN_LIMIT) {
+            cpu_relax();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+};
+
+// Per-thread state a lock may need: MCS waiters queue on their own node.
+struct alignas(CACHE_LINE) mcs_node {
+    std::atomic<mcs_node *> next{nullptr};
+    std::atomic<bool> locked{false};
+};
+
+struct thread_context {
+    mcs_node node;
+    bool shared = false; // Only shared_read takes the lock in shared mode
+};
+
+struct std_mutex_lock {
+    std::mutex m;
+    void lock(thread_context &) { m.lock(); }
+    void unlock(thread_context &) { m.unlock(); }
+};
+
+struct shared_mutex_lock {
+    std::shared_mutex m;
+    void lock(thread_context &c) { c.shared ? m.lock_shared() : m.lock(); }
+    void unlock(thread_context &c) { c.shared ? m.unlock_shared() : m.unlock(); }
+};
+
+struct ttas_lock {
+    std::atomic<bool> locked{false};
+    void lock(thread_context &) {
+        spinner spin;
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            // Wait on a plain load, so waiters share the cache line instead
+            // of bouncing it with writes
+            while (locked.load(std::memory_order_relaxed)) {
+                spin.pause();
+            }
+        }
+    }
+    void unlock(thread_context &) { locked.store(false, std::memory_order_release); }
+};
+
+struct ticket_lock {
+    alignas(CACHE_LINE) std::atomic<uint32_t> next{0};
+    alignas(CACHE_LINE) std::atomic<uint32_t> serving{0};
+    void lock(thread_context &) {
+        uint32_t mine = next.fetch_add(1, std::memory_order_relaxed);
+        spinner spin;
+        while (serving.load(std::memory_order_acquire) != mine) {
+            spin.pause();
+        }
+    }
+    void unlock(thread_context &) {
+        serving.store(serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+struct mcs_lock {
+    alignas(CACHE_LINE) std::atomic<mcs_node *> tail{nullptr};
+    void lock(thread_context &c) {
+        mcs_node &me = c.node;
+        me.next.store(nullptr, std::memory_order_relaxed);
+        me.locked.store(true, std::memory_order_relaxed);
+        mcs_node *prev = tail.exchange(&me, std::memory_order_acq_rel);
+        if (prev != nullptr) {
+            prev->next.store(&me, std::memory_order_release);
+            spinner spin;
+            while (me.locked.load(std::memory_order_acquire)) {
+                spin.pause();
+            }
+        }
+    }
+    void unlock(thread_context &c) {
+        mcs_node &me = c.node;
+        mcs_node *successor = me.next.load(std::memory_order_acquire);
+        if (successor == nullptr) {
+            mcs_node *expected = &me;
+            if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed)) {
+                return; // Nobody waiting
+            }
+            // A waiter swapped itself in but has not linked to us yet
+            spinner spin;
+            while ((successor = me.next.load(std::memory_order_acquire)) == nullptr) {
+                spin.pause();
+            }
+        }
+        successor->locked.store(false, std::memory_order_release);
+    }
+};
+
+// The data the locks protect.
+struct alignas(CACHE_LINE) shared_state {
+    uint64_t writes = 0;
+    uint64_t value = 1;
+    std::atomic<uint64_t> atomic_value{1}; // For the lock-free kind
+};
+
+static inline uint64_t step(uint64_t x) {
+    return x * 6364136223846793005ull + 1442695040888963407ull;
+}
+
+static inline uint64_t private_work(uint64_t x, int iters) {
+    for (int i = 0; i < iters; i++) {
+        x = step(x);
+    }
+    return x;
+}
+
+struct run_result {
+    uint64_t ops = 0;
+    double seconds = 0;
+    double jain = 0;
+    double min_over_max = 0;
+    bool consistent = true;
+};
+
+struct alignas(CACHE_LINE) thread_count {
+    uint64_t ops = 0;
+    uint64_t writes = 0;
+    uint64_t sink = 0;
+};
+
+// Start the workers together, stop them after run_ms and sum up their counts.
+run_result finish(std::vector<std::thread> &workers, std::atomic<bool> &go, std::atomic<bool> &stop,
+                  const std::vector<thread_count> &counts, int run_ms) {
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::milliseconds(run_ms));
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread &w : workers) {
+        w.join();
+    }
+    run_result result;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t least = UINT64_MAX, most = 0;
+    double sum = 0, sum_squares = 0;
+    for (const thread_count &c : counts) {
+        result.ops += c.ops;
+        least = std::min(least, c.ops);
+        most = std::max(most, c.ops);
+        sum += c.ops;
+        sum_squares += (double)c.ops * c.ops;
+    }
+    result.jain = sum_squares > 0 ? sum * sum / (counts.size() * sum_squares) : 0;
+    result.min_over_max = most > 0 ? (double)least / most : 0;
+    return result;
+}
+
+template <class Lock>
+run_result run(int threads, int cs_iters, int run_ms, int read_percent) {
+    Lock lock;
+    shared_state state;
+    std::atomic<bool> go{false}, stop{false};
+    std::vector<thread_count> counts(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            thread_context context;
+            thread_count &mine = counts[t];
+            uint64_t local = t + 1;
+            unsigned seed = t * 7919 + 1;
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            while (!stop.load(std::memory_order_relaxed)) {
+                context.shared = read_percent > 0 && (int)(rand_r(&seed) % 100) < read_percent;
+                lock.lock(context);
+                if (context.shared) {
+                    mine.sink += private_work(state.value, cs_iters);
+                } else {
+                    state.writes++;
+                    state.value = private_work(state.value, cs_iters);
+                    mine.writes++;
+                }
+                lock.unlock(context);
+                mine.ops++;
+                local = private_work(local, PRIVATE_ITERS);
+            }
+            mine.sink += local;
+        });
+    }
+
+    run_result result = finish(workers, go, stop, counts, run_ms);
+    uint64_t writes = 0;
+    for (const thread_count &c : counts) {
+        writes += c.writes;
+    }
+    result.consistent = state.writes == writes;
+    return result;
+}
+
+// The lock-free counter.
+template <>
+run_result run<void>(int threads, int cs_iters, int run_ms, int) {
+    shared_state state;
+    std::atomic<bool> go{false}, stop{false};
+    std::vector<thread_count> counts(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            thread_count &mine = counts[t];
+            uint64_t local = t + 1;
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            while (!stop.load(std::memory_order_relaxed)) {
+                // The work is done privately; only the result is shared
+                uint64_t delta = private_work(local, cs_iters) | 1;
+                state.atomic_value.fetch_add(delta, std::memory_order_relaxed);
+                mine.writes += delta;
+                mine.ops++;
+                local = private_work(local, PRIVATE_ITERS);
+            }
+        });
+    }
+
+    run_result result = finish(workers, go, stop, counts, run_ms);
+    uint64_t total = 1;
+    for (const thread_count &c : counts) {
+        total += c.writes; // Wraps the same way the counter does
+    }
+    result.consistent = state.atomic_value.load() == total;
+    return result;
+}
+
+std::vector<int> parse_list(const std::string &text) {
+    std::vector<int> values;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        values.push_back(std::atoi(item.c_str()));
+    }
+    return values;
+}
+
+std::vector<std::string> split(const std::string &text) {
+    std::vector<std::string> items;
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<int> thread_counts = {1, 2, 4, 8, 16, 32, 64};
+    std::vector<int> cs_lengths = {0, 50, 500};
+    std::vector<std::string> locks = {"mutex", "shared_mutex", "shared_read", "ttas", "ticket", "mcs", "atomic"};
+    int run_ms = DEFAULT_RUN_MS;
+    int read_percent = DEFAULT_READ_PERCENT;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            thread_counts = parse_list(argv[++i]);
+        } else if (arg == "--cs" && i + 1 < argc) {
+            cs_lengths = parse_list(argv[++i]);
+        } else if (arg == "--locks" && i + 1 < argc) {
+            locks = split(argv[++i]);
+        } else if (arg == "--ms" && i + 1 < argc) {
+            run_ms = std::atoi(argv[++i]);
+        } else if (arg == "--read-percent" && i + 1 < argc) {
+            read_percent = std::clamp(std::atoi(argv[++i]), 0, 100);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--threads 1,2,4] [--cs 0,100] [--locks mutex,mcs]"
+                      << " [--ms <per run>] [--read-percent <0-100>]\n";
+            return 1;
+        }
+    }
+
+    std::cerr << std::thread::hardware_concurrency() << " CPUs, " << run_ms << " ms per run\n";
+    std::cout << "lock,threads,cs_iters,ops,ops_per_sec,ns_per_op,jain_fairness,min_over_max\n";
+    bool consistent = true;
+    for (const std::string &name : locks) {
+        for (int cs : cs_lengths) {
+            for (int threads : thread_counts) {
+                run_result r;
+                if (name == "mutex") {
+                    r = run<std_mutex_lock>(threads, cs, run_ms, 0);
+                } else if (name == "shared_mutex") {
+                    r = run<shared_mutex_lock>(threads, cs, run_ms, 0);
+                } else if (name == "shared_read") {
+                    r = run<shared_mutex_lock>(threads, cs, run_ms, read_percent);
+                } else if (name == "ttas") {
+                    r = run<ttas_lock>(threads, cs, run_ms, 0);
+                } else if (name == "ticket") {
+                    r = run<ticket_lock>(threads, cs, run_ms, 0);
+                } else if (name == "mcs") {
+                    r = run<mcs_lock>(threads, cs, run_ms, 0);
+                } else if (name == "atomic") {
+                    r = run<void>(threads, cs, run_ms, 0);
+                } else {
+                    std::cerr << "Unknown lock " << name << "\n";
+                    return 1;
+                }
+                if (!r.consistent) {
+                    std::cerr << name << " lost updates with " << threads << " threads\n";
+                    consistent = false;
+                }
+                std::cout << name << "," << threads << "," << cs << "," << r.ops << ","
+                          << (uint64_t)(r.ops / r.seconds) << "," << r.seconds * 1e9 / std::max<uint64_t>(1, r.ops) << ","
+                          << r.jain << "," << r.min_over_max << std::endl;
+            }
+        }
+    }
+    return consistent ? 0 : 1;
+}
@@ -1,12 +1,47 @@
 #include <iostream>
+#include <iomanip>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
 #define PORT 8080
+#define BULK_BUFFER 65536
 
-int main() {
+double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// With --bulk <bytes>: send that many bytes, then report the rate
+void send_bulk(int sock, long long total) {
+    static char buffer[BULK_BUFFER];
+    for (size_t i = 0; i < sizeof(buffer); i++) buffer[i] = (char)(i * 131 + 7);
+    auto start = std::chrono::steady_clock::now();
+    double cpu_start = cpu_seconds();
+    for (long long sent = 0; sent < total;) {
+        ssize_t n = send(sock, buffer, std::min<long long>(sizeof(buffer), total - sent), 0);
+        if (n <= 0) {
+            perror("send");
+            return;
+        }
+        sent += n;
+    }
+    shutdown(sock, SHUT_WR);
+    read(sock, buffer, sizeof(buffer)); // Until the server has read it all and closed
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::fixed << std::setprecision(2) << "Sent " << total << " bytes in " << seconds << " s: "
+              << total * 8 / seconds / 1e9 << " Gbit/s, " << (cpu_seconds() - cpu_start) * 1e9 / total
+              << " ns CPU per byte" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    long long bulk = argc > 2 && strcmp(argv[1], "--bulk") == 0 ? atoll(argv[2]) : 0;
     int sock = 0;
     struct sockaddr_in serv_addr;
     const char* hello = "Hello from client";
@@ -33,6 +68,12 @@ int main() {
         return -1;
     }
 
+    if (bulk > 0) {
+        send_bulk(sock, bulk);
+        close(sock);
+        return 0;
+    }
+
     send(sock, hello, strlen(hello), 0);
     std::cout << "Hello message sent" << std::endl;
 
@@ -1,12 +1,40 @@
 #include <iostream>
+#include <iomanip>
 #include <cstring>
+#include <chrono>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <unistd.h>
 
 #define PORT 8080
+#define BULK_BUFFER 65536
 
-int main() {
+double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// With --bulk: read everything the client sends, then report the rate
+void receive_bulk(int sock) {
+    static char buffer[BULK_BUFFER];
+    long long total = 0;
+    ssize_t n = read(sock, buffer, sizeof(buffer));
+    auto start = std::chrono::steady_clock::now();
+    double cpu_start = cpu_seconds();
+    while (n > 0) {
+        total += n;
+        n = read(sock, buffer, sizeof(buffer));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::fixed << std::setprecision(2) << "Received " << total << " bytes in " << seconds << " s: "
+              << total * 8 / seconds / 1e9 << " Gbit/s, " << (cpu_seconds() - cpu_start) * 1e9 / total
+              << " ns CPU per byte" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    bool bulk = argc > 1 && strcmp(argv[1], "--bulk") == 0;
     int server_fd, new_socket;
     struct sockaddr_in address;
     int opt = 1;
@@ -50,6 +78,13 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    if (bulk) {
+        receive_bulk(new_socket);
+        close(new_socket);
+        close(server_fd);
+        return 0;
+    }
+
     read(new_socket, buffer, 1024);
     std::cout << "Message from client: " << buffer << std::endl;
 